@@ -0,0 +1,99 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_EXAMPLE_CONCAT_H_
+#define DJINN_EXAMPLE_CONCAT_H_
+
+#include <fstream> // Support for read/write.
+#include <string> // std::string
+#include <vector> // std::vector
+#include <djinn.h> // Djinn data models.
+
+/**
+ * In this example we will concatenate archives describing the same samples,
+ * for example one archive per chromosome, into a single archive. Blocks are
+ * copied without decoding or recompressing them; only the contig list, site
+ * tables whose contig indices change, the index, and the trailer are
+ * rewritten. All archives must have been written with the same model type
+ * and with models reset for every block.
+ *
+ * @param input_files Input archives in output order.
+ * @param output_file Output file string: file path or "-" to write to stdout
+ * @return int        Returns the number of blocks when successful or a negative value otherwise.
+ */
+int ConcatArchives(const std::vector<std::string>& input_files, std::string output_file) {
+    if (input_files.empty()) {
+        std::cerr << "No input archives provided" << std::endl;
+        return -1;
+    }
+
+    // Open file stream (or file handle) depending on the passed argument.
+    bool own_stream = false;
+    std::ostream* out_stream = nullptr;
+    if (output_file == "-") out_stream = &std::cout; // standard out (pipe)
+    else { // file stream (to disk)
+        out_stream = new std::ofstream(output_file, std::ios::out | std::ios::binary);
+        if (out_stream->good() == false) {
+            std::cerr << "Could not open output handle \"" << output_file << "\"!" << std::endl;
+            delete out_stream;
+            return -3;
+        }
+        own_stream = true;
+    }
+
+    djinn::djinn_archive_writer writer;
+    int64_t n_blocks = 0;
+    int ret = 0;
+    for (size_t i = 0; i < input_files.size(); ++i) {
+        std::ifstream in_stream(input_files[i], std::ios::in | std::ios::binary);
+        if (in_stream.good() == false) {
+            std::cerr << "could not open infile handle \"" << input_files[i] << "\"" << std::endl;
+            ret = -2; break;
+        }
+
+        djinn::djinn_archive_reader reader;
+        const int ret_open = reader.Open(in_stream);
+        if (ret_open != 1) {
+            std::cerr << "could not read archive header of \"" << input_files[i] << "\": " << (ret_open < 0 ? djinn::ArchiveErrorString(ret_open) : "input is not framed") << std::endl;
+            ret = -3; break;
+        }
+        if (i == 0 && writer.Open(*out_stream, reader.header) < 0) {
+            std::cerr << "Could not write to output handle \"" << output_file << "\"!" << std::endl;
+            ret = -3; break;
+        }
+
+        ret = writer.AppendArchive(reader);
+        if (ret < 0) {
+            std::cerr << "Failed to append \"" << input_files[i] << "\": " << djinn::ArchiveErrorString(ret) << std::endl;
+            break;
+        }
+        n_blocks += ret;
+        std::cerr << "[PROGRESS] Appended " << input_files[i] << ": " << ret << " blocks (" << writer.n_variants << " variants)" << std::endl;
+    }
+
+    // Write the index and trailer and close handle and clean up.
+    if (ret >= 0) writer.Close();
+    out_stream->flush();
+    if (own_stream) {
+        ((std::ofstream*)out_stream)->close();
+        delete out_stream;
+    }
+
+    return ret < 0 ? ret : n_blocks;
+}
+
+#endif
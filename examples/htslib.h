@@ -20,32 +20,50 @@
 
 #include <fstream> // Support for read/write.
 #include <djinn.h> // Djinn data models.
-#include <vcf_reader.h> // VcfReader support class for reading Htslib-based files.
+#include "resume.h" // Support for resuming imports.
+#include <vcf_reader.h> // VcfReaderAsync support class for reading Htslib-based files.
                         // Compiling with this header requires the htslib library.
 
 /**
- * In this example we will read data using the provided support class VcfReader
- * that interacts directly with Htslib data structures to consume either 
- * Vcf/Bcf/Vcf.gz/BGZF files either from stdin (pipe) or from a 
- * file handle (disk).
+ * In this example we will read data using the provided support class 
+ * VcfReaderAsync that interacts directly with Htslib data structures to 
+ * consume either Vcf/Bcf/Vcf.gz/BGZF files either from stdin (pipe) or from a 
+ * file handle (disk). Records are parsed in a separate producer thread such
+ * that parsing overlaps with encoding, and only the alleles are unpacked.
  * 
+ * Sample names, contig names, and the site metadata of every block (contig,
+ * position, and alleles) are stored alongside the genotypes such that
+ * complete Vcf records can be written when decoding.
  * 
  * @param input_file   Input file string: file path or "-" to read from stdin
  * @param output_file  Output file string: file path or "-" to write to stdout
  * @param type         1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
  * @param permute      Use PBWT preprocessor
  * @param reset_models Reset models for each block (random access)
+ * @param n_threads    Number of additional Htslib decompression threads
+ * @param resume       Resume an interrupted import into output_file or append to it
+ * @param gt_pbwt      Permute unphased diploid sites by genotype (gtPBWT)
+ * @param pbwt_ctx     Condition the context model on the PBWT divergence array (ctx model only)
+ * @param dense        Code noisy biallelic sites bit by bit (ctx model only)
  * @return int         Returns the number of imported variants when successful or a negative value otherwise.
+ *                     When resuming, previously imported variants are included.
  */
 int ImportHtslib(std::string input_file,   // input file: "-" for stdin
                  std::string output_file,  // output file: "-" for stdout
                  const uint32_t type,      // 1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
                  const bool permute = true,// PBWT preprocessor
-                 const bool reset_models = true) // Reset models for each block (random access)
+                 const bool reset_models = true, // Reset models for each block (random access)
+                 const uint32_t n_threads = 0, // Additional decompression threads
+                 const bool resume = false, // Resume an interrupted import
+                 const bool gt_pbwt = false, // Genotype PBWT for unphased diploid sites
+                 const bool pbwt_ctx = false, // PBWT divergence contexts (ctx model)
+                 const bool dense = false) // Bit-level coding of noisy sites (ctx model)
 {
-    // VcfReader use a singleton pattern: call the djinn::VcfReader::FromFile
-    // function to get the instance.
-    std::unique_ptr<djinn::VcfReader> reader = djinn::VcfReader::FromFile(input_file);
+    // VcfReaderAsync use a singleton pattern: call the 
+    // djinn::VcfReaderAsync::FromFile function to get the instance.
+    // Only the shared strings (alleles) are unpacked as genotypes are 
+    // retrieved directly from the raw record using BcfGenotypeScanner.
+    std::unique_ptr<djinn::VcfReaderAsync> reader = djinn::VcfReaderAsync::FromFile(input_file, n_threads, 4, 16, BCF_UN_STR);
     
     // If the file or stream could not be opened we exit here.
     if (reader.get() == nullptr) {
@@ -55,9 +73,13 @@ int ImportHtslib(std::string input_file,   // input file: "-" for stdin
 
     // Print out number of samples listed in the bcf header.
     std::cerr << "Samples in VCF file: " << reader->n_samples_ << std::endl;
+
+    // Resolve the header ID of the GT field once.
+    djinn::BcfGenotypeScanner gt(reader->header_);
     
     // Setup
     uint64_t n_lines   = 0;    // Keep track of how many variants we've imported
+    uint64_t n_records = 0;    // Keep track of how many records we've read
     uint32_t nv_blocks = 8192; // Number of desired variants per data block.
     uint32_t n_blocks  = 0;    // Keep track of how many data blocks we've processed.
 
@@ -65,12 +87,31 @@ int ImportHtslib(std::string input_file,   // input file: "-" for stdin
     if ((type >> 0) & 1)      djn_ctx = new djinn::djinn_ctx_model();
     else if ((type >> 1) & 1) djn_ctx = new djinn::djinn_ewah_model(djinn::CompressionStrategy::LZ4,  9);
     else if ((type >> 2) & 1) djn_ctx = new djinn::djinn_ewah_model(djinn::CompressionStrategy::ZSTD, 21);
+    djn_ctx->gt_pbwt = gt_pbwt;
+    djn_ctx->pbwt_ctx = pbwt_ctx;
+    djn_ctx->dense = dense;
     djn_ctx->StartEncoding(permute, reset_models);
     
     // Open file stream (or file handle) depending on the passed argument.
+    // When resuming, an existing archive is truncated after its last complete
+    // block and reopened for writing.
     bool own_stream = false;
     std::ostream* out_stream = nullptr;
-    if (output_file == "-") out_stream = &std::cout; // standard out (pipe)
+    djinn::djinn_archive_writer writer;
+    if (resume && output_file != "-") {
+        int error = 0;
+        out_stream = ResumeArchive(output_file, writer, type, reader->n_samples_, error);
+        if (error < 0) {
+            delete djn_ctx;
+            return -5;
+        }
+        own_stream = (out_stream != nullptr);
+    }
+    const bool resumed = own_stream;
+
+    if (resumed) {
+        // Stream positioned after the last complete block.
+    } else if (output_file == "-") out_stream = &std::cout; // standard out (pipe)
     else { // file stream (to disk)
         out_stream = new std::ofstream(output_file, std::ios::out | std::ios::binary);
         if (out_stream->good() == false) {
@@ -80,6 +121,29 @@ int ImportHtslib(std::string input_file,   // input file: "-" for stdin
         own_stream = true;
     }
 
+    // Write the archive header. Blocks are written as checksummed frames.
+    if (resumed == false && writer.Open(*out_stream, *djn_ctx, reader->n_samples_) < 0) {
+        std::cerr << "Could not write to output handle \"" << output_file << "\"!" << std::endl;
+        return -5;
+    }
+
+    // Sample and contig names are stored before the first block. The contig
+    // list is written again whenever new contigs are observed.
+    djinn::djinn_site_table sites;
+    std::string alleles;
+    size_t n_contigs_written = reader->Contigs().size();
+    if (writer.n_blocks == 0) {
+        writer.WriteNames(DJN_FRAME_SAMPLES, reader->samples_);
+        writer.WriteNames(DJN_FRAME_CONTIGS, reader->Contigs());
+    } else {
+        // Continue after the last record stored in the archive. The contig
+        // list is written again before the next block.
+        while (n_records <= (uint64_t)writer.last_ordinal && reader->Next()) ++n_records;
+        n_lines  = writer.n_variants;
+        n_blocks = writer.n_blocks;
+        n_contigs_written = 0;
+    }
+
     // Cumulators to print our progress.
     uint64_t data_in = 0, data_in_vcf = 0, model_out = 0;
 
@@ -87,11 +151,20 @@ int ImportHtslib(std::string input_file,   // input file: "-" for stdin
         // When we have decoded nv_blocks of variants we will stop encoding data
         // by calling FinishEncoding and then serialize the final encoded object
         // to the output stream.
-        if (n_lines % nv_blocks == 0 && n_lines != 0) {
+        if (n_lines % nv_blocks == 0 && djn_ctx->n_variants != 0) {
             // Calling FinisheEncoding is REQUIRED before either Serializing and
             // writing or decompressing.
-            djn_ctx->FinishEncoding();
-            int serial_size = djn_ctx->Serialize(*out_stream);
+            if (djn_ctx->FinishEncoding() < 0) {
+                std::cerr << "Failed to compress block " << n_blocks << std::endl;
+                return -6;
+            }
+            const std::vector<std::string> contigs = reader->Contigs();
+            if (contigs.size() != n_contigs_written) {
+                writer.WriteNames(DJN_FRAME_CONTIGS, contigs);
+                n_contigs_written = contigs.size();
+            }
+            int serial_size = writer.WriteBlock(*djn_ctx, sites);
+            sites.clear();
             ++n_blocks;
             model_out += serial_size;
 
@@ -108,35 +181,56 @@ int ImportHtslib(std::string input_file,   // input file: "-" for stdin
         if (reader->header_ == NULL) return -3;
 
         // Retrieve pointer to FORMAT field that holds GT data.
-        const bcf_fmt_t* fmt = bcf_get_fmt(reader->header_, reader->bcf1_, "GT");
-        if (fmt == NULL) continue;
+        const int gt_ret = gt.Scan(reader->bcf1_);
+        if (gt_ret < 0) {
+            std::cerr << "Failed to parse the GT field of record " << n_lines << std::endl;
+            return -4;
+        }
+        if (gt_ret == 0) { ++n_records; continue; }
         
         // Encode from htslib Bcf encoding by passing the arguments:
         // p: pointer to genotype data array
         // p_len: length of data
         // n: stride size (number of bytes per individual = base ploidy)
         // n_allele: number of alleles
-        int ret = djn_ctx->EncodeBcf(fmt->p, fmt->p_len, fmt->n, reader->bcf1_->n_allele);
+        int ret = djn_ctx->EncodeBcf(gt.p, gt.p_len, gt.n, reader->bcf1_->n_allele);
         assert(ret>0);
 
+        // Store the site: alleles are comma-separated with REF first.
+        const bcf1_t* rec = reader->bcf1_;
+        alleles.clear();
+        for (int i = 0; i < rec->n_allele; ++i) {
+            if (i) alleles += ',';
+            alleles += rec->d.allele[i];
+        }
+        sites.Add(rec->rid, (int64_t)rec->pos + 1, alleles.data(), alleles.size(), n_records++);
+
         // Update input bytes for uBcf and Vcf
-        data_in     += fmt->p_len; // uBcf
-        data_in_vcf += 2*fmt->p_len - 1; // Vcf: this is true only for diploid data with #alleles < 10
+        data_in     += gt.p_len; // uBcf
+        data_in_vcf += 2*gt.p_len - 1; // Vcf: this is true only for diploid data with #alleles < 10
         ++n_lines; // Number of variants processed
     }
 
-    // Compress final data.
-    djn_ctx->FinishEncoding();
-    int serial_size = djn_ctx->Serialize(*out_stream);
-    assert(serial_size > 0);
-    ++n_blocks;
-    model_out += serial_size;
+    // Compress final data. Nothing remains if a finished import was resumed.
+    if (djn_ctx->n_variants != 0 || writer.n_blocks == 0) {
+        if (djn_ctx->FinishEncoding() < 0) {
+            std::cerr << "Failed to compress block " << n_blocks << std::endl;
+            return -6;
+        }
+        const std::vector<std::string> contigs = reader->Contigs();
+        if (contigs.size() != n_contigs_written) writer.WriteNames(DJN_FRAME_CONTIGS, contigs);
+        int serial_size = writer.WriteBlock(*djn_ctx, sites);
+        assert(serial_size > 0);
+        ++n_blocks;
+        model_out += serial_size;
+    }
 
     std::cerr << "[PROGRESS] In uBCF: " << data_in << "->" << model_out 
         << " (" << (double)data_in/model_out << "-fold) In VCF: " << data_in_vcf << "->" << model_out 
         << " (" << (double)data_in_vcf/model_out << "-fold)" << std::endl;
 
-    // Close handle and clean up.
+    // Write the trailer and close handle and clean up.
+    writer.Close();
     out_stream->flush();
     
     if (own_stream) {
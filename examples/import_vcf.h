@@ -0,0 +1,214 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_EXAMPLE_IMPORT_VCF_H_
+#define DJINN_EXAMPLE_IMPORT_VCF_H_
+
+#include <fstream> // Support for read/write.
+#include <djinn.h> // Djinn data models.
+#include "resume.h" // Support for resuming imports.
+#include <vcf_text_reader.h> // VcfTextReader support class for reading Vcf files
+                             // without Htslib.
+
+/**
+ * In this example we will read Vcf or Vcf.gz files using the built-in
+ * VcfTextReader that extracts the GT field directly from the text without
+ * parsing the other FORMAT fields. Unlike ImportHtslib this does not support
+ * Bcf input. Sample names, contig names, and site metadata are stored as for
+ * ImportHtslib.
+ * 
+ * @param input_file   Input file string: file path or "-" to read from stdin
+ * @param output_file  Output file string: file path or "-" to write to stdout
+ * @param type         1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
+ * @param permute      Use PBWT preprocessor
+ * @param reset_models Reset models for each block (random access)
+ * @param n_threads    Number of threads used for inflating BGZF blocks
+ * @param resume       Resume an interrupted import into output_file or append to it
+ * @param gt_pbwt      Permute unphased diploid sites by genotype (gtPBWT)
+ * @param pbwt_ctx     Condition the context model on the PBWT divergence array (ctx model only)
+ * @param dense        Code noisy biallelic sites bit by bit (ctx model only)
+ * @return int         Returns the number of imported variants when successful or a negative value otherwise.
+ *                     When resuming, previously imported variants are included.
+ */
+int ImportVcf(std::string input_file,   // input file: "-" for stdin
+              std::string output_file,  // output file: "-" for stdout
+              const uint32_t type,      // 1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
+              const bool permute = true,// PBWT preprocessor
+              const bool reset_models = true, // Reset models for each block (random access)
+              const uint32_t n_threads = 0, // Threads for BGZF decompression
+              const bool resume = false, // Resume an interrupted import
+              const bool gt_pbwt = false, // Genotype PBWT for unphased diploid sites
+              const bool pbwt_ctx = false, // PBWT divergence contexts (ctx model)
+              const bool dense = false) // Bit-level coding of noisy sites (ctx model)
+{
+    std::unique_ptr<djinn::VcfTextReader> reader = djinn::VcfTextReader::FromFile(input_file, n_threads);
+    
+    // If the file or stream could not be opened we exit here.
+    if (reader.get() == nullptr) {
+        std::cerr << "Could not open input handle \"" << input_file << "\"!" << std::endl;
+        return -1;
+    }
+
+    // Print out number of samples listed in the header.
+    std::cerr << "Samples in VCF file: " << reader->n_samples_ << std::endl;
+    
+    // Setup
+    uint64_t n_lines   = 0;    // Keep track of how many variants we've imported
+    uint32_t nv_blocks = 8192; // Number of desired variants per data block.
+    uint32_t n_blocks  = 0;    // Keep track of how many data blocks we've processed.
+
+    djinn::djinn_model* djn_ctx = nullptr;
+    if ((type >> 0) & 1)      djn_ctx = new djinn::djinn_ctx_model();
+    else if ((type >> 1) & 1) djn_ctx = new djinn::djinn_ewah_model(djinn::CompressionStrategy::LZ4,  9);
+    else if ((type >> 2) & 1) djn_ctx = new djinn::djinn_ewah_model(djinn::CompressionStrategy::ZSTD, 21);
+    djn_ctx->gt_pbwt = gt_pbwt;
+    djn_ctx->pbwt_ctx = pbwt_ctx;
+    djn_ctx->dense = dense;
+    djn_ctx->StartEncoding(permute, reset_models);
+    
+    // Open file stream (or file handle) depending on the passed argument.
+    // When resuming, an existing archive is truncated after its last complete
+    // block and reopened for writing.
+    bool own_stream = false;
+    std::ostream* out_stream = nullptr;
+    djinn::djinn_archive_writer writer;
+    if (resume && output_file != "-") {
+        int error = 0;
+        out_stream = ResumeArchive(output_file, writer, type, reader->n_samples_, error);
+        if (error < 0) {
+            delete djn_ctx;
+            return -5;
+        }
+        own_stream = (out_stream != nullptr);
+    }
+    const bool resumed = own_stream;
+
+    if (resumed) {
+        // Stream positioned after the last complete block.
+    } else if (output_file == "-") out_stream = &std::cout; // standard out (pipe)
+    else { // file stream (to disk)
+        out_stream = new std::ofstream(output_file, std::ios::out | std::ios::binary);
+        if (out_stream->good() == false) {
+            std::cerr << "Could not open output handle \"" << output_file << "\"!" << std::endl;
+            delete djn_ctx;
+            return -3;
+        }
+        own_stream = true;
+    }
+
+    // Write the archive header. Blocks are written as checksummed frames.
+    if (resumed == false && writer.Open(*out_stream, *djn_ctx, reader->n_samples_) < 0) {
+        std::cerr << "Could not write to output handle \"" << output_file << "\"!" << std::endl;
+        return -5;
+    }
+
+    // Sample and contig names are stored before the first block. Contigs that
+    // are not declared in the header are appended when first observed.
+    djinn::djinn_site_table sites;
+    size_t n_contigs_written = reader->contigs_.size();
+    if (writer.n_blocks == 0) {
+        writer.WriteNames(DJN_FRAME_SAMPLES, reader->samples_);
+        writer.WriteNames(DJN_FRAME_CONTIGS, reader->contigs_);
+    } else {
+        // Continue after the last record stored in the archive. The contig
+        // list is written again before the next block.
+        while (reader->n_lines_ <= writer.last_ordinal && reader->Next() > 0) {}
+        n_lines  = writer.n_variants;
+        n_blocks = writer.n_blocks;
+        n_contigs_written = 0;
+    }
+
+    // Cumulators to print our progress.
+    uint64_t data_in = 0, model_out = 0;
+    int error = 0;
+
+    int ret_read = 0;
+    while ((ret_read = reader->Next()) > 0) {
+        // Records without GT data are skipped.
+        if (reader->gt_len_ == 0) continue;
+
+        if (n_lines % nv_blocks == 0 && djn_ctx->n_variants != 0) {
+            if (djn_ctx->FinishEncoding() < 0) {
+                std::cerr << "Failed to compress block " << n_blocks << std::endl;
+                error = -6;
+                break;
+            }
+            if (reader->contigs_.size() != n_contigs_written) {
+                writer.WriteNames(DJN_FRAME_CONTIGS, reader->contigs_);
+                n_contigs_written = reader->contigs_.size();
+            }
+            int serial_size = writer.WriteBlock(*djn_ctx, sites);
+            sites.clear();
+            ++n_blocks;
+            model_out += serial_size;
+
+            std::cerr << "[PROGRESS] In uBCF: " << data_in << "->" << model_out 
+                << " (" << (double)data_in/model_out << "-fold)" << std::endl;
+
+            djn_ctx->StartEncoding(permute, reset_models);
+        }
+
+        int ret = djn_ctx->EncodeBcf(reader->gt_, reader->gt_len_, reader->ploidy_, reader->n_allele_);
+        if (ret <= 0) {
+            std::cerr << "Failed to encode record " << reader->n_lines_ << std::endl;
+            error = -6;
+            break;
+        }
+
+        sites.Add(reader->rid_, reader->pos_, reader->alleles_.data(), reader->alleles_.size(), reader->n_lines_ - 1);
+        data_in += reader->gt_len_;
+        ++n_lines;
+    }
+
+    // A truncated or malformed input is an error: the archive is closed with
+    // the blocks written so far and can be completed with --resume.
+    if (error == 0 && ret_read < 0) {
+        std::cerr << "Failed to read input \"" << input_file << "\" after record " << n_lines << std::endl;
+        error = -4;
+    }
+
+    // Compress final data. Nothing remains if a finished import was resumed.
+    if (error == 0 && (djn_ctx->n_variants != 0 || writer.n_blocks == 0)) {
+        if (djn_ctx->FinishEncoding() < 0) {
+            std::cerr << "Failed to compress block " << n_blocks << std::endl;
+            error = -6;
+        } else {
+            if (reader->contigs_.size() != n_contigs_written) writer.WriteNames(DJN_FRAME_CONTIGS, reader->contigs_);
+            int serial_size = writer.WriteBlock(*djn_ctx, sites);
+            assert(serial_size > 0);
+            ++n_blocks;
+            model_out += serial_size;
+        }
+    }
+
+    std::cerr << "[PROGRESS] In uBCF: " << data_in << "->" << model_out 
+        << " (" << (double)data_in/model_out << "-fold)" << std::endl;
+
+    // Write the trailer and close handle and clean up.
+    writer.Close();
+    out_stream->flush();
+    if (own_stream) {
+        ((std::ofstream*)out_stream)->close();
+        delete out_stream;
+    }
+    delete djn_ctx;
+
+    if (error) return error;
+    return n_lines;
+}
+
+#endif
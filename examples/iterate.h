@@ -50,22 +50,33 @@ int Iterate(std::string input_file, int model) {
         in_stream->seekg(0);
     }
 
-    djinn::djinn_model* djn_decode = nullptr;
-    if (model == 1) djn_decode = new djinn::djinn_ctx_model();
-    else if(model == 2 || model == 4) djn_decode = new djinn::djinn_ewah_model();
-    else {
-        std::cerr << "unknown model: " << model << std::endl;
+    // The model is read from the archive header. The provided model type is
+    // only used for streams written without framing.
+    djinn::djinn_archive_reader reader;
+    const int ret_open = reader.Open(*in_stream, model);
+    if (ret_open < 0) {
+        std::cerr << "could not read archive header: " << djinn::ArchiveErrorString(ret_open) << std::endl;
         return -3;
     }
+    djinn::djinn_model* djn_decode = reader.CreateModel();
 
     uint32_t n_lines   = 0;
     djinn::djinn_variant_t* variant = nullptr;
 
+    int decode_ctx_ret = 0;
     while (true) {
-        int decode_ctx_ret = djn_decode->Deserialize(*in_stream);
-        if (decode_ctx_ret <= 0) break; // exit condition
+        decode_ctx_ret = reader.NextBlock(*djn_decode);
+        if (decode_ctx_ret < 0) {
+            std::cerr << "could not read block: " << djinn::ArchiveErrorString(decode_ctx_ret) << std::endl;
+            break;
+        }
+        if (decode_ctx_ret == 0) break; // exit condition
 
-        djn_decode->StartDecoding();
+        decode_ctx_ret = djn_decode->StartDecoding();
+        if (decode_ctx_ret < 0) {
+            std::cerr << "failed to decompress block" << std::endl;
+            break;
+        }
         for (int i = 0; i < djn_decode->n_variants; ++i, ++n_lines) {
             int objs = djn_decode->DecodeNext(variant);
             assert(objs > 0);
@@ -74,7 +85,7 @@ int Iterate(std::string input_file, int model) {
     delete variant;
     delete djn_decode;
 
-    return n_lines;
+    return decode_ctx_ret < 0 ? decode_ctx_ret : n_lines;
 }
 
 #endif
\ No newline at end of file
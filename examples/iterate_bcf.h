@@ -0,0 +1,176 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_EXAMPLE_ITERATE_BCF_H_
+#define DJINN_EXAMPLE_ITERATE_BCF_H_
+
+#include <fstream> // Support for read/write.
+#include <string> // std::string
+#include <vector> // std::vector
+#include <djinn.h> // Djinn data models.
+#include <htslib/vcf.h> // Compiling with this header requires the htslib library.
+
+/**
+ * In this example we will decode Djinn-compressed data and write the genotypes
+ * as BGZF-compressed Bcf using Htslib. Genotypes are converted directly into
+ * Bcf-encoded vectors with djinn_variant_t::ToBcf without going through an
+ * intermediate text representation.
+ *
+ * Contigs, positions, alleles, and sample names are taken from the archive
+ * metadata when available. Archives storing genotypes only are written with
+ * a placeholder contig ("djinn"), 1-based positions corresponding to the
+ * record index, a reference allele 'N', and one symbolic alternative allele
+ * for every additional allele observed, and samples are named by their index.
+ *
+ * @param input_file  Input file string: file path or "-" to read from stdin
+ * @param output_file Output file string: file path or "-" to write to stdout
+ * @param model       1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
+ * @return int        Returns the number of written records when successful or a negative value otherwise.
+ */
+int IterateBcf(std::string input_file, std::string output_file, int model) {
+    std::istream* in_stream = nullptr;
+    if (input_file == "-") in_stream = &std::cin;
+    else {
+        in_stream = new std::ifstream(input_file, std::ios::in | std::ios::binary);
+        if (in_stream->good() == false) {
+            std::cerr << "could not open infile handle" << std::endl;
+            delete in_stream;
+            return -2;
+        }
+    }
+
+    // The model is read from the archive header. The provided model type is
+    // only used for streams written without framing.
+    djinn::djinn_archive_reader reader;
+    const int ret_open = reader.Open(*in_stream, model);
+    if (ret_open < 0) {
+        std::cerr << "could not read archive header: " << djinn::ArchiveErrorString(ret_open) << std::endl;
+        if (input_file != "-") delete in_stream;
+        return -3;
+    }
+    djinn::djinn_model* djn_decode = reader.CreateModel();
+
+    // Htslib interprets "-" as standard out.
+    htsFile* fp = hts_open(output_file.c_str(), "wb");
+    if (fp == nullptr) {
+        std::cerr << "Could not open output handle \"" << output_file << "\"!" << std::endl;
+        if (input_file != "-") delete in_stream;
+        delete djn_decode;
+        return -4;
+    }
+
+    bcf_hdr_t* hdr = nullptr;
+    bcf1_t* rec = bcf_init();
+    uint32_t n_samples = 0;
+    int64_t n_lines = 0;
+    int ret = 0;
+
+    std::vector<uint8_t> gt8;  // Bcf-encoded genotypes from Djinn
+    std::vector<int32_t> gt32; // Htslib takes 32-bit genotypes
+    std::string alleles;
+
+    djinn::djinn_variant_t* variant = nullptr;
+
+    while (ret >= 0) {
+        int decode_ret = reader.NextBlock(*djn_decode);
+        if (decode_ret < 0) {
+            std::cerr << "could not read block: " << djinn::ArchiveErrorString(decode_ret) << std::endl;
+            ret = -10; break;
+        }
+        if (decode_ret == 0) break; // exit condition
+
+        if (djn_decode->StartDecoding() < 0) { ret = -5; break; }
+        for (int i = 0; i < djn_decode->n_variants; ++i) {
+            int objs = djn_decode->DecodeNext(variant);
+            if (objs <= 0) { ret = -5; break; }
+
+            // The header is written when the number of samples is known.
+            if (hdr == nullptr) {
+                n_samples = variant->data_len / (variant->ploidy <= 0 ? 1 : variant->ploidy);
+                hdr = bcf_hdr_init("w");
+                if (reader.has_sites) {
+                    for (size_t c = 0; c < reader.contigs.size(); ++c)
+                        bcf_hdr_append(hdr, ("##contig=<ID=" + reader.contigs[c] + ">").c_str());
+                } else bcf_hdr_append(hdr, "##contig=<ID=djinn>");
+                bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+                for (uint32_t s = 0; s < n_samples; ++s) {
+                    if (reader.samples.size() == n_samples) bcf_hdr_add_sample(hdr, reader.samples[s].c_str());
+                    else bcf_hdr_add_sample(hdr, std::to_string(s).c_str());
+                }
+                bcf_hdr_sync(hdr);
+                if (bcf_hdr_write(fp, hdr) < 0) { ret = -6; break; }
+            }
+
+            if (n_samples == 0 || variant->data_len % n_samples != 0) {
+                std::cerr << "Variant " << n_lines << " has " << variant->data_len << " haplotypes for " << n_samples << " samples" << std::endl;
+                ret = -7;
+                break;
+            }
+
+            if (gt8.size() < variant->data_len) {
+                gt8.resize(variant->data_len);
+                gt32.resize(variant->data_len);
+            }
+            const int len = variant->ToBcf(gt8.data());
+            if (len < 0) { ret = -8; break; }
+
+            // Widen to 32-bit values and find the largest allele.
+            int max_allele = 1;
+            for (int j = 0; j < len; ++j) {
+                if (gt8[j] == 0x81) {
+                    gt32[j] = bcf_int32_vector_end;
+                } else {
+                    gt32[j] = gt8[j];
+                    const int allele = (gt8[j] >> 1) - 1;
+                    max_allele = allele > max_allele ? allele : max_allele;
+                }
+            }
+
+            bcf_clear(rec);
+            if (reader.has_sites) {
+                if (reader.sites.contig[i] < 0 || (size_t)reader.sites.contig[i] >= reader.contigs.size()) {
+                    std::cerr << "Variant " << n_lines << " refers to an unknown contig" << std::endl;
+                    ret = -7;
+                    break;
+                }
+                alleles.assign(reader.sites.alleles(i), reader.sites.alleles_len(i));
+                rec->rid = reader.sites.contig[i];
+                rec->pos = reader.sites.pos[i] - 1;
+            } else {
+                alleles = "N";
+                for (int a = 1; a <= max_allele; ++a) alleles += ",<ALT" + std::to_string(a) + ">";
+                rec->rid = 0;
+                rec->pos = n_lines;
+            }
+            bcf_update_alleles_str(hdr, rec, alleles.c_str());
+            bcf_update_genotypes(hdr, rec, gt32.data(), len);
+            if (bcf_write(fp, hdr, rec) < 0) { ret = -9; break; }
+            ++n_lines;
+        }
+    }
+
+    bcf_destroy(rec);
+    if (hdr != nullptr) bcf_hdr_destroy(hdr);
+    hts_close(fp);
+    if (input_file != "-") delete in_stream;
+    delete variant;
+    delete djn_decode;
+
+    return ret < 0 ? ret : n_lines;
+}
+
+#endif
@@ -20,6 +20,23 @@
 
 #include <fstream> // Support for read/write.
 #include <djinn.h> // Djinn data models.
+#include <limits> // std::numeric_limits
+
+/**
+ * Write a Vcf header to standard out using the sample and contig names stored
+ * in the archive.
+ */
+void WriteVcfHeader(const djinn::djinn_archive_reader& reader) {
+    std::string header = "##fileformat=VCFv4.2\n";
+    for (size_t c = 0; c < reader.contigs.size(); ++c)
+        header += "##contig=<ID=" + reader.contigs[c] + ">\n";
+    header += "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    header += "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    for (size_t s = 0; s < reader.samples.size(); ++s)
+        header += "\t" + reader.samples[s];
+    header += "\n";
+    std::cout.write(header.data(), header.size());
+}
 
 /**
  * In this example we will read data using the provided support class VcfReader
@@ -27,15 +44,23 @@
  * Vcf/Bcf/Vcf.gz/BGZF-based files either from standard in (pipe) or from a 
  * file handle (from disk).
  * 
+ * Decoded genotypes are written to standard out as Vcf. Records are complete
+ * (CHROM to FORMAT followed by the GT columns) when the archive stores site
+ * metadata.
+ * 
+ * 
+ * When a filter is provided, blocks whose summary statistics exclude every
+ * variant are skipped without decoding and only passing variants are written.
  * 
  * @param input_file   Input file string: file path or "-" to read from stdin
  * @param output_file  Output file string: file path or "-" to write to stdout
  * @param type         1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
  * @param permute      Use PBWT preprocessor
  * @param reset_models Reset models for each block (random access)
+ * @param filter       Optional filter on per-variant summary statistics
  * @return int         Returns non-negative value when successful or a negative value otherwise.
  */
-int IterateVcf(std::string input_file, int model) {
+int IterateVcf(std::string input_file, int model, const djinn::djinn_stats_filter_t* filter = nullptr) {
     bool own_stream = false;
     uint64_t filesize = 0;
     std::istream* in_stream = nullptr;
@@ -50,29 +75,68 @@ int IterateVcf(std::string input_file, int model) {
         in_stream->seekg(0);
     }
 
-    djinn::djinn_model* djn_decode = nullptr;
-    if (model == 1) djn_decode = new djinn::djinn_ctx_model();
-    else if(model == 2 || model == 4) djn_decode = new djinn::djinn_ewah_model();
-    else {
-        std::cerr << "unknown model: " << model << std::endl;
+    // The model is read from the archive header. The provided model type is
+    // only used for streams written without framing.
+    djinn::djinn_archive_reader reader;
+    const int ret_open = reader.Open(*in_stream, model);
+    if (ret_open < 0) {
+        std::cerr << "could not read archive header: " << djinn::ArchiveErrorString(ret_open) << std::endl;
         return -3;
     }
+    djinn::djinn_model* djn_decode = reader.CreateModel();
 
     char* vcf_out_buffer = new char[4*65536];
+    std::vector<char> site_buffer(1024);
+    bool header_written = false;
     uint32_t len_vcf   = 0;
     uint32_t n_lines   = 0;
     uint64_t b_out_vcf = 0;
 
     djinn::djinn_variant_t* variant = nullptr;
 
+    int decode_ctx_ret = 0;
     while (true) {
-        int decode_ctx_ret = djn_decode->Deserialize(*in_stream);
-        if (decode_ctx_ret <= 0) break; // exit condition
+        decode_ctx_ret = filter ? reader.NextBlock(*djn_decode, *filter) : reader.NextBlock(*djn_decode);
+        if (decode_ctx_ret < 0) {
+            std::cerr << "could not read block: " << djinn::ArchiveErrorString(decode_ctx_ret) << std::endl;
+            break;
+        }
+        if (decode_ctx_ret == 0) break; // exit condition
+
+        // Archives with sample names or site metadata are written as Vcf
+        // files with a header and complete records. Otherwise only the
+        // genotype columns are written.
+        if (header_written == false && (reader.samples.size() || reader.has_sites)) {
+            WriteVcfHeader(reader);
+            header_written = true;
+        }
 
-        djn_decode->StartDecoding();
-        for (int i = 0; i < djn_decode->n_variants; ++i, ++n_lines) {
+        // Variants are decoded sequentially: stop after the last one that
+        // passes the filter.
+        int n_decode = djn_decode->n_variants;
+        if (filter && reader.has_stats) {
+            while (n_decode > 0 && reader.stats.Pass(n_decode - 1, *filter) == false) --n_decode;
+        }
+
+        decode_ctx_ret = djn_decode->StartDecoding();
+        if (decode_ctx_ret < 0) {
+            std::cerr << "failed to decompress block" << std::endl;
+            break;
+        }
+        for (int i = 0; i < n_decode; ++i) {
             int objs = djn_decode->DecodeNext(variant);
             assert(objs > 0);
+            if (filter && reader.has_stats && reader.stats.Pass(i, *filter) == false) continue;
+            ++n_lines;
+
+            if (reader.has_sites) {
+                const uint32_t len_site = reader.sites.VcfLength(i, reader.contigs);
+                if (site_buffer.size() < len_site) site_buffer.resize(len_site);
+                const int ret = reader.sites.ToVcf(i, reader.contigs, site_buffer.data());
+                assert(ret > 0);
+                std::cout.write(site_buffer.data(), ret);
+                b_out_vcf += ret;
+            }
 
             len_vcf = variant->ToVcf(vcf_out_buffer);
             assert(len_vcf > 0);
@@ -82,11 +146,93 @@ int IterateVcf(std::string input_file, int model) {
         }
     }
 
+    if (filter) std::cerr << "Skipped " << reader.n_skipped << "/" << reader.n_blocks << " blocks by summary statistics" << std::endl;
+
     delete[] vcf_out_buffer;
     delete variant;
     delete djn_decode;
 
-    return n_lines;
+    return decode_ctx_ret < 0 ? decode_ctx_ret : n_lines;
+}
+
+/**
+ * In this example we will decode the variants overlapping a genomic interval
+ * and write them to standard out as Vcf. The archive index is used to read
+ * only the blocks overlapping the interval. Requires an archive with site
+ * metadata stored in a file (seekable).
+ * 
+ * @param input_file Input file path.
+ * @param region     Interval as "contig", "contig:start", or "contig:start-end" (1-based, inclusive).
+ * @return int       Returns the number of written records when successful or a negative value otherwise.
+ */
+int QueryVcf(std::string input_file, std::string region) {
+    // Parse the region string.
+    std::string contig = region;
+    int64_t start = 1, end = std::numeric_limits<int64_t>::max();
+    const size_t colon = region.rfind(':');
+    if (colon != std::string::npos) {
+        contig = region.substr(0, colon);
+        const char* s = region.c_str() + colon + 1;
+        char* s_end = nullptr;
+        start = strtoll(s, &s_end, 10);
+        if (s_end == s) {
+            std::cerr << "Invalid region: " << region << std::endl;
+            return -1;
+        }
+        if (*s_end == '-') {
+            s = s_end + 1;
+            end = strtoll(s, &s_end, 10);
+            if (s_end == s) end = std::numeric_limits<int64_t>::max();
+        }
+    }
+
+    std::ifstream in_stream(input_file, std::ios::in | std::ios::binary);
+    if (in_stream.good() == false) {
+        std::cerr << "could not open infile handle" << std::endl;
+        return -2;
+    }
+
+    djinn::djinn_archive_reader reader;
+    const int ret_open = reader.Open(in_stream);
+    if (ret_open != 1) {
+        std::cerr << "could not read archive header: " << (ret_open < 0 ? djinn::ArchiveErrorString(ret_open) : "input is not framed") << std::endl;
+        return -3;
+    }
+    const int ret_index = reader.LoadIndex();
+    if (ret_index < 0) {
+        std::cerr << "could not load the archive index: " << djinn::ArchiveErrorString(ret_index) << std::endl;
+        return -4;
+    }
+    WriteVcfHeader(reader);
+
+    const int ret_query = reader.Query(contig, start, end);
+    if (ret_query < 0) {
+        std::cerr << "could not query the archive: " << djinn::ArchiveErrorString(ret_query) << std::endl;
+        return -5;
+    }
+
+    djinn::djinn_model* djn_decode = reader.CreateModel();
+    djinn::djinn_variant_t* variant = nullptr;
+    std::vector<char> vcf_out_buffer(1024);
+    int64_t n_lines = 0;
+    int ret = 0;
+
+    while ((ret = reader.NextQuery(*djn_decode, variant)) > 0) {
+        const uint32_t site = reader.query_site;
+        const uint32_t len = reader.sites.VcfLength(site, reader.contigs) + 4*variant->data_len + 1;
+        if (vcf_out_buffer.size() < len) vcf_out_buffer.resize(len);
+
+        int len_vcf = reader.sites.ToVcf(site, reader.contigs, vcf_out_buffer.data());
+        len_vcf += variant->ToVcf(&vcf_out_buffer[len_vcf]);
+        std::cout.write(vcf_out_buffer.data(), len_vcf);
+        ++n_lines;
+    }
+    if (ret < 0) std::cerr << "could not read block: " << djinn::ArchiveErrorString(ret) << std::endl;
+
+    delete variant;
+    delete djn_decode;
+
+    return ret < 0 ? ret : n_lines;
 }
 
 #endif
\ No newline at end of file
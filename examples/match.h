@@ -0,0 +1,197 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_EXAMPLE_MATCH_H_
+#define DJINN_EXAMPLE_MATCH_H_
+
+#include <fstream> // Support for read/write.
+#include <iterator> // std::istreambuf_iterator
+#include <limits> // std::numeric_limits
+#include <string> // std::string
+#include <vector> // std::vector
+#include <djinn.h> // Djinn data models.
+
+/**
+ * Write the matches stored in the matcher to standard out as tab-delimited
+ * lines: haplotype 1, haplotype 2, first and last position (or variant
+ * number if the archive has no site table), and the length in variants.
+ * Haplotypes are written as SAMPLE#HAPLOTYPE if sample names are available.
+ */
+void WriteMatches(djinn::djinn_pbwt_matcher& matcher, const djinn::djinn_archive_reader& reader,
+                  const std::vector<int64_t>& positions, const uint32_t ploidy)
+{
+    auto hap_name = [&](uint32_t h) -> std::string {
+        if (h >= matcher.n_haplotypes) return "query";
+        if (reader.samples.size() * ploidy == matcher.n_haplotypes)
+            return reader.samples[h / ploidy] + "#" + std::to_string(h % ploidy);
+        return std::to_string(h);
+    };
+
+    for (size_t i = 0; i < matcher.matches.size(); ++i) {
+        const djinn::djinn_hap_match_t& m = matcher.matches[i];
+        std::cout << hap_name(m.hap1) << '\t' << hap_name(m.hap2) << '\t';
+        if (positions.size()) std::cout << positions[m.start] << '\t' << positions[m.end - 1];
+        else std::cout << m.start + 1 << '\t' << m.end;
+        std::cout << '\t' << m.end - m.start << '\n';
+    }
+    matcher.matches.clear();
+}
+
+/**
+ * In this example we will search an archive for long shared haplotypes with
+ * the PBWT in a single pass over a region. Without a query haplotype, every
+ * pair of haplotypes matching over at least min_length consecutive variants
+ * is reported. With a query haplotype, the set-maximal matches of the query
+ * against the haplotypes in the archive are reported instead. The query is
+ * read from a file storing one allele per variant in the region as a string
+ * of digits ('.' for missing values); whitespace is ignored.
+ *
+ * @param input_file Input file path.
+ * @param region     Interval as "contig", "contig:start", or "contig:start-end" (1-based, inclusive) or empty for all variants.
+ * @param min_length Minimum match length in variants.
+ * @param query_file File storing the query haplotype or empty.
+ * @return int       Returns the number of reported matches when successful or a negative value otherwise.
+ */
+int64_t MatchHaplotypes(std::string input_file, std::string region, uint32_t min_length, std::string query_file) {
+    // Read the query haplotype.
+    std::vector<uint8_t> query;
+    if (query_file.size()) {
+        std::ifstream q_stream(query_file);
+        if (q_stream.good() == false) {
+            std::cerr << "could not open query handle \"" << query_file << "\"" << std::endl;
+            return -1;
+        }
+        std::string q((std::istreambuf_iterator<char>(q_stream)), std::istreambuf_iterator<char>());
+        for (size_t i = 0; i < q.size(); ++i) {
+            if (q[i] >= '0' && q[i] <= '9') query.push_back(q[i] - '0');
+            else if (q[i] == '.') query.push_back(DJN_ALLELE_MISSING);
+            else if (isspace(q[i]) == false) {
+                std::cerr << "Invalid allele in query haplotype: " << q[i] << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    // Parse the region string.
+    std::string contig = region;
+    int64_t start = 1, end = std::numeric_limits<int64_t>::max();
+    const size_t colon = region.rfind(':');
+    if (colon != std::string::npos) {
+        contig = region.substr(0, colon);
+        const char* s = region.c_str() + colon + 1;
+        char* s_end = nullptr;
+        start = strtoll(s, &s_end, 10);
+        if (s_end == s) {
+            std::cerr << "Invalid region: " << region << std::endl;
+            return -1;
+        }
+        if (*s_end == '-') {
+            s = s_end + 1;
+            end = strtoll(s, &s_end, 10);
+            if (s_end == s) end = std::numeric_limits<int64_t>::max();
+        }
+    }
+
+    std::ifstream in_stream(input_file, std::ios::in | std::ios::binary);
+    if (in_stream.good() == false) {
+        std::cerr << "could not open infile handle" << std::endl;
+        return -2;
+    }
+
+    djinn::djinn_archive_reader reader;
+    const int ret_open = reader.Open(in_stream);
+    if (ret_open != 1) {
+        std::cerr << "could not read archive header: " << (ret_open < 0 ? djinn::ArchiveErrorString(ret_open) : "input is not framed") << std::endl;
+        return -3;
+    }
+    if (region.size()) {
+        const int ret_index = reader.LoadIndex();
+        if (ret_index < 0) {
+            std::cerr << "could not load the archive index: " << djinn::ArchiveErrorString(ret_index) << std::endl;
+            return -4;
+        }
+        const int ret_query = reader.Query(contig, start, end);
+        if (ret_query < 0) {
+            std::cerr << "could not query the archive: " << djinn::ArchiveErrorString(ret_query) << std::endl;
+            return -5;
+        }
+    }
+
+    djinn::djinn_model* djn_decode = reader.CreateModel();
+    djinn::djinn_variant_t* variant = nullptr;
+    djinn::djinn_pbwt_matcher matcher;
+    std::vector<int64_t> positions;
+    uint32_t ploidy = 0;
+    int64_t block_site = 0; // next variant of the current block
+    int64_t n_matches = 0, n_variants = 0;
+    int ret = 0;
+
+    // Decode the next variant in the region and its position.
+    auto next_variant = [&]() -> int {
+        if (region.size()) {
+            const int r = reader.NextQuery(*djn_decode, variant);
+            if (r > 0 && reader.has_sites) positions.push_back(reader.sites.pos[reader.query_site]);
+            return r;
+        }
+        if (block_site == djn_decode->n_variants) {
+            do {
+                const int r = reader.NextBlock(*djn_decode);
+                if (r <= 0) return r;
+            } while (djn_decode->n_variants == 0);
+            if (djn_decode->StartDecoding() < 0) return -1;
+            block_site = 0;
+        }
+        if (djn_decode->DecodeNext(variant) <= 0) return -1;
+        if (reader.has_sites) positions.push_back(reader.sites.pos[block_site]);
+        ++block_site;
+        return 1;
+    };
+
+    while ((ret = next_variant()) > 0) {
+        if (n_variants == 0) {
+            ploidy = variant->ploidy ? variant->ploidy : 1;
+            if (matcher.Initiate(variant->data_len, min_length, query.size() != 0) < 0) { ret = -6; break; }
+        }
+        if (query.size() && n_variants >= (int64_t)query.size()) {
+            std::cerr << "Query haplotype has fewer alleles than variants in the region" << std::endl;
+            ret = -7; break;
+        }
+
+        const int r = matcher.Update(*variant, query.size() ? query[n_variants] : 0);
+        if (r < 0) { ret = -6; break; }
+        ++n_variants;
+        n_matches += r;
+        WriteMatches(matcher, reader, positions, ploidy);
+    }
+    if (ret < 0 && ret > -6) std::cerr << "could not read block: " << djinn::ArchiveErrorString(ret) << std::endl;
+
+    if (ret >= 0 && n_variants) {
+        if (query.size() && n_variants != (int64_t)query.size())
+            std::cerr << "Query haplotype has " << query.size() << " alleles but the region has " << n_variants << " variants" << std::endl;
+        n_matches += matcher.Finish();
+        WriteMatches(matcher, reader, positions, ploidy);
+    }
+    std::cout.flush();
+    std::cerr << "[Match] Reported " << n_matches << " matches over " << n_variants << " variants" << std::endl;
+
+    delete variant;
+    delete djn_decode;
+
+    return ret < 0 ? ret : n_matches;
+}
+
+#endif
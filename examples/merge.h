@@ -0,0 +1,225 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_EXAMPLE_MERGE_H_
+#define DJINN_EXAMPLE_MERGE_H_
+
+#include <fstream> // Support for read/write.
+#include <memory> // std::unique_ptr
+#include <thread> // std::thread
+#include <vector> // std::vector
+#include <djinn.h> // Djinn data models.
+
+/**
+ * Returns TRUE if site i of both tables describe the same contig, position,
+ * and alleles. Contigs are compared by name as the archives may list them in
+ * different orders.
+ */
+bool MergeSameSite(const djinn::djinn_archive_reader& r1, const djinn::djinn_archive_reader& r2, uint32_t i) {
+    const djinn::djinn_site_table& s1 = r1.sites;
+    const djinn::djinn_site_table& s2 = r2.sites;
+    if (s1.pos[i] != s2.pos[i]) return false;
+    if (s1.alleles_len(i) != s2.alleles_len(i)) return false;
+    if (memcmp(s1.alleles(i), s2.alleles(i), s1.alleles_len(i)) != 0) return false;
+
+    const int32_t c1 = s1.contig[i], c2 = s2.contig[i];
+    if (c1 < (int32_t)r1.contigs.size() && c2 < (int32_t)r2.contigs.size())
+        return r1.contigs[c1] == r2.contigs[c2];
+    return c1 == c2;
+}
+
+/**
+ * In this example we will merge two archives describing the same variants
+ * for disjoint sets of samples (for example a new sequencing batch) into a
+ * single archive without going through Vcf. Pairs of blocks are decoded and
+ * re-encoded in parallel with djinn_model::Merge. The samples of input_file1
+ * precede those of input_file2 and the metadata (contigs and sites) is taken
+ * from input_file1. Both archives must be framed and have identical block
+ * boundaries, which is the case when both were imported with the same
+ * settings.
+ *
+ * Blocks encoded without resetting the models depend on the preceding block
+ * and are then merged sequentially.
+ *
+ * @param input_file1  First input archive.
+ * @param input_file2  Second input archive.
+ * @param output_file  Output file string: file path or "-" to write to stdout
+ * @param type         1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
+ * @param permute      Use PBWT preprocessor
+ * @param n_threads    Number of threads used for merging blocks
+ * @return int         Returns the number of merged variants when successful or a negative value otherwise.
+ */
+int MergeArchives(std::string input_file1, std::string input_file2, std::string output_file,
+                  const uint32_t type, const bool permute = true, const uint32_t n_threads = 0)
+{
+    std::ifstream in1(input_file1, std::ios::in | std::ios::binary);
+    std::ifstream in2(input_file2, std::ios::in | std::ios::binary);
+    if (in1.good() == false || in2.good() == false) {
+        std::cerr << "could not open infile handle" << std::endl;
+        return -2;
+    }
+
+    djinn::djinn_archive_reader reader1, reader2;
+    if (reader1.Open(in1) != 1 || reader2.Open(in2) != 1) {
+        std::cerr << "could not read archive header: merging requires framed archives" << std::endl;
+        return -3;
+    }
+
+    // Every slot merges one pair of blocks per round.
+    const uint32_t n_slots = n_threads ? n_threads : 1;
+    struct merge_slot_t {
+        std::unique_ptr<djinn::djinn_model> dec1, dec2, enc;
+        djinn::djinn_site_table sites;
+        std::vector<std::string> contigs;
+        bool has_sites;
+        int ret;
+    };
+    std::vector<merge_slot_t> slots(n_slots);
+    for (uint32_t i = 0; i < n_slots; ++i) {
+        slots[i].dec1.reset(reader1.CreateModel());
+        slots[i].dec2.reset(reader2.CreateModel());
+        if ((type >> 0) & 1)      slots[i].enc.reset(new djinn::djinn_ctx_model());
+        else if ((type >> 1) & 1) slots[i].enc.reset(new djinn::djinn_ewah_model(djinn::CompressionStrategy::LZ4,  9));
+        else if ((type >> 2) & 1) slots[i].enc.reset(new djinn::djinn_ewah_model(djinn::CompressionStrategy::ZSTD, 21));
+    }
+
+    // Open file stream (or file handle) depending on the passed argument.
+    bool own_stream = false;
+    std::ostream* out_stream = nullptr;
+    if (output_file == "-") out_stream = &std::cout; // standard out (pipe)
+    else { // file stream (to disk)
+        out_stream = new std::ofstream(output_file, std::ios::out | std::ios::binary);
+        if (out_stream->good() == false) {
+            std::cerr << "Could not open output handle \"" << output_file << "\"!" << std::endl;
+            delete out_stream;
+            return -3;
+        }
+        own_stream = true;
+    }
+
+    djinn::djinn_archive_writer writer;
+    writer.Open(*out_stream, *slots[0].enc, reader1.header.n_samples + reader2.header.n_samples);
+
+    int64_t n_merged = 0;
+    int ret = 0;
+    bool names_written = false;
+    size_t n_contigs_written = 0;
+    uint32_t n_active = n_slots;
+
+    while (ret >= 0) {
+        // Read the next round of block pairs.
+        uint32_t n_read = 0;
+        for (/**/; n_read < n_active; ++n_read) {
+            merge_slot_t& slot = slots[n_read];
+            const int r1 = reader1.NextBlock(*slot.dec1);
+            const int r2 = reader2.NextBlock(*slot.dec2);
+            if (r1 < 0 || r2 < 0) {
+                std::cerr << "could not read block: " << djinn::ArchiveErrorString(r1 < 0 ? r1 : r2) << std::endl;
+                ret = -4; break;
+            }
+            if (r1 == 0 || r2 == 0) {
+                if (r1 != r2) {
+                    std::cerr << "Archives have a different number of blocks" << std::endl;
+                    ret = -5;
+                }
+                break;
+            }
+            if (slot.dec1->n_variants != slot.dec2->n_variants) {
+                std::cerr << "Archives have different block boundaries" << std::endl;
+                ret = -5; break;
+            }
+            if (reader1.has_sites && reader2.has_sites) {
+                for (uint32_t i = 0; i < reader1.sites.size(); ++i) {
+                    if (MergeSameSite(reader1, reader2, i) == false) {
+                        std::cerr << "Archives describe different sites at block " << reader1.n_blocks << std::endl;
+                        ret = -5; break;
+                    }
+                }
+                if (ret < 0) break;
+            }
+
+            // Blocks that depend on the preceding block are merged in order.
+            if ((slot.dec1->init == false || slot.dec2->init == false) && n_active > 1) {
+                if (reader1.n_blocks != 1) {
+                    std::cerr << "Archives mix independent and dependent blocks" << std::endl;
+                    ret = -5; break;
+                }
+                n_active = 1;
+            }
+
+            slot.has_sites = reader1.has_sites;
+            if (slot.has_sites) slot.sites = reader1.sites;
+            slot.contigs = reader1.contigs;
+        }
+        if (ret < 0 || n_read == 0) break;
+
+        // Sample names are available once the first blocks have been read.
+        if (names_written == false) {
+            if (reader1.samples.size() && reader2.samples.size()) {
+                std::vector<std::string> samples = reader1.samples;
+                samples.insert(samples.end(), reader2.samples.begin(), reader2.samples.end());
+                writer.WriteNames(DJN_FRAME_SAMPLES, samples);
+            }
+            names_written = true;
+        }
+
+        auto merge_func = [&slots, permute](uint32_t k) {
+            merge_slot_t& slot = slots[k];
+            slot.enc->gt_pbwt = slot.dec1->gt_pbwt;
+            slot.enc->pbwt_ctx = slot.dec1->pbwt_ctx;
+            slot.enc->dense = slot.dec1->dense;
+            slot.enc->StartEncoding(permute, slot.dec1->init);
+            slot.ret = slot.enc->Merge(*slot.dec1, *slot.dec2);
+            if (slot.ret >= 0 && slot.enc->FinishEncoding() < 0) slot.ret = -5;
+        };
+
+        if (n_read == 1) merge_func(0);
+        else {
+            std::vector<std::thread> threads;
+            for (uint32_t k = 0; k < n_read; ++k) threads.push_back(std::thread(merge_func, k));
+            for (uint32_t k = 0; k < n_read; ++k) threads[k].join();
+        }
+
+        // Write the merged blocks in order.
+        for (uint32_t k = 0; k < n_read; ++k) {
+            merge_slot_t& slot = slots[k];
+            if (slot.ret < 0) {
+                std::cerr << "Failed to merge block: " << slot.ret << std::endl;
+                ret = -6; break;
+            }
+            if (slot.contigs.size() != n_contigs_written) {
+                writer.WriteNames(DJN_FRAME_CONTIGS, slot.contigs);
+                n_contigs_written = slot.contigs.size();
+            }
+            const int w = slot.has_sites ? writer.WriteBlock(*slot.enc, slot.sites) : writer.WriteBlock(*slot.enc);
+            if (w < 0) { ret = -7; break; }
+            n_merged += slot.enc->n_variants;
+        }
+    }
+
+    // Write the trailer and close handle and clean up.
+    writer.Close();
+    out_stream->flush();
+    if (own_stream) {
+        ((std::ofstream*)out_stream)->close();
+        delete out_stream;
+    }
+
+    return ret < 0 ? ret : n_merged;
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_EXAMPLE_RESUME_H_
+#define DJINN_EXAMPLE_RESUME_H_
+
+#include <fstream> // Support for read/write.
+#include <unistd.h> // truncate
+#include <djinn.h> // Djinn data models.
+
+/**
+ * Support function for resuming an interrupted import (or appending to a
+ * finished one). The state of the archive stored at output_file is recovered
+ * into the writer, the file is truncated after the last complete block, and
+ * a stream positioned at the end of the file is returned. The importer then
+ * skips the input records up to writer.last_ordinal and continues encoding.
+ *
+ * @param output_file Path of the archive.
+ * @param writer      Target writer.
+ * @param type        1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
+ * @param n_samples   Number of samples in the input.
+ * @param error       Set to a negative value on error.
+ * @return std::ofstream* Returns the stream or nullptr if there is no archive to resume or on error.
+ */
+std::ofstream* ResumeArchive(const std::string& output_file, djinn::djinn_archive_writer& writer,
+                             const uint32_t type, const uint32_t n_samples, int& error)
+{
+    error = 0;
+    std::ifstream in_stream(output_file, std::ios::in | std::ios::binary | std::ios::ate);
+    if (in_stream.good() == false) return nullptr; // nothing to resume
+    const int64_t file_size = in_stream.tellg();
+    if (file_size < DJN_ARCHIVE_HEADER_SIZE) return nullptr; // header incomplete
+    in_stream.seekg(0);
+
+    const int64_t offset = writer.Recover(in_stream);
+    in_stream.close();
+    if (offset < 0) {
+        std::cerr << "Cannot resume \"" << output_file << "\": " << djinn::ArchiveErrorString(offset) << std::endl;
+        error = -1;
+        return nullptr;
+    }
+    if (offset < file_size) {
+        std::cerr << "Discarding " << (file_size - offset) << " bytes following block " << writer.n_blocks << " of \"" << output_file << "\"" << std::endl;
+    }
+
+    const uint8_t model = ((type >> 0) & 1) ? DJN_ARCHIVE_MODEL_CTX : DJN_ARCHIVE_MODEL_EWAH;
+    if (writer.header.model != model || writer.header.n_samples != n_samples) {
+        std::cerr << "Cannot resume \"" << output_file << "\": model type or number of samples differ" << std::endl;
+        error = -2;
+        return nullptr;
+    }
+
+    if (writer.n_blocks && writer.last_ordinal < 0) {
+        std::cerr << "Cannot resume \"" << output_file << "\": archive has no site metadata" << std::endl;
+        error = -2;
+        return nullptr;
+    }
+
+    // Discard everything following the last complete block.
+    if (truncate(output_file.c_str(), offset) != 0) {
+        std::cerr << "Could not truncate \"" << output_file << "\"" << std::endl;
+        error = -3;
+        return nullptr;
+    }
+
+    std::ofstream* out_stream = new std::ofstream(output_file, std::ios::in | std::ios::out | std::ios::binary);
+    out_stream->seekp(offset);
+    const int ret = writer.Resume(*out_stream);
+    if (ret < 0) {
+        std::cerr << "Cannot resume \"" << output_file << "\": " << djinn::ArchiveErrorString(ret) << std::endl;
+        delete out_stream;
+        error = -3;
+        return nullptr;
+    }
+
+    std::cerr << "Resuming \"" << output_file << "\" after " << writer.n_blocks << " blocks (" << writer.n_variants << " variants)" << std::endl;
+    return out_stream;
+}
+
+#endif
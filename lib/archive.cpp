@@ -0,0 +1,1226 @@
+#include <cstring> //memcpy
+#include <cstdio> //sprintf
+#include <algorithm> //min,max,lower_bound
+
+#include "djinn.h"
+#include "checksum.h"
+#include "compressors.h"
+#include "scratch.h"
+
+namespace djinn {
+
+/*======   Supportive functions   ======*/
+
+static inline void djn_store_u32(uint8_t* dst, uint32_t v) { memcpy(dst, &v, sizeof(uint32_t)); }
+static inline uint32_t djn_load_u32(const uint8_t* src) { uint32_t v; memcpy(&v, src, sizeof(uint32_t)); return v; }
+
+static inline void djn_put_varint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+static inline bool djn_get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+static inline uint64_t djn_zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t djn_unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+// Metadata frames use their own codec context such that dictionaries and
+// parameters set for genotype streams are not applied.
+static djn_codec_ctx_t& djn_meta_codec_ctx() {
+    static thread_local djn_codec_ctx_t ctx;
+    return ctx;
+}
+
+// Compressed metadata payload: codec (1 byte), uncompressed length (4 bytes),
+// and the (compressed) data.
+static int djn_pack_meta(const std::vector<uint8_t>& raw, CompressionStrategy codec, std::vector<uint8_t>& out) {
+    if (raw.size() > DJN_SCRATCH_MAX_CAPACITY) return -1;
+    const uint32_t bound = CompressBound(codec, raw.size());
+    out.resize(5 + bound);
+    
+    const int32_t level = codec == CompressionStrategy::ZSTD ? 19 : 9;
+    int ret = djn_meta_codec_ctx().Compress(codec, raw.data(), raw.size(), &out[5], bound, level);
+    if (ret < 0 || (uint32_t)ret >= raw.size()) {
+        codec = CompressionStrategy::NONE;
+        memcpy(&out[5], raw.data(), raw.size());
+        ret = raw.size();
+    }
+    out[0] = (uint8_t)codec;
+    djn_store_u32(&out[1], raw.size());
+    out.resize(5 + ret);
+    return out.size();
+}
+
+static int djn_unpack_meta(const uint8_t* data, uint32_t len, std::vector<uint8_t>& raw) {
+    if (len < 5) return -2;
+    const uint32_t len_raw = djn_load_u32(&data[1]);
+    if (len_raw > DJN_SCRATCH_MAX_CAPACITY) return -2;
+    raw.resize(len_raw);
+    if (len_raw == 0) return 0;
+
+    const CompressionStrategy codec = (CompressionStrategy)data[0];
+    if (codec == CompressionStrategy::NONE) {
+        if (len - 5 != len_raw) return -2;
+        memcpy(raw.data(), &data[5], len_raw);
+        return len_raw;
+    }
+    if (codec != CompressionStrategy::ZSTD && codec != CompressionStrategy::LZ4 && codec != CompressionStrategy::CTX) return -2;
+
+    const int ret = djn_meta_codec_ctx().Decompress(codec, &data[5], len - 5, raw.data(), len_raw);
+    if (ret == -1) return -4; // codec not available in this build
+    if (ret != (int)len_raw) return -2;
+    return len_raw;
+}
+
+const char* ArchiveErrorString(int code) {
+    switch (code) {
+    case DJN_ARCHIVE_ERR_IO:          return "archive is truncated or could not be written";
+    case DJN_ARCHIVE_ERR_CORRUPT:     return "checksum mismatch or corrupted frame";
+    case DJN_ARCHIVE_ERR_INVALID:     return "not a Djinn archive or invalid arguments";
+    case DJN_ARCHIVE_ERR_UNSUPPORTED: return "archive is incompatible or uses an unsupported version or codec";
+    case DJN_ARCHIVE_ERR_NO_INDEX:    return "archive has no index";
+    default: return code < 0 ? "unknown error" : "no error";
+    }
+}
+
+/*======   Site table   ======*/
+
+djinn_site_table::djinn_site_table() { clear(); }
+djinn_site_table::~djinn_site_table() {}
+
+void djinn_site_table::clear() {
+    contig.clear();
+    pos.clear();
+    ordinal.clear();
+    allele_offset.assign(1, 0);
+    allele_data.clear();
+}
+
+void djinn_site_table::Add(int32_t contig, int64_t position, const char* alleles, uint32_t len_alleles, uint64_t ordinal) {
+    this->contig.push_back(contig);
+    this->pos.push_back(position);
+    this->ordinal.push_back(ordinal);
+    allele_data.insert(allele_data.end(), alleles, alleles + len_alleles);
+    allele_offset.push_back(allele_data.size());
+}
+
+uint32_t djinn_site_table::VcfLength(uint32_t i, const std::vector<std::string>& contigs) const {
+    // Contig, position (20 digits), 7 tabs, alleles (with ALT '.'), and "\t.\t.\t.\tGT\t".
+    const uint32_t len_contig = (contig[i] >= 0 && (size_t)contig[i] < contigs.size()) ? contigs[contig[i]].size() : 11;
+    return len_contig + 20 + 4 + alleles_len(i) + 2 + 10;
+}
+
+int djinn_site_table::ToVcf(uint32_t i, const std::vector<std::string>& contigs, char* out) const {
+    if (out == nullptr || i >= size()) return -1;
+    char* o = out;
+
+    if (contig[i] >= 0 && (size_t)contig[i] < contigs.size()) {
+        memcpy(o, contigs[contig[i]].data(), contigs[contig[i]].size());
+        o += contigs[contig[i]].size();
+    } else {
+        o += sprintf(o, "%d", contig[i]);
+    }
+    o += sprintf(o, "\t%lld\t.\t", (long long)pos[i]);
+
+    // REF and ALT: the first comma separates the columns.
+    const char* a = alleles(i);
+    const uint32_t len = alleles_len(i);
+    const char* comma = (const char*)memchr(a, ',', len);
+    if (comma == nullptr) {
+        memcpy(o, a, len);
+        o += len;
+        memcpy(o, "\t.", 2);
+        o += 2;
+    } else {
+        memcpy(o, a, len);
+        o[comma - a] = '\t';
+        o += len;
+    }
+    memcpy(o, "\t.\t.\t.\tGT\t", 10);
+    o += 10;
+    return o - out;
+}
+
+int djinn_site_table::Serialize(std::vector<uint8_t>& out, CompressionStrategy codec) const {
+    std::vector<uint8_t> raw;
+    raw.reserve(8 + size() * 6 + allele_data.size());
+    djn_put_varint(raw, size());
+
+    // Contigs: runs of (contig, length).
+    for (uint32_t i = 0; i < size(); /**/) {
+        uint32_t j = i + 1;
+        while (j < size() && contig[j] == contig[i]) ++j;
+        djn_put_varint(raw, djn_zigzag(contig[i]));
+        djn_put_varint(raw, j - i);
+        i = j;
+    }
+
+    // Positions and ordinals: deltas to the previous site.
+    int64_t prev = 0;
+    for (uint32_t i = 0; i < size(); ++i) {
+        djn_put_varint(raw, djn_zigzag(pos[i] - prev));
+        prev = pos[i];
+    }
+    uint64_t prev_ordinal = 0;
+    for (uint32_t i = 0; i < size(); ++i) {
+        djn_put_varint(raw, djn_zigzag(ordinal[i] - prev_ordinal));
+        prev_ordinal = ordinal[i];
+    }
+
+    // Alleles: lengths followed by the concatenated strings.
+    for (uint32_t i = 0; i < size(); ++i) djn_put_varint(raw, alleles_len(i));
+    raw.insert(raw.end(), allele_data.begin(), allele_data.end());
+
+    return djn_pack_meta(raw, codec, out);
+}
+
+int djinn_site_table::Deserialize(const uint8_t* data, uint32_t len) {
+    clear();
+    std::vector<uint8_t> raw;
+    const int ret = djn_unpack_meta(data, len, raw);
+    if (ret < 0) return ret;
+
+    const uint8_t* p = raw.data();
+    const uint8_t* end = raw.data() + raw.size();
+    uint64_t n = 0, v = 0, run = 0;
+    if (djn_get_varint(p, end, n) == false) return -2;
+    if (n > raw.size()) return -2; // every site takes at least one byte
+
+    contig.reserve(n);
+    while (contig.size() < n) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        if (djn_get_varint(p, end, run) == false) return -2;
+        if (run == 0 || run > n - contig.size()) return -2;
+        contig.insert(contig.end(), run, (int32_t)djn_unzigzag(v));
+    }
+
+    pos.resize(n);
+    int64_t prev = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        prev += djn_unzigzag(v);
+        pos[i] = prev;
+    }
+    ordinal.resize(n);
+    uint64_t prev_ordinal = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        prev_ordinal += djn_unzigzag(v);
+        ordinal[i] = prev_ordinal;
+    }
+
+    allele_offset.resize(n + 1);
+    for (uint64_t i = 0; i < n; ++i) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        if (v > (uint64_t)(end - p)) return -2;
+        allele_offset[i+1] = allele_offset[i] + v;
+    }
+    if (allele_offset[n] != (uint64_t)(end - p)) return -2;
+    allele_data.assign(p, end);
+
+    return n;
+}
+
+// End position of a site: POS + len(REF) - 1.
+static inline int64_t djn_site_end(const djinn_site_table& sites, uint32_t i) {
+    const char* a = sites.alleles(i);
+    const uint32_t len = sites.alleles_len(i);
+    const char* comma = (const char*)memchr(a, ',', len);
+    const int64_t len_ref = comma == nullptr ? len : comma - a;
+    return sites.pos[i] + (len_ref > 0 ? len_ref - 1 : 0);
+}
+
+/*======   Summary statistics   ======*/
+
+// Uncompressed block summary preceding the per-variant records.
+#define DJN_STATS_SUMMARY_SIZE 26
+
+djinn_stats_table::djinn_stats_table() { clear(); }
+djinn_stats_table::~djinn_stats_table() {}
+
+void djinn_stats_table::clear() {
+    variants.clear();
+    n_variants = n_2mc = 0;
+    min_maf = max_maf = 0;
+    min_missing = max_missing = 0;
+    min_allele = max_allele = 0;
+}
+
+bool djinn_stats_table::Pass(uint32_t i, const djinn_stats_filter_t& filter) const {
+    const djinn_variant_stats_t& v = variants[i];
+    const float maf = v.Maf();
+    return maf >= filter.min_maf && maf <= filter.max_maf && 
+           v.n_missing <= filter.max_missing && 
+           v.max_allele <= filter.max_allele;
+}
+
+bool djinn_stats_table::Pass(const djinn_stats_filter_t& filter) const {
+    return max_maf >= filter.min_maf && min_maf <= filter.max_maf && 
+           min_missing <= filter.max_missing && 
+           min_allele <= filter.max_allele;
+}
+
+int djinn_stats_table::Serialize(const std::vector<djinn_variant_stats_t>& stats, std::vector<uint8_t>& out, CompressionStrategy codec) {
+    if (stats.empty()) return -1;
+
+    // Block summary.
+    uint32_t n_2mc = 0, min_missing = stats[0].n_missing, max_missing = stats[0].n_missing;
+    float min_maf = stats[0].Maf(), max_maf = min_maf;
+    uint8_t min_allele = stats[0].max_allele, max_allele = stats[0].max_allele;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        const float maf = stats[i].Maf();
+        n_2mc += (stats[i].archetype == 0);
+        min_maf = std::min(min_maf, maf);
+        max_maf = std::max(max_maf, maf);
+        min_missing = std::min(min_missing, stats[i].n_missing);
+        max_missing = std::max(max_missing, stats[i].n_missing);
+        min_allele = std::min(min_allele, stats[i].max_allele);
+        max_allele = std::max(max_allele, stats[i].max_allele);
+    }
+
+    uint8_t summary[DJN_STATS_SUMMARY_SIZE];
+    djn_store_u32(&summary[0], stats.size());
+    djn_store_u32(&summary[4], n_2mc);
+    memcpy(&summary[8], &min_maf, sizeof(float));
+    memcpy(&summary[12], &max_maf, sizeof(float));
+    djn_store_u32(&summary[16], min_missing);
+    djn_store_u32(&summary[20], max_missing);
+    summary[24] = min_allele;
+    summary[25] = max_allele;
+
+    // Per-variant records: the number of called alleles rarely changes and
+    // is delta-encoded.
+    std::vector<uint8_t> raw;
+    raw.reserve(stats.size() * 5);
+    int64_t prev_an = 0;
+    for (size_t i = 0; i < stats.size(); ++i) djn_put_varint(raw, stats[i].ac);
+    for (size_t i = 0; i < stats.size(); ++i) {
+        djn_put_varint(raw, djn_zigzag((int64_t)stats[i].an - prev_an));
+        prev_an = stats[i].an;
+    }
+    for (size_t i = 0; i < stats.size(); ++i) djn_put_varint(raw, stats[i].n_missing);
+    for (size_t i = 0; i < stats.size(); ++i) raw.push_back(stats[i].max_allele);
+    for (size_t i = 0; i < stats.size(); ++i) raw.push_back(stats[i].archetype);
+
+    std::vector<uint8_t> packed;
+    const int len = djn_pack_meta(raw, codec, packed);
+    if (len < 0) return len;
+    out.resize(DJN_STATS_SUMMARY_SIZE + len);
+    memcpy(out.data(), summary, DJN_STATS_SUMMARY_SIZE);
+    memcpy(&out[DJN_STATS_SUMMARY_SIZE], packed.data(), len);
+    return out.size();
+}
+
+int djinn_stats_table::Deserialize(const uint8_t* data, uint32_t len, bool summary_only) {
+    clear();
+    if (len < DJN_STATS_SUMMARY_SIZE) return -2;
+    n_variants = djn_load_u32(&data[0]);
+    n_2mc = djn_load_u32(&data[4]);
+    memcpy(&min_maf, &data[8], sizeof(float));
+    memcpy(&max_maf, &data[12], sizeof(float));
+    min_missing = djn_load_u32(&data[16]);
+    max_missing = djn_load_u32(&data[20]);
+    min_allele = data[24];
+    max_allele = data[25];
+    if (summary_only) return n_variants;
+
+    std::vector<uint8_t> raw;
+    const int ret = djn_unpack_meta(&data[DJN_STATS_SUMMARY_SIZE], len - DJN_STATS_SUMMARY_SIZE, raw);
+    if (ret < 0) return ret;
+    if (n_variants > raw.size()) return -2; // every record takes at least five bytes
+
+    const uint8_t* p = raw.data();
+    const uint8_t* end = raw.data() + raw.size();
+    uint64_t v = 0;
+    int64_t an = 0;
+    variants.resize(n_variants);
+    for (uint32_t i = 0; i < n_variants; ++i) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        variants[i].ac = v;
+    }
+    for (uint32_t i = 0; i < n_variants; ++i) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        an += djn_unzigzag(v);
+        variants[i].an = an;
+    }
+    for (uint32_t i = 0; i < n_variants; ++i) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        variants[i].n_missing = v;
+    }
+    if (end - p != 2 * (int64_t)n_variants) return -2;
+    for (uint32_t i = 0; i < n_variants; ++i) variants[i].max_allele = *p++;
+    for (uint32_t i = 0; i < n_variants; ++i) variants[i].archetype = *p++;
+
+    return n_variants;
+}
+
+static int djn_serialize_names(const std::vector<std::string>& names, CompressionStrategy codec, std::vector<uint8_t>& out) {
+    std::vector<uint8_t> raw;
+    djn_put_varint(raw, names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        raw.insert(raw.end(), names[i].begin(), names[i].end());
+        raw.push_back('\0');
+    }
+    return djn_pack_meta(raw, codec, out);
+}
+
+static int djn_deserialize_names(const uint8_t* data, uint32_t len, std::vector<std::string>& names) {
+    names.clear();
+    std::vector<uint8_t> raw;
+    const int ret = djn_unpack_meta(data, len, raw);
+    if (ret < 0) return ret;
+
+    const uint8_t* p = raw.data();
+    const uint8_t* end = raw.data() + raw.size();
+    uint64_t n = 0;
+    if (djn_get_varint(p, end, n) == false || n > raw.size()) return -2;
+    names.reserve(n);
+    for (uint64_t i = 0; i < n; ++i) {
+        const uint8_t* term = (const uint8_t*)memchr(p, '\0', end - p);
+        if (term == nullptr) return -2;
+        names.push_back(std::string((const char*)p, term - p));
+        p = term + 1;
+    }
+    return n;
+}
+
+/*======   Archive writer   ======*/
+
+djinn_archive_writer::djinn_archive_writer() :
+    n_blocks(0), n_variants(0), n_bytes(0), last_ordinal(-1), stream(nullptr),
+#if defined HAVE_ZSTD
+    meta_codec(CompressionStrategy::ZSTD),
+#elif defined HAVE_LZ4
+    meta_codec(CompressionStrategy::LZ4),
+#else
+    meta_codec(CompressionStrategy::NONE),
+#endif
+    closed(false)
+{}
+
+djinn_archive_writer::~djinn_archive_writer() {}
+
+int djinn_archive_writer::Open(std::ostream& stream, const djinn_model& model, uint32_t n_samples) {
+    djinn_archive_header_t header;
+    if (dynamic_cast<const djinn_ctx_model*>(&model) != nullptr) {
+        header.model = DJN_ARCHIVE_MODEL_CTX;
+    } else if (dynamic_cast<const djinn_ewah_model*>(&model) != nullptr) {
+        header.model = DJN_ARCHIVE_MODEL_EWAH;
+        header.codec = (uint8_t)static_cast<const djinn_ewah_model&>(model).codec;
+    } else return -3; // unknown model type
+    header.flags = (model.use_pbwt << 0) | (model.init << 1);
+    header.n_samples = n_samples;
+    const int ret = Open(stream, header);
+    if (ret < 0) return ret;
+
+    // A preset dictionary is stored once following the header.
+    const int len_dict = WriteDictionary(model);
+    if (len_dict < 0) return len_dict;
+    return ret + len_dict;
+}
+
+int djinn_archive_writer::Open(std::ostream& stream, const djinn_archive_header_t& header) {
+    this->header = header;
+    this->header.version = DJINN_VERSION_NUMBER;
+
+    uint8_t out[DJN_ARCHIVE_HEADER_SIZE] = {0};
+    memcpy(out, DJN_ARCHIVE_MAGIC, 8);
+    djn_store_u32(&out[8], header.version);
+    out[12] = header.model;
+    out[13] = header.codec;
+    memcpy(&out[14], &header.flags, sizeof(uint16_t));
+    djn_store_u32(&out[16], header.n_samples);
+    // Bytes 20-27 are reserved.
+    djn_store_u32(&out[28], djn_crc32c(0, out, 28));
+
+    stream.write((const char*)out, DJN_ARCHIVE_HEADER_SIZE);
+    if (stream.good() == false) return -2;
+
+    this->stream = &stream;
+    n_blocks = n_variants = 0;
+    n_bytes = DJN_ARCHIVE_HEADER_SIZE;
+    last_ordinal = -1;
+    index.clear();
+    contigs.clear();
+    samples.clear();
+    dict.clear();
+    dict_offsets.clear();
+    closed = false;
+    return DJN_ARCHIVE_HEADER_SIZE;
+}
+
+int djinn_archive_writer::WriteStats(const djinn_model& model) {
+    // Statistics are recorded while encoding: deserialized models have none.
+    if (model.n_variants == 0 || model.variant_stats.size() != model.n_variants) return 0;
+
+    const int len = djinn_stats_table::Serialize(model.variant_stats, meta_buf, meta_codec);
+    if (len < 0) return -1;
+    if (WriteFrame(DJN_FRAME_STATS, meta_buf.data(), len, model.n_variants) < 0) return -2;
+    return DJN_FRAME_HEADER_SIZE + len;
+}
+
+int djinn_archive_writer::WriteBlock(const djinn_model& model) {
+    if (WriteDictionary(model) < 0) return -2;
+    if (WriteStats(model) < 0) return -2;
+    return WriteBlockFrame(model);
+}
+
+int djinn_archive_writer::WriteDictionary(const djinn_model& model) {
+    const djinn_ewah_model* ewah = dynamic_cast<const djinn_ewah_model*>(&model);
+    if (ewah == nullptr || ewah->GetDictionarySize() == 0) return 0;
+
+    // Blocks keep using the last written dictionary until it changes.
+    const uint8_t* data = ewah->GetDictionary();
+    const uint32_t len = ewah->GetDictionarySize();
+    if (len == dict.size() && memcmp(data, dict.data(), len) == 0) return 0;
+
+    dict_offsets.push_back(n_bytes);
+    if (WriteFrame(DJN_FRAME_DICT, data, len, 0) < 0) return -2;
+    dict.assign(data, data + len);
+    return DJN_FRAME_HEADER_SIZE + len;
+}
+
+int djinn_archive_writer::WriteBlockFrame(const djinn_model& model) {
+    // Dictionaries are stored in dictionary frames rather than inline.
+    const djinn_ewah_model* ewah = dynamic_cast<const djinn_ewah_model*>(&model);
+    const int len = ewah ? ewah->GetSerializedSize(false) : model.GetSerializedSize();
+    if (len <= 0) return -1;
+    if (buf.size() < (size_t)len) buf.resize(len);
+
+    const int ret = ewah ? ewah->Serialize(buf.data(), false) : model.Serialize(buf.data());
+    if (ret != len) return -1;
+    if (WriteFrame(DJN_FRAME_BLOCK, buf.data(), len, model.n_variants) < 0) return -2;
+
+    ++n_blocks;
+    n_variants += model.n_variants;
+    return len;
+}
+
+int djinn_archive_writer::WriteBlock(const djinn_model& model, const djinn_site_table& sites) {
+    if (sites.size() != model.n_variants) return -3;
+    
+    const int len_dict = WriteDictionary(model);
+    if (len_dict < 0) return -2;
+
+    const uint64_t offset = n_bytes;
+    const int len_stats = WriteStats(model);
+    if (len_stats < 0) return -2;
+
+    const int len_sites = sites.Serialize(meta_buf, meta_codec);
+    if (len_sites < 0) return -1;
+    if (WriteFrame(DJN_FRAME_SITES, meta_buf.data(), len_sites, sites.size()) < 0) return -2;
+
+    const int ret = WriteBlockFrame(model);
+    if (ret < 0) return ret;
+
+    AddIndexEntries(offset, sites);
+    return len_dict + len_stats + DJN_FRAME_HEADER_SIZE + len_sites + ret;
+}
+
+void djinn_archive_writer::AddIndexEntries(uint64_t offset, const djinn_site_table& sites) {
+    if (sites.size()) last_ordinal = sites.ordinal.back();
+
+    // Index the runs of sites of the same contig.
+    for (uint32_t i = 0; i < sites.size(); /**/) {
+        djinn_index_entry_t entry;
+        entry.offset  = offset;
+        entry.contig  = sites.contig[i];
+        entry.min_pos = sites.pos[i];
+        entry.max_end = djn_site_end(sites, i);
+        for (++i; i < sites.size() && sites.contig[i] == entry.contig; ++i) {
+            entry.min_pos = std::min(entry.min_pos, sites.pos[i]);
+            entry.max_end = std::max(entry.max_end, djn_site_end(sites, i));
+        }
+        index.push_back(entry);
+    }
+}
+
+int djinn_archive_writer::WriteNames(uint32_t type, const std::vector<std::string>& names) {
+    if (type != DJN_FRAME_SAMPLES && type != DJN_FRAME_CONTIGS) return -1;
+    if (type == DJN_FRAME_SAMPLES && names.size() != header.n_samples) return -3;
+
+    const int len = djn_serialize_names(names, meta_codec, meta_buf);
+    if (len < 0) return -1;
+    if (type == DJN_FRAME_CONTIGS) contigs = names;
+    else samples = names;
+    return WriteFrame(type, meta_buf.data(), len, 0);
+}
+
+int djinn_archive_writer::WriteFrame(uint32_t type, const uint8_t* data, uint32_t len, uint32_t n_variants) {
+    if (stream == nullptr || closed) return -1;
+
+    uint8_t out[DJN_FRAME_HEADER_SIZE];
+    djn_store_u32(&out[0], type);
+    djn_store_u32(&out[4], len);
+    djn_store_u32(&out[8], n_variants);
+    djn_store_u32(&out[12], djn_crc32c(0, data, len));
+    djn_store_u32(&out[16], djn_crc32c(0, out, 16));
+
+    stream->write((const char*)out, DJN_FRAME_HEADER_SIZE);
+    stream->write((const char*)data, len);
+    if (stream->good() == false) return -2;
+
+    n_bytes += DJN_FRAME_HEADER_SIZE + len;
+    return DJN_FRAME_HEADER_SIZE + len;
+}
+
+int djinn_archive_writer::AppendArchive(djinn_archive_reader& reader) {
+    if (stream == nullptr || closed) return -1;
+    if (reader.legacy) return -3;
+    // The model kind and number of samples must match, and blocks must not
+    // depend on the preceding blocks unless nothing has been written.
+    if (reader.header.model != header.model || reader.header.n_samples != header.n_samples) return -4;
+    if (n_blocks && ((reader.header.flags >> 1) & 1) == 0) return -4;
+
+    // Maps contig indices of the source to indices in this archive.
+    std::vector<int32_t> contig_map;
+    std::vector<std::string> names;
+    djinn_site_table sites;
+    bool has_sites = false;
+    uint64_t offset = n_bytes; // start of the frames of the next block
+    const uint64_t n_blocks_start = n_blocks;
+
+    while (true) {
+        const int ret = reader.NextFrame();
+        if (ret < 0) return ret;
+        if (ret == 0) break;
+
+        const uint8_t* data = reader.frame_data();
+        switch (reader.frame_type) {
+        case DJN_FRAME_SAMPLES:
+            if (djn_deserialize_names(data, reader.frame_len, names) < 0) return -2;
+            if (samples.empty() && n_blocks == 0) {
+                if (WriteNames(DJN_FRAME_SAMPLES, names) < 0) return -2;
+            } else if (names != samples) return -4;
+            offset = n_bytes;
+            break;
+
+        case DJN_FRAME_CONTIGS: {
+            if (djn_deserialize_names(data, reader.frame_len, names) < 0) return -2;
+            std::vector<std::string> merged = contigs;
+            contig_map.resize(names.size());
+            for (size_t i = 0; i < names.size(); ++i) {
+                size_t j = std::find(merged.begin(), merged.end(), names[i]) - merged.begin();
+                if (j == merged.size()) merged.push_back(names[i]);
+                contig_map[i] = j;
+            }
+            if (merged.size() != contigs.size()) {
+                if (WriteNames(DJN_FRAME_CONTIGS, merged) < 0) return -2;
+            }
+            offset = n_bytes;
+            break;
+        }
+
+        case DJN_FRAME_SITES: {
+            if (sites.Deserialize(data, reader.frame_len) != (int)reader.frame_variants) return -2;
+            bool remap = false;
+            for (uint32_t i = 0; i < sites.size(); ++i) {
+                const int32_t c = sites.contig[i];
+                if (c >= 0 && c < (int32_t)contig_map.size() && contig_map[c] != c) {
+                    sites.contig[i] = contig_map[c];
+                    remap = true;
+                }
+            }
+            if (remap) {
+                const int len = sites.Serialize(meta_buf, meta_codec);
+                if (len < 0) return -1;
+                if (WriteFrame(DJN_FRAME_SITES, meta_buf.data(), len, sites.size()) < 0) return -2;
+            } else {
+                if (WriteFrame(DJN_FRAME_SITES, data, reader.frame_len, reader.frame_variants) < 0) return -2;
+            }
+            has_sites = true;
+            break;
+        }
+
+        case DJN_FRAME_INDEX: break; // rebuilt when closing
+
+        case DJN_FRAME_DICT:
+            dict_offsets.push_back(n_bytes);
+            if (WriteFrame(DJN_FRAME_DICT, data, reader.frame_len, 0) < 0) return -2;
+            dict.assign(data, data + reader.frame_len);
+            offset = n_bytes;
+            break;
+
+        case DJN_FRAME_BLOCK:
+            if (WriteFrame(DJN_FRAME_BLOCK, data, reader.frame_len, reader.frame_variants) < 0) return -2;
+            ++n_blocks;
+            n_variants += reader.frame_variants;
+            ++reader.n_blocks;
+            reader.n_variants += reader.frame_variants;
+            if (has_sites) AddIndexEntries(offset, sites);
+            has_sites = false;
+            offset = n_bytes;
+            break;
+
+        default: // statistics and unknown frames
+            if (WriteFrame(reader.frame_type, data, reader.frame_len, reader.frame_variants) < 0) return -2;
+            break;
+        }
+    }
+
+    return n_blocks - n_blocks_start;
+}
+
+int64_t djinn_archive_writer::Recover(std::istream& stream) {
+    djinn_archive_reader reader;
+    int ret = reader.Open(stream);
+    if (ret != 1) return ret < 0 ? ret : -3;
+    if (((reader.header.flags >> 1) & 1) == 0) return -4; // blocks depend on preceding blocks
+
+    header = reader.header;
+    this->stream = nullptr;
+    n_blocks = n_variants = 0;
+    last_ordinal = -1;
+    index.clear();
+    contigs.clear();
+    samples.clear();
+    dict.clear();
+    dict_offsets.clear();
+    closed = false;
+
+    // Metadata frames are only kept if the block they precede is complete.
+    std::vector<std::string> frame_contigs, frame_samples;
+    std::vector<uint8_t> frame_dict;
+    std::vector<uint64_t> frame_dict_offsets;
+    djinn_site_table sites;
+    bool has_sites = false;
+    uint64_t pos = DJN_ARCHIVE_HEADER_SIZE; // start of the next frame
+    uint64_t offset = pos; // start of the frames of the next block
+    n_bytes = pos;
+
+    while ((ret = reader.NextFrame()) > 0) {
+        const uint64_t frame_end = pos + DJN_FRAME_HEADER_SIZE + reader.frame_len;
+        const uint8_t* data = reader.frame_data();
+        if (reader.frame_type == DJN_FRAME_SAMPLES) {
+            if (djn_deserialize_names(data, reader.frame_len, frame_samples) < 0) break;
+            offset = frame_end;
+        } else if (reader.frame_type == DJN_FRAME_CONTIGS) {
+            if (djn_deserialize_names(data, reader.frame_len, frame_contigs) < 0) break;
+            offset = frame_end;
+        } else if (reader.frame_type == DJN_FRAME_DICT) {
+            frame_dict.assign(data, data + reader.frame_len);
+            frame_dict_offsets.push_back(pos);
+            offset = frame_end;
+        } else if (reader.frame_type == DJN_FRAME_SITES) {
+            if (sites.Deserialize(data, reader.frame_len) != (int)reader.frame_variants) break;
+            has_sites = true;
+        } else if (reader.frame_type == DJN_FRAME_BLOCK) {
+            ++n_blocks;
+            n_variants += reader.frame_variants;
+            ++reader.n_blocks;
+            reader.n_variants += reader.frame_variants;
+            if (has_sites) AddIndexEntries(offset, sites);
+            has_sites = false;
+            samples = frame_samples;
+            contigs = frame_contigs;
+            if (frame_dict_offsets.size()) {
+                dict.swap(frame_dict);
+                dict_offsets.insert(dict_offsets.end(), frame_dict_offsets.begin(), frame_dict_offsets.end());
+                frame_dict.clear();
+                frame_dict_offsets.clear();
+            }
+            offset = n_bytes = frame_end;
+        }
+        pos = frame_end;
+    }
+
+    return n_bytes;
+}
+
+int djinn_archive_writer::Resume(std::ostream& stream) {
+    if (n_bytes < DJN_ARCHIVE_HEADER_SIZE) return -1;
+    if (stream.good() == false) return -2;
+    this->stream = &stream;
+    closed = false;
+    return 1;
+}
+
+int djinn_archive_writer::Close() {
+    if (stream == nullptr || closed) return -1;
+
+    // Index: contig names followed by the entries with offsets and minimum
+    // positions delta-encoded, and the delta-encoded offsets of the 
+    // dictionary frames.
+    uint64_t index_offset = 0;
+    if (index.size()) {
+        std::vector<uint8_t> raw;
+        djn_put_varint(raw, contigs.size());
+        for (size_t i = 0; i < contigs.size(); ++i) {
+            raw.insert(raw.end(), contigs[i].begin(), contigs[i].end());
+            raw.push_back('\0');
+        }
+        djn_put_varint(raw, index.size());
+        uint64_t prev_offset = 0;
+        int64_t prev_pos = 0;
+        for (size_t i = 0; i < index.size(); ++i) {
+            djn_put_varint(raw, index[i].offset - prev_offset);
+            djn_put_varint(raw, djn_zigzag(index[i].contig));
+            djn_put_varint(raw, djn_zigzag(index[i].min_pos - prev_pos));
+            djn_put_varint(raw, index[i].max_end - index[i].min_pos);
+            prev_offset = index[i].offset;
+            prev_pos = index[i].min_pos;
+        }
+        if (dict_offsets.size()) {
+            djn_put_varint(raw, dict_offsets.size());
+            prev_offset = 0;
+            for (size_t i = 0; i < dict_offsets.size(); ++i) {
+                djn_put_varint(raw, dict_offsets[i] - prev_offset);
+                prev_offset = dict_offsets[i];
+            }
+        }
+
+        const int len = djn_pack_meta(raw, meta_codec, meta_buf);
+        if (len < 0) return -1;
+        index_offset = n_bytes;
+        if (WriteFrame(DJN_FRAME_INDEX, meta_buf.data(), len, 0) < 0) return -2;
+    }
+
+    uint8_t out[3*sizeof(uint64_t)];
+    memcpy(&out[0], &n_blocks, sizeof(uint64_t));
+    memcpy(&out[8], &n_variants, sizeof(uint64_t));
+    memcpy(&out[16], &index_offset, sizeof(uint64_t));
+    if (WriteFrame(DJN_FRAME_TRAILER, out, sizeof(out), 0) < 0) return -2;
+
+    stream->flush();
+    closed = true;
+    return 1;
+}
+
+/*======   Archive reader   ======*/
+
+djinn_archive_reader::djinn_archive_reader() :
+    legacy(false), finished(false),
+    frame_type(0), frame_len(0), frame_variants(0),
+    n_blocks(0), n_variants(0), n_skipped(0), has_sites(false), query_site(0), has_stats(false),
+    stream(nullptr), prefix_len(0), legacy_model(0), base(0), dict_offset(-1),
+    query_block(0), query_contig(0), query_start(0), query_end(0),
+    query_next(0), query_last(0), query_loaded(false)
+{}
+
+djinn_archive_reader::~djinn_archive_reader() {}
+
+int djinn_archive_reader::Open(std::istream& stream, int legacy_model) {
+    this->stream = &stream;
+    this->legacy_model = legacy_model;
+    header = djinn_archive_header_t();
+    legacy = finished = false;
+    n_blocks = n_variants = 0;
+    prefix_len = 0;
+    samples.clear();
+    contigs.clear();
+    sites.clear();
+    has_sites = false;
+    stats.clear();
+    has_stats = false;
+    n_skipped = 0;
+    index.clear();
+    dict_offsets.clear();
+    dict.clear();
+    dict_offset = -1;
+    query_blocks.clear();
+    query_loaded = false;
+
+    base = stream.tellg();
+    stream.read((char*)prefix, 8);
+    prefix_len = stream.gcount();
+    if (prefix_len < 8 || memcmp(prefix, DJN_ARCHIVE_MAGIC, 8) != 0) {
+        // Unframed stream: the consumed bytes are part of the first block.
+        if (legacy_model != 1 && legacy_model != 2 && legacy_model != 4) return -3;
+        header.model = legacy_model == 1 ? DJN_ARCHIVE_MODEL_CTX : DJN_ARCHIVE_MODEL_EWAH;
+        legacy = true;
+        return 2;
+    }
+
+    stream.read((char*)&prefix[8], DJN_ARCHIVE_HEADER_SIZE - 8);
+    prefix_len = 0;
+    if (stream.gcount() != DJN_ARCHIVE_HEADER_SIZE - 8) return -1;
+    if (djn_load_u32(&prefix[28]) != djn_crc32c(0, prefix, 28)) return -2;
+
+    header.version = djn_load_u32(&prefix[8]);
+    header.model   = prefix[12];
+    header.codec   = prefix[13];
+    memcpy(&header.flags, &prefix[14], sizeof(uint16_t));
+    header.n_samples = djn_load_u32(&prefix[16]);
+
+    if (header.version > DJINN_VERSION_NUMBER) return -4;
+    if (header.model != DJN_ARCHIVE_MODEL_CTX && header.model != DJN_ARCHIVE_MODEL_EWAH) return -4;
+
+    return 1;
+}
+
+djinn_model* djinn_archive_reader::CreateModel() const {
+    if (header.model == DJN_ARCHIVE_MODEL_CTX)  return new djinn_ctx_model();
+    if (header.model == DJN_ARCHIVE_MODEL_EWAH) return new djinn_ewah_model();
+    return nullptr;
+}
+
+int djinn_archive_reader::NextFrame() {
+    if (stream == nullptr) return -3;
+    if (finished) return 0;
+
+    if (legacy) {
+        // Legacy blocks start with their total serialized size.
+        uint8_t len_buf[4];
+        uint32_t have = prefix_len < 4 ? prefix_len : 4;
+        memcpy(len_buf, prefix, have);
+        stream->read((char*)&len_buf[have], 4 - have);
+        if (have + stream->gcount() == 0) { finished = true; return 0; }
+        if (have + stream->gcount() != 4) return -1;
+
+        const uint32_t len = djn_load_u32(len_buf);
+        if (len < 4 || len < prefix_len || len > DJN_SCRATCH_MAX_CAPACITY) return -2;
+        if (buf.size() < len) buf.resize(len);
+        memcpy(buf.data(), prefix, prefix_len);
+        memcpy(buf.data() + have, &len_buf[have], 4 - have);
+        const uint32_t offset = prefix_len > 4 ? prefix_len : 4;
+        prefix_len = 0;
+        stream->read((char*)&buf[offset], len - offset);
+        if (stream->gcount() != len - offset) return -1;
+
+        frame_type = DJN_FRAME_BLOCK;
+        frame_len = len;
+        frame_variants = 0;
+        return 1;
+    }
+
+    uint8_t hdr[DJN_FRAME_HEADER_SIZE];
+    stream->read((char*)hdr, DJN_FRAME_HEADER_SIZE);
+    if (stream->gcount() != DJN_FRAME_HEADER_SIZE) return -1; // missing trailer
+    if (djn_load_u32(&hdr[16]) != djn_crc32c(0, hdr, 16)) return -2;
+
+    frame_type = djn_load_u32(&hdr[0]);
+    frame_len  = djn_load_u32(&hdr[4]);
+    frame_variants = djn_load_u32(&hdr[8]);
+    if (frame_len > DJN_SCRATCH_MAX_CAPACITY) return -2;
+
+    if (buf.size() < frame_len) buf.resize(frame_len);
+    stream->read((char*)buf.data(), frame_len);
+    if (stream->gcount() != frame_len) return -1; // incomplete frame
+    if (djn_load_u32(&hdr[12]) != djn_crc32c(0, buf.data(), frame_len)) return -2;
+
+    if (frame_type == DJN_FRAME_TRAILER) {
+        if (frame_len < 2*sizeof(uint64_t)) return -2;
+        uint64_t t_blocks = 0, t_variants = 0;
+        memcpy(&t_blocks, &buf[0], sizeof(uint64_t));
+        memcpy(&t_variants, &buf[8], sizeof(uint64_t));
+        finished = true;
+        if (t_blocks != n_blocks || t_variants != n_variants) return -2;
+        return 0;
+    }
+
+    return 1;
+}
+
+int djinn_archive_reader::ReadNames(std::vector<std::string>& names) {
+    return djn_deserialize_names(buf.data(), frame_len, names);
+}
+
+int djinn_archive_reader::NextBlock(djinn_model& model) {
+    return NextBlock(model, nullptr);
+}
+
+int djinn_archive_reader::NextBlock(djinn_model& model, const djinn_stats_filter_t& filter) {
+    return NextBlock(model, &filter);
+}
+
+int djinn_archive_reader::NextBlock(djinn_model& model, const djinn_stats_filter_t* filter) {
+    has_sites = false;
+    has_stats = false;
+    bool skip = false;
+    while (true) {
+        const int ret = NextFrame();
+        if (ret <= 0) return ret;
+        
+        if (frame_type == DJN_FRAME_SAMPLES) {
+            const int n = ReadNames(samples);
+            if (n < 0) return n;
+            if ((uint32_t)n != header.n_samples) return -2;
+            continue;
+        } else if (frame_type == DJN_FRAME_CONTIGS) {
+            const int n = ReadNames(contigs);
+            if (n < 0) return n;
+            continue;
+        } else if (frame_type == DJN_FRAME_SITES) {
+            const int n = sites.Deserialize(buf.data(), frame_len);
+            if (n < 0) return n;
+            if ((uint32_t)n != frame_variants) return -2;
+            has_sites = true;
+            continue;
+        } else if (frame_type == DJN_FRAME_STATS) {
+            const int n = stats.Deserialize(buf.data(), frame_len);
+            if (n < 0) return n;
+            if ((uint32_t)n != frame_variants) return -2;
+            has_stats = true;
+            skip = filter != nullptr && stats.Pass(*filter) == false;
+            continue;
+        } else if (frame_type == DJN_FRAME_DICT) {
+            dict.assign(buf.begin(), buf.begin() + frame_len);
+            dict_offset = -1;
+            continue;
+        }
+        if (frame_type != DJN_FRAME_BLOCK) continue; // skip unknown frames
+
+        if (skip) {
+            // No variant can pass: account for the block without decoding it.
+            ++n_blocks;
+            n_variants += frame_variants;
+            ++n_skipped;
+            has_sites = has_stats = skip = false;
+            continue;
+        }
+
+        // Blocks refer to the last dictionary frame read.
+        djinn_ewah_model* ewah = dynamic_cast<djinn_ewah_model*>(&model);
+        if (ewah != nullptr && dict.size() &&
+            (ewah->GetDictionarySize() != dict.size() || memcmp(ewah->GetDictionary(), dict.data(), dict.size()) != 0))
+        {
+            if (ewah->SetDictionary(dict.data(), dict.size()) < 0) return -4;
+        }
+
+        if (model.Deserialize(buf.data()) != (int)frame_len) return -4;
+        if (legacy == false && model.n_variants != frame_variants) return -2;
+        if (has_sites && sites.size() != model.n_variants) return -2;
+        if (has_stats && stats.size() != model.n_variants) return -2;
+
+        ++n_blocks;
+        n_variants += model.n_variants;
+        return 1;
+    }
+}
+
+int64_t djinn_archive_reader::Verify() {
+    if (legacy) return -3;
+
+    int64_t n_verified = 0;
+    while (true) {
+        const int ret = NextFrame();
+        if (ret < 0) return ret;
+        if (ret == 0) return n_verified;
+        if (frame_type == DJN_FRAME_BLOCK) {
+            ++n_blocks;
+            n_variants += frame_variants;
+            ++n_verified;
+        }
+    }
+}
+
+int djinn_archive_reader::ReadIndex() {
+    std::vector<uint8_t> raw;
+    const int ret = djn_unpack_meta(buf.data(), frame_len, raw);
+    if (ret < 0) return ret;
+
+    const uint8_t* p = raw.data();
+    const uint8_t* end = raw.data() + raw.size();
+    uint64_t n = 0, v = 0;
+    if (djn_get_varint(p, end, n) == false || n > raw.size()) return -2;
+    contigs.clear();
+    for (uint64_t i = 0; i < n; ++i) {
+        const uint8_t* term = (const uint8_t*)memchr(p, '\0', end - p);
+        if (term == nullptr) return -2;
+        contigs.push_back(std::string((const char*)p, term - p));
+        p = term + 1;
+    }
+
+    if (djn_get_varint(p, end, n) == false || n > raw.size()) return -2;
+    index.resize(n);
+    uint64_t offset = 0;
+    int64_t pos = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        if (djn_get_varint(p, end, v) == false) return -2;
+        offset += v;
+        index[i].offset = offset;
+        if (djn_get_varint(p, end, v) == false) return -2;
+        index[i].contig = djn_unzigzag(v);
+        if (djn_get_varint(p, end, v) == false) return -2;
+        pos += djn_unzigzag(v);
+        index[i].min_pos = pos;
+        if (djn_get_varint(p, end, v) == false) return -2;
+        index[i].max_end = pos + v;
+    }
+
+    // Dictionary offsets are absent if no dictionary frames were written.
+    dict_offsets.clear();
+    if (p < end) {
+        uint64_t n_dicts = 0;
+        if (djn_get_varint(p, end, n_dicts) == false || n_dicts > raw.size()) return -2;
+        dict_offsets.resize(n_dicts);
+        offset = 0;
+        for (uint64_t i = 0; i < n_dicts; ++i) {
+            if (djn_get_varint(p, end, v) == false) return -2;
+            offset += v;
+            dict_offsets[i] = offset;
+        }
+    }
+    return n;
+}
+
+int djinn_archive_reader::LoadDictionary(uint64_t offset) {
+    // The dictionary of a block is the last one written before it.
+    std::vector<uint64_t>::const_iterator it = std::lower_bound(dict_offsets.begin(), dict_offsets.end(), offset);
+    if (it == dict_offsets.begin()) return 0;
+    const uint64_t dict_frame = *(--it);
+    if ((int64_t)dict_frame == dict_offset) return 0;
+
+    stream->clear();
+    stream->seekg(base + dict_frame);
+    finished = false;
+    const int ret = NextFrame();
+    if (ret <= 0 || frame_type != DJN_FRAME_DICT) return ret < 0 ? ret : -2;
+    dict.assign(buf.begin(), buf.begin() + frame_len);
+    dict_offset = dict_frame;
+    return 1;
+}
+
+int djinn_archive_reader::LoadIndex() {
+    if (stream == nullptr || legacy) return -3;
+    if (base < 0) return -3; // stream is not seekable
+
+    // Sample and contig names, and preset dictionaries, are stored before 
+    // the first block.
+    index.clear();
+    stream->clear();
+    stream->seekg(base + DJN_ARCHIVE_HEADER_SIZE);
+    finished = false;
+    while (true) {
+        const int64_t offset = stream->tellg();
+        const int ret = NextFrame();
+        if (ret < 0) return ret;
+        if (ret == 0) break;
+        if (frame_type == DJN_FRAME_SAMPLES) {
+            if (ReadNames(samples) < 0) return -2;
+        } else if (frame_type == DJN_FRAME_CONTIGS) {
+            if (ReadNames(contigs) < 0) return -2;
+        } else if (frame_type == DJN_FRAME_DICT) {
+            dict.assign(buf.begin(), buf.begin() + frame_len);
+            dict_offset = offset - base;
+        } else {
+            stream->seekg(offset);
+            break;
+        }
+    }
+    const int64_t first_frame = stream->tellg();
+
+    // The trailer is the last frame of the archive.
+    uint8_t trailer[DJN_FRAME_HEADER_SIZE + 3*sizeof(uint64_t)];
+    stream->clear();
+    stream->seekg(0, std::ios::end);
+    const int64_t end = stream->tellg();
+    if (end - base < DJN_ARCHIVE_HEADER_SIZE + (int64_t)sizeof(trailer)) return -6;
+    stream->seekg(end - sizeof(trailer));
+    stream->read((char*)trailer, sizeof(trailer));
+    if (stream->gcount() != sizeof(trailer)) return -1;
+
+    uint64_t index_offset = 0;
+    if (djn_load_u32(&trailer[0]) != DJN_FRAME_TRAILER ||
+        djn_load_u32(&trailer[4]) != 3*sizeof(uint64_t) ||
+        djn_load_u32(&trailer[16]) != djn_crc32c(0, trailer, 16) ||
+        djn_load_u32(&trailer[12]) != djn_crc32c(0, &trailer[DJN_FRAME_HEADER_SIZE], 3*sizeof(uint64_t)))
+    {
+        // Archives written without an index end with a shorter trailer.
+        return -6;
+    }
+    memcpy(&index_offset, &trailer[DJN_FRAME_HEADER_SIZE + 2*sizeof(uint64_t)], sizeof(uint64_t));
+    if (index_offset == 0) return -6;
+
+    stream->clear();
+    stream->seekg(base + index_offset);
+    int ret = NextFrame();
+    if (ret <= 0 || frame_type != DJN_FRAME_INDEX) return ret < 0 ? ret : -2;
+    ret = ReadIndex();
+    if (ret < 0) return ret;
+
+    // Rewind to the first frame.
+    stream->clear();
+    stream->seekg(first_frame);
+    finished = false;
+    return ret;
+}
+
+bool djinn_archive_reader::QueryMatch(uint32_t site) const {
+    return sites.contig[site] == query_contig && 
+           sites.pos[site] <= query_end && 
+           djn_site_end(sites, site) >= query_start;
+}
+
+int djinn_archive_reader::Query(int32_t contig, int64_t start, int64_t end) {
+    if (index.empty()) return -6;
+    if (((header.flags >> 1) & 1) == 0) return -4; // blocks depend on preceding blocks
+
+    query_contig = contig;
+    query_start = start;
+    query_end = end;
+    query_blocks.clear();
+    query_block = 0;
+    query_loaded = false;
+
+    // Entries of the same block are consecutive.
+    for (size_t i = 0; i < index.size(); ++i) {
+        if (index[i].contig != contig || index[i].min_pos > end || index[i].max_end < start) continue;
+        if (query_blocks.empty() || query_blocks.back() != index[i].offset)
+            query_blocks.push_back(index[i].offset);
+    }
+    return query_blocks.size();
+}
+
+int djinn_archive_reader::Query(const std::string& contig, int64_t start, int64_t end) {
+    if (index.empty()) return -6;
+    if (((header.flags >> 1) & 1) == 0) return -4; // blocks depend on preceding blocks
+    for (size_t i = 0; i < contigs.size(); ++i) {
+        if (contigs[i] == contig) return Query((int32_t)i, start, end);
+    }
+    query_blocks.clear();
+    query_loaded = false;
+    return 0;
+}
+
+int djinn_archive_reader::NextQuery(djinn_model& model, djinn_variant_t*& variant) {
+    while (true) {
+        if (query_loaded == false) {
+            if (query_block >= query_blocks.size()) return 0;
+
+            const int ret_dict = LoadDictionary(query_blocks[query_block]);
+            if (ret_dict < 0) return ret_dict;
+
+            stream->clear();
+            stream->seekg(base + query_blocks[query_block]);
+            finished = false;
+            const int ret = NextBlock(model);
+            if (ret <= 0) return ret < 0 ? ret : -1;
+            if (has_sites == false) return -2;
+            if (model.StartDecoding() < 0) return -4;
+
+            // Decoding stops after the last overlapping site.
+            query_next = 0;
+            query_last = 0;
+            for (uint32_t i = 0; i < sites.size(); ++i) {
+                if (QueryMatch(i)) query_last = i + 1;
+            }
+            query_loaded = true;
+        }
+
+        while (query_next < query_last) {
+            const uint32_t i = query_next++;
+            if (model.DecodeNext(variant) <= 0) return -4;
+            if (QueryMatch(i)) {
+                query_site = i;
+                return 1;
+            }
+        }
+
+        query_loaded = false;
+        ++query_block;
+    }
+}
+
+}
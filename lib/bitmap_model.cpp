@@ -0,0 +1,535 @@
+#include <cstring> //memcpy
+
+#include "djinn.h"
+#include "compressors.h"
+#include "scratch.h"
+#include "genotype_stats.h"
+
+namespace djinn {
+
+/*======   Supportive functions   ======*/
+
+/**
+ * In-place transpose of a 64x64 bit matrix stored as 64 64-bit words such
+ * that bit j in word i becomes bit i in word j. Based on the recursive block
+ * swap described in Hacker's Delight (Warren, 2nd ed., section 7-3).
+ *
+ * @param a Pointer to 64 consecutive 64-bit words.
+ */
+static inline void djn_transpose64(uint64_t* a) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    for (int j = 32; j != 0; j >>= 1, m ^= m << j) {
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            const uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+            a[k | j] ^= t;
+            a[k] ^= t << j;
+        }
+    }
+}
+
+/*======   Bitmap container   ======*/
+
+djn_bitmap_model_t::djn_bitmap_model_t() :
+    p(nullptr), p_len(0), u_len(0), p_cap(0), p_free(true)
+{
+
+}
+
+djn_bitmap_model_t::~djn_bitmap_model_t() {
+    if (p_free) delete[] p;
+}
+
+int djn_bitmap_model_t::Compress(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, CompressionStrategy strat, int c_level) {
+    if (p == nullptr || ctx == nullptr) return -1;
+    if (u_len == 0) { p_len = 0; return 0; }
+
+    if (scratch.Reserve(CompressBound(strat, u_len)) < 0) return -3;
+
+    int ret = ctx->Compress(strat, (uint8_t*)p, u_len, scratch.p, scratch.cap, c_level);
+    if (ret <= 0) return -2;
+
+    // Incompressible data may expand beyond the current capacity.
+    if ((uint32_t)ret > p_cap) {
+        if (p_free) delete[] p;
+        p_cap = ((ret + 7) >> 3) << 3;
+        p = new uint64_t[p_cap >> 3];
+        p_free = true;
+    }
+    memcpy(p, scratch.p, ret); // copy data back to p
+    p_len = ret;
+    return ret;
+}
+
+int djn_bitmap_model_t::Decompress(uint8_t* out, uint32_t out_cap, djn_codec_ctx_t* ctx, CompressionStrategy strat) const {
+    if (out == nullptr || ctx == nullptr) return -1;
+    if (out_cap < u_len) return -2;
+    if (p_len == 0) return 0;
+
+    int ret = ctx->Decompress(strat, (const uint8_t*)p, p_len, out, out_cap);
+    if (ret < 0 || (uint32_t)ret != u_len) return -3;
+    return ret;
+}
+
+int djn_bitmap_model_t::Serialize(uint8_t* dst) const {
+    // Serialize as (uint32_t,uint32_t,uint8_t*):
+    // p_len, u_len, p
+    uint32_t offset = 0;
+    *((uint32_t*)&dst[offset]) = p_len; // data length
+    offset += sizeof(uint32_t);
+    *((uint32_t*)&dst[offset]) = u_len; // uncompressed data length
+    offset += sizeof(uint32_t);
+    memcpy(&dst[offset], p, p_len); // data
+    offset += p_len;
+    return offset;
+}
+
+int djn_bitmap_model_t::Serialize(std::ostream& stream) const {
+    // Serialize as (uint32_t,uint32_t,uint8_t*):
+    // p_len, u_len, p
+    stream.write((char*)&p_len, sizeof(uint32_t));
+    stream.write((char*)&u_len, sizeof(uint32_t));
+    stream.write((char*)p, p_len);
+    return stream.tellp();
+}
+
+int djn_bitmap_model_t::GetSerializedSize() const {
+    return 2*sizeof(uint32_t) + p_len;
+}
+
+int djn_bitmap_model_t::Deserialize(uint8_t* dst, uint32_t len) {
+    if (len < 2*sizeof(uint32_t)) return -1;
+    uint32_t offset = 0;
+    p_len = *((uint32_t*)&dst[offset]);
+    offset += sizeof(uint32_t);
+    u_len = *((uint32_t*)&dst[offset]);
+    offset += sizeof(uint32_t);
+    if (p_len > len - offset) return -1;
+
+    // initiate a buffer if there is none or it's too small
+    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
+        if (p_free) delete[] p;
+        p_cap = ((p_len + 7) >> 3) << 3;
+        p = new uint64_t[p_cap >> 3];
+        p_free = true;
+    }
+
+    memcpy(p, &dst[offset], p_len); // data
+    offset += p_len;
+    return offset;
+}
+
+int djn_bitmap_model_t::Deserialize(std::istream& stream, uint32_t len) {
+    stream.read((char*)&p_len, sizeof(uint32_t));
+    stream.read((char*)&u_len, sizeof(uint32_t));
+    if (stream.good() == false || p_len > len) return -1;
+
+    // initiate a buffer if there is none or it's too small
+    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
+        if (p_free) delete[] p;
+        p_cap = ((p_len + 7) >> 3) << 3;
+        p = new uint64_t[p_cap >> 3];
+        p_free = true;
+    }
+
+    stream.read((char*)p, p_len);
+    if (stream.good() == false) return -1;
+    return 2*sizeof(uint32_t) + p_len;
+}
+
+/*======   Sample-centric bitmap model   ======*/
+
+djinn_bitmap_model::djinn_bitmap_model() :
+    codec(CompressionStrategy::LZ4), compression_level(1),
+    codec_ctx(std::make_shared<djn_codec_ctx_t>()),
+    ploidy(0), has_missing(0),
+    n_samples(0), n_samples_bitmap(0), n_variants(0), n_words_variant(0),
+    rows(nullptr), rows_missing(nullptr), m_rows(0)
+{
+
+}
+
+djinn_bitmap_model::djinn_bitmap_model(CompressionStrategy codec, int c_level) :
+    codec(codec), compression_level(c_level <= 0 ? 1 : c_level),
+    codec_ctx(std::make_shared<djn_codec_ctx_t>()),
+    ploidy(0), has_missing(0),
+    n_samples(0), n_samples_bitmap(0), n_variants(0), n_words_variant(0),
+    rows(nullptr), rows_missing(nullptr), m_rows(0)
+{
+
+}
+
+djinn_bitmap_model::~djinn_bitmap_model() {
+    delete[] rows;
+    delete[] rows_missing;
+}
+
+int djinn_bitmap_model::SetCodecParameters(const djinn_codec_params_t& params) {
+    return codec_ctx->SetParameters(params);
+}
+
+void djinn_bitmap_model::ResizeRows(uint32_t n_rows) {
+    // Always allocate a multiple of 64 rows such that the transpose step can
+    // operate on complete 64x64 bit blocks.
+    n_rows = ((n_rows + 63) >> 6) << 6;
+    if (n_rows <= m_rows) return;
+
+    const uint64_t n_words_row = n_samples_bitmap >> 6;
+    uint64_t* old = rows;
+    rows = new uint64_t[n_rows * n_words_row];
+    if (old != nullptr) memcpy(rows, old, m_rows * n_words_row * sizeof(uint64_t));
+    memset(&rows[m_rows * n_words_row], 0, (n_rows - m_rows) * n_words_row * sizeof(uint64_t));
+    delete[] old;
+
+    old = rows_missing;
+    rows_missing = new uint64_t[n_rows * n_words_row];
+    if (old != nullptr) memcpy(rows_missing, old, m_rows * n_words_row * sizeof(uint64_t));
+    memset(&rows_missing[m_rows * n_words_row], 0, (n_rows - m_rows) * n_words_row * sizeof(uint64_t));
+    delete[] old;
+
+    m_rows = n_rows;
+}
+
+int djinn_bitmap_model::StartEncoding(uint32_t n_samples, int ploidy) {
+    if (n_samples == 0) return -1;
+    if (ploidy != 1 && ploidy != 2) return -2;
+
+    if (this->n_samples != n_samples || this->ploidy != ploidy) {
+        this->n_samples = n_samples;
+        this->ploidy = ploidy;
+        n_samples_bitmap = ((n_samples * ploidy + 63) >> 6) << 6;
+        bitmaps.resize(n_samples);
+        for (size_t i = 0; i < bitmaps.size(); ++i) {
+            if (bitmaps[i].get() == nullptr)
+                bitmaps[i] = std::make_shared<djn_bitmap_model_t>();
+        }
+
+        // Input matrices depend on the number of samples.
+        delete[] rows; delete[] rows_missing;
+        rows = nullptr; rows_missing = nullptr;
+        m_rows = 0;
+    }
+
+    for (size_t i = 0; i < bitmaps.size(); ++i) {
+        bitmaps[i]->p_len = 0;
+        bitmaps[i]->u_len = 0;
+    }
+
+    n_variants = 0;
+    n_words_variant = 0;
+    has_missing = 0;
+    return 1;
+}
+
+int djinn_bitmap_model::EncodeBcf(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) {
+    if (data == nullptr) return -1;
+    if (len_data == 0)   return  0;
+    if (alt_alleles > 2) return -2;
+    if (ploidy != this->ploidy) return -3;
+    if (len_data != (size_t)n_samples * ploidy) return -3;
+
+    if (n_variants == m_rows) ResizeRows(m_rows == 0 ? 64 : 2*m_rows);
+
+    const uint32_t n_words_row = n_samples_bitmap >> 6;
+    uint64_t* row   = &rows[(uint64_t)n_variants * n_words_row];
+    uint64_t* row_m = &rows_missing[(uint64_t)n_variants * n_words_row];
+    memset(row,   0, n_words_row*sizeof(uint64_t));
+    memset(row_m, 0, n_words_row*sizeof(uint64_t));
+
+    // Compute allele counts and set the bits for alt alleles and missing
+    // values in a single pass over the data.
+    djn_gt_stats_t stats;
+    djn_gt_stats_bcf(data, len_data, stats, row, row_m);
+
+    // EOV symbols (mixed ploidy) and >2 alleles cannot be represented.
+    if (stats.has_eov || stats.max_allele > 1) return -4;
+
+    has_missing |= stats.has_missing;
+    ++n_variants;
+    return 1;
+}
+
+int djinn_bitmap_model::Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) {
+    if (data == nullptr) return -1;
+    if (len_data == 0)   return  0;
+    if (alt_alleles > 2) return -2;
+    if (ploidy != this->ploidy) return -3;
+    if (len_data != (size_t)n_samples * ploidy) return -3;
+
+    if (n_variants == m_rows) ResizeRows(m_rows == 0 ? 64 : 2*m_rows);
+
+    const uint32_t n_words_row = n_samples_bitmap >> 6;
+    uint64_t* row   = &rows[(uint64_t)n_variants * n_words_row];
+    uint64_t* row_m = &rows_missing[(uint64_t)n_variants * n_words_row];
+    memset(row,   0, n_words_row*sizeof(uint64_t));
+    memset(row_m, 0, n_words_row*sizeof(uint64_t));
+
+    djn_gt_stats_t stats;
+    djn_gt_stats(data, len_data, stats, row, row_m);
+
+    // Only ref, alt, and missing values are allowed.
+    if (stats.has_eov || stats.max_allele > 1) return -4;
+
+    has_missing |= stats.has_missing;
+    ++n_variants;
+    return 1;
+}
+
+int64_t djinn_bitmap_model::FinishEncoding() {
+    if (n_samples == 0) return 0;
+
+    n_words_variant = (n_variants + 63) >> 6;
+    const uint32_t n_words_row = n_samples_bitmap >> 6;
+    const uint32_t n_haplotypes = n_samples * ploidy;
+    const uint32_t n_planes = ploidy * (1 + has_missing);
+    const uint32_t u_len = n_planes * n_words_variant * sizeof(uint64_t);
+
+    // Clear trailing rows in the last 64-row block as these may contain
+    // data from a previous block.
+    if (n_variants != (n_words_variant << 6)) {
+        memset(&rows[(uint64_t)n_variants * n_words_row], 0, ((n_words_variant << 6) - n_variants) * n_words_row * sizeof(uint64_t));
+        memset(&rows_missing[(uint64_t)n_variants * n_words_row], 0, ((n_words_variant << 6) - n_variants) * n_words_row * sizeof(uint64_t));
+    }
+
+    // Prepare output buffers.
+    for (uint32_t i = 0; i < n_samples; ++i) {
+        djn_bitmap_model_t* b = bitmaps[i].get();
+        if (b->p_cap < u_len) {
+            if (b->p_free) delete[] b->p;
+            b->p = new uint64_t[u_len >> 3];
+            b->p_cap = u_len;
+            b->p_free = true;
+        }
+        b->u_len = u_len;
+        b->p_len = u_len;
+    }
+
+    // Cache-blocked transpose: iterate over 64x64 bit blocks of the
+    // variant-major input and scatter the transposed haplotype words
+    // directly into the per-sample bitmaps.
+    uint64_t block[64];
+    for (int m = 0; m < 1 + has_missing; ++m) {
+        const uint64_t* src = (m == 0 ? rows : rows_missing);
+        for (uint32_t vb = 0; vb < n_words_variant; ++vb) {
+            const uint64_t* src_block = &src[((uint64_t)vb << 6) * n_words_row];
+            for (uint32_t hb = 0; hb < n_words_row; ++hb) {
+                for (int j = 0; j < 64; ++j)
+                    block[j] = src_block[(uint64_t)j * n_words_row + hb];
+
+                djn_transpose64(block);
+
+                const uint32_t h_start = hb << 6;
+                const uint32_t h_end = (h_start + 64 > n_haplotypes ? n_haplotypes : h_start + 64);
+                for (uint32_t h = h_start; h < h_end; ++h) {
+                    const uint32_t s = h / ploidy;
+                    const uint32_t k = h - s * ploidy;
+                    bitmaps[s]->p[(m*ploidy + k) * n_words_variant + vb] = block[h - h_start];
+                }
+            }
+        }
+    }
+
+    // Compress each sample independently.
+    djn_scratch_t& scratch = djn_thread_scratch();
+    int64_t s_total = 0;
+    for (uint32_t i = 0; i < n_samples; ++i) {
+        int ret = bitmaps[i]->Compress(scratch, codec_ctx.get(), codec, compression_level);
+        if (ret < 0) return ret;
+        s_total += ret;
+    }
+
+    return s_total;
+}
+
+int djinn_bitmap_model::StartDecoding() {
+    if (bitmaps.size() != n_samples) return -1;
+
+    // Support buffer must be able to hold the bitmaps for one sample.
+    if (djn_thread_scratch().Reserve(GetSampleWords() * sizeof(uint64_t)) < 0) return -2;
+    return 1;
+}
+
+int djinn_bitmap_model::DecodeSample(uint32_t sample, uint64_t* out, uint32_t n_words) {
+    if (out == nullptr) return -1;
+    if (sample >= n_samples) return -2;
+    if (n_words < GetSampleWords()) return -3;
+
+    int ret = bitmaps[sample]->Decompress((uint8_t*)out, n_words * sizeof(uint64_t), codec_ctx.get(), codec);
+    if (ret < 0) return ret;
+    return ret / sizeof(uint64_t);
+}
+
+int djinn_bitmap_model::DecodeSample(uint32_t sample, uint8_t* out, uint32_t& out_len) {
+    if (out == nullptr) return -1;
+
+    // Decoding may happen on a different thread than StartDecoding.
+    djn_scratch_t& scratch = djn_thread_scratch();
+    if (scratch.Reserve(GetSampleWords() * sizeof(uint64_t)) < 0) return -4;
+
+    const int n_words = DecodeSample(sample, (uint64_t*)scratch.p, scratch.cap / sizeof(uint64_t));
+    if (n_words < 0) return n_words;
+
+    const uint64_t* bits = (const uint64_t*)scratch.p;
+    for (int k = 0; k < ploidy; ++k) {
+        const uint64_t* alt = &bits[k * n_words_variant];
+        const uint64_t* mis = has_missing ? &bits[(ploidy + k) * n_words_variant] : nullptr;
+        for (uint32_t w = 0; w < n_words_variant; ++w) {
+            const uint32_t to = (w << 6) + 64 > n_variants ? n_variants - (w << 6) : 64;
+            uint64_t a = alt[w];
+            uint8_t* o = &out[(w << 6) * ploidy + k];
+            // Fast path for words without any alternative alleles or missing
+            // values.
+            if (a == 0 && (mis == nullptr || mis[w] == 0)) {
+                for (uint32_t j = 0; j < to; ++j) o[j * ploidy] = 0;
+                continue;
+            }
+
+            for (uint32_t j = 0; j < to; ++j) {
+                o[j * ploidy] = a & 1;
+                a >>= 1;
+            }
+
+            if (mis != nullptr && mis[w]) {
+                uint64_t m = mis[w];
+                for (uint32_t j = 0; j < to; ++j) {
+                    if (m & 1) o[j * ploidy] = 14;
+                    m >>= 1;
+                }
+            }
+        }
+    }
+
+    out_len = n_variants * ploidy;
+    return 1;
+}
+
+int djinn_bitmap_model::Serialize(uint8_t* dst) const {
+    // Serialize as (uint32_t,int,uint32_t,int,uint32_t,uint8_t,bitmaps...):
+    // total length,codec,n_samples,ploidy,n_variants,has_missing,[bitmaps...]
+    uint32_t offset = 0;
+
+    // Reserve space for offset
+    offset += sizeof(uint32_t);
+
+    *((int*)&dst[offset]) = (int)codec; // codec used
+    offset += sizeof(int);
+    *((uint32_t*)&dst[offset]) = n_samples; // number of samples
+    offset += sizeof(uint32_t);
+    *((int*)&dst[offset]) = ploidy; // base ploidy
+    offset += sizeof(int);
+    *((uint32_t*)&dst[offset]) = n_variants; // number of variants
+    offset += sizeof(uint32_t);
+    dst[offset] = has_missing;
+    offset += sizeof(uint8_t);
+
+    for (size_t i = 0; i < bitmaps.size(); ++i) {
+        offset += bitmaps[i]->Serialize(&dst[offset]);
+    }
+    *((uint32_t*)&dst[0]) = offset;
+
+    return offset;
+}
+
+int djinn_bitmap_model::Serialize(std::ostream& stream) const {
+    uint32_t out_len = GetSerializedSize();
+    stream.write((char*)&out_len, sizeof(uint32_t));
+
+    int out_codec = (int)codec;
+    stream.write((char*)&out_codec, sizeof(int));
+    stream.write((char*)&n_samples, sizeof(uint32_t));
+    stream.write((char*)&ploidy, sizeof(int));
+    stream.write((char*)&n_variants, sizeof(uint32_t));
+    uint8_t missing = has_missing;
+    stream.write((char*)&missing, sizeof(uint8_t));
+
+    for (size_t i = 0; i < bitmaps.size(); ++i)
+        bitmaps[i]->Serialize(stream);
+
+    return out_len;
+}
+
+int djinn_bitmap_model::GetSerializedSize() const {
+    int ret = sizeof(uint32_t) + sizeof(int) + sizeof(uint32_t) + sizeof(int) + sizeof(uint32_t) + sizeof(uint8_t);
+    for (size_t i = 0; i < bitmaps.size(); ++i) {
+        ret += bitmaps[i]->GetSerializedSize();
+    }
+    return ret;
+}
+
+int djinn_bitmap_model::GetCurrentSize() const {
+    // Size of the variant-major input data prior to calling FinishEncoding.
+    if (n_words_variant == 0)
+        return (uint64_t)n_variants * (n_samples_bitmap >> 3) * (1 + has_missing);
+
+    int ret = 0;
+    for (size_t i = 0; i < bitmaps.size(); ++i) {
+        ret += bitmaps[i]->p_len;
+    }
+    return ret;
+}
+
+int djinn_bitmap_model::Deserialize(uint8_t* src) {
+    uint32_t offset = 0;
+
+    // Read total offset.
+    uint32_t tot_offset = *((uint32_t*)&src[offset]);
+    offset += sizeof(uint32_t);
+    if (tot_offset < sizeof(uint32_t) + sizeof(int) + sizeof(uint32_t) + sizeof(int) + sizeof(uint32_t) + sizeof(uint8_t))
+        return -2;
+
+    codec = CompressionStrategy(*((int*)&src[offset]));
+    offset += sizeof(int);
+    uint32_t n_s = *((uint32_t*)&src[offset]);
+    offset += sizeof(uint32_t);
+    int pl = *((int*)&src[offset]);
+    offset += sizeof(int);
+    if (StartEncoding(n_s, pl) < 0) return -1;
+
+    n_variants = *((uint32_t*)&src[offset]);
+    offset += sizeof(uint32_t);
+    has_missing = src[offset];
+    offset += sizeof(uint8_t);
+    n_words_variant = (n_variants + 63) >> 6;
+
+    for (uint32_t i = 0; i < n_samples; ++i) {
+        if (offset > tot_offset) return -2;
+        const int ret = bitmaps[i]->Deserialize(&src[offset], tot_offset - offset);
+        if (ret < 0) return -2;
+        offset += ret;
+    }
+    if (offset != tot_offset) return -2;
+    return offset;
+}
+
+int djinn_bitmap_model::Deserialize(std::istream& stream) {
+    uint32_t out_len = 0;
+    stream.read((char*)&out_len, sizeof(uint32_t));
+    if (stream.good() == false) return -1;
+
+    int in_codec = 0;
+    stream.read((char*)&in_codec, sizeof(int));
+    codec = CompressionStrategy(in_codec);
+
+    uint32_t n_s = 0; int pl = 0;
+    stream.read((char*)&n_s, sizeof(uint32_t));
+    stream.read((char*)&pl, sizeof(int));
+    if (StartEncoding(n_s, pl) < 0) return -1;
+
+    stream.read((char*)&n_variants, sizeof(uint32_t));
+    uint8_t missing = 0;
+    stream.read((char*)&missing, sizeof(uint8_t));
+    has_missing = missing;
+    n_words_variant = (n_variants + 63) >> 6;
+
+    uint32_t offset = sizeof(uint32_t) + sizeof(int) + sizeof(uint32_t) + sizeof(int) + sizeof(uint32_t) + sizeof(uint8_t);
+    for (uint32_t i = 0; i < n_samples; ++i) {
+        if (offset > out_len) return -2;
+        const int ret = bitmaps[i]->Deserialize(stream, out_len - offset);
+        if (ret < 0) return -2;
+        offset += ret;
+    }
+    if (offset != out_len) return -2;
+
+    return stream.tellg();
+}
+
+}
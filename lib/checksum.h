@@ -0,0 +1,114 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_CHECKSUM_H_
+#define DJINN_CHECKSUM_H_
+
+#include <cstdint>//uint
+#include <cstddef>//size_t
+#include <cstring>//memcpy
+
+// The SSE4.2 CRC32 instruction is used directly when the compiler targets
+// SSE4.2 and otherwise selected at run time on x86-64 with GCC and Clang.
+#if defined(__SSE4_2__)
+#define DJN_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DJN_CRC32C_SSE42 2
+#include <nmmintrin.h>
+#endif
+
+namespace djinn {
+
+/**
+ * Lookup tables for the slicing-by-8 software implementation of CRC32C
+ * (Castagnoli polynomial, reflected 0x82F63B78).
+ */
+struct djn_crc32c_table_t {
+    djn_crc32c_table_t() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int s = 1; s < 8; ++s) t[s][i] = (t[s-1][i] >> 8) ^ t[0][t[s-1][i] & 0xFF];
+        }
+    }
+
+    uint32_t t[8][256];
+};
+
+// Slicing-by-8 on the inverted checksum.
+static inline uint32_t djn_crc32c_sw(uint32_t crc, const uint8_t* data, size_t len) {
+    static const djn_crc32c_table_t table;
+    const uint32_t (*t)[256] = table.t;
+    for (/**/; len >= 8; len -= 8, data += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (/**/; len; --len) crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(DJN_CRC32C_SSE42)
+// CRC32 instruction on the inverted checksum.
+#if DJN_CRC32C_SSE42 == 2
+__attribute__((target("sse4.2")))
+#endif
+static inline uint32_t djn_crc32c_sse42(uint32_t crc, const uint8_t* data, size_t len) {
+    uint64_t c = crc;
+    for (/**/; len >= 8; len -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for (/**/; len; --len) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+/**
+ * Update a CRC32C checksum with len bytes of data. Uses the SSE4.2 CRC32
+ * instruction when the processor supports it and slicing-by-8 otherwise.
+ * Start with crc = 0.
+ *
+ * @param crc  Current checksum.
+ * @param data Input data.
+ * @param len  Length of the data.
+ * @return     Returns the updated checksum.
+ */
+static inline uint32_t djn_crc32c(uint32_t crc, const uint8_t* data, size_t len) {
+#if DJN_CRC32C_SSE42 == 1
+    return ~djn_crc32c_sse42(~crc, data, len);
+#elif DJN_CRC32C_SSE42 == 2
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) return ~djn_crc32c_sse42(~crc, data, len);
+    return ~djn_crc32c_sw(~crc, data, len);
+#else
+    return ~djn_crc32c_sw(~crc, data, len);
+#endif
+}
+
+}
+
+#endif
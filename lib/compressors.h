@@ -1,6 +1,13 @@
+#include <algorithm> // min
+#include <chrono> // decode throughput calibration
+#include <cstdint> // INT32_MAX
+
+#include "frequency_model.h" // order-1 context model (CompressionStrategy::CTX)
+
 #if defined HAVE_ZSTD
 #include <zstd.h>
 #include <zstd_errors.h>
+#include <zdict.h> // dictionary training
 #endif
 
 #if defined HAVE_LZ4
@@ -10,91 +17,602 @@
 
 namespace djinn {
 
+/**
+ * All codec functions return the number of bytes written on success or a
+ * negative value on error. Errors are never fatal:
+ *
+ *   -1: Codec is not available (not compiled with support).
+ *   -2: Illegal input (nullptr).
+ *   -3: Codec failure (malformed data or internal error).
+ *   -4: Destination buffer is too small.
+ */
 typedef int (*GeneralCompressor)(const uint8_t*, uint32_t, uint8_t*, uint32_t, const int32_t);
 typedef int (*GeneralDecompressor)(const uint8_t*, uint32_t, uint8_t*, uint32_t);
 
-static
-int ZstdCompress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity, const int32_t c_level = 1) {
-    if (in == nullptr) return -2;
-    if (n_in == 0) return 0;
-
+/**
+ * Returns the worst-case compressed size of n_in bytes for the given codec.
+ * Destination buffers of this size are guaranteed to never fail due to
+ * insufficient capacity.
+ */
+static inline
+uint32_t CompressBound(CompressionStrategy strat, uint32_t n_in) {
+    switch(strat) {
+    case (CompressionStrategy::NONE): return n_in;
+    // Length prefix, range coder flush, and at most 18 bits per symbol with
+    // slack for carry-less range reductions.
+    case (CompressionStrategy::CTX): return 4 + 8 + n_in + (n_in << 1);
 #if defined HAVE_ZSTD
-    int ret = ZSTD_compress(out, out_capacity, in, n_in, c_level);
-    return(ret);
-#else
-    std::cerr << "Program was not compiled with Zstd support!" << std::endl;
-    return -1;
+    case (CompressionStrategy::ZSTD): return ZSTD_compressBound(n_in);
+#endif
+#if defined HAVE_LZ4
+    case (CompressionStrategy::LZ4): return LZ4_compressBound(n_in);
 #endif
+    default: break;
+    }
+    // Upper bound for all codecs (used for AUTO).
+    return n_in + (n_in >> 7) + 65536;
 }
 
-static
-int ZstdDecompress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity) {
-    if (in == nullptr) return -2;
-    if (n_in == 0) return 0;
+/*======   Persistent codec state   ======*/
+
+/**
+ * Compression and decompression state that is kept alive across data blocks
+ * such that we do not pay the context setup cost for every compressed stream.
+ * Optionally holds a dictionary, either trained from a sample of uncompressed
+ * streams or loaded from an archive, that is applied to all streams when
+ * use_dict is set. Dictionaries are particularly helpful for the many small
+ * EWAH streams produced by small blocks and/or small ploidy models.
+ *
+ * A context is NOT thread safe: use one context per thread. The free
+ * functions below use a thread-local context (see djn_thread_codec_ctx).
+ */
+struct djn_codec_ctx_t {
+public:
+    djn_codec_ctx_t() :
+        use_dict(false), dict_level(0), zstd_params_level(0), zstd_params_dirty(true), auto_calibrated(false)
+#if defined HAVE_ZSTD
+        , zcctx(nullptr), zdctx(nullptr), zcdict(nullptr), zddict(nullptr)
+#endif
+#if defined HAVE_LZ4
+        , lz4hc(nullptr), lz4(nullptr)
+#endif
+    {}
+
+    ~djn_codec_ctx_t() {
+#if defined HAVE_ZSTD
+        ZSTD_freeCCtx(zcctx);
+        ZSTD_freeDCtx(zdctx);
+        ZSTD_freeCDict(zcdict);
+        ZSTD_freeDDict(zddict);
+#endif
+#if defined HAVE_LZ4
+        delete[] lz4hc;
+        delete[] lz4;
+#endif
+    }
 
+    /**
+     * Set advanced codec parameters. These apply to all subsequent calls
+     * to Compress. Zstd parameters outside of the range supported by the
+     * linked library, such as worker threads in a single-threaded build, 
+     * are rejected.
+     *
+     * @param p Codec parameters.
+     * @return int Returns 1 on success or a negative value otherwise.
+     */
+    int SetParameters(const djinn_codec_params_t& p) {
+        if (p.zstd_ldm < 0 || p.zstd_window_log < 0 || p.zstd_workers < 0 || p.lz4_acceleration < 0)
+            return -2;
 #if defined HAVE_ZSTD
-    int compressed_data_size = ZSTD_decompress(out, out_capacity, in, n_in);
-    
-    if (compressed_data_size < 0) {
-        std::cerr << "A negative result from ZSTD_decompress indicates a failure trying to compress the data.  See exit code (echo $?) for value returned." << std::endl;
-        exit(1);
+        if (p.zstd_window_log) {
+            ZSTD_bounds b = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+            if (ZSTD_isError(b.error) || p.zstd_window_log < b.lowerBound || p.zstd_window_log > b.upperBound) return -2;
+        }
+        if (p.zstd_workers) {
+            ZSTD_bounds b = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers);
+            if (ZSTD_isError(b.error) || p.zstd_workers > b.upperBound) return -2;
+        }
+#endif
+        params = p;
+        zstd_params_dirty = true;
+        return 1;
     }
 
-    return(compressed_data_size);
+    /**
+     * Compress the input data using the target codec. The dictionary, if any,
+     * is used when use_dict is set.
+     *
+     * @param strat        Compression codec.
+     * @param in           Input data.
+     * @param n_in         Length of input data.
+     * @param out          Destination buffer.
+     * @param out_capacity Capacity of destination buffer.
+     * @param c_level      Compression level. Negative LZ4 levels select fast 
+     *                     LZ4 with acceleration -c_level.
+     * @return int         Returns the compressed size or a negative value on error.
+     */
+    int Compress(CompressionStrategy strat, const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity, const int32_t c_level) {
+        if (in == nullptr || out == nullptr) return -2;
+        if (n_in == 0) return 0;
+
+        switch(strat) {
+        case (CompressionStrategy::NONE):
+            if (out_capacity < n_in) return -4;
+            memcpy(out, in, n_in);
+            return n_in;
+        case (CompressionStrategy::CTX):
+            return CompressCtx(in, n_in, out, out_capacity);
+        case (CompressionStrategy::ZSTD):
+#if defined HAVE_ZSTD
+        {
+            if (zcctx == nullptr) {
+                zcctx = ZSTD_createCCtx();
+                if (zcctx == nullptr) return -3;
+            }
+
+            // Parameters are sticky in the context and are only updated
+            // when changed.
+            if (zstd_params_dirty || zstd_params_level != c_level) {
+                ZSTD_CCtx_reset(zcctx, ZSTD_reset_parameters);
+                ZSTD_CCtx_setParameter(zcctx, ZSTD_c_compressionLevel, c_level);
+                if (params.zstd_ldm)
+                    ZSTD_CCtx_setParameter(zcctx, ZSTD_c_enableLongDistanceMatching, 1);
+                if (params.zstd_window_log) {
+                    if (ZSTD_isError(ZSTD_CCtx_setParameter(zcctx, ZSTD_c_windowLog, params.zstd_window_log))) return -3;
+                }
+                if (params.zstd_workers) {
+                    if (ZSTD_isError(ZSTD_CCtx_setParameter(zcctx, ZSTD_c_nbWorkers, params.zstd_workers))) return -3;
+                }
+                zstd_params_level = c_level;
+                zstd_params_dirty = false;
+            }
+
+            size_t ret = 0;
+            if (use_dict && dict.size()) {
+                // Digested dictionaries are bound to a compression level.
+                if (zcdict == nullptr || dict_level != c_level) {
+                    ZSTD_freeCDict(zcdict);
+                    zcdict = ZSTD_createCDict(&dict[0], dict.size(), c_level);
+                    dict_level = c_level;
+                }
+                ZSTD_CCtx_refCDict(zcctx, zcdict);
+            } else {
+                ZSTD_CCtx_refCDict(zcctx, nullptr);
+            }
+            ret = ZSTD_compress2(zcctx, out, out_capacity, in, n_in);
+
+            if (ZSTD_isError(ret)) {
+                ZSTD_CCtx_reset(zcctx, ZSTD_reset_session_only);
+                if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall) return -4;
+                return -3;
+            }
+            return ret;
+        }
 #else
-    std::cerr << "Program was not compiled with Zstd support!" << std::endl;
-    return -1;
+            return -1; // not compiled with Zstd support
 #endif
-}
+        case (CompressionStrategy::LZ4):
+#if defined HAVE_LZ4
+        {
+            int ret = 0;
+            const int acceleration = c_level < 0 ? -c_level : params.lz4_acceleration;
+            if (acceleration) {
+                // Fast LZ4 with an acceleration factor.
+                if (lz4 == nullptr) lz4 = new uint8_t[LZ4_sizeofState()];
+                if (use_dict && dict.size()) {
+                    LZ4_stream_t* stream = LZ4_initStream(lz4, LZ4_sizeofState());
+                    LZ4_loadDict(stream, (const char*)&dict[0], dict.size());
+                    ret = LZ4_compress_fast_continue(stream, (const char*)in, (char*)out, n_in, out_capacity, acceleration);
+                } else {
+                    ret = LZ4_compress_fast_extState(lz4, (const char*)in, (char*)out, n_in, out_capacity, acceleration);
+                }
+            } else {
+                if (lz4hc == nullptr) lz4hc = new uint8_t[LZ4_sizeofStateHC()];
+                if (use_dict && dict.size()) {
+                    LZ4_streamHC_t* stream = LZ4_initStreamHC(lz4hc, LZ4_sizeofStateHC());
+                    LZ4_resetStreamHC_fast(stream, c_level);
+                    LZ4_loadDictHC(stream, (const char*)&dict[0], dict.size());
+                    ret = LZ4_compress_HC_continue(stream, (const char*)in, (char*)out, n_in, out_capacity);
+                } else {
+                    ret = LZ4_compress_HC_extStateHC(lz4hc, (const char*)in, (char*)out, n_in, out_capacity, c_level);
+                }
+            }
+            // LZ4 returns 0 when the destination buffer is too small.
+            if (ret <= 0) return -4;
+            return ret;
+        }
+#else
+            return -1; // not compiled with LZ4 support
+#endif
+        default: break;
+        }
+        return -1;
+    }
 
-static
-int Lz4Compress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity, const int32_t c_level = 1) {
-    if (in == nullptr) return -2;
-    if (n_in == 0) return 0;
+    /**
+     * Compress the input data using the target codec and return the concrete
+     * codec that was used in used_strat. If strat is AUTO then the codec and 
+     * level are selected according to the auto_objective: the smallest 
+     * output is retained among the candidates whose decode throughput
+     * satisfies the objective. Candidates are evaluated from the cheapest to
+     * the most expensive and are pruned as follows:
+     * 
+     *   1. Fast LZ4 and Zstd level 1 probe the stream. If neither saves at
+     *      least 1/32 of the input then no other LZ-type candidate is tried.
+     *   2. LZ4-HC is only tried when fast LZ4 is the best candidate so far.
+     *   3. Higher Zstd levels are only tried while the previous level saved 
+     *      at least 1/32 relative to the level below it.
+     *   4. LZ4-HC and the context-model codec stop as soon as their output
+     *      grows beyond the best candidate.
+     * 
+     * Data is stored uncompressed (NONE) if no candidate reduces its size.
+     * The destination buffer MUST be able to hold 
+     * CompressBound(CompressionStrategy::AUTO, n_in) bytes.
+     *
+     * @param strat        Compression codec or AUTO.
+     * @param in           Input data.
+     * @param n_in         Length of input data.
+     * @param out          Destination buffer.
+     * @param out_capacity Capacity of destination buffer.
+     * @param c_level      Compression level. Ignored for AUTO.
+     * @param used_strat   Returns the codec used.
+     * @return int         Returns the compressed size or a negative value on error.
+     */
+    int Compress(CompressionStrategy strat, const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity, const int32_t c_level, CompressionStrategy& used_strat) {
+        used_strat = strat;
+        if (strat != CompressionStrategy::AUTO)
+            return Compress(strat, in, n_in, out, out_capacity, c_level);
+
+        if (in == nullptr || out == nullptr) return -2;
+        used_strat = CompressionStrategy::NONE;
+        if (n_in == 0) return 0;
 
+        const djinn_auto_codec_t& o = auto_objective;
+        if (o.min_decode_mbs > 0 && !auto_calibrated) CalibrateDecodeThroughput();
+
+        bool allow_lz4 = false, allow_zstd = false;
 #if defined HAVE_LZ4
-    int compressed_data_size = LZ4_compress_HC((const char*)in, (char*)out, n_in, out_capacity, c_level);
+        allow_lz4 = o.min_decode_mbs <= 0 || o.lz4_decode_mbs >= o.min_decode_mbs;
+#endif
+#if defined HAVE_ZSTD
+        allow_zstd = o.min_decode_mbs <= 0 || o.zstd_decode_mbs >= o.min_decode_mbs;
+#endif
+        const bool allow_ctx = o.allow_ctx && (o.min_decode_mbs <= 0 || o.ctx_decode_mbs >= o.min_decode_mbs);
+
+        if (auto_buf.size() < out_capacity) auto_buf.resize(out_capacity);
+
+        int best = n_in;
+        int ret = 0;
+        int zstd_prev = -1;
+        if (allow_lz4) {
+            ret = AutoCandidate(CompressionStrategy::LZ4, -o.lz4_acceleration, in, n_in, out, out_capacity, false, best, used_strat);
+            if (ret < 0) return ret;
+        }
+        if (allow_zstd) {
+            zstd_prev = ret = AutoCandidate(CompressionStrategy::ZSTD, 1, in, n_in, out, out_capacity, false, best, used_strat);
+            if (ret < 0) return ret;
+        }
+
+        // Stream is not compressible by the LZ-type codecs.
+        const bool lz_compressible = (uint32_t)best < n_in - (n_in >> 5);
+
+        if (lz_compressible && used_strat == CompressionStrategy::LZ4) {
+            ret = AutoCandidate(CompressionStrategy::LZ4, o.lz4_level, in, n_in, out, out_capacity, true, best, used_strat);
+            if (ret < 0) return ret;
+        }
+
+        if (lz_compressible && allow_zstd) {
+            const int zstd_levels[3] = {3, 9, 19};
+            int zstd_prev2 = n_in;
+            for (size_t i = 0; i < 3; ++i) {
+                if (zstd_levels[i] > o.zstd_max_level) break;
+                // Climb while the previous level saved at least 1/32.
+                if (zstd_prev > zstd_prev2 - (zstd_prev2 >> 5)) break;
+                zstd_prev2 = zstd_prev;
+                zstd_prev = ret = AutoCandidate(CompressionStrategy::ZSTD, zstd_levels[i], in, n_in, out, out_capacity, false, best, used_strat);
+                if (ret < 0) return ret;
+            }
+        }
 
-    if (compressed_data_size < 0) {
-        std::cerr << "A negative result from LZ4_compress_default indicates a failure trying to compress the data.  See exit code (echo $?) for value returned." << std::endl;
-        exit(compressed_data_size);
+        if (allow_ctx) {
+            ret = AutoCandidate(CompressionStrategy::CTX, 0, in, n_in, out, out_capacity, true, best, used_strat);
+            if (ret < 0) return ret;
+        }
+
+        if (used_strat == CompressionStrategy::NONE)
+            return Compress(CompressionStrategy::NONE, in, n_in, out, out_capacity, 0);
+
+        return best;
     }
-        
-    if (compressed_data_size == 0) {
-        std::cerr << "A result of 0 means compression worked, but was stopped because the destination buffer couldn't hold all the information." << std::endl;
-        exit(compressed_data_size);
+
+    /**
+     * Measure the decode throughput of each available codec on this machine
+     * and store the rates left at 0 in auto_objective. A fixed synthetic
+     * sample of sparse 32-bit words, resembling EWAH streams, is used such
+     * that the rates do not depend on the data being compressed.
+     */
+    void CalibrateDecodeThroughput() {
+        const uint32_t n_sample = 1 << 20;
+        std::vector<uint8_t> sample(n_sample, 0);
+        uint32_t state = 2463534242u; // xorshift32
+        for (uint32_t i = 0; i < n_sample; i += 4) {
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+            if ((state & 7) == 0) sample[i + ((state >> 8) & 3)] = (state >> 24) | 1;
+        }
+
+        // Digested dictionaries are not representative of the sample.
+        const bool dict_used = use_dict;
+        use_dict = false;
+        if (auto_objective.lz4_decode_mbs <= 0)
+            auto_objective.lz4_decode_mbs = MeasureDecodeThroughput(CompressionStrategy::LZ4, 9, sample);
+        if (auto_objective.zstd_decode_mbs <= 0)
+            auto_objective.zstd_decode_mbs = MeasureDecodeThroughput(CompressionStrategy::ZSTD, 3, sample);
+        if (auto_objective.ctx_decode_mbs <= 0)
+            auto_objective.ctx_decode_mbs = MeasureDecodeThroughput(CompressionStrategy::CTX, 0, sample);
+        use_dict = dict_used;
+        auto_calibrated = true;
     }
 
-    return(compressed_data_size);
+    /**
+     * Decompress the input data using the target codec. The dictionary, if
+     * any, is used when use_dict is set.
+     *
+     * @param strat        Compression codec.
+     * @param in           Compressed input data.
+     * @param n_in         Length of compressed data.
+     * @param out          Destination buffer.
+     * @param out_capacity Capacity of destination buffer.
+     * @return int         Returns the decompressed size or a negative value on error.
+     */
+    int Decompress(CompressionStrategy strat, const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity) {
+        if (in == nullptr || out == nullptr) return -2;
+        if (n_in == 0) return 0;
+
+        switch(strat) {
+        case (CompressionStrategy::NONE):
+            if (out_capacity < n_in) return -4;
+            memcpy(out, in, n_in);
+            return n_in;
+        case (CompressionStrategy::CTX):
+            return DecompressCtx(in, n_in, out, out_capacity);
+        case (CompressionStrategy::ZSTD):
+#if defined HAVE_ZSTD
+        {
+            if (zdctx == nullptr) {
+                zdctx = ZSTD_createDCtx();
+                if (zdctx == nullptr) return -3;
+            }
+            size_t ret = 0;
+            if (use_dict && dict.size()) {
+                if (zddict == nullptr) zddict = ZSTD_createDDict(&dict[0], dict.size());
+                ret = ZSTD_decompress_usingDDict(zdctx, out, out_capacity, in, n_in, zddict);
+            } else {
+                ret = ZSTD_decompressDCtx(zdctx, out, out_capacity, in, n_in);
+            }
+            if (ZSTD_isError(ret)) {
+                if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall) return -4;
+                return -3;
+            }
+            return ret;
+        }
 #else
-    std::cerr << "Program was not compiled with LZ4 support!" << std::endl;
-    return -1;
+            return -1; // not compiled with Zstd support
 #endif
-}
-
-static
-int Lz4Decompress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity) {
-    if (in == nullptr) return -2;
-    if (n_in == 0) return 0;
-
+        case (CompressionStrategy::LZ4):
 #if defined HAVE_LZ4
-    int32_t decompressed_size = LZ4_decompress_safe((const char*)in, (char*)out, n_in, out_capacity);
-    
-    if (decompressed_size < 0) {
-        std::cerr << "A negative result from LZ4_decompress_safe indicates a failure trying to decompress the data.  See exit code (echo $?) for value returned." << std::endl;
-        exit(decompressed_size);
+        {
+            int ret = 0;
+            if (use_dict && dict.size()) {
+                ret = LZ4_decompress_safe_usingDict((const char*)in, (char*)out, n_in, out_capacity, (const char*)&dict[0], dict.size());
+            } else {
+                ret = LZ4_decompress_safe((const char*)in, (char*)out, n_in, out_capacity);
+            }
+            // LZ4 does not distinguish between malformed input and
+            // insufficient capacity.
+            if (ret < 0) return -3;
+            return ret;
+        }
+#else
+            return -1; // not compiled with LZ4 support
+#endif
+        default: break;
+        }
+        return -1;
     }
 
-    if (decompressed_size == 0) {
-        std::cerr << "I'm not sure this function can ever return 0. Documentation in lz4.h doesn't indicate so.";
-        exit(decompressed_size);
+    /**
+     * Load an existing dictionary. Any digested dictionaries are dropped.
+     *
+     * @param src     Dictionary content.
+     * @param src_len Length of dictionary content.
+     * @return int    Returns 1 on success or a negative value otherwise.
+     */
+    int SetDictionary(const uint8_t* src, uint32_t src_len) {
+        if (src == nullptr && src_len) return -2;
+        ClearDictionary();
+        dict.assign(src, src + src_len);
+        return 1;
     }
 
-    return(decompressed_size);
+    /**
+     * Train a new dictionary from a set of samples stored consecutively in
+     * samples with their respective sizes in sample_sizes. Training requires
+     * Zstd support but the resulting dictionary can be used with either codec.
+     *
+     * @param samples      Consecutive sample data.
+     * @param sample_sizes Size of each sample.
+     * @param n_samples    Number of samples.
+     * @param dict_cap     Maximum size of the dictionary.
+     * @return int         Returns the dictionary size or a negative value otherwise.
+     */
+    int TrainDictionary(const uint8_t* samples, const size_t* sample_sizes, uint32_t n_samples, uint32_t dict_cap) {
+        if (samples == nullptr || sample_sizes == nullptr) return -2;
+        if (n_samples == 0 || dict_cap == 0) return -2;
+
+#if defined HAVE_ZSTD
+        std::vector<uint8_t> buf(dict_cap);
+        size_t ret = ZDICT_trainFromBuffer(&buf[0], dict_cap, samples, sample_sizes, n_samples);
+        if (ZDICT_isError(ret)) return -3;
+        return SetDictionary(&buf[0], ret) > 0 ? (int)ret : -3;
 #else
-    std::cerr << "Program was not compiled with LZ4 support!" << std::endl;
-    return -1;
+        return -1; // not compiled with Zstd support
+#endif
+    }
+
+    void ClearDictionary() {
+        dict.clear();
+        dict_level = 0;
+#if defined HAVE_ZSTD
+        if (zcctx != nullptr) ZSTD_CCtx_refCDict(zcctx, nullptr);
+        ZSTD_freeCDict(zcdict); zcdict = nullptr;
+        ZSTD_freeDDict(zddict); zddict = nullptr;
 #endif
+    }
+
+private:
+    // Evaluate a candidate for AUTO and retain it in out if it is smaller than
+    // the best candidate so far. If capped is set then the candidate stops as
+    // soon as it cannot improve on the best. Returns the compressed size, 
+    // INT32_MAX if it was stopped, or a negative value on error.
+    int AutoCandidate(CompressionStrategy strat, int32_t c_level, const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity, bool capped, int& best, CompressionStrategy& used_strat) {
+        if (best <= 1) return INT32_MAX;
+        const uint32_t cap = capped ? std::min(out_capacity, (uint32_t)best - 1) : out_capacity;
+        int ret = Compress(strat, in, n_in, &auto_buf[0], cap, c_level);
+        if (ret == -4) return INT32_MAX;
+        if (ret < 0) return ret;
+        if (ret < best) {
+            best = ret;
+            used_strat = strat;
+            memcpy(out, &auto_buf[0], ret);
+        }
+        return ret;
+    }
+
+    // Returns the decode throughput in MB/s for the target codec on the 
+    // sample or 0 if the codec is not available.
+    double MeasureDecodeThroughput(CompressionStrategy strat, int32_t c_level, const std::vector<uint8_t>& sample) {
+        std::vector<uint8_t> comp(CompressBound(strat, sample.size()));
+        std::vector<uint8_t> dec(sample.size());
+        const int n_comp = Compress(strat, &sample[0], sample.size(), &comp[0], comp.size(), c_level);
+        if (n_comp <= 0) return 0;
+
+        // Repeat for at least 5 ms to reduce timer noise.
+        uint64_t n_bytes = 0;
+        double elapsed = 0;
+        const auto t0 = std::chrono::steady_clock::now();
+        do {
+            if (Decompress(strat, &comp[0], n_comp, &dec[0], dec.size()) != (int)sample.size()) return 0;
+            n_bytes += sample.size();
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        } while (elapsed < 0.005);
+
+        return n_bytes / elapsed / 1e6;
+    }
+
+    // Context-model codec: the uncompressed length (4 bytes) followed by the
+    // range coded bytes, each modelled in the context of the preceding byte.
+    int CompressCtx(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity) {
+        if (out_capacity < 4 + 8) return -4;
+        if (ctx_codec.get() == nullptr) ctx_codec = std::make_shared<GeneralModel>(256, 256, 18, 16);
+        else ctx_codec->Reset();
+
+        // The range coder writes without bounds checking: keep slack for a
+        // single symbol.
+        if (ctx_buf.size() < (size_t)out_capacity + 32) ctx_buf.resize((size_t)out_capacity + 32);
+        RangeCoder* rc = ctx_codec->range_coder.get();
+        rc->SetOutput(&ctx_buf[0]);
+        rc->StartEncode();
+        const size_t limit = out_capacity - 4 - 8; // excluding length and final flush
+        for (uint32_t i = 0; i < n_in; ++i) {
+            ctx_codec->EncodeSymbol(in[i]);
+            if (rc->OutSize() > limit) return -4;
+        }
+        rc->FinishEncode();
+
+        const uint32_t n_out = rc->OutSize();
+        memcpy(out, &n_in, sizeof(uint32_t));
+        memcpy(&out[4], &ctx_buf[0], n_out);
+        return 4 + n_out;
+    }
+
+    int DecompressCtx(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity) {
+        if (n_in < 4 + 8) return -3;
+        uint32_t n_raw = 0;
+        memcpy(&n_raw, in, sizeof(uint32_t));
+        if (n_raw > out_capacity) return -4;
+        if (ctx_codec.get() == nullptr) ctx_codec = std::make_shared<GeneralModel>(256, 256, 18, 16);
+        else ctx_codec->Reset();
+
+        // Zero padding such that malformed input cannot read out of bounds
+        // before it is detected.
+        const uint32_t n_data = n_in - 4;
+        if (ctx_buf.size() < (size_t)n_data + 32) ctx_buf.resize((size_t)n_data + 32);
+        memcpy(&ctx_buf[0], &in[4], n_data);
+        memset(&ctx_buf[n_data], 0, 32);
+
+        ctx_codec->StartDecoding(&ctx_buf[0]);
+        const uint8_t* end = &ctx_buf[0] + n_data;
+        for (uint32_t i = 0; i < n_raw; ++i) {
+            out[i] = ctx_codec->DecodeSymbol();
+            if ((const uint8_t*)ctx_codec->range_coder->in_buf > end) return -3;
+        }
+        return n_raw;
+    }
+
+public:
+    bool use_dict; // Apply the dictionary to the current streams.
+    int dict_level; // Compression level of the digested Zstd dictionary.
+    int zstd_params_level; // Compression level currently set in the Zstd context.
+    bool zstd_params_dirty; // Parameters must be (re)applied to the Zstd context.
+    djinn_codec_params_t params; // Advanced parameters.
+    djinn_auto_codec_t auto_objective; // Objective for automatic codec selection.
+    bool auto_calibrated; // Unset decode throughputs in auto_objective have been measured.
+    std::vector<uint8_t> auto_buf; // Scratch for evaluating candidate codecs.
+    std::vector<uint8_t> dict; // Raw dictionary content.
+    std::shared_ptr<GeneralModel> ctx_codec; // Order-1 model for CompressionStrategy::CTX.
+    std::vector<uint8_t> ctx_buf; // Range coder buffer for CompressionStrategy::CTX.
+#if defined HAVE_ZSTD
+    ZSTD_CCtx*  zcctx;
+    ZSTD_DCtx*  zdctx;
+    ZSTD_CDict* zcdict;
+    ZSTD_DDict* zddict;
+#endif
+#if defined HAVE_LZ4
+    uint8_t* lz4hc; // LZ4HC state of size LZ4_sizeofStateHC()
+    uint8_t* lz4;   // LZ4 state of size LZ4_sizeofState()
+#endif
+};
+
+/**
+ * Returns the codec context owned by the calling thread. Used by the free
+ * codec functions such that repeated calls do not allocate a new context
+ * each time.
+ */
+inline djn_codec_ctx_t& djn_thread_codec_ctx() {
+    static thread_local djn_codec_ctx_t ctx;
+    return ctx;
 }
 
-}
\ No newline at end of file
+/*======   Free codec functions   ======*/
+
+static inline
+int ZstdCompress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity, const int32_t c_level = 1) {
+    return djn_thread_codec_ctx().Compress(CompressionStrategy::ZSTD, in, n_in, out, out_capacity, c_level);
+}
+
+static inline
+int ZstdDecompress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity) {
+    return djn_thread_codec_ctx().Decompress(CompressionStrategy::ZSTD, in, n_in, out, out_capacity);
+}
+
+static inline
+int Lz4Compress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity, const int32_t c_level = 1) {
+    return djn_thread_codec_ctx().Compress(CompressionStrategy::LZ4, in, n_in, out, out_capacity, c_level);
+}
+
+static inline
+int Lz4Decompress(const uint8_t* in, uint32_t n_in, uint8_t* out, uint32_t out_capacity) {
+    return djn_thread_codec_ctx().Decompress(CompressionStrategy::LZ4, in, n_in, out, out_capacity);
+}
+
+}
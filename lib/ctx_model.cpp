@@ -4,9 +4,37 @@
 #include "djinn.h"
 #include "frequency_model.h" // RangeCoder and FrequencyModel
 #include "pbwt.h" // PBWT algorithms
+#include "scratch.h" // growable buffers
+#include "genotype_stats.h" // allele counts
 
 namespace djinn {
 
+// Haplotypes that have matched their predecessor in PBWT order for fewer
+// than this many PBWT updates are flagged in the contexts of 2MC sites.
+#define DJN_CTX_PBWT_MATCH 16
+
+// 2MC sites are coded bit by bit if at least this fraction (in 1/8) of
+// their words are dirty.
+#define DJN_CTX_DENSE_DIRTY 7
+
+/*======   Supportive functions   ======*/
+
+/**
+ * Grow the output buffer of an object owning a range coder such that at
+ * least n additional bytes can be emitted. The range coder is re-pointed to
+ * the new buffer while retaining the bytes emitted so far.
+ */
+template <class T>
+static inline int djn_reserve_range_coder(T& obj, uint32_t n) {
+    const uint32_t rc_size = obj.range_coder->OutSize();
+    if (obj.p != nullptr && rc_size + n <= obj.p_cap) return 1;
+    int ret = djn_reserve(obj, (uint64_t)rc_size + n, rc_size);
+    if (ret < 0) return ret;
+    obj.range_coder->in_buf  = obj.p;
+    obj.range_coder->out_buf = obj.p + rc_size;
+    return ret;
+}
+
 /*======   Context container   ======*/
 
 djn_ctx_model_t::djn_ctx_model_t() :
@@ -18,7 +46,7 @@ djn_ctx_model_t::djn_ctx_model_t() :
 }
 
 djn_ctx_model_t::~djn_ctx_model_t() {
-    if (p_free) delete[] p;
+    djn_release(*this);
 }
 
 void djn_ctx_model_t::Initiate2mc() {
@@ -34,6 +62,9 @@ void djn_ctx_model_t::Initiate2mc() {
     mrle4_3    = std::make_shared<GeneralModel>(256, 64,  18, 8,  range_coder);
     mrle4_4    = std::make_shared<GeneralModel>(256, 64,  18, 8,  range_coder);
     dirty_wah  = std::make_shared<GeneralModel>(256, 256, 18, 16, range_coder);
+    dirty_pbwt = std::make_shared<GeneralModel>(256, 512, 18, 16, range_coder); // 1 bit preceding allele, 8 bit short matches
+    mdense     = std::make_shared<GeneralModel>(2,   4,   18, 8,  range_coder);
+    dense_bits = std::make_shared<GeneralModel>(2, 8192,  12, 8,  range_coder); // 12 preceding bits, 1 bit short match
     mtype      = std::make_shared<GeneralModel>(2,   512, 18, 1,  range_coder);
 }
 
@@ -66,6 +97,9 @@ void djn_ctx_model_t::reset() {
     if (mrle4_3.get() != nullptr)   mrle4_3->Reset(); 
     if (mrle4_4.get() != nullptr)   mrle4_4->Reset();
     if (dirty_wah.get() != nullptr) dirty_wah->Reset();
+    if (dirty_pbwt.get() != nullptr) dirty_pbwt->Reset();
+    if (mdense.get() != nullptr)    mdense->Reset();
+    if (dense_bits.get() != nullptr) dense_bits->Reset();
     if (mtype.get() != nullptr)     mtype->Reset();
     if (mref.get() != nullptr)      mref->Reset();
     if (pbwt.get() != nullptr)      pbwt->Reset();
@@ -75,13 +109,8 @@ void djn_ctx_model_t::reset() {
 int djn_ctx_model_t::StartEncoding(bool use_pbwt, bool reset) {
     if (range_coder.get() == nullptr) return -1;
 
-    if (p == nullptr) { // initiate a buffer if there is none
-        delete[] p;
-        p_cap = 10000000;
-        p = new uint8_t[p_cap];
-        p_len = 0;
-        p_free = true;
-    }
+    // initiate a buffer if there is none: grown on demand while encoding
+    if (djn_reserve(*this, DJN_SCRATCH_MIN_CAPACITY) < 0) return -4;
     if (reset) this->reset();
     p_len = 0;
 
@@ -90,7 +119,7 @@ int djn_ctx_model_t::StartEncoding(bool use_pbwt, bool reset) {
     return 1;
 }
 
-size_t djn_ctx_model_t::FinishEncoding() {
+int64_t djn_ctx_model_t::FinishEncoding() {
     if (range_coder.get() == nullptr) return -1;
     range_coder->FinishEncode();
     p_len = range_coder->OutSize();
@@ -148,14 +177,9 @@ int djn_ctx_model_t::Deserialize(uint8_t* dst) {
     n_variants = *((uint32_t*)&dst[offset]);
     offset += sizeof(uint32_t);
 
-    // initiate a buffer if there is none or it's too small
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
-    }
+    // initiate a buffer if there is none or it's too small: padded for 
+    // range coder read-ahead
+    if (djn_reserve(*this, (uint64_t)p_len + 65536) < 0) return -1;
 
     memcpy(p, &dst[offset], p_len); // data
     offset += p_len;
@@ -169,13 +193,11 @@ int djn_ctx_model_t::Deserialize(std::istream& stream) {
     stream.read((char*)&p_len, sizeof(uint32_t));
     stream.read((char*)&n_variants, sizeof(uint32_t));
 
-    // initiate a buffer if there is none or it's too small
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
+    // initiate a buffer if there is none or it's too small: padded for 
+    // range coder read-ahead
+    if (djn_reserve(*this, (uint64_t)p_len + 65536) < 0) {
+        stream.setstate(std::ios::failbit);
+        return -1;
     }
 
     stream.read((char*)p, p_len);
@@ -185,16 +207,14 @@ int djn_ctx_model_t::Deserialize(std::istream& stream) {
 /*======   Variant context model   ======*/
 
 djinn_ctx_model::djinn_ctx_model() : 
-    p(new uint8_t[1000000]), p_len(0), p_cap(1000000), p_free(true),
+    p(nullptr), p_len(0), p_cap(0), p_free(true),
     q(nullptr), q_len(0), q_alloc(0), q_free(true),
     range_coder(std::make_shared<RangeCoder>()), 
     ploidy_dict(std::make_shared<GeneralModel>(256, 256, range_coder))
-{
-    
-}
+{}
 
 djinn_ctx_model::~djinn_ctx_model() { 
-    if (p_free) delete[] p;
+    djn_release(*this);
     if (q_free) delete[] q;
 }
 
@@ -208,6 +228,7 @@ int djinn_ctx_model::EncodeBcf(uint8_t* data, size_t len_data, int ploidy, uint8
     std::shared_ptr<djn_ctx_model_container_t> tgt_container;
 
     const uint64_t tuple = ((uint64_t)len_data << 32) | ploidy;
+    if (djn_reserve_range_coder(*this, 16) < 0) return -4;
     auto search = ploidy_map.find(tuple);
     if (search != ploidy_map.end()) {
         tgt_container = ploidy_models[search->second];
@@ -218,44 +239,63 @@ int djinn_ctx_model::EncodeBcf(uint8_t* data, size_t len_data, int ploidy, uint8
         ploidy_dict->EncodeSymbol(ploidy_models.size());
         ploidy_models.push_back(std::make_shared<djn_ctx_model_container_t>(len_data, ploidy, (bool)use_pbwt));
         tgt_container = ploidy_models[ploidy_models.size() - 1];
+        tgt_container->pbwt_ctx = pbwt_ctx;
+        tgt_container->dense = dense;
+        tgt_container->gt_pbwt = gt_pbwt;
         tgt_container->StartEncoding(use_pbwt, init);
     }
     assert(tgt_container.get() != nullptr);
-
-    // Compute allele counts.
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
-    for (int i = 0; i < len_data; ++i) {
-        ++hist_alts[DJN_BCF_UNPACK_GENOTYPE_GENERAL(data[i])];
-    }
+    if (djn_reserve_range_coder(*tgt_container, 16) < 0) return -4;
+
+    // Compute allele counts and the presence of missing and EOV symbols.
+    // Without the PBWT, the bitmap of alt alleles computed in the same pass
+    // is encoded as is for 2mc sites.
+    uint32_t* bitmap = tgt_container->ResetBitmaps();
+    djn_gt_stats_t stats;
+    djn_gt_stats_bcf(data, len_data, stats, use_pbwt ? nullptr : bitmap);
     // Check.
     assert(tgt_container->marchetype.get() != nullptr);
+    if (tgt_container->EncodePhase(data, len_data) < 0) return -4;
 
-    // for (int i = 0; i < 256; ++i) {
-    //     if (hist_alts[i]) std::cerr << i << ":" << hist_alts[i] << ",";
-    // }
-    // std::cerr << " n_variants=" << tgt_container->n_variants << " data2m=" << tgt_container->model_2mc->range_coder->OutSize() << " dataNm=" << tgt_container->model_nm->range_coder->OutSize() << " permute=" << (int)use_pbwt << std::endl;
+    // Unphased diploid genotypes permuted with the genotype PBWT.
+    if (tgt_container->PackGenotypes(data, len_data, true)) {
+        tgt_container->marchetype->EncodeSymbol(0);
+        tgt_container->mgt->EncodeSymbol(1);
+
+        int ret = tgt_container->EncodeGt();
+        if (ret > 0) {
+            ++n_variants;
+            variant_stats.push_back(djn_variant_stats(stats, len_data, 2));
+        }
+        return ret;
+    }
 
     // Biallelic, no missing, and no special EOV symbols.
-    if (alt_alleles <= 2 && hist_alts[14] == 0 && hist_alts[15] == 0) {
+    if (alt_alleles <= 2 && stats.max_allele <= 1 && !stats.has_missing && !stats.has_eov) {
         tgt_container->marchetype->EncodeSymbol(0); // add archtype as 2mc
+        if (tgt_container->gt_pbwt) tgt_container->mgt->EncodeSymbol(0);
 
-        int ret = -1;
         if (use_pbwt) {
+            if (tgt_container->pbwt_ctx) tgt_container->UpdatePbwtContext();
+
+            // The permuted alleles are packed while permuting and the
+            // partition uses the reference allele count from the statistics
+            // pass.
+            PBWT* pbwt = tgt_container->model_2mc->pbwt.get();
             // Todo: add lower limit to stored parameters during serialization
-            if (hist_alts[1] < 10) { // dont update if < 10 alts
-                for (int i = 0; i < len_data; ++i) {
-                    tgt_container->model_2mc->pbwt->prev[i] = DJN_BCF_UNPACK_GENOTYPE(data[tgt_container->model_2mc->pbwt->ppa[i]]);
-                }
+            if (stats.n_alt < 10) { // dont update if < 10 alts
+                pbwt->PermuteBcf2mc(data, bitmap);
             } else {
-                tgt_container->model_2mc->pbwt->UpdateBcf(data, 1);
+                pbwt->UpdateBcf2mc(data, stats.n_ref, bitmap);
             }
-
-            ret = (tgt_container->Encode2mc(tgt_container->model_2mc->pbwt->prev, len_data));
-        } else {
-            ret = (tgt_container->Encode2mc(data, len_data, DJN_BCF_GT_UNPACK, 1));
         }
 
-        if (ret > 0) ++n_variants;
+        int ret = tgt_container->EncodeWah(bitmap, tgt_container->n_samples_wah >> 5); // n_samples_wah / 32
+
+        if (ret > 0) {
+            ++n_variants;
+            variant_stats.push_back(djn_variant_stats(stats, len_data, 0));
+        }
         return ret;
     } else { // Otherwise.
         tgt_container->marchetype->EncodeSymbol(1);
@@ -267,7 +307,10 @@ int djinn_ctx_model::EncodeBcf(uint8_t* data, size_t len_data, int ploidy, uint8
         } else {
             ret = (tgt_container->EncodeNm(data, len_data, DJN_BCF_GT_UNPACK_GENERAL, 1));
         }
-        if (ret > 0) ++n_variants;
+        if (ret > 0) {
+            ++n_variants;
+            variant_stats.push_back(djn_variant_stats(stats, len_data, 1));
+        }
         return ret;
     }
 }
@@ -282,6 +325,7 @@ int djinn_ctx_model::Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t
     std::shared_ptr<djn_ctx_model_container_t> tgt_container;
 
     const uint64_t tuple = ((uint64_t)len_data << 32) | ploidy;
+    if (djn_reserve_range_coder(*this, 16) < 0) return -4;
     auto search = ploidy_map.find(tuple);
     if (search != ploidy_map.end()) {
         tgt_container = ploidy_models[search->second];
@@ -292,44 +336,63 @@ int djinn_ctx_model::Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t
         ploidy_dict->EncodeSymbol(ploidy_models.size());
         ploidy_models.push_back(std::make_shared<djn_ctx_model_container_t>(len_data, ploidy, (bool)use_pbwt));
         tgt_container = ploidy_models[ploidy_models.size() - 1];
+        tgt_container->pbwt_ctx = pbwt_ctx;
+        tgt_container->dense = dense;
+        tgt_container->gt_pbwt = gt_pbwt;
         tgt_container->StartEncoding(use_pbwt, init); // Todo: fix me
     }
     assert(tgt_container.get() != nullptr);
-
-    // Compute allele counts.
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
-    for (int i = 0; i < len_data; ++i) {
-        ++hist_alts[data[i]];
-    }
+    if (djn_reserve_range_coder(*tgt_container, 16) < 0) return -4;
+
+    // Compute allele counts and the presence of missing and EOV symbols.
+    // Without the PBWT, the bitmap of alt alleles computed in the same pass
+    // is encoded as is for 2mc sites.
+    uint32_t* bitmap = tgt_container->ResetBitmaps();
+    djn_gt_stats_t stats;
+    djn_gt_stats(data, len_data, stats, use_pbwt ? nullptr : bitmap);
     // Check.
     assert(tgt_container->marchetype.get() != nullptr);
+    if (tgt_container->EncodePhase(nullptr, len_data) < 0) return -4;
 
-    // for (int i = 0; i < 256; ++i) {
-    //     if (hist_alts[i]) std::cerr << i << ":" << hist_alts[i] << ",";
-    // }
-    // std::cerr << " data2m=" << tgt_container->model_2mc->range_coder->OutSize() << " dataNm=" << tgt_container->model_nm->range_coder->OutSize() << " permute=" << (bool)use_pbwt << std::endl;
+    // Unphased diploid genotypes permuted with the genotype PBWT.
+    if (tgt_container->PackGenotypes(data, len_data, false)) {
+        tgt_container->marchetype->EncodeSymbol(0);
+        tgt_container->mgt->EncodeSymbol(1);
+
+        int ret = tgt_container->EncodeGt();
+        if (ret > 0) {
+            ++n_variants;
+            variant_stats.push_back(djn_variant_stats(stats, len_data, 2));
+        }
+        return ret;
+    }
 
     // Biallelic, no missing, and no special EOV symbols.
-    if (alt_alleles <= 2 && hist_alts[14] == 0 && hist_alts[15] == 0) {
+    if (alt_alleles <= 2 && stats.max_allele <= 1 && !stats.has_missing && !stats.has_eov) {
         tgt_container->marchetype->EncodeSymbol(0); // add archtype as 2mc
+        if (tgt_container->gt_pbwt) tgt_container->mgt->EncodeSymbol(0);
 
-        int ret = -1;
         if (use_pbwt) {
+            if (tgt_container->pbwt_ctx) tgt_container->UpdatePbwtContext();
+
+            // The permuted alleles are packed while permuting and the
+            // partition uses the reference allele count from the statistics
+            // pass.
+            PBWT* pbwt = tgt_container->model_2mc->pbwt.get();
             // Todo: add lower limit to stored parameters during serialization
-            if (hist_alts[1] < 10) { // dont update if < 10 alts
-                for (int i = 0; i < len_data; ++i) {
-                    tgt_container->model_2mc->pbwt->prev[i] = data[tgt_container->model_2mc->pbwt->ppa[i]];
-                }
+            if (stats.n_alt < 10) { // dont update if < 10 alts
+                pbwt->Permute2mc(data, bitmap);
             } else {
-                tgt_container->model_2mc->pbwt->Update(data, 1);
+                pbwt->Update2mc(data, stats.n_ref, bitmap);
             }
-
-            ret = (tgt_container->Encode2mc(tgt_container->model_2mc->pbwt->prev, len_data));
-        } else {
-            ret = (tgt_container->Encode2mc(data, len_data, DJN_MAP_NONE, 0));
         }
 
-        if (ret > 0) ++n_variants;
+        int ret = tgt_container->EncodeWah(bitmap, tgt_container->n_samples_wah >> 5); // n_samples_wah / 32
+
+        if (ret > 0) {
+            ++n_variants;
+            variant_stats.push_back(djn_variant_stats(stats, len_data, 0));
+        }
         return ret;
     } else { // Otherwise.
         tgt_container->marchetype->EncodeSymbol(1);
@@ -341,7 +404,10 @@ int djinn_ctx_model::Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t
         } else {
             ret = (tgt_container->EncodeNm(data, len_data, DJN_MAP_NONE, 0));
         }
-        if (ret > 0) ++n_variants;
+        if (ret > 0) {
+            ++n_variants;
+            variant_stats.push_back(djn_variant_stats(stats, len_data, 1));
+        }
         return ret;
     }
 }
@@ -392,6 +458,7 @@ int djinn_ctx_model::DecodeNext(djinn_variant_t*& variant) {
     variant->data_len = 0;
     variant->errcode  = 0;
     variant->unpacked = DJN_UN_IND;
+    variant->phased   = DJN_PHASE_UNKNOWN;
     variant->n_allele = 0;
 
     int ret = tgt_container->DecodeNext(q,q_len,variant->data,variant->data_len);
@@ -399,15 +466,9 @@ int djinn_ctx_model::DecodeNext(djinn_variant_t*& variant) {
         variant->errcode = 1;
         return ret;
     }
+    tgt_container->SetPhase(variant);
 
-    // Compute number of alleles.
-    uint32_t max_allele = 0;
-    for (int i = 0; i < 256; ++i) {
-        max_allele = tgt_container->hist_alts[i] != 0 ? i : max_allele;
-        // if (tgt_container->hist_alts[i]) std::cerr << i << ":" << tgt_container->hist_alts[i] << ",";
-    }
-    // std::cerr << " max=" << max_allele << std::endl;
-    variant->n_allele = max_allele + 1;
+    variant->n_allele = tgt_container->max_symbol_obs + 1;
 
     return 1;
 }
@@ -433,27 +494,38 @@ void djinn_ctx_model::StartEncoding(bool use_pbwt, bool reset) {
     this->init = reset;
 
     n_variants = 0;
+    variant_stats.clear();
     p_len = 0;
 
-    // Local range coder
+    // Local range coder. If the buffer cannot be allocated then the first
+    // Encode call fails as the range coder buffer is grown on demand.
+    djn_reserve(*this, DJN_SCRATCH_MIN_CAPACITY);
     range_coder->SetOutput(p);
     range_coder->StartEncode();
 
+    // The archetype model must also be reset for blocks to be decodable
+    // independently.
+    if (reset) ploidy_dict->Reset();
     for (int i = 0; i < ploidy_models.size(); ++i) {
+        ploidy_models[i]->pbwt_ctx = pbwt_ctx;
+        ploidy_models[i]->dense = dense;
+        ploidy_models[i]->gt_pbwt = gt_pbwt;
         ploidy_models[i]->StartEncoding(use_pbwt, reset);
     }
 }
 
-size_t djinn_ctx_model::FinishEncoding() {
+int64_t djinn_ctx_model::FinishEncoding() {
     if (range_coder.get() == nullptr) return -1;
     range_coder->FinishEncode();
     p_len = range_coder->OutSize();
 
-    size_t s_models = 0;
+    int64_t s_models = 0;
     for (int i = 0; i < ploidy_models.size(); ++i) {
-        s_models += ploidy_models[i]->FinishEncoding();
+        const int64_t ret = ploidy_models[i]->FinishEncoding();
+        if (ret < 0) return ret;
+        s_models += ret;
     }
-    size_t s_rc  = range_coder->OutSize();
+    int64_t s_rc  = range_coder->OutSize();
     
     return s_rc + s_models;
 }
@@ -462,7 +534,11 @@ int djinn_ctx_model::StartDecoding() {
     assert(p != nullptr);
     assert(ploidy_models.size() != 0);
 
+    if (init) ploidy_dict->Reset();
     for (int i = 0; i <ploidy_models.size(); ++i) {
+        ploidy_models[i]->pbwt_ctx = pbwt_ctx;
+        ploidy_models[i]->dense = dense;
+        ploidy_models[i]->gt_pbwt = gt_pbwt;
         ploidy_models[i]->StartDecoding(use_pbwt, init);
     }
 
@@ -487,7 +563,7 @@ int djinn_ctx_model::Serialize(uint8_t* dst) const {
     offset += sizeof(uint32_t);
 
     // Serialize bit-packed controller.
-    uint8_t pack = (use_pbwt << 7) | (init << 6) | (unused << 0);
+    uint8_t pack = (use_pbwt << 7) | (init << 6) | (pbwt_ctx << 5) | (dense << 4) | (gt_pbwt << 3) | DJN_CTX_FORMAT_VERSION;
     dst[offset] = pack;
     offset += sizeof(uint8_t);
 
@@ -518,7 +594,7 @@ int djinn_ctx_model::Serialize(std::ostream& stream) const {
     stream.write((char*)&n_variants, sizeof(uint32_t));
 
     // Serialize bit-packed controller.
-    uint8_t pack = (use_pbwt << 7) | (init << 6) | (unused << 0);
+    uint8_t pack = (use_pbwt << 7) | (init << 6) | (pbwt_ctx << 5) | (dense << 4) | (gt_pbwt << 3) | DJN_CTX_FORMAT_VERSION;
     stream.write((char*)&pack, sizeof(uint8_t));
     stream.write((char*)&p_len, sizeof(uint32_t));
     stream.write((char*)p, p_len);
@@ -563,8 +639,12 @@ int djinn_ctx_model::Deserialize(uint8_t* src) {
     n_variants = *((uint32_t*)&src[offset]);
     offset += sizeof(uint32_t);
     uint8_t pack = src[offset];
+    if ((pack & 7) != DJN_CTX_FORMAT_VERSION) return -1;
     use_pbwt = (pack >> 7) & 1;
     init = (pack >> 6) & 1;
+    pbwt_ctx = (pack >> 5) & 1;
+    dense = (pack >> 4) & 1;
+    gt_pbwt = (pack >> 3) & 1;
     unused = 0;
     offset += sizeof(uint8_t);
 
@@ -572,7 +652,8 @@ int djinn_ctx_model::Deserialize(uint8_t* src) {
     p_len = *((uint32_t*)&src[offset]);
     offset += sizeof(uint32_t);
     
-    // Store model selection data.
+    // Store model selection data. Padded for range coder read-ahead.
+    if (djn_reserve(*this, (uint64_t)p_len + 65536) < 0) return -1;
     memcpy(p, &src[offset], p_len);
     offset += p_len;
     
@@ -587,13 +668,16 @@ int djinn_ctx_model::Deserialize(uint8_t* src) {
         // the encoding order.
         const uint64_t tuple = ((uint64_t)n_s << 32) | pl;
         auto search = ploidy_map.find(tuple);
+        int ret = 0;
         if (search != ploidy_map.end()) {
-            offset += ploidy_models[search->second]->Deserialize(&src[offset]);
+            ret = ploidy_models[search->second]->Deserialize(&src[offset]);
         } else {
             ploidy_map[tuple] = ploidy_models.size();
             ploidy_models.push_back(std::make_shared<djinn::djn_ctx_model_container_t>(n_s, pl, (bool)use_pbwt));
-            offset += ploidy_models.back()->Deserialize(&src[offset]);
+            ret = ploidy_models.back()->Deserialize(&src[offset]);
         }
+        if (ret < 0) return ret;
+        offset += ret;
     }
     // std::cerr << "[Deserialize] Decoded=" << offset << "/" << tot_offset << std::endl;
     assert(offset == tot_offset);
@@ -615,11 +699,17 @@ int djinn_ctx_model::Deserialize(std::istream& stream) {
     // Deserialize bit-packed controller.
     uint8_t pack = 0;
     stream.read((char*)&pack, sizeof(uint8_t));
+    if (stream.good() == false || (pack & 7) != DJN_CTX_FORMAT_VERSION) return -1;
     use_pbwt = (pack >> 7) & 1;
     init = (pack >> 6) & 1;
+    pbwt_ctx = (pack >> 5) & 1;
+    dense = (pack >> 4) & 1;
+    gt_pbwt = (pack >> 3) & 1;
     unused = 0;
 
     stream.read((char*)&p_len, sizeof(uint32_t));
+    // Padded for range coder read-ahead.
+    if (djn_reserve(*this, (uint64_t)p_len + 65536) < 0) return -1;
     stream.read((char*)p, p_len);
 
     // Serialize each model.
@@ -645,6 +735,7 @@ int djinn_ctx_model::Deserialize(std::istream& stream) {
             ploidy_models.push_back(std::make_shared<djinn::djn_ctx_model_container_t>(n_s, pl, (bool)use_pbwt));
             ploidy_models.back()->Deserialize(stream);
         }
+        if (stream.fail()) return -1;
     }
 
     return stream.tellg();
@@ -653,17 +744,23 @@ int djinn_ctx_model::Deserialize(std::istream& stream) {
 /*======   Container   ======*/
 
 djn_ctx_model_container_t::djn_ctx_model_container_t(int64_t n_s, int pl, bool use_pbwt) : 
-    use_pbwt(use_pbwt),
+    use_pbwt(use_pbwt), pbwt_ctx(false), dense(false), gt_pbwt(false),
     ploidy(pl), n_samples(n_s), n_variants(0),
     n_samples_wah(std::ceil((float)n_samples / 32) * 32), 
     n_samples_wah_nm(std::ceil((float)n_samples * 4/32) * 8),
     n_wah(n_samples_wah_nm / 8),
-    wah_bitmaps(new uint32_t[n_wah]), 
-    p(new uint8_t[1000000]), p_len(0), p_cap(1000000), p_free(true),
+    wah_bitmaps(new uint32_t[n_wah]), div_bitmaps(nullptr), gt_buffer(nullptr),
+    phase_mode(DJN_PHASE_UNKNOWN), phase_bits(nullptr),
+    p(nullptr), p_len(0), p_cap(0), p_free(true),
     range_coder(std::make_shared<RangeCoder>()), 
     marchetype(std::make_shared<GeneralModel>(2, 1024, range_coder)),
+    mgt(std::make_shared<GeneralModel>(2, 4, 18, 8, range_coder)),
+    mphase(std::make_shared<GeneralModel>(4, 4, 18, 16, range_coder)),
+    mphase_bits(std::make_shared<GeneralModel>(256, 256, 18, 16, range_coder)),
     model_2mc(std::make_shared<djn_ctx_model_t>()),
-    model_nm(std::make_shared<djn_ctx_model_t>())
+    model_nm(std::make_shared<djn_ctx_model_t>()),
+    pbwt_gt(std::make_shared<PBWT>()),
+    n_alt_obs(0), max_symbol_obs(0)
 {
     assert(n_s % pl == 0); // #samples/#ploidy must be divisible
     model_2mc->Initiate2mc();
@@ -671,17 +768,23 @@ djn_ctx_model_container_t::djn_ctx_model_container_t(int64_t n_s, int pl, bool u
 }
 
 djn_ctx_model_container_t::djn_ctx_model_container_t(int64_t n_s, int pl, bool use_pbwt, uint8_t* src, uint32_t src_len) : 
-    use_pbwt(use_pbwt),
+    use_pbwt(use_pbwt), pbwt_ctx(false), dense(false), gt_pbwt(false),
     ploidy(pl), n_samples(n_s), n_variants(0),
     n_samples_wah(std::ceil((float)n_samples / 32) * 32), 
     n_samples_wah_nm(std::ceil((float)n_samples * 4/32) * 8),
     n_wah(n_samples_wah_nm / 8),
-    wah_bitmaps(new uint32_t[n_wah]), 
+    wah_bitmaps(new uint32_t[n_wah]), div_bitmaps(nullptr), gt_buffer(nullptr),
+    phase_mode(DJN_PHASE_UNKNOWN), phase_bits(nullptr),
     p(src), p_len(src_len), p_cap(0), p_free(false),
     range_coder(std::make_shared<RangeCoder>()), 
     marchetype(std::make_shared<GeneralModel>(2, 1024, range_coder)),
+    mgt(std::make_shared<GeneralModel>(2, 4, 18, 8, range_coder)),
+    mphase(std::make_shared<GeneralModel>(4, 4, 18, 16, range_coder)),
+    mphase_bits(std::make_shared<GeneralModel>(256, 256, 18, 16, range_coder)),
     model_2mc(std::make_shared<djn_ctx_model_t>()),
-    model_nm(std::make_shared<djn_ctx_model_t>())
+    model_nm(std::make_shared<djn_ctx_model_t>()),
+    pbwt_gt(std::make_shared<PBWT>()),
+    n_alt_obs(0), max_symbol_obs(0)
 {
     assert(n_s % pl == 0); // #samples/#ploidy must be divisible
     model_2mc->Initiate2mc();
@@ -689,8 +792,11 @@ djn_ctx_model_container_t::djn_ctx_model_container_t(int64_t n_s, int pl, bool u
 }
 
 djn_ctx_model_container_t::~djn_ctx_model_container_t() {
-    if (p_free) delete[] p;
+    djn_release(*this);
     delete[] wah_bitmaps;
+    delete[] div_bitmaps;
+    delete[] gt_buffer;
+    delete[] phase_bits;
 }
 
 void djn_ctx_model_container_t::StartEncoding(bool use_pbwt, bool reset) {
@@ -712,19 +818,37 @@ void djn_ctx_model_container_t::StartEncoding(bool use_pbwt, bool reset) {
             }
             model_nm->pbwt->Initiate(n_samples, 16);
         }
+        model_2mc->pbwt->EnableDivergence(pbwt_ctx);
     }
     this->use_pbwt = use_pbwt;
     n_variants = 0;
 
-    // Local range coder
+    // The genotype PBWT only applies to diploid data.
+    gt_pbwt = gt_pbwt && use_pbwt && ploidy == 2;
+    if (gt_pbwt) {
+        if (pbwt_gt->n_symbols == 0) pbwt_gt->Initiate(n_samples / 2, 4);
+        if (gt_buffer == nullptr) gt_buffer = new uint8_t[n_samples / 2];
+        pbwt_gt->EnableDivergence(pbwt_ctx);
+    }
+
+    // Local range coder. If the buffer cannot be allocated then the first
+    // Encode call fails as the range coder buffer is grown on demand.
+    djn_reserve(*this, DJN_SCRATCH_MIN_CAPACITY);
     range_coder->SetOutput(p);
     range_coder->StartEncode();
 
+    if (reset) {
+        marchetype->Reset();
+        mgt->Reset();
+        mphase->Reset();
+        mphase_bits->Reset();
+        if (pbwt_gt->n_symbols) pbwt_gt->Reset();
+    }
     model_2mc->StartEncoding(use_pbwt, reset);
     model_nm->StartEncoding(use_pbwt, reset);
 }
 
-size_t djn_ctx_model_container_t::FinishEncoding() {
+int64_t djn_ctx_model_container_t::FinishEncoding() {
     if (range_coder.get() == nullptr) return -1;
     range_coder->FinishEncode();
     model_2mc->FinishEncoding();
@@ -753,11 +877,21 @@ void djn_ctx_model_container_t::StartDecoding(bool use_pbwt, bool reset) {
             }
             model_nm->pbwt->Initiate(n_samples, 16);
         }
+        model_2mc->pbwt->EnableDivergence(pbwt_ctx);
+    }
+
+    // The genotype PBWT only applies to diploid data.
+    gt_pbwt = gt_pbwt && use_pbwt && ploidy == 2;
+    if (gt_pbwt) {
+        if (pbwt_gt->n_symbols == 0) pbwt_gt->Initiate(n_samples / 2, 4);
+        if (gt_buffer == nullptr) gt_buffer = new uint8_t[n_samples / 2];
+        pbwt_gt->EnableDivergence(pbwt_ctx);
     }
 
     if (reset) {
         model_2mc->reset();
         model_nm->reset();
+        if (pbwt_gt->n_symbols) pbwt_gt->Reset();
     } else {
         model_2mc->n_variants = 0;
         model_nm->n_variants  = 0;
@@ -771,6 +905,12 @@ void djn_ctx_model_container_t::StartDecoding(bool use_pbwt, bool reset) {
     range_coder->SetInput(p);
     range_coder->StartDecode();
 
+    if (reset) {
+        marchetype->Reset();
+        mgt->Reset();
+        mphase->Reset();
+        mphase_bits->Reset();
+    }
     model_2mc->StartDecoding(use_pbwt, reset);
     model_nm->StartDecoding(use_pbwt, reset);
 }
@@ -862,14 +1002,133 @@ int djn_ctx_model_container_t::EncodeNm(uint8_t* data, uint32_t len, const uint8
     return EncodeWahNm(wah_bitmaps, n_samples_wah_nm >> 3); // n_samples_wah_nm / 8
 }
 
+int djn_ctx_model_container_t::EncodePhase(const uint8_t* data, uint32_t len) {
+    uint8_t mode = DJN_PHASE_UNKNOWN;
+    if (data != nullptr) {
+        // Count phased separators: the first allele of every sample and
+        // end-of-vector markers have no preceding separator.
+        uint32_t n_sep = 0, n_phased = 0;
+        for (uint32_t i = 0; i < len; i += ploidy) {
+            for (int k = 1; k < ploidy; ++k) {
+                if ((data[i+k] >> 1) == 64) continue; // EOV
+                ++n_sep;
+                n_phased += data[i+k] & 1;
+            }
+        }
+        if (n_sep == 0) mode = DJN_PHASE_UNKNOWN;
+        else if (n_phased == n_sep) mode = DJN_PHASE_ALL;
+        else if (n_phased == 0) mode = DJN_PHASE_NONE;
+        else mode = DJN_PHASE_MIXED;
+    }
+
+    // Mixed phasing: one bit per haplotype packed into bytes. Every symbol
+    // emits at most four bytes from the range coder.
+    const uint32_t n_bytes = (len + 7) / 8;
+    if (mode == DJN_PHASE_MIXED) {
+        if (djn_reserve_range_coder(*this, 4*n_bytes + 16) < 0) return -4;
+    }
+
+    mphase->EncodeSymbol(mode);
+    if (mode != DJN_PHASE_MIXED) return mode;
+
+    for (uint32_t i = 0; i < n_bytes; ++i) {
+        uint8_t bits = 0;
+        for (uint32_t j = 8*i; j < len && j < 8*i + 8; ++j)
+            bits |= (data[j] & 1) << (j & 7);
+        mphase_bits->EncodeSymbol(bits);
+    }
+    return mode;
+}
+
+void djn_ctx_model_container_t::DecodePhase() {
+    phase_mode = mphase->DecodeSymbol();
+    if (phase_mode != DJN_PHASE_MIXED) return;
+
+    const uint32_t n_bytes = (n_samples + 7) / 8;
+    if (phase_bits == nullptr) phase_bits = new uint8_t[n_bytes];
+    for (uint32_t i = 0; i < n_bytes; ++i)
+        phase_bits[i] = mphase_bits->DecodeSymbol();
+}
+
+void djn_ctx_model_container_t::SetPhase(djinn_variant_t* variant) const {
+    variant->phased = phase_mode;
+    variant->phase_len = 0;
+    if (phase_mode != DJN_PHASE_MIXED) return;
+
+    const uint32_t n_bytes = (n_samples + 7) / 8;
+    if (n_bytes > variant->phase_alloc) {
+        delete[] variant->phase;
+        variant->phase_alloc = n_bytes + 1024;
+        variant->phase = new uint8_t[variant->phase_alloc];
+    }
+    memcpy(variant->phase, phase_bits, n_bytes);
+    variant->phase_len = n_bytes;
+}
+
+bool djn_ctx_model_container_t::PackGenotypes(const uint8_t* data, uint32_t len, bool bcf) {
+    if (gt_pbwt == false || gt_buffer == nullptr) return false;
+    if (len != n_samples) return false;
+    return bcf ? djn_gt_pack_bcf(data, len, gt_buffer) : djn_gt_pack(data, len, gt_buffer);
+}
+
+int djn_ctx_model_container_t::EncodeGt() {
+    if (gt_buffer == nullptr) return -1;
+    if (pbwt_gt->n_symbols == 0) return -2;
+
+    if (pbwt_ctx) UpdatePbwtContext(true);
+    pbwt_gt->Update(gt_buffer, 1);
+
+    memset(wah_bitmaps, 0, n_wah*sizeof(uint32_t));
+    for (int i = 0; i < pbwt_gt->n_samples; ++i) {
+        wah_bitmaps[i / 16] |= (uint32_t)DJN_GT_CODE[pbwt_gt->prev[i]] << (2*(i % 16));
+    }
+
+    return EncodeWah(wah_bitmaps, n_samples_wah >> 5); // n_samples_wah / 32
+}
+
+int djn_ctx_model_container_t::UnpermuteGt(const uint8_t* ewah_data, uint32_t len) {
+    if (gt_buffer == nullptr) return -1;
+
+    const uint32_t* ppa = pbwt_gt->ppa;
+    const int64_t n_gt = pbwt_gt->n_samples;
+    uint32_t n_obs[4] = {0}; // number of samples with each genotype symbol
+
+    uint32_t local_offset = 0;
+    int64_t j = 0;
+    while (local_offset < len) {
+        const djinn_ewah_t* ewah = (const djinn_ewah_t*)&ewah_data[local_offset];
+        local_offset += sizeof(djinn_ewah_t);
+
+        // Clean words.
+        const uint8_t gt = DJN_GT_FROM_CODE[(ewah->ref & 1) ? 3 : 0];
+        const int64_t to = j + ewah->clean*16 > n_gt ? n_gt : j + ewah->clean*16;
+        n_obs[gt] += to - j;
+        for (/**/; j < to; ++j) gt_buffer[ppa[j]] = gt;
+
+        for (int i = 0; i < ewah->dirty; ++i) {
+            uint32_t dirty = *((const uint32_t*)&ewah_data[local_offset]); // copy
+            for (int k = 0; k < 16 && j < n_gt; ++k, ++j) {
+                gt_buffer[ppa[j]] = DJN_GT_FROM_CODE[dirty & 3];
+                ++n_obs[gt_buffer[ppa[j]]];
+                dirty >>= 2;
+            }
+            local_offset += sizeof(uint32_t);
+        }
+    }
+    assert(j == n_gt);
+    djn_gt_counts(n_obs, n_alt_obs, max_symbol_obs);
+
+    pbwt_gt->Update(gt_buffer, 1);
+    return 1;
+}
+
 int djn_ctx_model_container_t::DecodeRaw_nm(uint8_t* data, uint32_t& len) {
     if (data == nullptr) return -1;
 
     int64_t n_samples_obs = 0;
     int objects = 0;
-
-    // Compute als
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
+    n_alt_obs = 0;
+    max_symbol_obs = 0;
 
     // Emit empty EWAH marker.
     djinn_ewah_t* ewah = (djinn_ewah_t*)&data[len]; 
@@ -883,12 +1142,10 @@ int djn_ctx_model_container_t::DecodeRaw_nm(uint8_t* data, uint32_t& len) {
             uint32_t* t = (uint32_t*)&data[len];
             for (int i = 0; i < 4; ++i) {
                 data[len] = model_nm->dirty_wah->DecodeSymbol();
-                uint8_t r = data[len]; // copy
+                const uint8_t r = data[len]; // copy
                 ++len;
-                for (int j = 0; j < 2; ++j) {
-                    ++hist_alts[r & 15];
-                    r >>= 4;
-                }
+                if ((r & 15) > max_symbol_obs) max_symbol_obs = r & 15;
+                if ((r >> 4) > max_symbol_obs) max_symbol_obs = r >> 4;
             }
             
             n_samples_obs += 8;
@@ -904,61 +1161,43 @@ int djn_ctx_model_container_t::DecodeRaw_nm(uint8_t* data, uint32_t& len) {
 
             // Decode an RLE
             uint32_t ref = 1; uint32_t len = 1;
-            DecodeWahRLE_nm(ref, len, model_nm);
+            if (DecodeWahRLE_nm(ref, len, model_nm) < 0) return -2;
             ewah->ref   = ref & 15;
             ewah->clean = len;
-            hist_alts[ref & 15] += len*8;
+            if (len && (ref & 15) > max_symbol_obs) max_symbol_obs = ref & 15;
 
             n_samples_obs += ewah->clean*8;
         }
 
-        if (n_samples_obs == n_samples_wah_nm) {
-            // std::cerr << "[djn_ctx_model_container_t::DecodeRaw_nm] obs=" << n_samples_obs << "/" << n_samples_wah_nm << std::endl;
-            break;
-        }
+        if (n_samples_obs == n_samples_wah_nm) break;
         
-        if (n_samples_obs > n_samples_wah_nm) {
-            std::cerr << "[djn_ctx_model_container_t::DecodeRaw_nm] Decompression corruption: " << n_samples_obs << "/" << n_samples_wah_nm  << std::endl;
-            exit(1);
-        }
+        // Decompression corruption.
+        if (n_samples_obs > n_samples_wah_nm) return -2;
     }
 
     if (ewah->clean || ewah->dirty) {
         ++objects;
     }
 
-    uint32_t n_alts_obs = 0;
-    // std::cerr << "alts=";
-    for (int i = 0; i < 256; ++i) {
-        // if (hist_alts[i]) std::cerr << i << ":" << hist_alts[i] << ",";
-        n_alts_obs += hist_alts[i];
-    }
-    // std::cerr << " n_alts_obs=" << n_alts_obs << "/" << n_samples_wah_nm << std::endl;
-    assert(n_alts_obs == n_samples_wah_nm);
-
     return objects;
 }
 
 int djn_ctx_model_container_t::EncodeWah(uint32_t* wah, uint32_t len) { // input WAH-encoded data
     if (wah == nullptr) return -1;
+    if (dense) {
+        if (djn_reserve_range_coder(*model_2mc, n_samples + 16*len) < 0) return -2;
+        const bool is_dense = IsDense(wah, len);
+        model_2mc->mdense->EncodeSymbol(is_dense);
+        if (is_dense) return EncodeWahDense(wah, len);
+    }
+    if (use_pbwt && pbwt_ctx) return EncodeWahPbwt(wah, len);
     ++model_2mc->n_variants;
 
     uint32_t wah_ref = wah[0];
     uint32_t wah_run = 1;
 
     // Resize if necessary.
-    if (model_2mc->range_coder->OutSize() + n_samples > model_2mc->p_cap) {
-        const uint32_t rc_size = model_2mc->range_coder->OutSize();
-        std::cerr << "[djn_ctx_model_container_t::EncodeWah][RESIZE] resizing from: " << rc_size << "->" << (rc_size + 2*n_samples + 65536) << std::endl;
-        uint8_t* prev = model_2mc->p; // old
-        model_2mc->p_cap = rc_size + 2*n_samples + 65536;
-        model_2mc->p = new uint8_t[model_2mc->p_cap];
-        memcpy(model_2mc->p, prev, rc_size);
-        if (model_2mc->p_free) delete[] prev;
-        model_2mc->p_free = true;
-        model_2mc->range_coder->out_buf = model_2mc->p + rc_size; 
-        model_2mc->range_coder->in_buf  = model_2mc->p;
-    }
+    if (djn_reserve_range_coder(*model_2mc, n_samples + 16*len) < 0) return -2;
 
     for (int i = 1; i < len; ++i) {
         if ((wah_ref != 0 && wah_ref != std::numeric_limits<uint32_t>::max()) || (wah_ref != wah[i])) {
@@ -998,26 +1237,121 @@ int djn_ctx_model_container_t::EncodeWah(uint32_t* wah, uint32_t len) { // input
     return 1;
 }
 
+void djn_ctx_model_container_t::UpdatePbwtContext(bool gt) {
+    const PBWT& pbwt = gt ? *pbwt_gt : *model_2mc->pbwt;
+    assert(pbwt.has_divergence());
+
+    const uint32_t n_words = n_samples_wah >> 5; // n_samples_wah / 32
+    if (div_bitmaps == nullptr) div_bitmaps = new uint32_t[n_words];
+    memset(div_bitmaps, 0, n_words*sizeof(uint32_t));
+
+    // Genotypes occupy two bits each.
+    const uint32_t mask = gt ? 3 : 1;
+    const int stride = gt ? 2 : 1;
+    for (int i = 0; i < pbwt.n_samples; ++i) {
+        if (pbwt.MatchLength(i) < DJN_CTX_PBWT_MATCH)
+            div_bitmaps[(i*stride) / 32] |= mask << ((i*stride) % 32);
+    }
+}
+
+int djn_ctx_model_container_t::EncodeWahPbwt(uint32_t* wah, uint32_t len) { // input WAH-encoded data
+    if (wah == nullptr) return -1;
+    if (div_bitmaps == nullptr) return -3;
+    ++model_2mc->n_variants;
+
+    // Resize if necessary.
+    if (djn_reserve_range_coder(*model_2mc, n_samples + 16*len) < 0) return -2;
+
+    // Objects are emitted as in EncodeWah. The contexts are the allele
+    // preceding the current position (last) and the positions flagged in
+    // div_bitmaps: without flagged positions a word is expected to repeat
+    // the preceding allele.
+    uint32_t last = 0;
+    uint32_t wah_ref = wah[0];
+    uint32_t wah_run = 1;
+
+    for (uint32_t i = 1; i <= len; ++i) {
+        const bool dirty = (wah_ref != 0 && wah_ref != std::numeric_limits<uint32_t>::max());
+        if (i < len && dirty == false && wah_ref == wah[i]) {
+            ++wah_run;
+            continue;
+        }
+
+        // Emit the object ending before word i.
+        const uint32_t start = i - wah_run;
+        model_2mc->mtype->model_context <<= 1;
+        model_2mc->mtype->model_context |= (div_bitmaps[start] != 0);
+        model_2mc->mtype->model_context &= model_2mc->mtype->model_ctx_mask;
+
+        if (dirty || wah_run == 1) {
+            model_2mc->mtype->EncodeSymbol(0);
+
+            uint32_t mask = div_bitmaps[start];
+            for (int j = 0; j < 4; ++j) {
+                model_2mc->dirty_pbwt->model_context = (last << 8) | (mask & 255);
+                model_2mc->dirty_pbwt->EncodeSymbolNoUpdate(wah_ref & 255);
+                last = (wah_ref >> 7) & 1;
+                wah_ref >>= 8;
+                mask >>= 8;
+            }
+        } else {
+            model_2mc->mtype->EncodeSymbol(1);
+            model_2mc->mref->model_context <<= 1;
+            model_2mc->mref->model_context |= last;
+            model_2mc->mref->model_context &= model_2mc->mref->model_ctx_mask;
+            EncodeWahRLE(wah_ref, wah_run, model_2mc);
+            last = wah_ref & 1;
+        }
+
+        if (i < len) {
+            wah_ref = wah[i];
+            wah_run = 1;
+        }
+    }
+
+    ++n_variants;
+    return 1;
+}
+
+bool djn_ctx_model_container_t::IsDense(const uint32_t* wah, uint32_t len) const {
+    uint32_t n_dirty = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+        n_dirty += (wah[i] != 0 && wah[i] != std::numeric_limits<uint32_t>::max());
+    }
+    return 8*n_dirty >= DJN_CTX_DENSE_DIRTY*len;
+}
+
+int djn_ctx_model_container_t::EncodeWahDense(uint32_t* wah, uint32_t len) { // input WAH-encoded data
+    if (wah == nullptr) return -1;
+    ++model_2mc->n_variants;
+
+    // Resize if necessary.
+    if (djn_reserve_range_coder(*model_2mc, n_samples + 16*len) < 0) return -2;
+
+    // Every bit is coded given the 12 preceding bits and, if available, the
+    // divergence flag of its position.
+    const bool use_div = (use_pbwt && pbwt_ctx && div_bitmaps != nullptr);
+    uint32_t hist = 0;
+    for (int i = 0; i < n_samples; ++i) {
+        const uint32_t bit = (wah[i >> 5] >> (i & 31)) & 1;
+        uint32_t ctx = hist & 4095;
+        if (use_div) ctx |= ((div_bitmaps[i >> 5] >> (i & 31)) & 1) << 12;
+        model_2mc->dense_bits->model_context = ctx;
+        model_2mc->dense_bits->EncodeSymbolNoUpdate(bit);
+        hist = (hist << 1) | bit;
+    }
+
+    ++n_variants;
+    return 1;
+}
+
 int djn_ctx_model_container_t::EncodeWahNm(uint32_t* wah, uint32_t len) { // input WAH-encoded data
     if (wah == nullptr) return -1;
 
     ++model_nm->n_variants;
 
     // Resize if necessary.
-    // std::cerr << "[djn_ctx_model_container_t::EncodeWahNm] " << model_nm->range_coder->OutSize() << "/" << model_nm->p_cap << std::endl;
-    if (model_nm->range_coder->OutSize() + n_samples > model_nm->p_cap) {
-        const uint32_t rc_size = model_nm->range_coder->OutSize();
-        std::cerr << "[djn_ctx_model_container_t::EncodeWahNm][RESIZE] resizing from: " 
-            << rc_size << "->" << (rc_size + 2*n_samples + 65536) << std::endl;
-        uint8_t* prev = model_nm->p; // old
-        model_nm->p_cap = rc_size + 2*n_samples + 65536;
-        model_nm->p = new uint8_t[model_nm->p_cap];
-        memcpy(model_nm->p, prev, rc_size);
-        if (model_nm->p_free) delete[] prev;
-        model_nm->p_free = true;
-        model_nm->range_coder->out_buf = model_nm->p + rc_size; 
-        model_nm->range_coder->in_buf  = model_nm->p;
-    }
+    if (djn_reserve_range_coder(*model_nm, n_samples + 16*len) < 0) return -2;
 
     // Debug
     uint32_t n_objs = 1;
@@ -1229,10 +1563,8 @@ int djn_ctx_model_container_t::DecodeWahRLE(uint32_t& ref, uint32_t& len, std::s
     ref = model->mref->DecodeSymbol();
     uint32_t log_length = model->mlog_rle->DecodeSymbol();
 
-    if (log_length < 2) {
-        // std::cerr << "single=" << len << "," << (ref&1) << std::endl;
-        exit(1);
-    }
+    // Runs are at least two words long.
+    if (log_length < 2) return -2;
     else if (log_length <= 8) {
         model->mrle->model_context <<= 1;
         model->mrle->model_context |= (ref & 1);
@@ -1341,22 +1673,35 @@ int djn_ctx_model_container_t::DecodeNext(uint8_t* ewah_data, uint32_t& ret_ewah
     if (ewah_data == nullptr)  return -1;
     if (ret_buffer == nullptr) return -2;
 
-    // Decode stream archetype.
+    // Decode site phasing and stream archetype.
+    DecodePhase();
     uint8_t type = marchetype->DecodeSymbol();
 
     size_t ret_ewah_init = ret_ewah;
     int objs = 0;
+
+    // Genotypes are permuted with the genotype PBWT.
+    if (type == 0 && gt_pbwt && mgt->DecodeSymbol()) {
+        objs = DecodeRaw(ewah_data, ret_ewah, true);
+        if (objs <= 0) return -1;
+        if (UnpermuteGt(&ewah_data[ret_ewah_init], ret_ewah - ret_ewah_init) <= 0) return -1;
+
+        djn_gt_unpack(gt_buffer, pbwt_gt->n_samples, ret_buffer);
+        ret_len = n_samples;
+        return objs;
+    }
+
     switch(type) {
     case 0: objs = DecodeRaw(ewah_data, ret_ewah); break;
     case 1: objs = DecodeRaw_nm(ewah_data, ret_ewah); break;
-    default: std::cerr << "[djn_ctx_model_container_t::DecodeNext] decoding error: " << (int)type << " (valid=[0,1])" << std::endl; return -1;
+    default: return -1; // corrupted archetype
     }
 
     if (objs <= 0) return -1;
 
     if (use_pbwt) {
         if (type == 0) {
-            if (hist_alts[1] >= 10) {
+            if (n_alt_obs >= 10) {
                 model_2mc->pbwt->ReverseUpdateEWAH(ewah_data, ret_ewah, ret_buffer); 
                 ret_len = n_samples;
             } else {
@@ -1470,17 +1815,56 @@ int djn_ctx_model_container_t::DecodeNext(uint8_t* ewah_data, uint32_t& ret_ewah
 int djn_ctx_model_container_t::DecodeNextRaw(uint8_t* data, uint32_t& len) {
     if (data == nullptr) return -1;
    
-    // Decode stream archetype.
+    // Decode site phasing and stream archetype.
+    DecodePhase();
     uint8_t type = marchetype->DecodeSymbol();
 
+    const uint32_t start = len;
+    int ret = 0;
     switch(type) {
-    case 0: return(DecodeRaw(data, len)); break;
+    case 0:
+        if (gt_pbwt && mgt->DecodeSymbol()) return(DecodeRawGt(data, len));
+        ret = DecodeRaw(data, len);
+        break;
     case 1: return(DecodeRaw_nm(data, len)); break;
-    default: std::cerr << "[djn_ctx_model_container_t::DecodeNextRaw] decoding error: " << (int)type << " (valid=[0,1])" << std::endl; return -1;
+    default: return -1; // corrupted archetype
+    }
+
+    // Contexts conditioned on the divergence array require the PBWT
+    // to follow the decoded stream.
+    if (ret > 0 && use_pbwt && pbwt_ctx && n_alt_obs >= 10)
+        model_2mc->pbwt->ReverseUpdateEWAH(&data[start], len - start);
+
+    return ret;
+}
+
+int djn_ctx_model_container_t::DecodeRawGt(uint8_t* data, uint32_t& len) {
+    if (data == nullptr) return -1;
+    if (gt_pbwt == false) return -2;
+
+    // The permuted genotypes are decoded into the output buffer and are
+    // overwritten once the genotype PBWT has restored the sample order.
+    const uint32_t start = len;
+    if (DecodeRaw(data, len, true) <= 0) return -3;
+    if (UnpermuteGt(&data[start], len - start) <= 0) return -3;
+    len = start;
+
+    // Haplotypes are returned as a single object of dirty 4-bit words.
+    const uint32_t n_words = n_samples_wah_nm >> 3; // n_samples_wah_nm / 8
+    djinn_ewah_t* ewah = (djinn_ewah_t*)&data[len];
+    ewah->reset();
+    ewah->dirty = n_words;
+    len += sizeof(djinn_ewah_t);
+
+    uint32_t* words = (uint32_t*)&data[len];
+    memset(words, 0, n_words*sizeof(uint32_t));
+    for (int i = 0; i < pbwt_gt->n_samples; ++i) {
+        const uint8_t* alleles = DJN_GT_ALLELES[gt_buffer[i]];
+        words[i / 4] |= (uint32_t)(alleles[0] | (alleles[1] << 4)) << (8*(i % 4));
     }
+    len += n_words*sizeof(uint32_t);
 
-    // Never reached.
-    return -3;
+    return 1;
 }
 
 int djn_ctx_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
@@ -1500,22 +1884,32 @@ int djn_ctx_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
     variant->data_len = 0;
     variant->errcode  = 0;
     variant->unpacked = DJN_UN_EWAH;
+    variant->phased   = DJN_PHASE_UNKNOWN;
     variant->n_allele = 0;
 
-    // Decode stream archetype.
+    // Decode site phasing and stream archetype.
+    DecodePhase();
     uint8_t type = marchetype->DecodeSymbol();
 
     int ret = 0;
+    bool gt = false;
     switch(type) {
-    case 0: ret = DecodeRaw(variant->data, variant->data_len);    break;
+    case 0:
+        gt = gt_pbwt && mgt->DecodeSymbol();
+        ret = gt ? DecodeRawGt(variant->data, variant->data_len) : DecodeRaw(variant->data, variant->data_len);
+        break;
     case 1: ret = DecodeRaw_nm(variant->data, variant->data_len); break;
-    default: std::cerr << "[djn_ctx_model_container_t::DecodeNextRaw] decoding error: " << (int)type << " (valid=[0,1])" << std::endl; return -1;
+    default: return -1; // corrupted archetype
     }
 
     if (ret <= 0) {
         variant->errcode = 1;
         return ret;
     }
+    SetPhase(variant);
+
+    if (type == 0 && !gt && use_pbwt && pbwt_ctx && n_alt_obs >= 10)
+        model_2mc->pbwt->ReverseUpdateEWAH(variant->data, variant->data_len);
 
     if (variant->d == nullptr) {
         variant->d = new djn_variant_dec_t;
@@ -1537,7 +1931,7 @@ int djn_ctx_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
     variant->d->n_ewah  = 0;
     variant->d->n_dirty = 0;
     // Set bitmap type.
-    variant->d->dirty_type = type;
+    variant->d->dirty_type = gt ? DJN_DIRTY_NM : type; // genotypes are returned as NM
     variant->d->n_samples  = n_samples;
 
     // Construct EWAH mapping
@@ -1567,21 +1961,17 @@ int djn_ctx_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
     }
     assert(ret_pos == n_samples);
 
-    // Compute number of alleles.
-    uint32_t max_allele = 0;
-    for (int i = 0; i < 256; ++i) {
-        max_allele = hist_alts[i] != 0 ? i : max_allele;
-        // if (tgt_container->hist_alts[i]) std::cerr << i << ":" << tgt_container->hist_alts[i] << ",";
-    }
-    // std::cerr << " max=" << max_allele << std::endl;
-    variant->n_allele = max_allele + 1;
+    variant->n_allele = max_symbol_obs + 1;
 
     return ret;
 }
 
 // Return raw, potentially permuted, EWAH encoding
-int djn_ctx_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len) {
+int djn_ctx_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len, bool gt) {
     if (data == nullptr) return -1;
+    if (use_pbwt && pbwt_ctx) UpdatePbwtContext(gt);
+    if (dense && model_2mc->mdense->DecodeSymbol()) return DecodeRawDense(data, len);
+    if (use_pbwt && pbwt_ctx) return DecodeRawPbwt(data, len);
 
     int64_t n_samples_obs = 0;
     int objects = 0;
@@ -1591,8 +1981,7 @@ int djn_ctx_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len) {
     ewah->reset();
     len += sizeof(djinn_ewah_t);
 
-    // Compute als
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
+    n_alt_obs = 0;
 
     while(true) {
         uint8_t type = model_2mc->mtype->DecodeSymbol();
@@ -1605,8 +1994,7 @@ int djn_ctx_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len) {
                 data[len] = model_2mc->dirty_wah->DecodeSymbol();
                 ++len;
             }
-            hist_alts[0] += __builtin_popcount(~(*c));
-            hist_alts[1] += __builtin_popcount(*c);
+            n_alt_obs += __builtin_popcount(*c);
             n_samples_obs += 32;
 
         } else { // is RLE
@@ -1620,42 +2008,136 @@ int djn_ctx_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len) {
 
             // Decode an RLE
             uint32_t ref = 1; uint32_t len = 1;
-            DecodeWahRLE(ref, len, model_2mc);
+            if (DecodeWahRLE(ref, len, model_2mc) < 0) return -2;
             ewah->ref = ref & 1;
             ewah->clean = len;
-            hist_alts[ewah->ref] += ewah->clean * 32;
+            n_alt_obs += ewah->ref * ewah->clean * 32;
 
             n_samples_obs += len*32;
         }
 
-        if (n_samples_obs == n_samples_wah) {
-            // std::cerr << "obs=" << n_samples_obs << "/" << n_samples_wah << std::endl;
-            break;
-        }
+        if (n_samples_obs == n_samples_wah) break;
 
-        if (n_samples_obs > n_samples_wah) {
-            std::cerr << "[djn_ctx_model_container_t::DecodeNextRaw] Decompression corruption: " << n_samples_obs << "/" << n_samples_wah  << std::endl;
-            exit(1);
-        }
+        // Decompression corruption.
+        if (n_samples_obs > n_samples_wah) return -2;
     }
 
     if (ewah->clean > 0 || ewah->dirty > 0) {
         ++objects;
-        // hist_alts[ewah->ref] += ewah->clean * 32;
     }
+    max_symbol_obs = (n_alt_obs != 0);
+
+    return objects;
+}
+
+int djn_ctx_model_container_t::DecodeRawPbwt(uint8_t* data, uint32_t& len) {
+    if (data == nullptr) return -1;
+    if (div_bitmaps == nullptr) return -3;
 
-    uint32_t n_alts_obs = 0;
-    // std::cerr << "alts=";
-    for (int i = 0; i < 256; ++i) {
-        // if (hist_alts[i]) std::cerr << i << ":" << hist_alts[i] << ",";
-        n_alts_obs += hist_alts[i];
+    int64_t n_samples_obs = 0;
+    int objects = 0;
+    uint32_t last = 0; // allele preceding the current position
+
+    // Emit empty EWAH marker.
+    djinn_ewah_t* ewah = (djinn_ewah_t*)&data[len]; 
+    ewah->reset();
+    len += sizeof(djinn_ewah_t);
+
+    n_alt_obs = 0;
+
+    while(true) {
+        const uint32_t start = n_samples_obs >> 5; // current word
+        model_2mc->mtype->model_context <<= 1;
+        model_2mc->mtype->model_context |= (div_bitmaps[start] != 0);
+        model_2mc->mtype->model_context &= model_2mc->mtype->model_ctx_mask;
+        uint8_t type = model_2mc->mtype->DecodeSymbol();
+
+        if (type == 0) { // bitmaps
+            ++ewah->dirty;
+
+            uint32_t* c = (uint32_t*)&data[len]; // pointer to data
+            uint32_t mask = div_bitmaps[start];
+            for (int i = 0; i < 4; ++i) {
+                model_2mc->dirty_pbwt->model_context = (last << 8) | (mask & 255);
+                data[len] = model_2mc->dirty_pbwt->DecodeSymbolNoUpdate();
+                last = (data[len] >> 7) & 1;
+                mask >>= 8;
+                ++len;
+            }
+            n_alt_obs += __builtin_popcount(*c);
+            n_samples_obs += 32;
+
+        } else { // is RLE
+            // Emit new EWAH marker
+            if (ewah->clean > 0 || ewah->dirty > 0) {
+                ewah = (djinn_ewah_t*)&data[len];
+                ewah->reset();
+                len += sizeof(djinn_ewah_t);
+                ++objects;
+            }
+
+            // Decode an RLE
+            model_2mc->mref->model_context <<= 1;
+            model_2mc->mref->model_context |= last;
+            model_2mc->mref->model_context &= model_2mc->mref->model_ctx_mask;
+            uint32_t ref = 1; uint32_t len = 1;
+            if (DecodeWahRLE(ref, len, model_2mc) < 0) return -2;
+            ewah->ref = ref & 1;
+            ewah->clean = len;
+            n_alt_obs += ewah->ref * ewah->clean * 32;
+            last = ref & 1;
+
+            n_samples_obs += len*32;
+        }
+
+        if (n_samples_obs == n_samples_wah) break;
+
+        // Decompression corruption.
+        if (n_samples_obs > n_samples_wah) return -2;
     }
-    // std::cerr << " n_alts_obs=" << n_alts_obs << "/" << n_samples_wah << std::endl;
-    assert(n_alts_obs == n_samples_wah);
+
+    if (ewah->clean > 0 || ewah->dirty > 0) {
+        ++objects;
+    }
+    max_symbol_obs = (n_alt_obs != 0);
 
     return objects;
 }
 
+int djn_ctx_model_container_t::DecodeRawDense(uint8_t* data, uint32_t& len) {
+    if (data == nullptr) return -1;
+
+    // Bits are returned as a single object of dirty words.
+    const uint32_t n_words = n_samples_wah >> 5; // n_samples_wah / 32
+    djinn_ewah_t* ewah = (djinn_ewah_t*)&data[len]; 
+    ewah->reset();
+    ewah->dirty = n_words;
+    len += sizeof(djinn_ewah_t);
+
+    uint32_t* wah = (uint32_t*)&data[len];
+    memset(wah, 0, n_words*sizeof(uint32_t));
+
+    const bool use_div = (use_pbwt && pbwt_ctx && div_bitmaps != nullptr);
+    uint32_t hist = 0;
+    for (int i = 0; i < n_samples; ++i) {
+        uint32_t ctx = hist & 4095;
+        if (use_div) ctx |= ((div_bitmaps[i >> 5] >> (i & 31)) & 1) << 12;
+        model_2mc->dense_bits->model_context = ctx;
+        const uint32_t bit = model_2mc->dense_bits->DecodeSymbolNoUpdate();
+        wah[i >> 5] |= bit << (i & 31);
+        hist = (hist << 1) | bit;
+    }
+    len += n_words*sizeof(uint32_t);
+
+    n_alt_obs = 0;
+    for (uint32_t i = 0; i < n_words; ++i) {
+        n_alt_obs += __builtin_popcount(wah[i]);
+    }
+    max_symbol_obs = (n_alt_obs != 0);
+
+    return 1;
+}
+
 int djn_ctx_model_container_t::Serialize(uint8_t* dst) const {
     // Serialize as (int,uint32_t,uint32_t,uint8_t*,ctx1,ctx2):
     // ploidy,n_samples,n_variants,p_len,p,model_2mc,model_nm
@@ -1714,20 +2196,18 @@ int djn_ctx_model_container_t::Deserialize(uint8_t* dst) {
     p_len = *((uint32_t*)&dst[offset]);
     offset += sizeof(uint32_t);
 
-    // initiate a buffer if there is none or it's too small
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
-    }
+    // initiate a buffer if there is none or it's too small: padded for 
+    // range coder read-ahead
+    if (djn_reserve(*this, (uint64_t)p_len + 65536) < 0) return -1;
 
     memcpy(p, &dst[offset], p_len); // data
     offset += p_len;
-    // Todo objects
-    offset += model_2mc->Deserialize(&dst[offset]);
-    offset += model_nm->Deserialize(&dst[offset]);
+    int ret = model_2mc->Deserialize(&dst[offset]);
+    if (ret < 0) return ret;
+    offset += ret;
+    ret = model_nm->Deserialize(&dst[offset]);
+    if (ret < 0) return ret;
+    offset += ret;
 
     return(offset);
 }
@@ -1742,18 +2222,17 @@ int djn_ctx_model_container_t::Deserialize(std::istream& stream) {
     stream.read((char*)&n_variants, sizeof(uint32_t));
     stream.read((char*)&p_len, sizeof(uint32_t));
     
-    // initiate a buffer if there is none or it's too small
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
+    // initiate a buffer if there is none or it's too small: padded for 
+    // range coder read-ahead
+    if (djn_reserve(*this, (uint64_t)p_len + 65536) < 0) {
+        stream.setstate(std::ios::failbit);
+        return -1;
     }
 
     stream.read((char*)p, p_len);
     model_2mc->Deserialize(stream);
     model_nm->Deserialize(stream);
+    if (stream.fail()) return -1;
     return stream.tellg();
 }
 
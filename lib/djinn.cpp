@@ -1,16 +1,81 @@
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "djinn.h"
+#include "scratch.h"
 
 namespace djinn {
 
+void SetScratchMemoryLimit(uint64_t max_bytes) {
+    djn_scratch_limit() = max_bytes;
+}
+
+uint64_t GetScratchMemoryUsage() {
+    return djn_scratch_usage().load();
+}
+
+int djinn_model::EncodeBcfBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded) {
+    if (n_encoded != nullptr) *n_encoded = 0;
+    if (data == nullptr || ploidy == nullptr || alt_alleles == nullptr) return -2;
+    for (uint32_t i = 0; i < n_rows; ++i) {
+        int ret = EncodeBcf(&data[(uint64_t)i * len_data], len_data, ploidy[i], alt_alleles[i]);
+        if (ret <= 0) return ret < 0 ? ret : -1;
+        if (n_encoded != nullptr) ++(*n_encoded);
+    }
+    return n_rows;
+}
+
+int djinn_model::EncodeBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded) {
+    if (n_encoded != nullptr) *n_encoded = 0;
+    if (data == nullptr || ploidy == nullptr || alt_alleles == nullptr) return -2;
+    for (uint32_t i = 0; i < n_rows; ++i) {
+        int ret = Encode(&data[(uint64_t)i * len_data], len_data, ploidy[i], alt_alleles[i]);
+        if (ret <= 0) return ret < 0 ? ret : -1;
+        if (n_encoded != nullptr) ++(*n_encoded);
+    }
+    return n_rows;
+}
+
+int djinn_model::Merge(djinn_model& model1, djinn_model& model2) {
+    if (model1.n_variants != model2.n_variants) return -1;
+    if (model1.StartDecoding() < 0 || model2.StartDecoding() < 0) return -2;
+
+    djinn_variant_t* v1 = nullptr;
+    djinn_variant_t* v2 = nullptr;
+    std::vector<uint8_t> gt;
+    int ret = model1.n_variants;
+    for (uint32_t i = 0; i < model1.n_variants; ++i) {
+        if (model1.DecodeNext(v1) <= 0 || model2.DecodeNext(v2) <= 0) { ret = -2; break; }
+        if (v1->Merge(*v2) < 0) { ret = -3; break; }
+
+        // Decoded allele counts include the missing and EOV symbols.
+        uint8_t max_allele = 0;
+        for (uint32_t j = 0; j < v1->data_len; ++j) {
+            if (v1->data[j] < DJN_ALLELE_MISSING && v1->data[j] > max_allele) max_allele = v1->data[j];
+        }
+
+        if (gt.size() < v1->data_len) gt.resize(v1->data_len);
+        const int len = v1->ToBcf(gt.data());
+        if (EncodeBcf(gt.data(), len, v1->ploidy, max_allele + 1) <= 0) { ret = -4; break; }
+    }
+
+    delete v1;
+    delete v2;
+    return ret;
+}
+
 djinn_variant_t::djinn_variant_t() : 
     ploidy(0), n_allele(0), data(nullptr), data_len(0), 
     data_alloc(0), data_free(false), errcode(0), 
-    unpacked(0), d(nullptr) 
+    unpacked(0), d(nullptr), phased(DJN_PHASE_UNKNOWN),
+    phase(nullptr), phase_len(0), phase_alloc(0)
 {}
 
 djinn_variant_t::~djinn_variant_t() {
     if (data_free) delete[] data;
     delete d;
+    delete[] phase;
 }
 
 int djinn_variant_t::ToVcfDebug(char* out, const char phasing) const {
@@ -24,79 +89,451 @@ int djinn_variant_t::ToVcfDebug(char* out, const char phasing) const {
     return ret;
 }
 
+/*======   VCF genotype formatting   ======*/
+
+// Text for internal allele symbols: allele indices, missing ('.'), and the
+// end-of-vector marker that is omitted from the output.
+static const char DJN_VCF_ALLELE_TEXT[16][3] = 
+    {"0","1","2","3","4","5","6","7","8","9","10","11","12","13",".",""};
+static const uint8_t DJN_VCF_ALLELE_LEN[16] = 
+    {1,1,1,1,1,1,1,1,1,1,2,2,2,2,1,0};
+
+// Every haplotype with a single-character allele (0-9 or missing) is emitted
+// as a 2-byte unit: the allele character followed by either the phasing
+// separator or, for the last haplotype of a sample, a tab. The output is
+// therefore periodic in the ploidy and whole runs of haplotypes can be
+// formatted by adding allele characters to a precomputed separator pattern.
+// Variants with multi-digit alleles or end-of-vector markers use the general
+// path. The trailing tab of the last sample is replaced by a newline.
+#define DJN_VCF_PATTERN_HAPLOTYPES 32
+
+struct djn_vcf_formatter_t {
+    djn_vcf_formatter_t(int ploidy, char phasing, const uint8_t* phase) : 
+        ploidy(ploidy <= 0 ? 1 : ploidy), phase(0), n_hap(0), n_written(0),
+        phasing(phasing), phase_bits(phase)
+    {
+        // Separator pattern for 32 haplotypes with '0' as allele character.
+        // Only valid as a whole when the ploidy divides the number of
+        // haplotypes formatted at once.
+        for (int i = 0; i < DJN_VCF_PATTERN_HAPLOTYPES; ++i) {
+            pattern[2*i+0] = '0';
+            pattern[2*i+1] = ((i + 1) % this->ploidy == 0) ? '\t' : phasing;
+        }
+    }
+
+    // Returns true if runs of n haplotypes starting at a sample boundary end
+    // at a sample boundary.
+    inline bool Aligned(uint32_t n) const { return (n % ploidy) == 0; }
+
+    // Returns true if the symbol is written as a single character.
+    static inline bool Simple(uint8_t sym) { return sym < 10 || sym == DJN_ALLELE_MISSING; }
+
+    // Returns true if all 4-bit symbols packed in a word are written as a
+    // single character.
+    static inline bool SimpleNm(uint32_t word) {
+        const uint32_t b0 =  word       & 0x11111111;
+        const uint32_t b1 = (word >> 1) & 0x11111111;
+        const uint32_t b2 = (word >> 2) & 0x11111111;
+        const uint32_t b3 = (word >> 3) & 0x11111111;
+        const uint32_t ge10 = b3 & (b2 | b1);
+        const uint32_t eq14 = b3 & b2 & b1 & ~b0;
+        return (ge10 & ~eq14) == 0;
+    }
+
+    // Returns true if all byte literals are written as a single character.
+    static bool SimpleBytes(const uint8_t* data, uint32_t len) {
+        uint32_t i = 0;
+#if defined(__SSE2__)
+        const __m128i ten = _mm_set1_epi8(10);
+        const __m128i mis = _mm_set1_epi8(DJN_ALLELE_MISSING);
+        for (/**/; i + 16 <= len; i += 16) {
+            const __m128i x = _mm_loadu_si128((const __m128i*)&data[i]);
+            const __m128i ge10 = _mm_cmpeq_epi8(_mm_max_epu8(x, ten), x);
+            if (_mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(x, mis), ge10))) return false;
+        }
+#endif
+        for (/**/; i < len; ++i) {
+            if (Simple(data[i]) == false) return false;
+        }
+        return true;
+    }
+
+    // Emit a single haplotype as a 2-byte unit.
+    inline char* Emit(char* out, uint8_t allele) {
+        *out++ = DJN_VCF_ALLELE_TEXT[allele][0];
+        if (++phase == ploidy) { phase = 0; *out++ = '\t'; }
+        else *out++ = phasing;
+        return out;
+    }
+
+    // Emit a single haplotype with any symbol: the separator is written
+    // before every allele except the first of a sample such that
+    // end-of-vector markers can be omitted.
+    inline char* EmitGeneral(char* out, uint32_t sym) {
+        const uint32_t h = n_hap++;
+        if (sym != DJN_ALLELE_EOV) {
+            if (n_written++) {
+                if (phase_bits == nullptr) *out++ = phasing;
+                else *out++ = ((phase_bits[h >> 3] >> (h & 7)) & 1) ? '|' : '/';
+            }
+            if (sym < 16) {
+                memcpy(out, DJN_VCF_ALLELE_TEXT[sym], 2);
+                out += DJN_VCF_ALLELE_LEN[sym];
+            } else {
+                if (sym >= 100) *out++ = '0' + sym / 100;
+                *out++ = '0' + (sym / 10) % 10;
+                *out++ = '0' + sym % 10;
+            }
+        }
+        if (++phase == ploidy) {
+            if (n_written == 0) *out++ = '.';
+            *out++ = '\t';
+            phase = 0; n_written = 0;
+        }
+        return out;
+    }
+
+    // Build the formatted output for n <= 32 haplotypes that all carry the
+    // same single-character allele. Requires Aligned(n).
+    inline void BuildRun(char* chunk, uint8_t allele, uint32_t n) const {
+        memcpy(chunk, pattern, 2*n);
+        for (uint32_t i = 0; i < n; ++i) chunk[2*i] = DJN_VCF_ALLELE_TEXT[allele][0];
+    }
+
+    // Emit 32 haplotypes from a 1-bit dirty word. Requires Aligned(32) and
+    // a haplotype offset at a sample boundary.
+    inline char* EmitDirty2mc(char* out, uint32_t word) const {
+#if defined(__SSE2__)
+        // Lane 2i selects bit i of the broadcasted byte. Odd lanes are
+        // separators and select nothing.
+        const __m128i mask = _mm_set_epi8(0,(char)128,0,64,0,32,0,16,0,8,0,4,0,2,0,1);
+        const __m128i one  = _mm_set1_epi8(1);
+        for (int i = 0; i < 4; ++i) {
+            const __m128i x    = _mm_set1_epi8((char)(word >> (8*i)));
+            const __m128i bits = _mm_min_epu8(_mm_and_si128(x, mask), one);
+            const __m128i base = _mm_loadu_si128((const __m128i*)&pattern[16*i]);
+            _mm_storeu_si128((__m128i*)&out[16*i], _mm_add_epi8(base, bits));
+        }
+#else
+        memcpy(out, pattern, 64);
+        for (int i = 0; i < 32; ++i) out[2*i] += (word >> i) & 1;
+#endif
+        return out + 64;
+    }
+
+#if defined(__SSE2__)
+    // Convert symbols (0-9 or missing) in even lanes to characters.
+    inline __m128i ToChars(__m128i sym, __m128i base) const {
+        const __m128i fix = _mm_and_si128(_mm_cmpeq_epi8(sym, _mm_set1_epi8(DJN_ALLELE_MISSING)), 
+                                          _mm_set1_epi8('.' - ('0' + DJN_ALLELE_MISSING)));
+        return _mm_add_epi8(_mm_add_epi8(base, sym), fix);
+    }
+#endif
+
+    // Emit 8 haplotypes from a 4-bit dirty word. Requires Aligned(8),
+    // a haplotype offset at a sample boundary, and SimpleNm(word).
+    inline char* EmitDirtyNm(char* out, uint32_t word) const {
+#if defined(__SSE2__)
+        const __m128i nib  = _mm_set1_epi8(15);
+        const __m128i x    = _mm_cvtsi32_si128(word);
+        const __m128i lo   = _mm_and_si128(x, nib);
+        const __m128i hi   = _mm_and_si128(_mm_srli_epi16(x, 4), nib);
+        // Interleave to symbol order and then with zeroes to skip the
+        // separator lanes.
+        const __m128i sym  = _mm_unpacklo_epi8(_mm_unpacklo_epi8(lo, hi), _mm_setzero_si128());
+        const __m128i base = _mm_loadu_si128((const __m128i*)pattern);
+        _mm_storeu_si128((__m128i*)out, ToChars(sym, base));
+#else
+        memcpy(out, pattern, 16);
+        for (int i = 0; i < 8; ++i) out[2*i] = DJN_VCF_ALLELE_TEXT[(word >> (4*i)) & 15][0];
+#endif
+        return out + 16;
+    }
+
+    // Emit 16 haplotypes from unpacked byte literals. Requires Aligned(16),
+    // a haplotype offset at a sample boundary, and SimpleBytes.
+    inline char* EmitBytes16(char* out, const uint8_t* data) const {
+#if defined(__SSE2__)
+        const __m128i x = _mm_loadu_si128((const __m128i*)data);
+        const __m128i z = _mm_setzero_si128();
+        const __m128i base = _mm_loadu_si128((const __m128i*)pattern);
+        _mm_storeu_si128((__m128i*)&out[0],  ToChars(_mm_unpacklo_epi8(x, z), base));
+        _mm_storeu_si128((__m128i*)&out[16], ToChars(_mm_unpackhi_epi8(x, z), base));
+#else
+        memcpy(out, pattern, 32);
+        for (int i = 0; i < 16; ++i) out[2*i] = DJN_VCF_ALLELE_TEXT[data[i]][0];
+#endif
+        return out + 32;
+    }
+
+    // Rewrite separators in 2-byte unit output according to per-haplotype
+    // phasing bits.
+    inline void PatchPhase(char* out, uint32_t n_haplotypes) const {
+        if (phase_bits == nullptr || ploidy == 1) return;
+        for (uint32_t b = 0; b < n_haplotypes; b += 8) {
+            uint8_t bits = phase_bits[b >> 3];
+            if (bits == 0xFF) continue;
+            const uint32_t to = b + 8 > n_haplotypes ? n_haplotypes : b + 8;
+            for (uint32_t h = b; h < to; ++h, bits >>= 1) {
+                if (h % ploidy == 0) continue;
+                out[2*h - 1] = (bits & 1) ? '|' : '/';
+            }
+        }
+    }
+
+    int ploidy, phase;
+    uint32_t n_hap, n_written; // general path: haplotypes consumed and alleles written in the current sample
+    char phasing;
+    const uint8_t* phase_bits;
+    char pattern[2*DJN_VCF_PATTERN_HAPLOTYPES];
+};
+
 int djinn_variant_t::ToVcf(char* out, const char phasing) const {
     if (out == nullptr) return -1;
 
-    uint32_t len_vcf = 0;
+    // Recorded phasing takes precedence over the provided separator. Mixed
+    // phasing is written with '|' and patched from the per-haplotype bits.
+    char sep = phasing;
+    const uint8_t* bits = nullptr;
+    switch (phased) {
+    case DJN_PHASE_ALL:  sep = '|'; break;
+    case DJN_PHASE_NONE: sep = '/'; break;
+    case DJN_PHASE_MIXED: sep = '|'; bits = phase; break;
+    default: break;
+    }
+
+    djn_vcf_formatter_t fmt(ploidy, sep, bits);
+    char* o = out;
+
     if (unpacked == DJN_UN_IND) {
-        if (n_allele < 10) {
-            for (int j = 0; j < data_len; j += ploidy) {
-                out[len_vcf++] = (char)data[j+0] + '0';
-                for (int i = 1; i < ploidy; ++i) {
-                    out[len_vcf++] = phasing;
-                    out[len_vcf++] = (char)data[j+1] + '0';
-                }
-                out[len_vcf++] = '\t';
+        if (fmt.SimpleBytes(data, data_len)) {
+            uint32_t i = 0;
+            if (fmt.Aligned(16)) {
+                for (/**/; i + 16 <= data_len; i += 16) o = fmt.EmitBytes16(o, &data[i]);
             }
-            out[len_vcf++] = '\n';
+            for (/**/; i < data_len; ++i) o = fmt.Emit(o, data[i]);
+            fmt.PatchPhase(out, data_len);
         } else {
-            std::cerr << "not implemented" << std::endl;
+            for (uint32_t i = 0; i < data_len; ++i) o = fmt.EmitGeneral(o, data[i]);
         }
+
     } else if (unpacked == DJN_UN_EWAH) {
         assert(d != nullptr);
-        if (n_allele < 10) {
-            uint32_t n_out = 0;
-            uint32_t diff  = 0;
-            // mul: number of packed items in 32-bit dirty bitvectors.
-            // mask: bitmap for dirty bitvectors (either 1-bit or 4-bit selector).
-            // shift: bit-shift width in bits for unpacking dirty words.
-            const uint32_t mul   = (d->dirty_type == DJN_DIRTY_2MC ? 32 :  8);
-            const uint8_t  mask  = (d->dirty_type == DJN_DIRTY_2MC ?  1 : 15);
-            const uint8_t  shift = (d->dirty_type == DJN_DIRTY_2MC ?  1 :  4);
-
-            uint32_t to = 0;
+
+        // mul: number of packed items in 32-bit dirty bitvectors.
+        // mask: bitmap for dirty bitvectors (either 1-bit or 4-bit selector).
+        // shift: bit-shift width in bits for unpacking dirty words.
+        const bool is_2mc = (d->dirty_type == DJN_DIRTY_2MC);
+        const uint32_t mul   = (is_2mc ? 32 :  8);
+        const uint8_t  mask  = (is_2mc ?  1 : 15);
+        const uint8_t  shift = (is_2mc ?  1 :  4);
+        // Whole words always start at a sample boundary if the ploidy
+        // divides the number of haplotypes per word.
+        const bool aligned = fmt.Aligned(mul);
+
+        // Biallelic words are always written as single characters.
+        bool simple = true;
+        if (is_2mc == false) {
+            for (int i = 0; i < d->n_ewah && simple; ++i) {
+                simple = fmt.Simple(d->ewah[i]->ref & mask);
+                for (int j = 0; j < d->ewah[i]->dirty && simple; ++j) {
+                    simple = fmt.SimpleNm(d->dirty[i][j]);
+                }
+            }
+        }
+
+        uint32_t n_out = 0, to = 0;
+        if (simple) {
+            char run[2*DJN_VCF_PATTERN_HAPLOTYPES];
             for (int i = 0; i < d->n_ewah; ++i) {
-                // Emit clean words
-                for (int j = 0; j < d->ewah[i]->clean; ++j) {
+                const uint8_t ref = d->ewah[i]->ref & mask;
+                
+                // Emit clean words: copy a preformatted run of haplotypes.
+                const uint32_t n_clean = d->ewah[i]->clean;
+                if (aligned && n_clean) fmt.BuildRun(run, ref, mul);
+                for (uint32_t j = 0; j < n_clean; ++j) {
                     to = n_out + mul > d->n_samples ? d->n_samples - n_out : mul;
-                    for (int k = 0; k < to; ++k, ++n_out) {
-                        diff = n_out % ploidy;
-                        if (diff == 0 && n_out != 0) out[len_vcf++] = '\t';
-                        if (diff != 0) {
-                            out[len_vcf++] = phasing;
-                        }
-                        out[len_vcf++] = (d->ewah[i]->ref & mask) + '0';
+                    if (aligned && to == mul) {
+                        memcpy(o, run, 2*mul);
+                        o += 2*mul;
+                    } else {
+                        for (uint32_t k = 0; k < to; ++k) o = fmt.Emit(o, ref);
                     }
+                    n_out += to;
                 }
                 
                 // Emit dirty words
                 for (int j = 0; j < d->ewah[i]->dirty; ++j) {
-                    uint32_t ref = *(d->dirty[i] + j); // copy
+                    uint32_t word = d->dirty[i][j]; // copy
                     to = n_out + mul > d->n_samples ? d->n_samples - n_out : mul;
-                    for (int k = 0; k < to; ++k, ++n_out) {
-                        diff = n_out % ploidy;
-                        if (diff == 0 && n_out != 0) out[len_vcf++] = '\t';
-                        if (diff != 0) {
-                            out[len_vcf++] = phasing;
+                    if (aligned && to == mul) {
+                        o = is_2mc ? fmt.EmitDirty2mc(o, word) : fmt.EmitDirtyNm(o, word);
+                    } else {
+                        for (uint32_t k = 0; k < to; ++k) {
+                            o = fmt.Emit(o, word & mask);
+                            word >>= shift;
                         }
-                        out[len_vcf++] = (ref & mask) + '0';
-                        ref >>= shift;    
                     }
+                    n_out += to;
                 }
             }
-            assert(n_out == d->n_samples);
-            // out[len_vcf++] = '\t';
-            out[len_vcf++] = '\n';
+            fmt.PatchPhase(out, n_out);
         } else {
-            std::cerr << "not implemented" << std::endl;
-            return -1;
+            for (int i = 0; i < d->n_ewah; ++i) {
+                const uint8_t ref = d->ewah[i]->ref & mask;
+                for (int j = 0; j < d->ewah[i]->clean; ++j) {
+                    to = n_out + mul > d->n_samples ? d->n_samples - n_out : mul;
+                    for (uint32_t k = 0; k < to; ++k) o = fmt.EmitGeneral(o, ref);
+                    n_out += to;
+                }
+                for (int j = 0; j < d->ewah[i]->dirty; ++j) {
+                    uint32_t word = d->dirty[i][j]; // copy
+                    to = n_out + mul > d->n_samples ? d->n_samples - n_out : mul;
+                    for (uint32_t k = 0; k < to; ++k) {
+                        o = fmt.EmitGeneral(o, word & mask);
+                        word >>= shift;
+                    }
+                    n_out += to;
+                }
+            }
+        }
+        assert(n_out == d->n_samples);
+
+    } else {
+        return -1;
+    }
+
+    // Replace the trailing tab with a newline.
+    if (o != out) o[-1] = '\n';
+    else *o++ = '\n';
+
+    return o - out;
+}
+
+/*======   BCF genotype encoding   ======*/
+
+// Bcf-encoding of internal allele symbols without the phasing bit: alleles
+// as (allele+1) << 1, missing as 0, and the int8 end-of-vector value.
+static const uint8_t DJN_BCF_GT_PACK[16] = 
+    {2,4,6,8,10,12,14,16,18,20,22,24,26,28,0,0x81};
+
+int djinn_variant_t::Merge(const djinn_variant_t& other) {
+    if (errcode || other.errcode) return -1;
+    if (unpacked != DJN_UN_IND || other.unpacked != DJN_UN_IND) return -1;
+    if (ploidy != other.ploidy) return -2;
+
+    const uint32_t len = data_len + other.data_len;
+    if (len > data_alloc) {
+        uint8_t* old = data;
+        data_alloc = len + 65536;
+        data = new uint8_t[data_alloc];
+        memcpy(data, old, data_len);
+        if (data_free) delete[] old;
+        data_free = true;
+    }
+
+    // Per-haplotype phasing bits are required unless the phasing of both
+    // variants is recorded identically. Unknown phasing is written as phased.
+    if (phased != other.phased || phased == DJN_PHASE_MIXED) {
+        const uint32_t n_bytes = (len + 7) / 8;
+        uint8_t* bits = new uint8_t[n_bytes + 1024];
+        memset(bits, 0, n_bytes + 1024);
+        const djinn_variant_t* src[2] = {this, &other};
+        uint32_t h = 0;
+        for (int k = 0; k < 2; ++k) {
+            for (uint32_t i = 0; i < src[k]->data_len; ++i, ++h) {
+                bool bit = src[k]->phased != DJN_PHASE_NONE;
+                if (src[k]->phased == DJN_PHASE_MIXED) bit = (src[k]->phase[i >> 3] >> (i & 7)) & 1;
+                bits[h >> 3] |= bit << (h & 7);
+            }
+        }
+        delete[] phase;
+        phase = bits;
+        phase_len = n_bytes;
+        phase_alloc = n_bytes + 1024;
+        phased = DJN_PHASE_MIXED;
+    }
+
+    memcpy(&data[data_len], other.data, other.data_len);
+    data_len = len;
+    n_allele = std::max(n_allele, other.n_allele);
+    return 1;
+}
+
+int djinn_variant_t::ToBcf(uint8_t* out, const char phasing) const {
+    if (out == nullptr) return -1;
+
+    uint32_t n_out = 0;
+    if (unpacked == DJN_UN_IND) {
+        uint32_t i = 0;
+#if defined(__SSE2__)
+        // (x+1) << 1 for alleles, then fix missing and EOV lanes.
+        const __m128i two = _mm_set1_epi8(2);
+        const __m128i mis = _mm_set1_epi8(DJN_ALLELE_MISSING);
+        const __m128i eov = _mm_set1_epi8(DJN_ALLELE_EOV);
+        const __m128i v_eov = _mm_set1_epi8((char)0x81);
+        for (/**/; i + 16 <= data_len; i += 16) {
+            const __m128i x = _mm_loadu_si128((const __m128i*)&data[i]);
+            __m128i y = _mm_add_epi8(_mm_add_epi8(x, x), two);
+            y = _mm_andnot_si128(_mm_cmpeq_epi8(x, mis), y);
+            const __m128i is_eov = _mm_cmpeq_epi8(x, eov);
+            y = _mm_or_si128(_mm_andnot_si128(is_eov, y), _mm_and_si128(is_eov, v_eov));
+            _mm_storeu_si128((__m128i*)&out[i], y);
+        }
+#endif
+        for (/**/; i < data_len; ++i) {
+            out[i] = data[i] < 16 ? DJN_BCF_GT_PACK[data[i]] : (data[i] + 1) << 1;
+        }
+        n_out = data_len;
+
+    } else if (unpacked == DJN_UN_EWAH) {
+        assert(d != nullptr);
+
+        const bool is_2mc = (d->dirty_type == DJN_DIRTY_2MC);
+        const uint32_t mul   = (is_2mc ? 32 :  8);
+        const uint8_t  mask  = (is_2mc ?  1 : 15);
+        const uint8_t  shift = (is_2mc ?  1 :  4);
+
+        uint32_t to = 0;
+        for (int i = 0; i < d->n_ewah; ++i) {
+            // Clean words are runs of a single value.
+            to = n_out + d->ewah[i]->clean * mul;
+            to = to > (uint32_t)d->n_samples ? d->n_samples : to;
+            memset(&out[n_out], DJN_BCF_GT_PACK[d->ewah[i]->ref & mask], to - n_out);
+            n_out = to;
+
+            for (int j = 0; j < d->ewah[i]->dirty; ++j) {
+                uint32_t word = d->dirty[i][j]; // copy
+                to = n_out + mul > (uint32_t)d->n_samples ? d->n_samples : n_out + mul;
+                for (/**/; n_out < to; ++n_out) {
+                    out[n_out] = DJN_BCF_GT_PACK[word & mask];
+                    word >>= shift;
+                }
+            }
         }
+        assert(n_out == d->n_samples);
 
     } else {
         return -1;
     }
-    
-    return len_vcf;
+
+    // Set the phasing bit on every allele except the first of each sample.
+    // The bit is already set for end-of-vector values.
+    const int pl = ploidy <= 0 ? 1 : ploidy;
+    if (phased == DJN_PHASE_MIXED && phase != nullptr) {
+        for (uint32_t i = 0; i < n_out; i += pl) {
+            for (int k = 1; k < pl && i + k < n_out; ++k) {
+                const uint32_t h = i + k;
+                out[h] |= (phase[h >> 3] >> (h & 7)) & 1;
+            }
+        }
+    } else if (phased == DJN_PHASE_ALL || (phased == DJN_PHASE_UNKNOWN && phasing == '|')) {
+        for (uint32_t i = 0; i < n_out; i += pl) {
+            for (int k = 1; k < pl && i + k < n_out; ++k) out[i + k] |= 1;
+        }
+    }
+
+    return n_out;
 }
 
-}
\ No newline at end of file
+}
@@ -30,6 +30,7 @@
 #include <unordered_map> //std::unordered_map
 #include <limits> //std::numeric_limit
 #include <vector> //std::Vector
+#include <string> //std::string
 #include <memory> //std::shared_ptr
 
 namespace djinn {
@@ -145,6 +146,23 @@ static constexpr uint32_t DJN_NM_REF_BITS[16] =
 #define DJN_DIRTY_2MC 0 // 1-bit or
 #define DJN_DIRTY_NM  1 // 4-bit encoding in dirty bitmaps
 
+#define DJN_PHASE_UNKNOWN 0 // Phasing not recorded
+#define DJN_PHASE_ALL     1 // All genotypes phased
+#define DJN_PHASE_NONE    2 // All genotypes unphased
+#define DJN_PHASE_MIXED   3 // Per-haplotype phasing bits
+
+// Archetype flag of EWAH-encoded 2MC sites stored as raw packed bitmaps as
+// the EWAH objects would have been larger.
+#define DJN_ARCHETYPE_DENSE 8
+// Archetype flag of EWAH-encoded unphased diploid sites stored as one
+// genotype per sample in the 2MC stream (see djinn_model::gt_pbwt).
+#define DJN_ARCHETYPE_GT 16
+
+// Internal allele symbols for missing values and the end-of-vector (EOV)
+// marker used for samples with a lower ploidy than the variant.
+#define DJN_ALLELE_MISSING 14
+#define DJN_ALLELE_EOV     15
+
 // EWAH structure
 #pragma pack(push, 1)
 struct djinn_ewah_t {
@@ -193,8 +211,22 @@ struct djinn_variant_t {
     djinn_variant_t();
     ~djinn_variant_t();
 
-    // Todo: implement me
-    // int ToBcf(char* out, const char phasing = '|') const;
+    /**
+     * Convert data into a Bcf-encoded genotype vector (typed int8 values as
+     * stored in the FORMAT/GT field of a Bcf record) irrespective of wether
+     * the internally stored data is EWAH compressed or unpacked into byte
+     * literals. Alleles are encoded as ((allele+1) << 1 | phased), missing
+     * alleles as (0 | phased), and end-of-vector markers as 0x81. As for
+     * ToVcf, raw EWAH data may be permuted.
+     * 
+     * No overflow checks are made for the output buffer and the buffer must be
+     * pre-allocated by the user to hold at least 1 byte per haplotype.
+     * 
+     * @param out     Output buffer.
+     * @param phasing Phasing used if none is recorded: '|' for phased.
+     * @return int    Returns the number of bytes used.
+     */
+    int ToBcf(uint8_t* out, const char phasing = '|') const;
 
     /**
      * Silly function that adds a trailing "\t\n". This output is used in 
@@ -213,8 +245,13 @@ struct djinn_variant_t {
      * if raw EWAH data is used (for example as retrieved from the GetNextRaw function)
      * it is possible that the output VCF order is permuted!
      * 
+     * Missing alleles are written as '.', alleles marked as end-of-vector are
+     * omitted together with their separator, and recorded phasing (see
+     * phased) takes precedence over the phasing argument.
+     * 
      * No overflow checks are made for the output buffer and the buffer must be
-     * pre-allocated by the user.
+     * pre-allocated by the user to hold at least 3 bytes per haplotype plus
+     * one byte.
      * 
      * @param out     Output buffer.
      * @param phasing Character to use as phasing separator if ploidy > 1.
@@ -222,24 +259,17 @@ struct djinn_variant_t {
      */
     int ToVcf(char* out, const char phasing = '|') const;
 
-    // Todo: implement me
-    int Merge(const djinn_variant_t& other) {
-        if (data == nullptr && other.data == nullptr) return 0;
-        if (errcode || other.errcode) return -1*errcode;
-        if (unpacked != other.unpacked) return -1;
-
-        // Resize if required
-        if (data_len + other.data_len > data_alloc) {
-            uint8_t* old = data;
-            data_alloc = data_len + other.data_len + 65536;
-            data = new uint8_t[data_alloc];
-            memcpy(data, old, data_len);
-            if (data_free) delete[] old;
-            data_free = true;
-        }
-
-        return 1;
-    }
+    /**
+     * Append the haplotypes of another variant to this variant, for example
+     * when merging archives with disjoint samples. Both variants must be
+     * unpacked into byte literals (DJN_UN_IND) and have the same ploidy.
+     * Phasing is kept if it is recorded identically for both variants and
+     * stored as per-haplotype bits otherwise.
+     * 
+     * @param other Variant whose haplotypes are appended.
+     * @return int  Returns 1 on success or a negative value otherwise.
+     */
+    int Merge(const djinn_variant_t& other);
 
     int ploidy, n_allele; // ploidy: data stride size for unpacked data, n_allele: number of alleles including ref
     uint8_t* data;
@@ -248,6 +278,12 @@ struct djinn_variant_t {
     int errcode; // error code when something goes wrong
     int unpacked; // one of DJN_UN_*
     djn_variant_dec_t* d;
+    int phased; // one of DJN_PHASE_*
+    // Phasing bits when phased is DJN_PHASE_MIXED: bit h is set if the
+    // separator preceding haplotype h is '|'. Bits for the first haplotype of
+    // every sample are ignored.
+    uint8_t* phase;
+    uint32_t phase_len, phase_alloc; // number of used and allocated bytes in phase
 };
 
 /*======  Helper functions  ======*/
@@ -265,6 +301,29 @@ static uint32_t round_log2(uint32_t x) {
 	return r;
 }
 
+/**
+ * Summary statistics of an encoded variant. Recorded by the models while
+ * encoding and stored in archives such that variants and blocks can be
+ * filtered without decoding the genotypes.
+ */
+struct djinn_variant_stats_t {
+    djinn_variant_stats_t() : ac(0), an(0), n_missing(0), max_allele(0), archetype(0) {}
+
+    // Minor allele frequency: the frequency of non-reference alleles folded
+    // at 0.5. Variants without called alleles have a frequency of 0.
+    float Maf() const {
+        if (an == 0) return 0;
+        const float af = (float)ac / an;
+        return af > 0.5f ? 1 - af : af;
+    }
+
+    uint32_t ac;         // number of non-reference alleles
+    uint32_t an;         // number of called alleles (excluding missing values and EOV)
+    uint32_t n_missing;  // number of missing values
+    uint8_t  max_allele; // largest allele index
+    uint8_t  archetype;  // 0: 2MC, 1: NM, 2: genotypes (gtPBWT)
+};
+
 /*======   Base interface for Djinn   ======*/
 
 /***************************************
@@ -272,7 +331,7 @@ static uint32_t round_log2(uint32_t x) {
 ***************************************/
 class djinn_model {
 public:
-    djinn_model() : use_pbwt(true), init(true), unused(0), n_variants(0) {}
+    djinn_model() : use_pbwt(true), init(true), pbwt_ctx(false), dense(false), gt_pbwt(false), unused(0), n_variants(0) {}
     virtual ~djinn_model() {}
 
     /**
@@ -302,6 +361,29 @@ public:
      */
     virtual int Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) =0;
 
+    /**
+     * Compress and encode a batch of Bcf-encoded variants stored contiguously
+     * as a matrix of n_rows rows with len_data bytes each. Row i is encoded
+     * as a call to EncodeBcf(&data[i*len_data], len_data, ploidy[i], alt_alleles[i])
+     * but per-variant overheads such as the compression group lookup are
+     * amortized over the batch. Encoding stops at the first row that fails;
+     * the rows preceding it remain encoded and their number is returned in
+     * n_encoded.
+     * 
+     * @param data        Matrix of Bcf-encoded genotypes.
+     * @param len_data    Number of bytes per variant.
+     * @param n_rows      Number of variants.
+     * @param ploidy      Ploidy of each variant.
+     * @param alt_alleles Number of alleles of each variant.
+     * @param n_encoded   Optional: set to the number of encoded variants, including on error.
+     * @return int        Returns the number of encoded variants or a negative value on error.
+     */
+    virtual int EncodeBcfBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded = nullptr);
+    /**
+     * Same as EncodeBcfBatch but accepts [0,N-1]-encoded byte vectors.
+     */
+    virtual int EncodeBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded = nullptr);
+
     /**
      * Builds all the neccessary objects before passing data for encoding. 
      * Calling this function is REQUIRED prior to calling EncodeBcf or Encode
@@ -317,9 +399,9 @@ public:
      * calling Serialize or starting to Decode data as additional information is
      * written.
      * 
-     * @return size_t 
+     * @return int64_t Returns the compressed size in bytes or a negative value on error.
      */
-    virtual size_t FinishEncoding() =0;
+    virtual int64_t FinishEncoding() =0;
 
     /**
      * Starts encoding the internal data that MUST have been provided prior to calling
@@ -377,18 +459,31 @@ public:
      */
     virtual int GetCurrentSize() const =0;
 
-    // Todo:
-    // virtual int Merge(djinn_model* b1, djinn_model* b2);
+    /**
+     * Merge two blocks describing the same variants for disjoint sets of
+     * samples and encode the result into the current block of this model:
+     * the samples of model1 precede those of model2. The source models must
+     * be deserialized and are decoded by this function, whereby PBWT
+     * permutations are undone. This model must be prepared with 
+     * StartEncoding and the sources may use a different model type.
+     * 
+     * @param model1 First source block.
+     * @param model2 Second source block.
+     * @return int   Returns the number of merged variants or a negative value on error.
+     */
+    virtual int Merge(djinn_model& model1, djinn_model& model2);
 
 public:
     uint8_t use_pbwt: 1, // PBWT pre-processor is used
             init: 1,     // Models should be reset
-            unused: 6;   // Reserved space
+            pbwt_ctx: 1, // Context models are conditioned on the PBWT divergence array (opt-in)
+            dense: 1,    // Context models may code noisy 2MC sites bit by bit (opt-in)
+            gt_pbwt: 1,  // Unphased diploid sites are permuted by genotype (gtPBWT)
+            unused: 3;   // Reserved space
     uint32_t n_variants; // Number of encoded variants
 
-    // Supportive array for computing allele counts to determine the presence
-    // of missing values and/or end-of-vector symbols (in Bcf-encodings).
-    uint32_t hist_alts[256];
+    // Summary statistics of the variants encoded since StartEncoding.
+    std::vector<djinn_variant_stats_t> variant_stats;
 };
 
 /***************************************
@@ -412,7 +507,7 @@ public:
     void InitiateNm();
 
     int StartEncoding(bool use_pbwt, bool reset = false);
-    size_t FinishEncoding();
+    int64_t FinishEncoding();
     int StartDecoding(bool use_pbwt, bool reset = false);
     size_t FinishDecoding() { return 0; } // no effect
     
@@ -433,6 +528,9 @@ public:
     std::shared_ptr<GeneralModel> mlog_rle; // log2(run length)
     std::shared_ptr<GeneralModel> mrle, mrle2_1, mrle2_2, mrle4_1, mrle4_2, mrle4_3, mrle4_4; // rle models for 1-byte, 2-byte, or 4-byte run lengths
     std::shared_ptr<GeneralModel> dirty_wah; // Dirty bitmap words
+    std::shared_ptr<GeneralModel> dirty_pbwt; // Dirty bitmap words conditioned on the PBWT divergence array
+    std::shared_ptr<GeneralModel> mdense; // Flag for sites coded bit by bit
+    std::shared_ptr<GeneralModel> dense_bits; // Bits of dense sites conditioned on the preceding bits
     std::shared_ptr<GeneralModel> mtype; // Archetype encoding: either bitmap or RLE
     uint8_t *p;     // data
     uint32_t p_len; // data length
@@ -456,10 +554,10 @@ public:
     djn_ctx_model_container_t& operator=(djn_ctx_model_container_t&& other) = delete;
     
     void StartEncoding(bool use_pbwt, bool reset = false);
-    size_t FinishEncoding();
+    int64_t FinishEncoding();
     void StartDecoding(bool use_pbwt, bool reset = false);
 
-    inline void ResetBitmaps() { memset(wah_bitmaps, 0, n_wah*sizeof(uint32_t)); }
+    inline uint32_t* ResetBitmaps() { memset(wah_bitmaps, 0, n_wah*sizeof(uint32_t)); return wah_bitmaps; }
 
     int DecodeNext(uint8_t* ewah_data, uint32_t& ret_ewah, uint8_t* ret_buffer, uint32_t& ret_len);
     int DecodeNextRaw(uint8_t* data, uint32_t& len);
@@ -483,14 +581,62 @@ public:
     int EncodeWahRLE(uint32_t ref, uint32_t len, std::shared_ptr<djn_ctx_model_t> model);
     int EncodeWahRLE_nm(uint32_t ref, uint32_t len, std::shared_ptr<djn_ctx_model_t> model);
 
+    // Contexts derived from the PBWT state preceding the next 2MC site: bit
+    // i of div_bitmaps is set if haplotype ppa[i] has matched its
+    // predecessor for fewer than DJN_CTX_PBWT_MATCH updates. Neighbouring
+    // haplotypes with long matches rarely carry different alleles. Must be
+    // called before the PBWT is updated with the site, both when encoding
+    // and decoding. For gtPBWT sites (gt) both bits of a sample are set if
+    // it has a short match in pbwt_gt.
+    void UpdatePbwtContext(bool gt = false);
+    int EncodeWahPbwt(uint32_t* wah, uint32_t len);
+
+    // Sites where most words are dirty gain little from the object coding
+    // and are instead coded bit by bit when dense is set. The choice is
+    // flagged per site with mdense.
+    bool IsDense(const uint32_t* wah, uint32_t len) const;
+    int EncodeWahDense(uint32_t* wah, uint32_t len);
+
+    // Unphased diploid sites are collapsed into one genotype symbol per
+    // sample (DJN_GT_*) in gt_buffer, permuted with pbwt_gt, and coded as
+    // 2-bit codes (DJN_GT_CODE) in the 2MC stream. PackGenotypes returns
+    // FALSE if the site cannot be represented losslessly in this way.
+    bool PackGenotypes(const uint8_t* data, uint32_t len, bool bcf);
+    int EncodeGt();
+    // Restore the genotypes of an EWAH-encoded gtPBWT site into gt_buffer
+    // in sample order and update pbwt_gt.
+    int UnpermuteGt(const uint8_t* ewah, uint32_t len);
+
+    /**
+     * Encode the phasing of a site, as in the EWAH model, with mphase as one
+     * of DJN_PHASE_*. Explicit per-haplotype bits follow with mphase_bits if
+     * phasing is mixed. Bcf-encoded genotypes are summarized from data and
+     * other genotypes are recorded as DJN_PHASE_UNKNOWN (data is nullptr).
+     * 
+     * @return int Returns the DJN_PHASE_* mode or a negative value on error.
+     */
+    int EncodePhase(const uint8_t* data, uint32_t len);
+    // Decode the phasing of the next site into phase_mode and phase_bits.
+    void DecodePhase();
+    // Copy the phasing of the last decoded variant into the target variant.
+    void SetPhase(djinn_variant_t* variant) const;
+
 public:
-    int DecodeRaw(uint8_t* data, uint32_t& len);
+    int DecodeRaw(uint8_t* data, uint32_t& len, bool gt = false);
+    int DecodeRawPbwt(uint8_t* data, uint32_t& len);
+    int DecodeRawDense(uint8_t* data, uint32_t& len);
     int DecodeRaw_nm(uint8_t* data, uint32_t& len);
+    // Decode the next gtPBWT site into haplotype-level NM EWAH in sample
+    // order.
+    int DecodeRawGt(uint8_t* data, uint32_t& len);
     int DecodeWahRLE(uint32_t& ref, uint32_t& len, std::shared_ptr<djn_ctx_model_t> model);
     int DecodeWahRLE_nm(uint32_t& ref, uint32_t& len, std::shared_ptr<djn_ctx_model_t> model);
 
 public:
     bool use_pbwt;
+    bool pbwt_ctx; // 2MC sites are encoded with contexts from the PBWT (see UpdatePbwtContext)
+    bool dense; // 2MC sites may be coded bit by bit (see IsDense)
+    bool gt_pbwt; // unphased diploid sites may be permuted by genotype (see EncodeGt)
 
     int ploidy;
     int64_t n_samples; // number of "samples" = haplotypes
@@ -501,6 +647,10 @@ public:
     int64_t n_samples_wah_nm;
     uint64_t n_wah; // Number of allocated 32-bit bitmaps
     uint32_t* wah_bitmaps; // Bitmaps
+    uint32_t* div_bitmaps; // Positions with short PBWT matches (n_samples_wah / 32 words), allocated on demand
+    uint8_t* gt_buffer; // Genotype symbols (n_samples / 2), allocated on demand
+    uint8_t phase_mode; // Phasing of the last decoded variant (DJN_PHASE_*)
+    uint8_t* phase_bits; // Phasing bits ((n_samples + 7) / 8), allocated on demand
 
     uint8_t* p;     // data
     uint32_t p_len; // data length
@@ -513,14 +663,26 @@ public:
     // or one (1) for 2M, or two (2) for everything else.
     // This information is required to differentiate
     std::shared_ptr<GeneralModel> marchetype; // 0 for 2MC, 2 else
+    std::shared_ptr<GeneralModel> mgt; // Flag for 2MC sites stored as genotypes (gt_pbwt only)
+    std::shared_ptr<GeneralModel> mphase; // Phasing of each site (DJN_PHASE_*)
+    std::shared_ptr<GeneralModel> mphase_bits; // Per-haplotype phasing bits of mixed sites, as bytes
     std::shared_ptr<djn_ctx_model_t> model_2mc;
     std::shared_ptr<djn_ctx_model_t> model_nm;
+    std::shared_ptr<PBWT> pbwt_gt; // genotype PBWT over n_samples / 2 samples
 
-    // Supportive array for computing allele counts to determine the presence
-    // of missing values and/or end-of-vector symbols (in Bcf-encodings).
-    uint32_t hist_alts[256];
+    // Allele counts of the last decoded variant: the number of alt (1)
+    // symbols restores the PBWT update decision of the encoder and the
+    // largest observed symbol the number of alleles.
+    uint32_t n_alt_obs;
+    uint8_t max_symbol_obs;
 };
 
+// Version of the serialized djinn_ctx_model layout, stored in the low three
+// bits of its bit-packed controller. Deserialize rejects other versions, 
+// including blocks written before the phasing of each site was recorded
+// (version 0).
+#define DJN_CTX_FORMAT_VERSION 1
+
 class djinn_ctx_model : public djinn_model {
 public:
     djinn_ctx_model();
@@ -530,7 +692,7 @@ public:
     int Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) override;
 
     void StartEncoding(bool use_pbwt, bool reset = false) override;
-    size_t FinishEncoding() override;
+    int64_t FinishEncoding() override;
     int StartDecoding() override;
 
     // Read/write
@@ -569,8 +731,67 @@ public:
 /***************************************
 *  EWAH model
 ***************************************/
-// Compression strategy used.
-enum class CompressionStrategy : uint32_t { ZSTD = 0, LZ4 = 1 };
+// Compression strategy used. CTX entropy codes a stream with an adaptive
+// order-1 context model (the range coder used by the CTX model). AUTO selects
+// a concrete codec (ZSTD, LZ4, CTX, or NONE) for each compressed stream
+// according to a djinn_auto_codec_t objective. The selected codec is recorded
+// with each stream.
+enum class CompressionStrategy : uint32_t { ZSTD = 0, LZ4 = 1, NONE = 2, AUTO = 3, CTX = 4 };
+
+// Forward declaration of persistent codec state (compressors.h) and
+// growable support memory (scratch.h).
+struct djn_codec_ctx_t;
+struct djn_scratch_t;
+struct djn_gt_stats_t;
+
+/**
+ * Cap the total amount of memory held by all threads for encoding, 
+ * compressing, and decompressing blocks: transient scratch buffers and the
+ * data buffers of the EWAH and CTX models. Buffers grow with the block size
+ * up to this limit and operations that would exceed it fail with an error
+ * instead.
+ * 
+ * @param max_bytes Upper limit in bytes. Set to 0 for no limit (default).
+ */
+void SetScratchMemoryLimit(uint64_t max_bytes);
+
+/**
+ * Returns the total amount of scratch memory currently held by all threads in
+ * bytes.
+ */
+uint64_t GetScratchMemoryUsage();
+
+/**
+ * Advanced codec parameters. Zero values retain the codec defaults.
+ */
+struct djinn_codec_params_t {
+    djinn_codec_params_t() : zstd_ldm(0), zstd_window_log(0), zstd_workers(0), lz4_acceleration(0) {}
+
+    int zstd_ldm;         // Enable Zstd long-distance matching.
+    int zstd_window_log;  // Zstd window size (log2). Larger windows benefit long-distance matching.
+    int zstd_workers;     // Number of Zstd worker threads. Requires libzstd built with multithreading.
+    int lz4_acceleration; // Use fast LZ4 with this acceleration factor instead of LZ4-HC.
+};
+
+/**
+ * Objective for automatic codec selection (CompressionStrategy::AUTO): 
+ * minimise the compressed size subject to a minimum decode throughput. 
+ * Decode throughputs left at 0 are measured once on this machine when they
+ * are first needed, that is when min_decode_mbs is set. Set them explicitly
+ * to make the selection independent of the hardware.
+ */
+struct djinn_auto_codec_t {
+    djinn_auto_codec_t() : min_decode_mbs(0), lz4_acceleration(1), lz4_level(9), zstd_max_level(19), allow_ctx(true), lz4_decode_mbs(0), zstd_decode_mbs(0), ctx_decode_mbs(0) {}
+
+    double min_decode_mbs;  // Minimum decode throughput in MB/s. Set to 0 to minimise size only.
+    int lz4_acceleration;   // Acceleration factor of the fast LZ4 candidate.
+    int lz4_level;          // LZ4-HC level evaluated.
+    int zstd_max_level;     // Highest Zstd level evaluated among levels 1, 3, 9, and 19.
+    bool allow_ctx;         // Evaluate the context-model codec (CompressionStrategy::CTX).
+    double lz4_decode_mbs;  // LZ4 decode throughput in MB/s or 0 to measure.
+    double zstd_decode_mbs; // Zstd decode throughput in MB/s or 0 to measure.
+    double ctx_decode_mbs;  // CTX decode throughput in MB/s or 0 to measure.
+};
 
 struct djn_ewah_model_t {
 public:
@@ -578,8 +799,8 @@ public:
     ~djn_ewah_model_t();
 
     int StartEncoding(bool use_pbwt, bool reset = false);
-    size_t FinishEncoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, int c_level);
-    int StartDecoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, bool use_pbwt, bool reset = false);
+    int64_t FinishEncoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, CompressionStrategy strat, int c_level);
+    int StartDecoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, bool use_pbwt, bool reset = false);
     size_t FinishDecoding() { return 0; } // no effect
     
     void reset();
@@ -597,6 +818,7 @@ public:
     uint32_t p_len, u_len; // data length
     uint32_t p_cap:31, p_free:1; // capacity (memory allocated), flag for data ownership
     uint32_t n_variants; // number of variants encoded
+    CompressionStrategy p_codec; // codec used for p
 };
 
 struct djn_ewah_model_container_t {
@@ -606,10 +828,10 @@ public:
     ~djn_ewah_model_container_t();
 
     void StartEncoding(bool use_pbwt, bool reset = false);
-    size_t FinishEncoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, int c_level);
-    void StartDecoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, bool use_pbwt, bool reset = false);
+    int64_t FinishEncoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, CompressionStrategy strat, int c_level);
+    int StartDecoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, bool use_pbwt, bool reset = false);
 
-    inline void ResetBitmaps() { memset(wah_bitmaps, 0, n_wah*sizeof(uint32_t)); }
+    inline uint32_t* ResetBitmaps() { memset(wah_bitmaps, 0, n_wah*sizeof(uint32_t)); return wah_bitmaps; }
 
     int DecodeNext(uint8_t* ewah_data, uint32_t& ret_ewah, uint8_t* ret_buffer, uint32_t& ret_len);
     int DecodeNextRaw(uint8_t* data, uint32_t& len);
@@ -628,15 +850,53 @@ public:
     int Encode2mc(uint8_t* data, uint32_t len, const uint8_t* map, const int shift = 1);
     int EncodeNm(uint8_t* data, uint32_t len);
     int EncodeNm(uint8_t* data, uint32_t len, const uint8_t* map, const int shift = 1);
-    int EncodeWah(uint32_t* wah, uint32_t len);
+    int EncodeWah(uint32_t* wah, uint32_t len, uint32_t n_set = std::numeric_limits<uint32_t>::max());
     int EncodeWahNm(uint32_t* wah, uint32_t len);
 
+    // Noisy sites where most words are dirty expand when stored as EWAH
+    // objects and are stored as packed bitmaps instead, flagged with
+    // DJN_ARCHETYPE_DENSE. The choice is made before encoding: n_set, the
+    // number of set bits if known, bounds the number of dirty words as
+    // every dirty word has both set and unset bits.
+    bool IsDense(const uint32_t* wah, uint32_t len, uint32_t n_set) const;
+    int EncodeWahDense(uint32_t* wah, uint32_t len);
+
+    // Unphased diploid sites are collapsed into one genotype symbol per
+    // sample (DJN_GT_*) in gt_buffer, permuted with pbwt_gt, and stored as
+    // 2-bit codes (DJN_GT_CODE) in the 2MC stream. PackGenotypes returns
+    // FALSE if the site cannot be represented losslessly in this way.
+    bool PackGenotypes(const uint8_t* data, uint32_t len, bool bcf);
+    int EncodeGt();
+    // Restore the genotypes of an EWAH-encoded gtPBWT site into gt_buffer
+    // in sample order and update pbwt_gt.
+    int UnpermuteGt(const uint8_t* ewah, uint32_t len);
+
 public:
     int DecodeRaw(uint8_t* data, uint32_t& len);
     int DecodeRaw_nm(uint8_t* data, uint32_t& len);
+    // Decode the next gtPBWT site into haplotype-level NM EWAH in sample
+    // order.
+    int DecodeRawGt(uint8_t* data, uint32_t& len);
+
+    /**
+     * Summarize the phasing of Bcf-encoded genotypes as one of DJN_PHASE_*.
+     * Explicit per-haplotype bits are appended to model_phase if phasing is
+     * mixed.
+     */
+    uint8_t EncodePhase(const uint8_t* data, uint32_t len);
+
+    /**
+     * Read the archetype byte of the next variant: the archetype is returned
+     * and the recorded phasing is stored in phase_mode and phase_bits.
+     */
+    uint8_t NextArchetype();
+
+    // Copy the phasing of the last decoded variant into the target variant.
+    void SetPhase(djinn_variant_t* variant) const;
 
 public:
     bool use_pbwt;
+    bool gt_pbwt; // unphased diploid sites may be permuted by genotype (see EncodeGt)
     int ploidy;
     int64_t n_samples; // number of "samples" = haplotypes
     int64_t n_variants;
@@ -646,21 +906,39 @@ public:
     int64_t n_samples_wah_nm;
     uint64_t n_wah; // Number of allocated 32-bit bitmaps
     uint32_t* wah_bitmaps; // Bitmaps
+    uint8_t* gt_buffer; // Genotype symbols (n_samples / 2), allocated on demand
 
     uint8_t* p;     // data
     uint32_t p_len; // data length
     uint32_t p_cap:31, p_free:1; // allocated data length, ownership of data flag
+    CompressionStrategy p_codec; // codec used for p
     
     // std::shared_ptr<GeneralModel> marchetype; // 0 for 2MC, 2 else
     std::shared_ptr<djn_ewah_model_t> model_2mc;
     std::shared_ptr<djn_ewah_model_t> model_2m; // unused
     std::shared_ptr<djn_ewah_model_t> model_nm;
-
-    // Supportive array for computing allele counts to determine the presence
-    // of missing values and/or end-of-vector symbols (in Bcf-encodings).
-    uint32_t hist_alts[256];
+    std::shared_ptr<PBWT> pbwt_gt; // genotype PBWT over n_samples / 2 samples
+    // Byte stream of phasing bits for variants with mixed phasing. The
+    // phasing mode of a variant is stored in bits 1-2 of its archetype byte.
+    std::shared_ptr<djn_ewah_model_t> model_phase;
+    uint8_t phase_mode; // phasing of the last decoded variant
+    const uint8_t* phase_bits; // phasing bits of the last decoded variant
+    bool dense; // the last decoded variant is stored as raw bitmaps (DJN_ARCHETYPE_DENSE)
+    bool gt; // the last decoded variant is stored as genotypes (DJN_ARCHETYPE_GT)
+
+    // Allele counts of the last decoded variant: the number of alt (1)
+    // symbols restores the PBWT update decision of the encoder and the
+    // largest observed symbol the number of alleles.
+    uint32_t n_alt_obs;
+    uint8_t max_symbol_obs;
 };
 
+// Version of the serialized djinn_ewah_model layout, stored in the low three
+// bits of its bit-packed controller. Deserialize rejects other versions, 
+// including blocks written before per-stream codecs and dictionaries were
+// added (version 0).
+#define DJN_EWAH_FORMAT_VERSION 1
+
 class djinn_ewah_model : public djinn_model {
 public:
     djinn_ewah_model();
@@ -669,9 +947,11 @@ public:
 
     int EncodeBcf(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) override;
     int Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) override;
+    int EncodeBcfBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded = nullptr) override;
+    int EncodeBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded = nullptr) override;
 
     void StartEncoding(bool use_pbwt, bool reset = false) override;
-    size_t FinishEncoding() override;
+    int64_t FinishEncoding() override;
     int StartDecoding() override;
 
     // Read/write
@@ -682,60 +962,105 @@ public:
     int GetSerializedSize() const override;
     int GetCurrentSize() const override;
 
-    // Todo: Merge EWAH data pairwise.
-    // If the data is PBWT-permuted then first unpermute and add
-    // raw data together.
-    int Merge(djinn_ewah_model& model1, djinn_ewah_model& model2) {
-        std::unordered_map<uint32_t, uint64_t> merge_map; // map ploidy -> new length
-        std::unordered_map<uint32_t, uint64_t> model_map; // map ploidy -> offset in tgt_containers
-        // Vector of vector of model containers to merge.
-        std::vector< std::vector< std::shared_ptr<djn_ewah_model_container_t> > > tgt_containers;
-
-        djinn_ewah_model* models[2] = {&model1, &model2};
-        
-        // Cycle over pairs of ploidy models in either container.
-        // Record the ploidy maps where ploidy in the (ploidy,len)-tuple are the same
-        // and add a new container with (ploidy,lenA + lenB).
-        for (int i = 0; i < 2; ++i) {
-            std::unordered_map<uint64_t, uint32_t>& target_map = models[i]->ploidy_map;
-            for (auto it = target_map.begin(); it != target_map.end(); ++it) {
-                // it->first  = (ploidy,len)-tuple
-                // it->second = offset into ploidy_models
-                // const uint64_t tuple = ((uint64_t)len_data << 32) | ploidy;
-                uint32_t ploidy = it->first & ((1L << 32) - 1);
-                uint32_t len = (it->first >> 32) & ((1L << 32) - 1);
-                std::cerr << it->first << "(" << ploidy << "," << len << ") -> " << it->second << std::endl;
-
-                auto search = merge_map.find(ploidy);
-                if (search != merge_map.end()) {
-                    // Already in map: increment by current length.
-                    search->second += len;
-                    tgt_containers.back().push_back(models[i]->ploidy_models[it->second]);
-                } else {
-                    // std::cerr << "Not found. Inserting: " << len_data << "," << ploidy << "(" << tuple << ") as " << ploidy_models.size() << std::endl;
-                    merge_map[ploidy] = len;
-                    model_map[ploidy] = tgt_containers.size();
-                    tgt_containers.push_back(std::vector< std::shared_ptr<djn_ewah_model_container_t> >());
-                    tgt_containers.back().push_back(models[i]->ploidy_models[it->second]);
-                }
-            }
-        }
-
-        for (auto it = merge_map.begin(); it != merge_map.end(); ++it) {
-            // it->first  = ploidy
-            // it->second = new len
-            const uint64_t tuple = ((uint64_t)it->second << 32) | it->first;
-            ploidy_map[tuple] = ploidy_models.size();
-
-            // Add new containers.
-            ploidy_models.push_back(std::make_shared<djn_ewah_model_container_t>(it->second, it->first, (bool)use_pbwt));
-            ploidy_models.back()->StartEncoding(use_pbwt, init);
-            // tgt_container = ploidy_models[ploidy_models.size() - 1];
-            // tgt_container->StartEncoding(use_pbwt, init);
-        }
-
-        return 1;
-    }
+    /**
+     * Serialize the model, optionally without storing the dictionary inline.
+     * Used by djinn_archive_writer that stores the dictionary once in a
+     * DJN_FRAME_DICT frame instead.
+     * 
+     * @param dst         Destination buffer.
+     * @param inline_dict Store the dictionary in the first block that uses it.
+     * @return int        Returns the number of written bytes.
+     */
+    int Serialize(uint8_t* dst, bool inline_dict) const;
+    int GetSerializedSize(bool inline_dict) const;
+
+    /**
+     * Train a compression dictionary from the uncompressed streams of the 
+     * next n_blocks calls to FinishEncoding. Once trained, the dictionary is
+     * applied to all subsequent blocks. Archives store it once in a 
+     * DJN_FRAME_DICT frame preceding the first block that uses it, whereas
+     * blocks serialized directly store it inline in the first block that 
+     * uses it. Readers keep the dictionary alive across calls to Deserialize.
+     * Training requires Zstd support but the dictionary is used by either
+     * codec. If training fails, encoding continues without a dictionary and
+     * GetDictionarySize returns 0.
+     * 
+     * @param n_blocks Number of blocks to sample. Setting this to 0 disables training.
+     * @param dict_cap Maximum size of the dictionary in bytes.
+     * @return int     Returns 1 on success or a negative value otherwise.
+     */
+    int SetDictionaryTraining(uint32_t n_blocks, uint32_t dict_cap = 65536);
+
+    /**
+     * Set advanced codec parameters such as Zstd long-distance matching, 
+     * worker threads, or the LZ4 acceleration factor. These parameters only
+     * affect encoding.
+     * 
+     * @param params Codec parameters.
+     * @return int   Returns 1 on success, -2 if a parameter is not supported 
+     *               by the linked codec library, or another negative value 
+     *               otherwise.
+     */
+    int SetCodecParameters(const djinn_codec_params_t& params);
+
+    /**
+     * Set the objective used for automatic codec selection when the codec is
+     * CompressionStrategy::AUTO. Each compressed stream, in each block and
+     * each ploidy container, is then compressed with the candidate codec and 
+     * level resulting in the smallest output that satisfy the objective.
+     * 
+     * @param objective Selection objective.
+     * @return int      Returns 1 on success or a negative value otherwise.
+     */
+    int SetAutoObjective(const djinn_auto_codec_t& objective);
+
+    /**
+     * Load a pre-computed dictionary. This is required when decoding blocks 
+     * serialized outside of an archive out-of-order as the dictionary is only
+     * stored in the first block that used it. Archive readers load the 
+     * dictionary frames automatically. A dictionary loaded before opening an
+     * archive writer is stored following the archive header. StartDecoding
+     * returns -5 for blocks requiring a dictionary when none is loaded.
+     * 
+     * @param dict     Dictionary content.
+     * @param dict_len Length of the dictionary.
+     * @return int     Returns 1 on success or a negative value otherwise.
+     */
+    int SetDictionary(const uint8_t* dict, uint32_t dict_len);
+    const uint8_t* GetDictionary() const;
+    uint32_t GetDictionarySize() const;
+
+private:
+    // Append an uncompressed stream to the dictionary training samples.
+    void SampleDictionaryStream(const uint8_t* src, uint32_t src_len);
+
+    // Returns the offset of the container for the (data length, ploidy)-tuple
+    // in ploidy_models. New containers are created as required.
+    uint32_t SelectContainer(size_t len_data, int ploidy);
+    
+    // Same as SelectContainer but caches the offsets by ploidy in offsets
+    // for the rows of a batch.
+    uint32_t SelectBatchContainer(std::vector<uint32_t>& offsets, size_t len_data, int ploidy);
+    
+    // Encode a single variant into the given container.
+    int EncodeBcfContainer(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, uint8_t alt_alleles);
+    int EncodeContainer(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, uint8_t alt_alleles);
+    int EncodeRow(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, uint8_t alt_alleles, bool bcf);
+    int EncodeGtRow(djn_ewah_model_container_t* tgt_container, const uint8_t* data, size_t len_data, const djn_gt_stats_t& stats, bool bcf);
+
+    // The two stages of encoding a variant: PermuteRow selects the archetype
+    // and permutes the variant with the PBWT. 2mc sites are packed into the
+    // zeroed bitmap. Otherwise, the permuted row is written to out if set,
+    // or in place, and returned. EncodePermutedRow encodes the bitmap or the
+    // returned row.
+    uint8_t* PermuteRow(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, const djn_gt_stats_t& stats, uint8_t alt_alleles, bool bcf, uint8_t* out, uint32_t* bitmap, uint8_t& type);
+    int EncodePermutedRow(djn_ewah_model_container_t* tgt_container, const uint8_t* data, size_t len_data, const djn_gt_stats_t& stats, uint8_t type, uint8_t* permuted, uint32_t* bitmap, bool bcf);
+
+    // Shared implementation for EncodeBcfBatch and EncodeBatch. Batches of
+    // PBWT-permuted variants with at least DJN_BATCH_PIPELINE_MIN_SAMPLES
+    // haplotypes overlap the two encoding stages across variants.
+    int EncodeBatchContainers(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, bool bcf, uint32_t* n_encoded);
+    int EncodeBatchPipelined(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, bool bcf, uint32_t* n_encoded);
 
 public:
     int DecodeNext(djinn_variant_t*& variant) override;
@@ -744,12 +1069,13 @@ public:
     int DecodeNextRaw(djinn_variant_t*& variant) override;
 
 public:
-    CompressionStrategy codec; // Either ZSTD or LZ4 at the moment.
+    CompressionStrategy codec; // Either ZSTD, LZ4, NONE, or AUTO.
     int compression_level;
 
     uint8_t *p;     // data
     uint32_t p_len; // data length
     uint32_t p_cap:31, p_free:1; // allocated data length, ownership of data flag
+    CompressionStrategy p_codec; // codec used for p
 
     // Support buffer. Currently only used for decoding EWAH.
     uint8_t *q;     // data
@@ -758,6 +1084,17 @@ public:
 
     std::unordered_map<uint64_t, uint32_t> ploidy_map; // maps (data length, ploidy) packed into a 64-bit word to model offsets
     std::vector< std::shared_ptr<djn_ewah_model_container_t> > ploidy_models;
+
+    // Persistent codec state reused across blocks, including the optional
+    // dictionary.
+    std::shared_ptr<djn_codec_ctx_t> codec_ctx;
+    uint32_t dict_train_blocks, dict_sampled_blocks, dict_cap; // dictionary training parameters
+    std::vector<uint8_t> dict_samples; // uncompressed samples for training
+    std::vector<size_t> dict_sample_sizes;
+    uint8_t block_dict: 1,        // current block uses the dictionary
+            block_dict_inline: 1, // current block stores the dictionary
+            dict_emitted: 1,      // dictionary has been stored in a previous block
+            dict_unused: 5;
 };
 
 /***************************************
@@ -765,93 +1102,134 @@ public:
 ***************************************/
 struct djn_bitmap_model_t {
 public:
-    djn_bitmap_model_t() : p(nullptr), p_len(0), u_len(0), p_cap(0), p_free(true) {}
-    ~djn_bitmap_model_t() { 
-        if (p_free) delete[] p;
-    }
+    djn_bitmap_model_t();
+    ~djn_bitmap_model_t();
+
+    /**
+     * Compress the u_len bytes currently stored in p using the provided
+     * scratch memory and codec. The compressed data is copied back into p.
+     * 
+     * @param scratch        Scratch memory. Grown if too small.
+     * @param ctx            Codec state.
+     * @param strat          Compression codec.
+     * @param c_level        Compression level.
+     * @return int           Returns the compressed size in bytes or a negative value on error.
+     */
+    int Compress(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, CompressionStrategy strat, int c_level);
+
+    /**
+     * Decompress the stored data into an external buffer that MUST be able to
+     * hold at least u_len bytes.
+     * 
+     * @param out     Destination buffer.
+     * @param out_cap Capacity of the destination buffer in bytes.
+     * @param ctx     Codec state.
+     * @param strat   Compression codec.
+     * @return int    Returns the number of decompressed bytes or a negative value on error.
+     */
+    int Decompress(uint8_t* out, uint32_t out_cap, djn_codec_ctx_t* ctx, CompressionStrategy strat) const;
 
     // Read/write
     int Serialize(uint8_t* dst) const;
     int Serialize(std::ostream& stream) const;
     int GetSerializedSize() const;
-    int Deserialize(uint8_t* dst);
-    int Deserialize(std::istream& stream);
+    // Deserialization fails if the data exceeds len bytes.
+    int Deserialize(uint8_t* dst, uint32_t len);
+    int Deserialize(std::istream& stream, uint32_t len);
 
 public:
     // Data must be aligned to the largest memory boundary available to 
     // ascertain good vectorization performance.
     uint64_t *p;     // bitmaps
-    uint32_t p_len, u_len; // data length
-    uint32_t p_cap:31, p_free:1; // capacity (memory allocated), flag for data ownership
+    uint32_t p_len, u_len; // data length in bytes (compressed, uncompressed)
+    uint32_t p_cap:31, p_free:1; // capacity in bytes (memory allocated), flag for data ownership
 };
 
+/**
+ * Sample-centric bitmap model. Input data is provided in the usual
+ * variant-major order (one variant at a time) and is transposed into 
+ * sample-major bitmaps when calling FinishEncoding. Each sample stores 
+ * ploidy-many haplotype bitmaps spanning all the variants in the block, 
+ * followed by the same number of missing-value bitmaps if any missing
+ * values were observed in the block. Each sample is compressed 
+ * independently such that the genotypes for a single sample can be 
+ * retrieved without touching the remaining samples.
+ * 
+ * Only biallelic haploid or diploid samples are supported in this model.
+ * This is a concious design decision to maximize computational throughput
+ * for the most common use-case.
+ */
 class djinn_bitmap_model {
 public:
-    djinn_bitmap_model() : 
-        codec(CompressionStrategy::LZ4), compression_level(1), 
-        q(new uint8_t[10000000]), q_len(0), 
-        q_alloc(10000000), q_free(true), n_samples(0), n_samples_bitmap(0), n_variants(0) { }
-
-    djinn_bitmap_model(CompressionStrategy codec, int c_level = 1) : 
-        codec(codec), compression_level(c_level), 
-        q(new uint8_t[10000000]), q_len(0), 
-        q_alloc(10000000), q_free(true), n_samples(0), n_samples_bitmap(0), n_variants(0) { }
+    djinn_bitmap_model();
+    djinn_bitmap_model(CompressionStrategy codec, int c_level = 1);
+    ~djinn_bitmap_model();
 
-    ~djinn_bitmap_model() {
-        if (q_free) delete[] q;
-    }
-
-    // Only biallelic haploid or diploid samples are supported in this model.
-    // This is a concious design decision to maximize computational throughput
-    // for the most common use-case.
+    /**
+     * Encode Bcf-encoded data for a single variant site. The length of the 
+     * data MUST be equal to n_samples * ploidy as set in StartEncoding.
+     * 
+     * @param data        Bcf-encoded genotypes.
+     * @param len_data    Length of the data array.
+     * @param ploidy      Base ploidy (stride size).
+     * @param alt_alleles Number of alleles including the reference.
+     * @return int        Returns 1 on success or a negative value otherwise.
+     */
     int EncodeBcf(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles);
+    /**
+     * Same as EncodeBcf but accepts [0,N-1]-encoded byte vectors where 14 
+     * encodes missing values.
+     */
+    int Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles);
+
+    /**
+     * Builds all the neccessary objects before passing data for encoding. 
+     * Calling this function is REQUIRED prior to calling EncodeBcf or Encode.
+     * 
+     * @param n_samples Number of samples.
+     * @param ploidy    Base ploidy: either 1 or 2.
+     * @return int      Returns 1 on success or a negative value otherwise.
+     */
+    int StartEncoding(uint32_t n_samples, int ploidy);
     
-    int Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) {
-        if (data == nullptr) return -1;
-        if (len_data == 0)   return  0;
-        if (alt_alleles > 4) return -2;
-        if (n_variants == n_samples) return -3;
-
-        // Compute allele counts.
-        memset(hist_alts, 0, 256*sizeof(uint32_t));
-        for (int i = 0; i < len_data; ++i) {
-            ++hist_alts[data[i]];
-        }
-
-        if (ploidy == 1) {
-            for (int i = 0; i < len_data; ++i) {
-                const uint8_t& gt = DJN_BCF_UNPACK_GENOTYPE(data[i]);
-                bitmaps[i]->p[n_variants / 64] |= (uint64_t)gt << (n_variants % 64);
-            }
-        } else if (ploidy == 2) {
-                for (int i = 0; i < len_data; ++i) {
-                const uint8_t& gt = DJN_BCF_UNPACK_GENOTYPE(data[i]);
-                bitmaps[i]->p[n_variants / 32] |= (uint64_t)gt << (2*(n_variants % 32)+0);
-                bitmaps[i]->p[n_variants / 32] |= (uint64_t)gt << (2*(n_variants % 32)+1);
-            }
-        }
-        ++n_variants;
-
-        return 1;
-    }
+    /**
+     * Transpose the variant-major input data into sample-major bitmaps and
+     * compress each sample independently. Calling this function is REQUIRED 
+     * prior to calling Serialize or starting to decode data.
+     * 
+     * @return int64_t Returns the total compressed size in bytes or a negative value on error.
+     */
+    int64_t FinishEncoding();
+    int StartDecoding();
 
-    // Allele counts must be either 2 (biallelic, no missing) or 4
-    // biallelic (including missing).
-    int StartEncoding(uint32_t n_samples, uint32_t n_alleles) {
-        if (n_samples == 0) return -1;
-        if (this->n_samples != n_samples) {
-            this->n_samples = n_samples;
-            n_samples_bitmap = std::ceil(n_samples/32.0f)*32;
-            bitmaps.resize(n_samples);
-            n_variants = 0;
-        } else {
-            for (int i = 0; i < bitmaps.size(); ++i) 
-                bitmaps[i]->p_len = 0;
-        }
-        return 1;
-    }
+    /**
+     * Decode the bitmaps for a given sample. The output is written as 
+     * ploidy-many haplotype bitmaps of n_words_variant 64-bit words each,
+     * where bit j in word i corresponds to variant 64*i + j, followed by the
+     * same number of missing-value bitmaps if has_missing is set.
+     * 
+     * @param sample  Target sample in [0, n_samples).
+     * @param out     Destination buffer.
+     * @param n_words Capacity of the destination buffer in 64-bit words. Use 
+     *                GetSampleWords() to determine the required size.
+     * @return int    Returns the number of 64-bit words written or a negative value otherwise.
+     */
+    int DecodeSample(uint32_t sample, uint64_t* out, uint32_t n_words);
 
-    int StartDecoding();
+    /**
+     * Decode the genotypes for a given sample into a byte array of length
+     * n_variants * ploidy. Alleles are stored as 0 (ref), 1 (alt) or 14
+     * (missing) in the same ordering as the input data.
+     * 
+     * @param sample  Target sample in [0, n_samples).
+     * @param out     Destination buffer of at least n_variants * ploidy bytes.
+     * @param out_len Returns the number of bytes written.
+     * @return int    Returns 1 on success or a negative value otherwise.
+     */
+    int DecodeSample(uint32_t sample, uint8_t* out, uint32_t& out_len);
+
+    // Number of 64-bit words required to hold the decoded bitmaps of a sample.
+    inline uint32_t GetSampleWords() const { return ploidy * n_words_variant * (1 + has_missing); }
 
     // Read/write
     int Serialize(uint8_t* dst) const;
@@ -861,26 +1239,639 @@ public:
     int GetSerializedSize() const;
     int GetCurrentSize() const;
 
+    // Set advanced codec parameters. See djinn_ewah_model::SetCodecParameters.
+    int SetCodecParameters(const djinn_codec_params_t& params);
+
     // Accessors.
     std::shared_ptr<djn_bitmap_model_t> operator[](const uint32_t p) { return bitmaps[p]; }
     std::shared_ptr<djn_bitmap_model_t> at(const uint32_t p) { return bitmaps[p]; }
 
+private:
+    // Grow the variant-major input matrices to hold at least n_rows variants.
+    void ResizeRows(uint32_t n_rows);
+
 public:
     CompressionStrategy codec; // Either ZSTD or LZ4 at the moment.
     int compression_level;
-
-    // Support buffer. Currently only used for using additional compressors.
-    uint8_t *q;     // data
-    uint32_t q_len; // data length
-    uint32_t q_alloc:31, q_free:1; // allocated data length, ownership of data flag
+    std::shared_ptr<djn_codec_ctx_t> codec_ctx; // Persistent codec state.
 
     // Vector of bitmaps.
-    uint32_t n_samples, n_samples_bitmap, n_variants;
+    int ploidy; // base ploidy: either 1 or 2
+    int has_missing; // set if any missing values were observed in this block
+    uint32_t n_samples, n_samples_bitmap, n_variants; // n_samples_bitmap: haplotypes rounded up to closest 64-bit boundary
+    uint32_t n_words_variant; // number of 64-bit words per haplotype bitmap (variants / 64)
     std::vector< std::shared_ptr<djn_bitmap_model_t> > bitmaps;
 
-    // Supportive array for computing allele counts to determine the presence
-    // of missing values and/or end-of-vector symbols (in Bcf-encodings).
-    uint32_t hist_alts[256];
+    // Variant-major input matrices: each row stores n_samples_bitmap bits for
+    // a single variant. These are transposed into the sample-major bitmaps
+    // when calling FinishEncoding.
+    uint64_t* rows; // alt alleles
+    uint64_t* rows_missing; // missing values
+    uint32_t m_rows; // number of rows allocated
+};
+
+/***************************************
+*  PBWT haplotype matching
+***************************************/
+// Haplotype match reported by djinn_pbwt_matcher. Matches span the
+// half-open interval [start, end) of variants counted from the first variant
+// added to the matcher.
+struct djinn_hap_match_t {
+    uint32_t hap1, hap2; // haplotype indices with hap1 < hap2
+    uint32_t start, end; // first variant and one-past-last variant of the match
+};
+
+/**
+ * Haplotype matching with the positional Burrows-Wheeler transform (Durbin
+ * 2014). Decoded variants are provided one at a time in the order they are
+ * stored and the prefix (ppa) and divergence (div) arrays are maintained
+ * with the usual single-pass queue scheme. Matches are reported at the
+ * variant where they end, so a region is scanned in a single pass with
+ * O(n_haplotypes) memory.
+ *
+ * Two queries are supported:
+ * 1) All pairs of haplotypes with a match of at least min_length variants
+ *    (Algorithm 3 in Durbin 2014).
+ * 2) Set-maximal matches of an external query haplotype against the panel
+ *    of at least min_length variants (Algorithm 4 in Durbin 2014). The query
+ *    haplotype is appended to the panel with index n_haplotypes and every
+ *    reported match has hap2 == n_haplotypes.
+ *
+ * Alleles are compared as stored: missing values and end-of-vector markers
+ * are treated as distinct alleles and therefore break matches. The
+ * permutation stored in PBWT-encoded blocks cannot be reused for matching
+ * as the models only update it for a subset of the variants and per ploidy
+ * and archetype.
+ */
+class djinn_pbwt_matcher {
+public:
+    djinn_pbwt_matcher();
+    ~djinn_pbwt_matcher();
+
+    // Disallow all forms of copying and moving.
+    djinn_pbwt_matcher(const djinn_pbwt_matcher& other) = delete;
+    djinn_pbwt_matcher(djinn_pbwt_matcher&& other) noexcept = delete;
+    djinn_pbwt_matcher& operator=(const djinn_pbwt_matcher& other) = delete;
+    djinn_pbwt_matcher& operator=(djinn_pbwt_matcher&& other) noexcept = delete;
+
+    /**
+     * Prepare the matcher for a new pass over a panel of haplotypes. Any
+     * previous state and stored matches are discarded.
+     *
+     * @param n_haplotypes Number of haplotypes in the panel (samples * ploidy).
+     * @param min_length   Minimum match length in number of variants.
+     * @param with_query   Report set-maximal matches of an external query
+     *                     haplotype instead of all pairs of long matches.
+     * @return int         Returns 1 on success or a negative value otherwise.
+     */
+    int Initiate(uint32_t n_haplotypes, uint32_t min_length, bool with_query = false);
+
+    /**
+     * Add the next variant to the matcher. Matches ending at this variant
+     * are appended to matches.
+     *
+     * @param variant      Variant unpacked into byte literals (DJN_UN_IND).
+     * @param query_allele Allele of the query haplotype. Ignored unless the
+     *                     matcher was initiated with a query.
+     * @return int         Returns the number of reported matches or a negative value otherwise.
+     */
+    int Update(const djinn_variant_t& variant, uint8_t query_allele = 0);
+    int Update(const uint8_t* alleles, uint8_t query_allele = 0);
+
+    /**
+     * Report the matches extending to the last variant added. Must be called
+     * once the region has been scanned.
+     *
+     * @return int Returns the number of reported matches.
+     */
+    int Finish();
+
+private:
+    // Report the matches that end at variant n_variants given the alleles
+    // in prefix order or at the end of the region (alleles == nullptr).
+    uint32_t ReportLong(const uint8_t* alleles);
+    uint32_t ReportQuery(const uint8_t* alleles);
+    void AddMatch(uint32_t h1, uint32_t h2, uint32_t start);
+
+public:
+    uint32_t n_haplotypes; // number of panel haplotypes
+    uint32_t min_length; // minimum match length in variants
+    uint32_t n_variants; // number of variants added
+    bool with_query; // report matches of the query haplotype
+    std::vector<djinn_hap_match_t> matches; // reported matches; cleared by the user
+
+private:
+    uint32_t n_total; // n_haplotypes, +1 for the query haplotype
+    uint32_t query_pos; // position of the query haplotype in ppa
+    uint32_t* ppa; // haplotypes sorted by their reverse prefixes
+    uint32_t* div; // start of the match between ppa[i-1] and ppa[i]; div[n_total] is a sentinel
+    uint32_t* tmp_ppa; // output buffers for the queues
+    uint32_t* tmp_div;
+    uint8_t*  y; // alleles in prefix order
+};
+
+/***************************************
+*  Archive format
+***************************************/
+// Archives are framed streams of serialized blocks:
+//
+// Header:  magic (8 bytes), version, model, codec, flags, #samples,
+//          reserved, CRC32C of the preceding header bytes.
+// Frames:  type, payload length, #variants, CRC32C of the payload,
+//          CRC32C of the preceding frame header bytes, payload.
+// Trailer: a DJN_FRAME_TRAILER frame storing the total number of blocks and
+//          variants, and the offset of the index frame (0 if absent). A 
+//          stream without a trailer has been truncated.
+//
+// Archives with site tables end with a DJN_FRAME_INDEX frame listing the
+// contig names and, for every run of sites of the same contig within a
+// block, the offset of the block and the covered interval. Together with
+// the positions in the site tables this forms a two-level index for
+// interval queries.
+//
+// Optional metadata frames precede the genotype blocks they describe:
+// DJN_FRAME_SAMPLES and DJN_FRAME_CONTIGS store name lists (a contig frame
+// replaces any previous one) and a DJN_FRAME_SITES frame stores the site
+// table of the block that immediately follows it. Likewise, a 
+// DJN_FRAME_STATS frame stores the summary statistics of the following block.
+// A DJN_FRAME_DICT frame stores the compression dictionary of all following
+// EWAH blocks that use one: a preset dictionary follows the header and a 
+// trained dictionary precedes the first block that uses it. The index lists
+// the offsets of the dictionary frames for random access.
+//
+// Frames of unknown types are skipped by readers.
+#define DJN_ARCHIVE_HEADER_SIZE 32
+#define DJN_FRAME_HEADER_SIZE   20
+
+#define DJN_ARCHIVE_MODEL_CTX  1
+#define DJN_ARCHIVE_MODEL_EWAH 2
+
+#define DJN_FRAME_BLOCK   1
+#define DJN_FRAME_SAMPLES 2
+#define DJN_FRAME_CONTIGS 3
+#define DJN_FRAME_SITES   4
+#define DJN_FRAME_INDEX   5
+#define DJN_FRAME_STATS   6
+#define DJN_FRAME_DICT    7
+#define DJN_FRAME_TRAILER 255
+
+// Error codes returned by the archive reader and writer. The library does not
+// print diagnostics: use ArchiveErrorString to describe a code.
+#define DJN_ARCHIVE_ERR_IO          -1 // truncated stream, failed write, or invalid state
+#define DJN_ARCHIVE_ERR_CORRUPT     -2 // checksum mismatch or malformed frame
+#define DJN_ARCHIVE_ERR_INVALID     -3 // not an archive or invalid arguments
+#define DJN_ARCHIVE_ERR_UNSUPPORTED -4 // incompatible archives, newer version, or unavailable codec
+#define DJN_ARCHIVE_ERR_NO_INDEX    -6 // archive has no index
+
+/**
+ * Returns a short description of a DJN_ARCHIVE_ERR_* code.
+ */
+const char* ArchiveErrorString(int code);
+
+static constexpr uint8_t DJN_ARCHIVE_MAGIC[8] = {'D','J','N','A',0x0D,0x0A,0x1A,0x0A};
+
+struct djinn_archive_header_t {
+    djinn_archive_header_t() : version(DJINN_VERSION_NUMBER), model(0), codec(0), flags(0), n_samples(0) {}
+
+    uint32_t version;   // DJINN_VERSION_NUMBER of the writer
+    uint8_t  model;     // DJN_ARCHIVE_MODEL_*
+    uint8_t  codec;     // CompressionStrategy (EWAH model only)
+    uint16_t flags;     // bit 0: PBWT, bit 1: models reset for every block
+    uint32_t n_samples; // number of samples
+};
+
+/**
+ * Columnar table of site metadata for the variants of a single block: contig
+ * index, 1-based position, alleles, and the ordinal of the record in the
+ * source file. Alleles are stored comma-separated with the reference allele
+ * first ("A,C,G"), as used by Htslib.
+ * 
+ * Serialized columns are encoded separately (run-length encoded contigs,
+ * delta-encoded positions and ordinals, allele lengths followed by the
+ * allele strings) and compressed as a whole.
+ */
+class djinn_site_table {
+public:
+    djinn_site_table();
+    ~djinn_site_table();
+
+    void clear();
+    uint32_t size() const { return pos.size(); }
+
+    /**
+     * Add a site.
+     * 
+     * @param contig      Index of the contig.
+     * @param position    1-based position.
+     * @param alleles     Comma-separated alleles with the reference allele first.
+     * @param len_alleles Length of the alleles string.
+     * @param ordinal     Ordinal of the record in the source file.
+     */
+    void Add(int32_t contig, int64_t position, const char* alleles, uint32_t len_alleles, uint64_t ordinal);
+
+    const char* alleles(uint32_t i) const { return &allele_data[allele_offset[i]]; }
+    uint32_t alleles_len(uint32_t i) const { return allele_offset[i+1] - allele_offset[i]; }
+
+    /**
+     * Write the first eight Vcf columns and the FORMAT column of site i
+     * (CHROM to FORMAT, tab-terminated). Contigs without a name are written
+     * as their index. The destination must hold at least VcfLength(i) bytes.
+     * 
+     * @return int Returns the number of written bytes or a negative value on error.
+     */
+    int ToVcf(uint32_t i, const std::vector<std::string>& contigs, char* out) const;
+    uint32_t VcfLength(uint32_t i, const std::vector<std::string>& contigs) const;
+
+    /**
+     * Serialize and compress the table. Falls back to storing the
+     * uncompressed columns if the codec is not available.
+     * 
+     * @param out   Destination buffer (resized as required).
+     * @param codec Compression codec.
+     * @return int  Returns the size of the serialized table or a negative value on error.
+     */
+    int Serialize(std::vector<uint8_t>& out, CompressionStrategy codec) const;
+
+    /**
+     * Decompress and deserialize a table written by Serialize.
+     * 
+     * @return int Returns the number of sites or a negative value on error.
+     */
+    int Deserialize(const uint8_t* data, uint32_t len);
+
+public:
+    std::vector<int32_t>  contig;
+    std::vector<int64_t>  pos;
+    std::vector<uint64_t> ordinal;
+    std::vector<uint32_t> allele_offset; // size() + 1 offsets into allele_data
+    std::vector<char>     allele_data;
+};
+
+/**
+ * Filter on variant summary statistics. The default filter accepts all
+ * variants.
+ */
+struct djinn_stats_filter_t {
+    djinn_stats_filter_t() : min_maf(0), max_maf(1), max_missing(std::numeric_limits<uint32_t>::max()), max_allele(255) {}
+
+    float    min_maf, max_maf; // minor allele frequency interval
+    uint32_t max_missing; // largest number of missing values
+    uint8_t  max_allele;  // largest allele index
+};
+
+/**
+ * Summary statistics of the variants of a block. Besides the per-variant
+ * records, the serialized table starts with an uncompressed block summary
+ * such that blocks can be skipped without decompressing the records.
+ */
+class djinn_stats_table {
+public:
+    djinn_stats_table();
+    ~djinn_stats_table();
+
+    void clear();
+    uint32_t size() const { return variants.size(); }
+
+    /**
+     * Returns TRUE if variant i passes the filter.
+     */
+    bool Pass(uint32_t i, const djinn_stats_filter_t& filter) const;
+
+    /**
+     * Returns FALSE if no variant of the block can pass the filter.
+     */
+    bool Pass(const djinn_stats_filter_t& filter) const;
+
+    /**
+     * Serialize and compress the per-variant records. The block summary is
+     * computed from the records.
+     * 
+     * @return int Returns the size of the serialized table or a negative value on error.
+     */
+    static int Serialize(const std::vector<djinn_variant_stats_t>& stats, std::vector<uint8_t>& out, CompressionStrategy codec);
+
+    /**
+     * Deserialize the block summary and, optionally, the per-variant records.
+     * 
+     * @return int Returns the number of variants or a negative value on error.
+     */
+    int Deserialize(const uint8_t* data, uint32_t len, bool summary_only = false);
+
+public:
+    std::vector<djinn_variant_stats_t> variants;
+
+    // Block summary.
+    uint32_t n_variants;
+    uint32_t n_2mc; // number of variants of the 2MC archetype
+    float    min_maf, max_maf;
+    uint32_t min_missing, max_missing;
+    uint8_t  min_allele, max_allele; // range of the largest allele index of the variants
+};
+
+/**
+ * Index entry describing a run of sites of a single contig within a block.
+ */
+struct djinn_index_entry_t {
+    djinn_index_entry_t() : offset(0), contig(0), min_pos(0), max_end(0) {}
+
+    uint64_t offset;  // offset of the first frame of the block from the start of the archive
+    int32_t  contig;  // contig index
+    int64_t  min_pos; // smallest position of the sites
+    int64_t  max_end; // largest end position (POS + len(REF) - 1) of the sites
+};
+
+class djinn_archive_reader;
+
+/**
+ * Writes djinn_model blocks as a framed archive with per-block checksums.
+ * Usage: call Open once with the encoding model, WriteBlock after every call
+ * to FinishEncoding, and Close after the last block to write the trailer.
+ * Errors are returned as DJN_ARCHIVE_ERR_* codes.
+ */
+class djinn_archive_writer {
+public:
+    djinn_archive_writer();
+    ~djinn_archive_writer();
+
+    /**
+     * Write the archive header. The model kind and codec are inferred from the
+     * provided model. A dictionary loaded into an EWAH model is written 
+     * following the header.
+     * 
+     * @param stream    Destination stream.
+     * @param model     Model used for encoding.
+     * @param n_samples Number of samples.
+     * @return int      Returns the number of written bytes or a negative value on error.
+     */
+    int Open(std::ostream& stream, const djinn_model& model, uint32_t n_samples);
+
+    /**
+     * Write the archive header with the model kind, codec, flags, and number
+     * of samples of an existing archive. Used when concatenating archives.
+     * 
+     * @param stream Destination stream.
+     * @param header Header of the source archive.
+     * @return int   Returns the number of written bytes or a negative value on error.
+     */
+    int Open(std::ostream& stream, const djinn_archive_header_t& header);
+    
+    /**
+     * Serialize a finished model as a block frame. The summary statistics
+     * recorded while encoding are written in a preceding frame.
+     * 
+     * @param model Encoded model after calling FinishEncoding.
+     * @return int  Returns the size of the serialized model or a negative value on error.
+     */
+    int WriteBlock(const djinn_model& model);
+
+    /**
+     * Serialize a finished model as a block frame preceded by a frame holding
+     * its site table. The table must have one site per encoded variant.
+     * 
+     * @param model Encoded model after calling FinishEncoding.
+     * @param sites Site metadata of the encoded variants.
+     * @return int  Returns the total size of both frames or a negative value on error.
+     */
+    int WriteBlock(const djinn_model& model, const djinn_site_table& sites);
+
+    /**
+     * Write a list of names as a DJN_FRAME_SAMPLES or DJN_FRAME_CONTIGS frame.
+     * Sample names must be written before the first block.
+     * 
+     * @param type  DJN_FRAME_SAMPLES or DJN_FRAME_CONTIGS.
+     * @param names Names in index order.
+     * @return int  Returns the number of written bytes or a negative value on error.
+     */
+    int WriteNames(uint32_t type, const std::vector<std::string>& names);
+
+    /**
+     * Write a frame of the given type. Used for auxiliary data stored
+     * alongside the genotype blocks.
+     */
+    int WriteFrame(uint32_t type, const uint8_t* data, uint32_t len, uint32_t n_variants);
+
+    /**
+     * Append the blocks of another archive without decoding or recompressing
+     * them. The source must store the same model kind and number of samples,
+     * and its blocks must be independently decodable (models reset for every
+     * block) unless nothing has been written yet. Block frames are copied
+     * verbatim after verifying their checksums. Sample names must match the
+     * names written so far, and contigs are merged by name: site tables are
+     * only rewritten when contig indices change. The index is rebuilt when
+     * calling Close.
+     * 
+     * @param reader Source archive after calling Open.
+     * @return int   Returns the number of appended blocks or a negative value on error.
+     */
+    int AppendArchive(djinn_archive_reader& reader);
+
+    /**
+     * Recover the state of an existing archive, for example one left behind
+     * by an interrupted import, such that more blocks can be appended to it.
+     * Frames are read and verified up to the trailer or the first truncated
+     * or corrupted frame. Everything following the last complete block, 
+     * including the index and trailer of a finished archive, is discarded:
+     * the caller must truncate the file at the returned offset and then call
+     * Resume with a stream positioned at that offset. Requires an archive
+     * with models reset for every block.
+     * 
+     * @param stream Source archive.
+     * @return int64_t Returns the offset following the last complete block or a negative value on error.
+     */
+    int64_t Recover(std::istream& stream);
+
+    /**
+     * Continue writing after a call to Recover. The stream must be positioned
+     * at the offset returned by Recover.
+     * 
+     * @param stream Destination stream.
+     * @return int   Returns 1 on success or a negative value on error.
+     */
+    int Resume(std::ostream& stream);
+
+    /**
+     * Write the index, if any blocks with site tables were written, and the
+     * trailer. No frames may be written after calling Close.
+     * 
+     * @return int Returns 1 on success or a negative value on error.
+     */
+    int Close();
+
+public:
+    djinn_archive_header_t header;
+    uint64_t n_blocks;   // number of written blocks
+    uint64_t n_variants; // number of written variants
+    uint64_t n_bytes;    // number of written bytes
+    int64_t last_ordinal; // ordinal of the last written site or -1
+
+private:
+    int WriteStats(const djinn_model& model);
+    int WriteBlockFrame(const djinn_model& model);
+    int WriteDictionary(const djinn_model& model);
+    void AddIndexEntries(uint64_t offset, const djinn_site_table& sites);
+
+private:
+    std::ostream* stream;
+    std::vector<uint8_t> buf; // serialization buffer
+    std::vector<uint8_t> meta_buf; // metadata serialization buffer
+    CompressionStrategy meta_codec; // codec for metadata frames
+    std::vector<djinn_index_entry_t> index; // index entries of written blocks
+    std::vector<std::string> contigs; // last written contig names
+    std::vector<std::string> samples; // written sample names
+    std::vector<uint8_t> dict; // last written dictionary
+    std::vector<uint64_t> dict_offsets; // offsets of the dictionary frames
+    bool closed;
+};
+
+/**
+ * Reads archives written by djinn_archive_writer. Checksums are verified for
+ * every frame before its payload is deserialized. Streams written without
+ * framing (concatenated calls to Serialize) are read in legacy mode when the
+ * magic number is absent; the model kind must then be provided by the caller.
+ * Errors are returned as DJN_ARCHIVE_ERR_* codes.
+ */
+class djinn_archive_reader {
+public:
+    djinn_archive_reader();
+    ~djinn_archive_reader();
+
+    /**
+     * Read and verify the archive header.
+     * 
+     * @param stream       Source stream.
+     * @param legacy_model Model type of unframed streams (1: ctx model, 2 or 4: EWAH).
+     * @return int         Returns 1 for archives, 2 for legacy streams, or a negative value on error.
+     */
+    int Open(std::istream& stream, int legacy_model = 0);
+
+    /**
+     * Allocate a model matching the archive header. The caller owns the
+     * returned object.
+     */
+    djinn_model* CreateModel() const;
+
+    /**
+     * Read, verify, and deserialize the next block into the provided model.
+     * Metadata frames preceding the block are loaded into samples, contigs,
+     * and sites. The last dictionary read is loaded into EWAH models.
+     * 
+     * @param model Target model.
+     * @return int  Returns 1 when a block was read, 0 at the end of the 
+     *              archive, -1 if the stream is truncated, -2 on checksum 
+     *              mismatches, or another negative value on error.
+     */
+    int NextBlock(djinn_model& model);
+
+    /**
+     * Read the next block that may contain variants passing the filter.
+     * Blocks whose summary statistics exclude all variants are skipped
+     * without deserializing their payload. Blocks without statistics are
+     * always read. Use stats.Pass(i, filter) to select individual variants.
+     * 
+     * @param model  Target model.
+     * @param filter Filter on summary statistics.
+     * @return int   Returns values as for NextBlock.
+     */
+    int NextBlock(djinn_model& model, const djinn_stats_filter_t& filter);
+
+    /**
+     * Read and verify the next frame of any type without interpreting it.
+     * The payload is available in frame_data() after a successful call.
+     * 
+     * @return int Returns 1 when a frame was read, 0 at the end of the
+     *             archive, or a negative value as for NextBlock.
+     */
+    int NextFrame();
+
+    /**
+     * Verify the checksums of all remaining frames without decoding them.
+     * 
+     * @return int Returns the number of verified blocks or a negative value as for NextBlock.
+     */
+    int64_t Verify();
+
+    /**
+     * Load the index and the sample and contig names from a seekable stream.
+     * The stream is rewound to the first frame afterwards.
+     * 
+     * @return int Returns the number of index entries, -6 if the archive has
+     *             no index, or another negative value on error.
+     */
+    int LoadIndex();
+
+    /**
+     * Select the variants overlapping the interval [start, end] (1-based,
+     * inclusive) of a contig. A variant overlaps if any base of its
+     * reference allele is within the interval. Requires LoadIndex and an
+     * archive whose models were reset for every block.
+     * 
+     * @param contig Contig index or name.
+     * @param start  First position.
+     * @param end    Last position.
+     * @return int   Returns the number of blocks to read or a negative value on error.
+     */
+    int Query(int32_t contig, int64_t start, int64_t end);
+    int Query(const std::string& contig, int64_t start, int64_t end);
+
+    /**
+     * Decode the next variant selected by Query. Only blocks overlapping the
+     * interval are read. Variants preceding the interval in the first block
+     * are decoded (as the model state is sequential) but not returned, and
+     * decoding of a block stops after its last overlapping variant. The site
+     * of the returned variant is sites[query_site].
+     * 
+     * @param model   Model used for decoding the blocks.
+     * @param variant Destination variant.
+     * @return int    Returns 1 when a variant was decoded, 0 when there are no
+     *                more variants, or a negative value on error.
+     */
+    int NextQuery(djinn_model& model, djinn_variant_t*& variant);
+
+    const uint8_t* frame_data() const { return buf.data(); }
+
+public:
+    djinn_archive_header_t header;
+    bool legacy;   // stream is not framed
+    bool finished; // trailer has been read
+    uint32_t frame_type, frame_len, frame_variants; // last frame read
+    uint64_t n_blocks;   // number of blocks read
+    uint64_t n_variants; // number of variants read
+    uint64_t n_skipped;  // number of blocks skipped by filters
+
+    std::vector<std::string> samples; // sample names, if stored
+    std::vector<std::string> contigs; // contig names, if stored
+    djinn_site_table sites; // site table of the last block read
+    bool has_sites; // the last block read has a site table
+    std::vector<djinn_index_entry_t> index; // index entries, if loaded
+    std::vector<uint64_t> dict_offsets; // offsets of the dictionary frames, if loaded
+    uint32_t query_site; // site of the last variant returned by NextQuery
+    djinn_stats_table stats; // summary statistics of the last block read
+    bool has_stats; // the last block read has summary statistics
+
+private:
+    int ReadNames(std::vector<std::string>& names);
+    int ReadIndex();
+    int LoadDictionary(uint64_t offset);
+    int NextBlock(djinn_model& model, const djinn_stats_filter_t* filter);
+    bool QueryMatch(uint32_t site) const;
+
+private:
+    std::istream* stream;
+    std::vector<uint8_t> buf; // frame payload
+    uint8_t prefix[DJN_ARCHIVE_HEADER_SIZE]; // bytes consumed when detecting legacy streams
+    uint32_t prefix_len;
+    int legacy_model;
+    int64_t base; // stream offset of the archive header
+    std::vector<uint8_t> dict; // last dictionary read
+    int64_t dict_offset; // offset of the loaded dictionary frame or -1 if unknown
+
+    // Query state.
+    std::vector<uint64_t> query_blocks; // offsets of the blocks to read
+    uint32_t query_block; // current block in query_blocks
+    int32_t  query_contig;
+    int64_t  query_start, query_end;
+    uint32_t query_next, query_last; // next and one-past-last site to decode
+    bool     query_loaded; // a block of query_blocks is being decoded
 };
 
 }
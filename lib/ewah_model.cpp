@@ -1,24 +1,54 @@
 #include <cstring> //memcpy
+#include <thread> //std::thread
+#include <mutex> //std::mutex
+#include <condition_variable> //std::condition_variable
 
 #include "djinn.h"
 #include "pbwt.h"
 #include "compressors.h"
+#include "scratch.h"
+#include "genotype_stats.h"
 
 namespace djinn {
 
+/*======   Supportive functions   ======*/
+
+// Batches of PBWT-permuted variants with at least this many haplotypes are
+// encoded in a two-stage pipeline on multi-core machines. Smaller variants
+// are encoded faster than they can be handed over between threads.
+#define DJN_BATCH_PIPELINE_MIN_SAMPLES 32768
+// Batch container lookups are cached for ploidies below this value.
+#define DJN_BATCH_MAX_CACHED_PLOIDY 256
+
+/**
+ * Grow a scratch buffer such that it can hold the worst-case compressed
+ * output of n_in bytes.
+ */
+static inline int djn_reserve_compress(djn_scratch_t& scratch, CompressionStrategy strat, uint32_t n_in) {
+    return scratch.Reserve(CompressBound(strat, n_in));
+}
+
+/**
+ * Worst-case number of bytes required to EWAH-encode len 32-bit words: every
+ * word is dirty and preceded by its own EWAH header.
+ */
+static inline uint64_t djn_ewah_bound(uint32_t len) {
+    return (uint64_t)(len + 1) * (sizeof(djinn_ewah_t) + sizeof(uint32_t));
+}
+
 /*======   EWAH container   ======*/
 
 djn_ewah_model_t::djn_ewah_model_t() :
     pbwt(std::make_shared<PBWT>()),
     p(nullptr),
     p_len(0), u_len(0), p_cap(0), p_free(false),
-    n_variants(0)
+    n_variants(0), p_codec(CompressionStrategy::NONE)
 {
     
 }
 
 djn_ewah_model_t::~djn_ewah_model_t() {
-    if (p_free) delete[] p;
+    djn_release(*this);
 }
 
 void djn_ewah_model_t::reset() {
@@ -27,13 +57,8 @@ void djn_ewah_model_t::reset() {
 }
 
 int djn_ewah_model_t::StartEncoding(bool use_pbwt, bool reset) {
-    if (p_cap == 0) { // initiate a buffer if there is none
-        delete[] p;
-        p = new uint8_t[10000000];
-        p_len = 0;
-        p_cap = 10000000;
-        p_free = true;
-    }
+    // Initiate a buffer if there is none: the buffer grows as required.
+    if (p_cap == 0 && djn_reserve(*this, DJN_SCRATCH_MIN_CAPACITY) < 0) return -4;
     if (reset) this->reset();
     p_len = 0;
     u_len = 0;
@@ -41,43 +66,32 @@ int djn_ewah_model_t::StartEncoding(bool use_pbwt, bool reset) {
     return 1;
 }
 
-size_t djn_ewah_model_t::FinishEncoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, int c_level) {
-    GeneralCompressor comp;
-    switch(strat) {
-        case (CompressionStrategy::ZSTD): comp = &ZstdCompress; break;
-        case (CompressionStrategy::LZ4):  comp = &Lz4Compress;  break;
-    }
+int64_t djn_ewah_model_t::FinishEncoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, CompressionStrategy strat, int c_level) {
+    if (ctx == nullptr) return -1;
+
     u_len = p_len;
     if (p_len != 0) {
-        int ret = (*comp)(p, p_len, support_buffer, support_cap, c_level);
-        memcpy(p, support_buffer, ret); // copy data back to p
+        if (djn_reserve_compress(scratch, strat, p_len) < 0) return -4;
+        int ret = ctx->Compress(strat, p, p_len, scratch.p, scratch.cap, c_level, p_codec);
+        if (ret < 0) return ret;
+        if (djn_reserve(*this, ret) < 0) return -4; // output may expand if stored as-is
+        memcpy(p, scratch.p, ret); // copy data back to p
         p_len = ret;
     }
-    // std::cerr << "[djn_ewah_model_t::FinishEncoding] debug=" << u_len << "->" << p_len << "->" << ret << std::endl;
     return p_len;
 }
 
-int djn_ewah_model_t::StartDecoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, bool use_pbwt, bool reset) {
+int djn_ewah_model_t::StartDecoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, bool use_pbwt, bool reset) {
     if (reset) this->reset();
     if (p == nullptr) return -2;
-
-    GeneralDecompressor dec;
-    switch(strat) {
-        case (CompressionStrategy::ZSTD): dec = &ZstdDecompress; break;
-        case (CompressionStrategy::LZ4):  dec = &Lz4Decompress;  break;
-    }
-
-    if (support_cap < u_len) {
-        uint8_t* old = support_buffer;
-        support_buffer = new uint8_t[u_len + 65536];
-        memcpy(support_buffer, old, support_cap);
-        delete[] old;
-        support_cap = u_len + 65536;
-    }
+    if (ctx == nullptr) return -1;
 
     if (p_len != 0) {
-        int ret = (*dec)(p, p_len, support_buffer, support_cap);
-        memcpy(p, support_buffer, ret); // copy data back to p
+        if (scratch.Reserve(u_len) < 0) return -4;
+        int ret = ctx->Decompress(p_codec, p, p_len, scratch.p, scratch.cap);
+        if (ret < 0) return -3;
+        if (djn_reserve(*this, ret) < 0) return -4;
+        memcpy(p, scratch.p, ret); // copy data back to p
     }
     p_len = 0;
 
@@ -94,6 +108,8 @@ int djn_ewah_model_t::Serialize(uint8_t* dst) const {
     offset += sizeof(uint32_t);
     *((uint32_t*)&dst[offset]) = n_variants; // number of variants
     offset += sizeof(uint32_t);
+    dst[offset] = (uint8_t)p_codec; // codec used
+    offset += sizeof(uint8_t);
     memcpy(&dst[offset], p, p_len); // data
     offset += p_len;
     return offset;
@@ -105,12 +121,14 @@ int djn_ewah_model_t::Serialize(std::ostream& stream) const {
     stream.write((char*)&p_len, sizeof(uint32_t));
     stream.write((char*)&u_len, sizeof(uint32_t));
     stream.write((char*)&n_variants, sizeof(uint32_t));
+    uint8_t out_codec = (uint8_t)p_codec;
+    stream.write((char*)&out_codec, sizeof(uint8_t));
     stream.write((char*)p, p_len);
     return stream.tellp();
 }
 
 int djn_ewah_model_t::GetSerializedSize() const {
-    int ret = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + p_len;
+    int ret = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t) + p_len;
     return ret;
 }
 
@@ -122,15 +140,12 @@ int djn_ewah_model_t::Deserialize(uint8_t* dst) {
     offset += sizeof(uint32_t);
     n_variants = *((uint32_t*)&dst[offset]);
     offset += sizeof(uint32_t);
+    p_codec = CompressionStrategy(dst[offset]);
+    offset += sizeof(uint8_t);
 
-    // initiate a buffer if there is none or it's too small
-    if (p_cap == 0 || p == nullptr || u_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p_cap = (u_len > p_len ? u_len : p_len) + 65536;
-        p = new uint8_t[p_cap + 65536];
-        p_free = true;
-    }
+    // initiate a buffer if there is none or it's too small: data is
+    // decompressed in-place in StartDecoding.
+    if (djn_reserve(*this, u_len > p_len ? u_len : p_len) < 0) return -1;
 
     memcpy(p, &dst[offset], p_len); // data
     offset += p_len;
@@ -144,15 +159,15 @@ int djn_ewah_model_t::Deserialize(std::istream& stream) {
     stream.read((char*)&p_len, sizeof(uint32_t));
     stream.read((char*)&u_len, sizeof(uint32_t));
     stream.read((char*)&n_variants, sizeof(uint32_t));
+    uint8_t in_codec = 0;
+    stream.read((char*)&in_codec, sizeof(uint8_t));
+    p_codec = CompressionStrategy(in_codec);
 
-    // initiate a buffer if there is none or it's too small
-    // std::cerr << "[Deserialize] " << p_len << "," << u_len << std::endl;
-    if (p_cap == 0 || p == nullptr || u_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p_cap = (u_len > p_len ? u_len : p_len) + 65536;
-        p = new uint8_t[p_cap];
-        p_free = true;
+    // initiate a buffer if there is none or it's too small: data is
+    // decompressed in-place in StartDecoding.
+    if (djn_reserve(*this, u_len > p_len ? u_len : p_len) < 0) {
+        stream.setstate(std::ios::failbit);
+        return -1;
     }
 
     stream.read((char*)p, p_len);
@@ -163,99 +178,61 @@ int djn_ewah_model_t::Deserialize(std::istream& stream) {
 
 djinn_ewah_model::djinn_ewah_model() : 
     codec(CompressionStrategy::ZSTD), compression_level(DJINN_CLEVEL_DEFAULT),
-    p(new uint8_t[1000000]), p_len(0), p_cap(1000000), p_free(true),
-    q(nullptr), q_len(0), q_alloc(0), q_free(true)
+    p(nullptr), p_len(0), p_cap(0), p_free(true), p_codec(CompressionStrategy::NONE),
+    q(nullptr), q_len(0), q_alloc(0), q_free(true),
+    codec_ctx(std::make_shared<djn_codec_ctx_t>()),
+    dict_train_blocks(0), dict_sampled_blocks(0), dict_cap(0),
+    block_dict(0), block_dict_inline(0), dict_emitted(0), dict_unused(0)
 {
 }
 
 djinn_ewah_model::djinn_ewah_model(CompressionStrategy codec, int c_level) : 
     codec(codec), compression_level(c_level),
-    p(new uint8_t[1000000]), p_len(0), p_cap(1000000), p_free(true),
-    q(nullptr), q_len(0), q_alloc(0), q_free(true)
+    p(nullptr), p_len(0), p_cap(0), p_free(true), p_codec(CompressionStrategy::NONE),
+    q(nullptr), q_len(0), q_alloc(0), q_free(true),
+    codec_ctx(std::make_shared<djn_codec_ctx_t>()),
+    dict_train_blocks(0), dict_sampled_blocks(0), dict_cap(0),
+    block_dict(0), block_dict_inline(0), dict_emitted(0), dict_unused(0)
 {
     
     if (c_level <= 0) c_level = 1;
 }
 
 djinn_ewah_model::~djinn_ewah_model() { 
-    if (p_free) delete[] p;
+    djn_release(*this);
     if (q_free) delete[] q;
 }
 
+uint32_t djinn_ewah_model::SelectContainer(size_t len_data, int ploidy) {
+    const uint64_t tuple = ((uint64_t)len_data << 32) | ploidy;
+    auto search = ploidy_map.find(tuple);
+    if (search != ploidy_map.end()) return search->second;
+
+    ploidy_map[tuple] = ploidy_models.size();
+    ploidy_models.push_back(std::make_shared<djn_ewah_model_container_t>(len_data, ploidy, (bool)use_pbwt));
+    ploidy_models.back()->gt_pbwt = gt_pbwt;
+    ploidy_models.back()->StartEncoding(use_pbwt, init);
+    return ploidy_models.size() - 1;
+}
+
 int djinn_ewah_model::EncodeBcf(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) {
     if (data == nullptr) return -2;
     if (len_data % ploidy != 0) return -3;
     // Currently limited to 14 alt alleles + missing + EOV marker (total of 16).
     assert(alt_alleles < 14);
 
-    // Todo: check that ploidy_dict model is initiated!
-    std::shared_ptr<djn_ewah_model_container_t> tgt_container;
-
-    const uint64_t tuple = ((uint64_t)len_data << 32) | ploidy;
-    auto search = ploidy_map.find(tuple);
-    if (search != ploidy_map.end()) {
-        tgt_container = ploidy_models[search->second];
-        // ploidy_dict->EncodeSymbol(search->second);
-        p[p_len++] = search->second;
-    } else {
-        // std::cerr << "Not found. Inserting: " << len_data << "," << ploidy << "(" << tuple << ") as " << ploidy_models.size() << std::endl;
-        ploidy_map[tuple] = ploidy_models.size();
-        // ploidy_dict->EncodeSymbol(ploidy_models.size());
-        p[p_len++] = ploidy_models.size();
-
-        ploidy_models.push_back(std::make_shared<djn_ewah_model_container_t>(len_data, ploidy, (bool)use_pbwt));
-        tgt_container = ploidy_models[ploidy_models.size() - 1];
-        tgt_container->StartEncoding(use_pbwt, init);
-    }
-    assert(tgt_container.get() != nullptr);
-
-    // Compute allele counts.
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
-    for (int i = 0; i < len_data; ++i) {
-        ++hist_alts[DJN_BCF_UNPACK_GENOTYPE_GENERAL(data[i])];
-    }
-
-    // for (int i = 0; i < 256; ++i) {
-    //     if (hist_alts[i]) std::cerr << i << ":" << hist_alts[i] << ",";
-    // }
-    // std::cerr << " data2m=" << tgt_container->model_2mc->range_coder->OutSize() << " dataNm=" << tgt_container->model_nm->range_coder->OutSize() << " permute=" << permute << std::endl;
-
-    // Biallelic, no missing, and no special EOV symbols.
-    if (alt_alleles <= 2 && hist_alts[14] == 0 && hist_alts[15] == 0) {
-        tgt_container->p[tgt_container->p_len++] = 0;
-
-        int ret = -1;
-        if (use_pbwt) {
-            // Todo: add lower limit to stored parameters during serialization
-            if (hist_alts[1] < 10) { // dont update if < 10 alts
-                for (int i = 0; i < len_data; ++i) {
-                    tgt_container->model_2mc->pbwt->prev[i] = DJN_BCF_UNPACK_GENOTYPE(data[tgt_container->model_2mc->pbwt->ppa[i]]);
-                }
-            } else {
-                tgt_container->model_2mc->pbwt->UpdateBcf(data, 1);
-            }
+    // Store model selection data. The selector is only written once the
+    // variant is encoded such that it remains in sync with n_variants.
+    const uint32_t offset = SelectContainer(len_data, ploidy);
+    if (djn_reserve_append(*this, 1) < 0) return -4;
 
-            ret = (tgt_container->Encode2mc(tgt_container->model_2mc->pbwt->prev, len_data));
-        } else {
-            // std::cerr << "encoding nopbwt" << std::endl;
-            ret = (tgt_container->Encode2mc(data, len_data, DJN_BCF_GT_UNPACK, 1));
-        }
+    int ret = EncodeBcfContainer(ploidy_models[offset].get(), data, len_data, alt_alleles);
+    if (ret > 0) p[p_len++] = offset;
+    return ret;
+}
 
-        if (ret > 0) ++n_variants;
-        return ret;
-    } else { // Otherwise.
-        tgt_container->p[tgt_container->p_len++] = 1;
-        
-        int ret = -1;
-        if (use_pbwt) {
-            tgt_container->model_nm->pbwt->UpdateBcfGeneral(data, 1); // otherwise
-            ret = (tgt_container->EncodeNm(tgt_container->model_nm->pbwt->prev, len_data));
-        } else {
-            ret = (tgt_container->EncodeNm(data, len_data, DJN_BCF_GT_UNPACK_GENERAL, 1));
-        }
-        if (ret > 0) ++n_variants;
-        return ret;
-    }
+int djinn_ewah_model::EncodeBcfContainer(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, uint8_t alt_alleles) {
+    return EncodeRow(tgt_container, data, len_data, alt_alleles, true);
 }
 
 int djinn_ewah_model::Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t alt_alleles) {
@@ -264,69 +241,289 @@ int djinn_ewah_model::Encode(uint8_t* data, size_t len_data, int ploidy, uint8_t
     // Currently limited to 14 alt alleles + missing + EOV marker (total of 16).
     assert(alt_alleles < 14);
 
-    std::shared_ptr<djn_ewah_model_container_t> tgt_container;
+    // Store model selection data. The selector is only written once the
+    // variant is encoded such that it remains in sync with n_variants.
+    const uint32_t offset = SelectContainer(len_data, ploidy);
+    if (djn_reserve_append(*this, 1) < 0) return -4;
 
-    const uint64_t tuple = ((uint64_t)len_data << 32) | ploidy;
-    auto search = ploidy_map.find(tuple);
-    if (search != ploidy_map.end()) {
-        tgt_container = ploidy_models[search->second];
-        p[p_len++] = search->second;
+    int ret = EncodeContainer(ploidy_models[offset].get(), data, len_data, alt_alleles);
+    if (ret > 0) p[p_len++] = offset;
+    return ret;
+}
+
+int djinn_ewah_model::EncodeContainer(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, uint8_t alt_alleles) {
+    return EncodeRow(tgt_container, data, len_data, alt_alleles, false);
+}
+
+int djinn_ewah_model::EncodeRow(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, uint8_t alt_alleles, bool bcf) {
+    assert(tgt_container != nullptr);
+
+    // Compute allele counts and the presence of missing and EOV symbols.
+    // Without the PBWT, the bitmap of alt alleles computed in the same pass
+    // is encoded as is for 2mc sites.
+    uint32_t* bitmap = tgt_container->ResetBitmaps();
+    uint32_t* bits_alt = use_pbwt ? nullptr : bitmap;
+    djn_gt_stats_t stats;
+    if (bcf) djn_gt_stats_bcf(data, len_data, stats, bits_alt);
+    else djn_gt_stats(data, len_data, stats, bits_alt);
+
+    // Unphased diploid genotypes permuted with the genotype PBWT.
+    if (tgt_container->PackGenotypes(data, len_data, bcf))
+        return EncodeGtRow(tgt_container, data, len_data, stats, bcf);
+
+    uint8_t type = 0;
+    uint8_t* permuted = PermuteRow(tgt_container, data, len_data, stats, alt_alleles, bcf, nullptr, bitmap, type);
+    return EncodePermutedRow(tgt_container, data, len_data, stats, type, permuted, bitmap, bcf);
+}
+
+int djinn_ewah_model::EncodeGtRow(djn_ewah_model_container_t* tgt_container, const uint8_t* data, size_t len_data, const djn_gt_stats_t& stats, bool bcf) {
+    const uint32_t p_len_start = tgt_container->p_len;
+    const uint32_t phase_len_start = tgt_container->model_phase->p_len;
+
+    if (djn_reserve_append(*tgt_container, 1) < 0) return -4;
+    const uint8_t phase = bcf ? tgt_container->EncodePhase(data, len_data) : DJN_PHASE_UNKNOWN;
+    tgt_container->p[tgt_container->p_len++] = 0 | DJN_ARCHETYPE_GT | (phase << 1);
+
+    int ret = tgt_container->EncodeGt();
+    if (ret <= 0) {
+        // Roll back the archetype and phase such that the container streams
+        // remain in sync with the encoded variants.
+        tgt_container->p_len = p_len_start;
+        tgt_container->model_phase->p_len = phase_len_start;
+        return ret;
+    }
+
+    ++n_variants;
+    variant_stats.push_back(djn_variant_stats(stats, len_data, 2));
+    return ret;
+}
+
+uint8_t* djinn_ewah_model::PermuteRow(djn_ewah_model_container_t* tgt_container, uint8_t* data, size_t len_data, const djn_gt_stats_t& stats, uint8_t alt_alleles, bool bcf, uint8_t* out, uint32_t* bitmap, uint8_t& type) {
+    // Biallelic, no missing, and no special EOV symbols are stored as 2mc
+    // and everything else as nm.
+    type = (alt_alleles <= 2 && stats.max_allele <= 1 && !stats.has_missing && !stats.has_eov) ? 0 : 1;
+    if (use_pbwt == false) return data;
+
+    if (type == 0) {
+        // The permuted alleles are packed while permuting and the partition
+        // uses the reference allele count from the statistics pass.
+        PBWT* pbwt = tgt_container->model_2mc->pbwt.get();
+        // Todo: add lower limit to stored parameters during serialization
+        if (stats.n_alt < 10) { // dont update if < 10 alts
+            if (bcf) pbwt->PermuteBcf2mc(data, bitmap);
+            else pbwt->Permute2mc(data, bitmap);
+        } else {
+            if (bcf) pbwt->UpdateBcf2mc(data, stats.n_ref, bitmap);
+            else pbwt->Update2mc(data, stats.n_ref, bitmap);
+        }
+        return nullptr;
+    }
+
+    PBWT* pbwt = tgt_container->model_nm->pbwt.get();
+    if (bcf) pbwt->UpdateBcfGeneral(data, 1);
+    else pbwt->Update(data, 1);
+
+    if (out == nullptr) return pbwt->prev;
+    memcpy(out, pbwt->prev, len_data);
+    return out;
+}
+
+int djinn_ewah_model::EncodePermutedRow(djn_ewah_model_container_t* tgt_container, const uint8_t* data, size_t len_data, const djn_gt_stats_t& stats, uint8_t type, uint8_t* permuted, uint32_t* bitmap, bool bcf) {
+    const uint32_t p_len_start = tgt_container->p_len;
+    const uint32_t phase_len_start = tgt_container->model_phase->p_len;
+
+    if (djn_reserve_append(*tgt_container, 1) < 0) return -4;
+    const uint8_t phase = bcf ? tgt_container->EncodePhase(data, len_data) : DJN_PHASE_UNKNOWN;
+    tgt_container->p[tgt_container->p_len++] = type | (phase << 1);
+
+    int ret = -1;
+    if (type == 0) {
+        ret = tgt_container->EncodeWah(bitmap, tgt_container->n_samples_wah >> 5, stats.n_alt); // n_samples_wah / 32
     } else {
-        // std::cerr << "Not found. Inserting: " << len_data << "," << ploidy << "(" << tuple << ") as " << ploidy_models.size() << std::endl;
-        ploidy_map[tuple] = ploidy_models.size();
-        p[p_len++] = ploidy_models.size();
-        ploidy_models.push_back(std::make_shared<djn_ewah_model_container_t>(len_data, ploidy, (bool)use_pbwt));
-        tgt_container = ploidy_models[ploidy_models.size() - 1];
-        tgt_container->StartEncoding(use_pbwt, init);
-    }
-    assert(tgt_container.get() != nullptr);
-
-    // Compute allele counts.
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
-    for (int i = 0; i < len_data; ++i) {
-        ++hist_alts[data[i]];
-    }
-
-    // for (int i = 0; i < 256; ++i) {
-    //     if (hist_alts[i]) std::cerr << i << ":" << hist_alts[i] << ",";
-    // }
-    // std::cerr << " data2m=" << tgt_container->model_2mc->range_coder->OutSize() << " dataNm=" << tgt_container->model_nm->range_coder->OutSize() << " permute=" << permute << std::endl;
-
-    // Biallelic, no missing, and no special EOV symbols.
-    if (alt_alleles <= 2 && hist_alts[14] == 0 && hist_alts[15] == 0) {
-        tgt_container->p[tgt_container->p_len++] = 0;// add archtype as 2mc
-
-        int ret = -1;
-        if (use_pbwt) {
-            // Todo: add lower limit to stored parameters during serialization
-            if (hist_alts[1] < 10) { // dont update if < 10 alts
-                for (int i = 0; i < len_data; ++i) {
-                    tgt_container->model_2mc->pbwt->prev[i] = data[tgt_container->model_2mc->pbwt->ppa[i]];
+        if (use_pbwt) ret = tgt_container->EncodeNm(permuted, len_data);
+        else if (bcf) ret = tgt_container->EncodeNm(permuted, len_data, DJN_BCF_GT_UNPACK_GENERAL, 1);
+        else ret = tgt_container->EncodeNm(permuted, len_data, DJN_MAP_NONE, 0);
+    }
+
+    if (ret <= 0) {
+        // Roll back the archetype and phase such that the container streams
+        // remain in sync with the encoded variants.
+        tgt_container->p_len = p_len_start;
+        tgt_container->model_phase->p_len = phase_len_start;
+        return ret;
+    }
+
+    ++n_variants;
+    variant_stats.push_back(djn_variant_stats(stats, len_data, type));
+    return ret;
+}
+
+int djinn_ewah_model::EncodeBcfBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded) {
+    return EncodeBatchContainers(data, len_data, n_rows, ploidy, alt_alleles, true, n_encoded);
+}
+
+int djinn_ewah_model::EncodeBatch(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, uint32_t* n_encoded) {
+    return EncodeBatchContainers(data, len_data, n_rows, ploidy, alt_alleles, false, n_encoded);
+}
+
+uint32_t djinn_ewah_model::SelectBatchContainer(std::vector<uint32_t>& offsets, size_t len_data, int ploidy) {
+    // All rows in a batch have the same length: the container is cached by
+    // ploidy for the duration of the batch.
+    if (ploidy >= DJN_BATCH_MAX_CACHED_PLOIDY) return SelectContainer(len_data, ploidy);
+    if ((size_t)ploidy >= offsets.size()) offsets.resize(ploidy + 1, UINT32_MAX);
+    if (offsets[ploidy] == UINT32_MAX) offsets[ploidy] = SelectContainer(len_data, ploidy);
+    return offsets[ploidy];
+}
+
+int djinn_ewah_model::EncodeBatchContainers(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, bool bcf, uint32_t* n_encoded) {
+    if (n_encoded != nullptr) *n_encoded = 0;
+    if (data == nullptr || ploidy == nullptr || alt_alleles == nullptr) return -2;
+    if (n_rows == 0) return 0;
+
+    // Model selection data is written for the entire batch at once.
+    if (djn_reserve_append(*this, n_rows) < 0) return -4;
+
+    if (use_pbwt && n_rows > 1 && len_data >= DJN_BATCH_PIPELINE_MIN_SAMPLES &&
+        std::thread::hardware_concurrency() > 1) {
+        return EncodeBatchPipelined(data, len_data, n_rows, ploidy, alt_alleles, bcf, n_encoded);
+    }
+
+    std::vector<uint32_t> offsets;
+    for (uint32_t i = 0; i < n_rows; ++i) {
+        if (ploidy[i] <= 0 || len_data % ploidy[i] != 0) return -3;
+        assert(alt_alleles[i] < 14);
+
+        const uint32_t offset = SelectBatchContainer(offsets, len_data, ploidy[i]);
+        uint8_t* row = &data[(uint64_t)i * len_data];
+        int ret = EncodeRow(ploidy_models[offset].get(), row, len_data, alt_alleles[i], bcf);
+        if (ret <= 0) return ret < 0 ? ret : -1;
+
+        // The selector is only stored for encoded rows such that it remains
+        // in sync with n_variants if a row fails.
+        p[p_len++] = offset;
+        if (n_encoded != nullptr) ++(*n_encoded);
+    }
+
+    return n_rows;
+}
+
+int djinn_ewah_model::EncodeBatchPipelined(uint8_t* data, size_t len_data, uint32_t n_rows, const int* ploidy, const uint8_t* alt_alleles, bool bcf, uint32_t* n_encoded) {
+    // Two-stage pipeline: this thread permutes row i+1 with the PBWT into one
+    // of two row buffers, or bitmaps for 2mc sites, while a worker thread
+    // EWAH-encodes row i. Rows are handed over and encoded in order.
+    // Rows that are permuted with the genotype PBWT are encoded by this thread
+    // after the worker has drained as the packed genotypes share a buffer.
+    struct djn_batch_job_t {
+        djn_ewah_model_container_t* tgt_container;
+        const uint8_t* data;
+        uint8_t* permuted;
+        uint32_t* bitmap;
+        djn_gt_stats_t stats;
+        uint32_t offset;
+        uint8_t type;
+    };
+
+    const size_t n_words = (len_data + 31) / 32;
+    std::vector<uint8_t> rows(2 * len_data);
+    std::vector<uint32_t> bitmaps(2 * n_words);
+    djn_batch_job_t jobs[2];
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32_t n_produced = 0, n_consumed = 0, n_done = 0;
+    bool finished = false;
+    int error = 0;
+
+    std::thread worker([&]() {
+        while (true) {
+            djn_batch_job_t* job = nullptr;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cv.wait(guard, [&]() { return n_consumed < n_produced || finished; });
+                if (n_consumed == n_produced) return;
+                job = &jobs[n_consumed & 1];
+                if (error) {
+                    // Drop rows permuted after the failing row.
+                    ++n_consumed;
+                    cv.notify_all();
+                    continue;
                 }
-            } else {
-                tgt_container->model_2mc->pbwt->Update(data, 1);
             }
 
-            ret = (tgt_container->Encode2mc(tgt_container->model_2mc->pbwt->prev, len_data));
-        } else {
-            ret = (tgt_container->Encode2mc(data, len_data, DJN_MAP_NONE, 0));
+            int ret = EncodePermutedRow(job->tgt_container, job->data, len_data, job->stats, job->type, job->permuted, job->bitmap, bcf);
+            if (ret > 0) p[p_len++] = job->offset;
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (ret <= 0) error = ret < 0 ? ret : -1;
+            else ++n_done;
+            ++n_consumed;
+            cv.notify_all();
         }
+    });
 
-        if (ret > 0) ++n_variants;
-        return ret;
-    } else { // Otherwise.
-        tgt_container->p[tgt_container->p_len++] = 1;
-        
-        int ret = -1;
-        if (use_pbwt) {
-            tgt_container->model_nm->pbwt->Update(data, 1);
-            ret = (tgt_container->EncodeNm(tgt_container->model_nm->pbwt->prev, len_data));
-        } else {
-            ret = (tgt_container->EncodeNm(data, len_data, DJN_MAP_NONE, 0));
+    std::vector<uint32_t> offsets;
+    for (uint32_t i = 0; i < n_rows; ++i) {
+        if (ploidy[i] <= 0 || len_data % ploidy[i] != 0) {
+            std::lock_guard<std::mutex> guard(lock);
+            error = -3;
+            break;
         }
-        if (ret > 0) ++n_variants;
-        return ret;
+        assert(alt_alleles[i] < 14);
+
+        const uint32_t offset = SelectBatchContainer(offsets, len_data, ploidy[i]);
+        djn_ewah_model_container_t* tgt_container = ploidy_models[offset].get();
+        uint8_t* row = &data[(uint64_t)i * len_data];
+
+        if (tgt_container->gt_pbwt) {
+            // Wait for the worker to drain before encoding in this thread.
+            std::unique_lock<std::mutex> guard(lock);
+            cv.wait(guard, [&]() { return n_consumed == n_produced || error; });
+            if (error) break;
+            guard.unlock();
+
+            int ret = EncodeRow(tgt_container, row, len_data, alt_alleles[i], bcf);
+            guard.lock();
+            if (ret <= 0) {
+                error = ret < 0 ? ret : -1;
+                break;
+            }
+            p[p_len++] = offset;
+            ++n_done;
+            continue;
+        }
+
+        // Wait for a free row buffer: at most one row is queued while the
+        // worker encodes another.
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cv.wait(guard, [&]() { return n_produced - n_consumed < 2 || error; });
+            if (error) break;
+        }
+
+        djn_batch_job_t& job = jobs[n_produced & 1];
+        job.tgt_container = tgt_container;
+        job.data = row;
+        job.offset = offset;
+        job.bitmap = &bitmaps[(n_produced & 1) * n_words];
+        memset(job.bitmap, 0, n_words*sizeof(uint32_t));
+        if (bcf) djn_gt_stats_bcf(row, len_data, job.stats);
+        else djn_gt_stats(row, len_data, job.stats);
+        job.permuted = PermuteRow(tgt_container, row, len_data, job.stats, alt_alleles[i], bcf, &rows[(n_produced & 1) * len_data], job.bitmap, job.type);
+
+        std::lock_guard<std::mutex> guard(lock);
+        ++n_produced;
+        cv.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        finished = true;
+        cv.notify_all();
     }
+    worker.join();
+
+    if (n_encoded != nullptr) *n_encoded = n_done;
+    if (error) return error;
+    return n_rows;
 }
 
 int djinn_ewah_model::DecodeNext(uint8_t* ewah_data, uint32_t& ret_ewah, uint8_t* ret_buffer, uint32_t& ret_len) {
@@ -386,15 +583,9 @@ int djinn_ewah_model::DecodeNext(djinn_variant_t*& variant) {
         variant->errcode = 1;
         return ret;
     }
+    tgt_container->SetPhase(variant);
     
-    // Compute number of alleles.
-    uint32_t max_allele = 0;
-    for (int i = 0; i < 256; ++i) {
-        max_allele = tgt_container->hist_alts[i] != 0 ? i : max_allele;
-        // if (tgt_container->hist_alts[i]) std::cerr << i << ":" << tgt_container->hist_alts[i] << ",";
-    }
-    // std::cerr << " max=" << max_allele << std::endl;
-    variant->n_allele = max_allele + 1;
+    variant->n_allele = tgt_container->max_symbol_obs + 1;
 
     return ret;
 }
@@ -419,40 +610,57 @@ void djinn_ewah_model::StartEncoding(bool use_pbwt, bool reset) {
     this->use_pbwt = use_pbwt;
     this->init = reset;
     n_variants = 0;
+    variant_stats.clear();
     p_len = 0;
 
-    // std::cerr << "[djinn_ewah_model::StartEncoding] models start encoding" << std::endl;
     for (int i = 0; i < ploidy_models.size(); ++i) {
+        ploidy_models[i]->gt_pbwt = gt_pbwt;
         ploidy_models[i]->StartEncoding(use_pbwt, reset);
     }
 }
 
-size_t djinn_ewah_model::FinishEncoding() {
-    if (q == nullptr) {
-        q = new uint8_t[10000000];
-        q_free = true;
-        q_alloc = 10000000;
-        q_len = 0;
-    }
-    q_len = 0;
+int64_t djinn_ewah_model::FinishEncoding() {
+    // Support memory is shared between all models and blocks in this thread.
+    djn_scratch_t& scratch = djn_thread_scratch();
+
+    // Sample the uncompressed streams and train a dictionary when enough
+    // blocks have been observed.
+    if (dict_train_blocks && codec_ctx->dict.size() == 0) {
+        SampleDictionaryStream(p, p_len);
+        for (int i = 0; i < ploidy_models.size(); ++i) {
+            SampleDictionaryStream(ploidy_models[i]->p, ploidy_models[i]->p_len);
+            SampleDictionaryStream(ploidy_models[i]->model_2mc->p, ploidy_models[i]->model_2mc->p_len);
+            SampleDictionaryStream(ploidy_models[i]->model_nm->p, ploidy_models[i]->model_nm->p_len);
+        }
 
-    GeneralCompressor comp;
-    switch(codec) {
-        case (CompressionStrategy::ZSTD): comp = &ZstdCompress; break;
-        case (CompressionStrategy::LZ4):  comp = &Lz4Compress;  break;
+        if (++dict_sampled_blocks >= dict_train_blocks) {
+            // Encoding continues without a dictionary if training fails.
+            codec_ctx->TrainDictionary(dict_samples.data(), dict_sample_sizes.data(), dict_sample_sizes.size(), dict_cap);
+            dict_emitted = false;
+            dict_train_blocks = 0;
+            dict_samples = std::vector<uint8_t>();
+            dict_sample_sizes = std::vector<size_t>();
+        }
     }
 
+    block_dict = (codec_ctx->dict.size() != 0);
+    block_dict_inline = (block_dict && dict_emitted == false);
+    dict_emitted |= block_dict;
+    codec_ctx->use_dict = block_dict;
+
     if (p_len != 0) {
-        int ret = (*comp)(p, p_len, q, q_alloc, compression_level);
-        memcpy(p, q, ret); // copy data back to p
+        if (djn_reserve_compress(scratch, codec, p_len) < 0) return -4;
+        int ret = codec_ctx->Compress(codec, p, p_len, scratch.p, scratch.cap, compression_level, p_codec);
+        if (ret < 0) return ret;
+        if (djn_reserve(*this, ret) < 0) return -4;
+        memcpy(p, scratch.p, ret); // copy data back to p
         p_len = ret;
     }
 
-    size_t s_models = 0;
+    int64_t s_models = 0;
     for (int i = 0; i < ploidy_models.size(); ++i) {
-        uint32_t qa = q_alloc; // workaround for not being able to pass bit-field by reference
-        int ret = ploidy_models[i]->FinishEncoding(q, qa, codec, compression_level); // use q as support buffer
-        q_alloc = qa;
+        const int64_t ret = ploidy_models[i]->FinishEncoding(scratch, codec_ctx.get(), codec, compression_level);
+        if (ret < 0) return ret;
         s_models += ret;
     }
     
@@ -463,35 +671,39 @@ int djinn_ewah_model::StartDecoding() {
     assert(p != nullptr);
     assert(ploidy_models.size() != 0);
 
-    if (q == nullptr) {
-        q_alloc = 10000000;
-        q = new uint8_t[q_alloc];
-        q_free = true;
-        q_len  = 0;
-    }
-    q_len = 0;
+    // Support memory is shared between all models and blocks in this thread.
+    djn_scratch_t& scratch = djn_thread_scratch();
 
-    GeneralDecompressor dec;
-    switch(codec) {
-        case (CompressionStrategy::ZSTD): dec = &ZstdDecompress; break;
-        case (CompressionStrategy::LZ4):  dec = &Lz4Decompress;  break;
-    }
+    // Block requires a dictionary but none has been loaded.
+    if (block_dict && codec_ctx->dict.size() == 0) return -5;
+    codec_ctx->use_dict = block_dict;
+
+    // Model selection data is stored as one byte per variant.
     if (p_len != 0) {
-        int ret = (*dec)(p, p_len, q, q_alloc);
-        memcpy(p, q, ret); // copy data back to p
+        if (scratch.Reserve(n_variants) < 0) return -3;
+        int ret = codec_ctx->Decompress(p_codec, p, p_len, scratch.p, scratch.cap);
+        if (ret < 0) return -2;
+        if (djn_reserve(*this, ret) < 0) return -3;
+        memcpy(p, scratch.p, ret); // copy data back to p
     }
     p_len = 0;
 
     for (int i = 0; i <ploidy_models.size(); ++i) {
-        uint32_t qa = q_alloc; // workaround for not being able to pass bit-field by reference
-        ploidy_models[i]->StartDecoding(q,qa,codec,use_pbwt,init);
-        q_alloc = qa;
+        ploidy_models[i]->gt_pbwt = gt_pbwt;
+        int ret = ploidy_models[i]->StartDecoding(scratch,codec_ctx.get(),use_pbwt,init);
+        if (ret < 0) return ret;
     }
 
     return 1;
 }
 
 int djinn_ewah_model::Serialize(uint8_t* dst) const {
+    return Serialize(dst, true);
+}
+
+int djinn_ewah_model::Serialize(uint8_t* dst, bool inline_dict) const {
+    inline_dict = inline_dict && block_dict_inline;
+
     // Serialize as (int,uint32_t,uint32_t,uint8_t*,ctx1,ctx2):
     // #models,p_len,p,[models...]
     uint32_t offset = 0;
@@ -508,10 +720,20 @@ int djinn_ewah_model::Serialize(uint8_t* dst) const {
     offset += sizeof(uint32_t);
 
     // Serialize bit-packed controller.
-    uint8_t pack = (use_pbwt << 7) | (init << 6) | (unused << 0);
+    uint8_t pack = (use_pbwt << 7) | (init << 6) | (block_dict << 5) | (inline_dict << 4) | (gt_pbwt << 3) | DJN_EWAH_FORMAT_VERSION;
     dst[offset] = pack;
     offset += sizeof(uint8_t);
 
+    // Store the dictionary the first time it is used.
+    if (inline_dict) {
+        *((uint32_t*)&dst[offset]) = codec_ctx->dict.size();
+        offset += sizeof(uint32_t);
+        memcpy(&dst[offset], &codec_ctx->dict[0], codec_ctx->dict.size());
+        offset += codec_ctx->dict.size();
+    }
+
+    dst[offset] = (uint8_t)p_codec; // codec used for model selection data
+    offset += sizeof(uint8_t);
     *((uint32_t*)&dst[offset]) = p_len; // data length
     offset += sizeof(uint32_t);
     
@@ -542,8 +764,15 @@ int djinn_ewah_model::Serialize(std::ostream& stream) const {
     stream.write((char*)&n_variants, sizeof(uint32_t));
 
     // Serialize bit-packed controller.
-    uint8_t pack = (use_pbwt << 7) | (init << 6) | (unused << 0);
+    uint8_t pack = (use_pbwt << 7) | (init << 6) | (block_dict << 5) | (block_dict_inline << 4) | (gt_pbwt << 3) | DJN_EWAH_FORMAT_VERSION;
     stream.write((char*)&pack, sizeof(uint8_t));
+    if (block_dict_inline) {
+        uint32_t dict_len = codec_ctx->dict.size();
+        stream.write((char*)&dict_len, sizeof(uint32_t));
+        stream.write((char*)&codec_ctx->dict[0], dict_len);
+    }
+    uint8_t out_p_codec = (uint8_t)p_codec;
+    stream.write((char*)&out_p_codec, sizeof(uint8_t));
     stream.write((char*)&p_len, sizeof(uint32_t));
     stream.write((char*)p, p_len);
 
@@ -555,7 +784,12 @@ int djinn_ewah_model::Serialize(std::ostream& stream) const {
 }
 
 int djinn_ewah_model::GetSerializedSize() const {
-    int ret = sizeof(uint32_t) + 2*sizeof(int) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t) + p_len;
+    return GetSerializedSize(true);
+}
+
+int djinn_ewah_model::GetSerializedSize(bool inline_dict) const {
+    int ret = sizeof(uint32_t) + 2*sizeof(int) + sizeof(uint32_t) + 2*sizeof(uint8_t) + sizeof(uint32_t) + p_len;
+    if (inline_dict && block_dict_inline) ret += sizeof(uint32_t) + codec_ctx->dict.size();
     for (int i = 0; i < ploidy_models.size(); ++i) {
         ret += ploidy_models[i]->GetSerializedSize();
     }
@@ -572,9 +806,6 @@ int djinn_ewah_model::GetCurrentSize() const {
 
 // Deserialize data from an external buffer.
 int djinn_ewah_model::Deserialize(uint8_t* src) {
-    // Reset.
-    // ploidy_remap.clear();
-
     uint32_t offset = 0;
 
     // Read total offset.
@@ -591,22 +822,31 @@ int djinn_ewah_model::Deserialize(uint8_t* src) {
     n_variants = *((uint32_t*)&src[offset]);
     offset += sizeof(uint32_t);
     uint8_t pack = src[offset];
+    if ((pack & 7) != DJN_EWAH_FORMAT_VERSION) return -1;
     use_pbwt = (pack >> 7) & 1;
     init = (pack >> 6) & 1;
+    block_dict = (pack >> 5) & 1;
+    block_dict_inline = (pack >> 4) & 1;
+    gt_pbwt = (pack >> 3) & 1;
     unused = 0;
     offset += sizeof(uint8_t);
 
-    // Read p_len,p
+    // Load the dictionary if it is stored in this block.
+    if (block_dict_inline) {
+        uint32_t dict_len = *((uint32_t*)&src[offset]);
+        offset += sizeof(uint32_t);
+        codec_ctx->SetDictionary(&src[offset], dict_len);
+        offset += dict_len;
+    }
+
+    // Read p_codec,p_len,p
+    p_codec = CompressionStrategy(src[offset]);
+    offset += sizeof(uint8_t);
     p_len = *((uint32_t*)&src[offset]);
     offset += sizeof(uint32_t);
 
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
-    }    
+    // Data is decompressed in-place into n_variants bytes.
+    if (djn_reserve(*this, p_len > n_variants ? p_len : n_variants) < 0) return -1;
     
     // Store model selection data.
     memcpy(p, &src[offset], p_len);
@@ -623,16 +863,18 @@ int djinn_ewah_model::Deserialize(uint8_t* src) {
         // the encoding order.
         const uint64_t tuple = ((uint64_t)n_s << 32) | pl;
         auto search = ploidy_map.find(tuple);
+        int ret = 0;
         if (search != ploidy_map.end()) {
-            offset += ploidy_models[search->second]->Deserialize(&src[offset]);
+            ret = ploidy_models[search->second]->Deserialize(&src[offset]);
         } else {
             ploidy_map[tuple] = ploidy_models.size();
             ploidy_models.push_back(std::make_shared<djinn::djn_ewah_model_container_t>(n_s, pl, (bool)use_pbwt));
-            offset += ploidy_models.back()->Deserialize(&src[offset]);
+            ret = ploidy_models.back()->Deserialize(&src[offset]);
         }
+        if (ret < 0) return ret;
+        offset += ret;
     }
-    // std::cerr << "[Deserialize] Decoded=" << offset << "/" << tot_offset << std::endl;
-    assert(offset == tot_offset);
+    if (offset != tot_offset) return -2;
     return offset;
 }
 
@@ -656,21 +898,30 @@ int djinn_ewah_model::Deserialize(std::istream& stream) {
     // Deserialize bit-packed controller.
     uint8_t pack = 0;
     stream.read((char*)&pack, sizeof(uint8_t));
+    if (stream.good() == false || (pack & 7) != DJN_EWAH_FORMAT_VERSION) return -1;
     use_pbwt = (pack >> 7) & 1;
     init = (pack >> 6) & 1;
+    block_dict = (pack >> 5) & 1;
+    block_dict_inline = (pack >> 4) & 1;
+    gt_pbwt = (pack >> 3) & 1;
     unused = 0;
 
-    stream.read((char*)&p_len, sizeof(uint32_t));
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
+    // Load the dictionary if it is stored in this block.
+    if (block_dict_inline) {
+        uint32_t dict_len = 0;
+        stream.read((char*)&dict_len, sizeof(uint32_t));
+        std::vector<uint8_t> dict(dict_len);
+        if (dict_len) stream.read((char*)&dict[0], dict_len);
+        codec_ctx->SetDictionary(dict.size() ? &dict[0] : nullptr, dict_len);
     }
 
-    // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-    
+    uint8_t in_p_codec = 0;
+    stream.read((char*)&in_p_codec, sizeof(uint8_t));
+    p_codec = CompressionStrategy(in_p_codec);
+    stream.read((char*)&p_len, sizeof(uint32_t));
+    // Data is decompressed in-place into n_variants bytes.
+    if (djn_reserve(*this, p_len > n_variants ? p_len : n_variants) < 0) return -1;
+
     stream.read((char*)p, p_len);
 
     // Serialize each model.
@@ -682,7 +933,6 @@ int djinn_ewah_model::Deserialize(std::istream& stream) {
         stream.read((char*)&pl,  sizeof(int));
         stream.read((char*)&n_s, sizeof(uint32_t));
 
-        // std::cerr << "[Deserialize] #pl=" << pl << ", #n_s=" << n_s << std::endl;
 
         // Update ploidy map and insert data in the correct position relative
         // the encoding order.
@@ -691,49 +941,111 @@ int djinn_ewah_model::Deserialize(std::istream& stream) {
         if (search != ploidy_map.end()) {
             ploidy_models[search->second]->Deserialize(stream);
         } else {
-            // std::cerr << "[Deserialize] Adding map [" << tuple << "] for [" << n_s << "," << pl << "]" << std::endl; 
             ploidy_map[tuple] = ploidy_models.size();
             ploidy_models.push_back(std::make_shared<djinn::djn_ewah_model_container_t>(n_s, pl, (bool)use_pbwt));
             ploidy_models.back()->Deserialize(stream);
         }
+        if (stream.fail()) return -1;
     }
 
     return stream.tellg();
 }
 
+int djinn_ewah_model::SetDictionaryTraining(uint32_t n_blocks, uint32_t dict_cap) {
+    if (n_blocks && dict_cap < 256) return -1;
+    dict_train_blocks = n_blocks;
+    dict_sampled_blocks = 0;
+    this->dict_cap = dict_cap;
+    dict_samples.clear();
+    dict_sample_sizes.clear();
+    return 1;
+}
+
+int djinn_ewah_model::SetDictionary(const uint8_t* dict, uint32_t dict_len) {
+    if (dict == nullptr && dict_len) return -1;
+    dict_train_blocks = 0;
+    dict_emitted = false;
+    return codec_ctx->SetDictionary(dict, dict_len);
+}
+
+int djinn_ewah_model::SetCodecParameters(const djinn_codec_params_t& params) {
+    return codec_ctx->SetParameters(params);
+}
+
+int djinn_ewah_model::SetAutoObjective(const djinn_auto_codec_t& objective) {
+    if (objective.min_decode_mbs < 0) return -1;
+    if (objective.lz4_level <= 0 || objective.zstd_max_level <= 0) return -1;
+    if (objective.lz4_acceleration <= 0) return -1;
+    if (objective.lz4_decode_mbs < 0 || objective.zstd_decode_mbs < 0 || objective.ctx_decode_mbs < 0) return -1;
+    codec_ctx->auto_objective = objective;
+    codec_ctx->auto_calibrated = false;
+    return 1;
+}
+
+const uint8_t* djinn_ewah_model::GetDictionary() const {
+    return codec_ctx->dict.size() ? &codec_ctx->dict[0] : nullptr;
+}
+
+uint32_t djinn_ewah_model::GetDictionarySize() const {
+    return codec_ctx->dict.size();
+}
+
+void djinn_ewah_model::SampleDictionaryStream(const uint8_t* src, uint32_t src_len) {
+    // Zstd recommends roughly 100-fold more sample data than the target
+    // dictionary size. Streams are chopped into smaller chunks as training 
+    // requires many samples.
+    const uint32_t chunk = 8192;
+    const size_t limit = 100 * (size_t)dict_cap;
+    for (uint32_t i = 0; i < src_len; i += chunk) {
+        if (dict_samples.size() >= limit) return;
+        const uint32_t len = (src_len - i > chunk ? chunk : src_len - i);
+        dict_samples.insert(dict_samples.end(), &src[i], &src[i] + len);
+        dict_sample_sizes.push_back(len);
+    }
+}
+
 /*======   Container   ======*/
 
 djn_ewah_model_container_t::djn_ewah_model_container_t(int64_t n_s, int pl, bool use_pbwt) : 
-    use_pbwt(use_pbwt),
+    use_pbwt(use_pbwt), gt_pbwt(false),
     ploidy(pl), n_samples(n_s), n_variants(0),
     n_samples_wah(std::ceil((float)n_samples / 32) * 32), 
     n_samples_wah_nm(std::ceil((float)n_samples * 4/32) * 8),
     n_wah(n_samples_wah_nm / 8),
-    wah_bitmaps(new uint32_t[n_wah]), 
-    p(new uint8_t[1000000]), p_len(0), p_cap(1000000), p_free(true),
+    wah_bitmaps(new uint32_t[n_wah]), gt_buffer(nullptr),
+    p(nullptr), p_len(0), p_cap(0), p_free(true), p_codec(CompressionStrategy::NONE),
     model_2mc(std::make_shared<djn_ewah_model_t>()),
-    model_nm(std::make_shared<djn_ewah_model_t>())
+    model_nm(std::make_shared<djn_ewah_model_t>()),
+    pbwt_gt(std::make_shared<PBWT>()),
+    model_phase(std::make_shared<djn_ewah_model_t>()),
+    phase_mode(DJN_PHASE_UNKNOWN), phase_bits(nullptr), dense(false), gt(false),
+    n_alt_obs(0), max_symbol_obs(0)
 {
     assert(n_s % pl == 0); // #samples/#ploidy must be divisible
 }
 
 djn_ewah_model_container_t::djn_ewah_model_container_t(int64_t n_s, int pl, bool use_pbwt, uint8_t* src, uint32_t src_len) : 
-    use_pbwt(use_pbwt),
+    use_pbwt(use_pbwt), gt_pbwt(false),
     ploidy(pl), n_samples(n_s), n_variants(0),
     n_samples_wah(std::ceil((float)n_samples / 32) * 32), 
     n_samples_wah_nm(std::ceil((float)n_samples * 4/32) * 8),
     n_wah(n_samples_wah_nm / 8),
-    wah_bitmaps(new uint32_t[n_wah]), 
-    p(src), p_len(src_len), p_cap(0), p_free(false),
+    wah_bitmaps(new uint32_t[n_wah]), gt_buffer(nullptr),
+    p(src), p_len(src_len), p_cap(0), p_free(false), p_codec(CompressionStrategy::NONE),
     model_2mc(std::make_shared<djn_ewah_model_t>()),
-    model_nm(std::make_shared<djn_ewah_model_t>())
+    model_nm(std::make_shared<djn_ewah_model_t>()),
+    pbwt_gt(std::make_shared<PBWT>()),
+    model_phase(std::make_shared<djn_ewah_model_t>()),
+    phase_mode(DJN_PHASE_UNKNOWN), phase_bits(nullptr), dense(false), gt(false),
+    n_alt_obs(0), max_symbol_obs(0)
 {
     assert(n_s % pl == 0); // #samples/#ploidy must be divisible
 }
 
 djn_ewah_model_container_t::~djn_ewah_model_container_t() {
-    if (p_free) delete[] p;
+    djn_release(*this);
     delete[] wah_bitmaps;
+    delete[] gt_buffer;
 }
 
 void djn_ewah_model_container_t::StartEncoding(bool use_pbwt, bool reset) {
@@ -756,14 +1068,22 @@ void djn_ewah_model_container_t::StartEncoding(bool use_pbwt, bool reset) {
         }
     }
 
+    // The genotype PBWT only applies to diploid data.
+    gt_pbwt = gt_pbwt && use_pbwt && ploidy == 2;
+    if (gt_pbwt) {
+        if (pbwt_gt->n_symbols == 0) pbwt_gt->Initiate(n_samples / 2, 4);
+        if (gt_buffer == nullptr) gt_buffer = new uint8_t[n_samples / 2];
+    }
+
     if (reset) {
-        // std::cerr << "[djn_ewah_model_container_t::StartEncoding] resetting" << std::endl;
         model_2mc->reset();
         model_nm->reset();
+        if (pbwt_gt->n_symbols) pbwt_gt->Reset();
     } else {
         model_2mc->n_variants = 0;
         model_nm->n_variants = 0;
     }
+    model_phase->reset();
 
     this->use_pbwt = use_pbwt;
     n_variants = 0;
@@ -771,34 +1091,38 @@ void djn_ewah_model_container_t::StartEncoding(bool use_pbwt, bool reset) {
 
     model_2mc->StartEncoding(use_pbwt, reset);
     model_nm->StartEncoding(use_pbwt, reset);
+    model_phase->StartEncoding(false, reset);
 }
 
-size_t djn_ewah_model_container_t::FinishEncoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, int c_level) {
+int64_t djn_ewah_model_container_t::FinishEncoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, CompressionStrategy strat, int c_level) {
     if (model_2mc.get() == nullptr) return -1;
     if (model_nm.get() == nullptr) return -1;
+    if (ctx == nullptr) return -1;
 
-    int s_2mc = model_2mc->FinishEncoding(support_buffer, support_cap, strat, c_level);
-    int s_nm  = model_nm->FinishEncoding(support_buffer, support_cap, strat, c_level);
-
-    GeneralCompressor comp;
-    switch(strat) {
-        case (CompressionStrategy::ZSTD): comp = &ZstdCompress; break;
-        case (CompressionStrategy::LZ4):  comp = &Lz4Compress; break;
-    }
+    const int64_t s_2mc = model_2mc->FinishEncoding(scratch, ctx, strat, c_level);
+    if (s_2mc < 0) return s_2mc;
+    const int64_t s_nm  = model_nm->FinishEncoding(scratch, ctx, strat, c_level);
+    if (s_nm < 0) return s_nm;
+    const int64_t s_phase = model_phase->FinishEncoding(scratch, ctx, strat, c_level);
+    if (s_phase < 0) return s_phase;
 
     if (p_len != 0) {
-        int ret = (*comp)(p, p_len, support_buffer, support_cap, c_level);
-        memcpy(p, support_buffer, ret); // copy data back to p
+        if (djn_reserve_compress(scratch, strat, p_len) < 0) return -4;
+        int ret = ctx->Compress(strat, p, p_len, scratch.p, scratch.cap, c_level, p_codec);
+        if (ret < 0) return ret;
+        if (djn_reserve(*this, ret) < 0) return -4;
+        memcpy(p, scratch.p, ret); // copy data back to p
         p_len = ret;
     }
 
-    size_t s_rc  = p_len;
-    return s_rc + s_2mc + s_nm;
+    int64_t s_rc  = p_len;
+    return s_rc + s_2mc + s_nm + s_phase;
 }
 
-void djn_ewah_model_container_t::StartDecoding(uint8_t*& support_buffer, uint32_t& support_cap, CompressionStrategy strat, bool use_pbwt, bool reset) {
-    if (model_2mc.get() == nullptr) return;
-    if (model_nm.get() == nullptr) return;
+int djn_ewah_model_container_t::StartDecoding(djn_scratch_t& scratch, djn_codec_ctx_t* ctx, bool use_pbwt, bool reset) {
+    if (model_2mc.get() == nullptr) return -1;
+    if (model_nm.get() == nullptr) return -1;
+    if (ctx == nullptr) return -1;
 
     if (use_pbwt) {
         if (model_2mc->pbwt->n_symbols == 0) {
@@ -816,31 +1140,98 @@ void djn_ewah_model_container_t::StartDecoding(uint8_t*& support_buffer, uint32_
         }
     }
 
+    // The genotype PBWT only applies to diploid data.
+    gt_pbwt = gt_pbwt && use_pbwt && ploidy == 2;
+    if (gt_pbwt) {
+        if (pbwt_gt->n_symbols == 0) pbwt_gt->Initiate(n_samples / 2, 4);
+        if (gt_buffer == nullptr) gt_buffer = new uint8_t[n_samples / 2];
+    }
+
     if (reset) {
-        // std::cerr << "[djn_ewah_model_container_t::StartDecoding] resetting" << std::endl;
         model_2mc->reset();
         model_nm->reset();
+        if (pbwt_gt->n_symbols) pbwt_gt->Reset();
     } else {
         model_2mc->n_variants = 0;
         model_nm->n_variants = 0;
     }
-    // std::cerr << "[djn_ewah_model_container_t::StartDecoding] p_len=" << p_len << std::endl;
 
     this->use_pbwt = use_pbwt;
 
-    GeneralDecompressor dec;
-    switch(strat) {
-        case (CompressionStrategy::ZSTD): dec = &ZstdDecompress; break;
-        case (CompressionStrategy::LZ4):  dec = &Lz4Decompress;  break;
-    }
+    // Archetype data is stored as one byte per variant.
     if (p_len != 0) {    
-        int ret = (*dec)(p, p_len, support_buffer, support_cap);
-        memcpy(p, support_buffer, ret); // copy data back to p
+        if (scratch.Reserve(n_variants) < 0) return -3;
+        int ret = ctx->Decompress(p_codec, p, p_len, scratch.p, scratch.cap);
+        if (ret < 0) return -2;
+        if (djn_reserve(*this, ret) < 0) return -3;
+        memcpy(p, scratch.p, ret); // copy data back to p
     }
     p_len = 0;
 
-    model_2mc->StartDecoding(support_buffer, support_cap, strat, use_pbwt, reset);
-    model_nm->StartDecoding(support_buffer, support_cap, strat, use_pbwt, reset);
+    int ret = model_2mc->StartDecoding(scratch, ctx, use_pbwt, reset);
+    if (ret < 0) return ret;
+    ret = model_nm->StartDecoding(scratch, ctx, use_pbwt, reset);
+    if (ret < 0) return ret;
+    ret = model_phase->StartDecoding(scratch, ctx, false, true);
+    if (ret < 0) return ret;
+    phase_mode = DJN_PHASE_UNKNOWN;
+    phase_bits = nullptr;
+    return 1;
+}
+
+uint8_t djn_ewah_model_container_t::EncodePhase(const uint8_t* data, uint32_t len) {
+    // Count phased separators: the first allele of every sample and
+    // end-of-vector markers have no preceding separator.
+    uint32_t n_sep = 0, n_phased = 0;
+    for (uint32_t i = 0; i < len; i += ploidy) {
+        for (int k = 1; k < ploidy; ++k) {
+            if ((data[i+k] >> 1) == 64) continue; // EOV
+            ++n_sep;
+            n_phased += data[i+k] & 1;
+        }
+    }
+    if (n_sep == 0) return DJN_PHASE_UNKNOWN;
+    if (n_phased == n_sep) return DJN_PHASE_ALL;
+    if (n_phased == 0) return DJN_PHASE_NONE;
+
+    // Mixed phasing: store one bit per haplotype.
+    const uint32_t n_bytes = (len + 7) / 8;
+    if (djn_reserve_append(*model_phase, n_bytes) < 0) return DJN_PHASE_UNKNOWN;
+    uint8_t* dst = &model_phase->p[model_phase->p_len];
+    memset(dst, 0, n_bytes);
+    for (uint32_t i = 0; i < len; ++i) {
+        dst[i >> 3] |= (data[i] & 1) << (i & 7);
+    }
+    model_phase->p_len += n_bytes;
+    return DJN_PHASE_MIXED;
+}
+
+uint8_t djn_ewah_model_container_t::NextArchetype() {
+    const uint8_t type = p[p_len++];
+    phase_mode = (type >> 1) & 3;
+    dense = (type & DJN_ARCHETYPE_DENSE);
+    gt = (type & DJN_ARCHETYPE_GT);
+    phase_bits = nullptr;
+    if (phase_mode == DJN_PHASE_MIXED) {
+        phase_bits = &model_phase->p[model_phase->p_len];
+        model_phase->p_len += (n_samples + 7) / 8;
+    }
+    return type & 1;
+}
+
+void djn_ewah_model_container_t::SetPhase(djinn_variant_t* variant) const {
+    variant->phased = phase_mode;
+    variant->phase_len = 0;
+    if (phase_mode != DJN_PHASE_MIXED) return;
+
+    const uint32_t n_bytes = (n_samples + 7) / 8;
+    if (n_bytes > variant->phase_alloc) {
+        delete[] variant->phase;
+        variant->phase_alloc = n_bytes + 1024;
+        variant->phase = new uint8_t[variant->phase_alloc];
+    }
+    memcpy(variant->phase, phase_bits, n_bytes);
+    variant->phase_len = n_bytes;
 }
 
 int djn_ewah_model_container_t::Encode2mc(uint8_t* data, uint32_t len) {
@@ -928,6 +1319,62 @@ int djn_ewah_model_container_t::EncodeNm(uint8_t* data, uint32_t len, const uint
     return EncodeWahNm(wah_bitmaps, n_samples_wah_nm >> 3); // n_samples_wah_nm / 8
 }
 
+bool djn_ewah_model_container_t::PackGenotypes(const uint8_t* data, uint32_t len, bool bcf) {
+    if (gt_pbwt == false || gt_buffer == nullptr) return false;
+    if (len != n_samples) return false;
+    return bcf ? djn_gt_pack_bcf(data, len, gt_buffer) : djn_gt_pack(data, len, gt_buffer);
+}
+
+int djn_ewah_model_container_t::EncodeGt() {
+    if (gt_buffer == nullptr) return -1;
+    if (pbwt_gt->n_symbols == 0) return -2;
+
+    pbwt_gt->Update(gt_buffer, 1);
+
+    memset(wah_bitmaps, 0, n_wah*sizeof(uint32_t));
+    for (int i = 0; i < pbwt_gt->n_samples; ++i) {
+        wah_bitmaps[i / 16] |= (uint32_t)DJN_GT_CODE[pbwt_gt->prev[i]] << (2*(i % 16));
+    }
+
+    return EncodeWah(wah_bitmaps, n_samples_wah >> 5); // n_samples_wah / 32
+}
+
+int djn_ewah_model_container_t::UnpermuteGt(const uint8_t* ewah_data, uint32_t len) {
+    if (gt_buffer == nullptr) return -1;
+
+    const uint32_t* ppa = pbwt_gt->ppa;
+    const int64_t n_gt = pbwt_gt->n_samples;
+    uint32_t n_obs[4] = {0}; // number of samples with each genotype symbol
+
+    uint32_t local_offset = 0;
+    int64_t j = 0;
+    while (local_offset < len) {
+        const djinn_ewah_t* ewah = (const djinn_ewah_t*)&ewah_data[local_offset];
+        local_offset += sizeof(djinn_ewah_t);
+
+        // Clean words.
+        const uint8_t gt = DJN_GT_FROM_CODE[(ewah->ref & 1) ? 3 : 0];
+        const int64_t to = j + ewah->clean*16 > n_gt ? n_gt : j + ewah->clean*16;
+        n_obs[gt] += to - j;
+        for (/**/; j < to; ++j) gt_buffer[ppa[j]] = gt;
+
+        for (int i = 0; i < ewah->dirty; ++i) {
+            uint32_t dirty = *((const uint32_t*)&ewah_data[local_offset]); // copy
+            for (int k = 0; k < 16 && j < n_gt; ++k, ++j) {
+                gt_buffer[ppa[j]] = DJN_GT_FROM_CODE[dirty & 3];
+                ++n_obs[gt_buffer[ppa[j]]];
+                dirty >>= 2;
+            }
+            local_offset += sizeof(uint32_t);
+        }
+    }
+    assert(j == n_gt);
+    djn_gt_counts(n_obs, n_alt_obs, max_symbol_obs);
+
+    pbwt_gt->Update(gt_buffer, 1);
+    return 1;
+}
+
 int djn_ewah_model_container_t::DecodeRaw_nm(uint8_t* data, uint32_t& len) {
     if (data == nullptr) return -1;
     if (model_nm.get() == nullptr) return -2;
@@ -935,8 +1382,8 @@ int djn_ewah_model_container_t::DecodeRaw_nm(uint8_t* data, uint32_t& len) {
     int64_t n_samples_obs = 0;
     int objects = 0;
 
-    // Reset alts
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
+    n_alt_obs = 0;
+    max_symbol_obs = 0;
 
     while(true) {
         // Emit empty EWAH marker.
@@ -952,13 +1399,13 @@ int djn_ewah_model_container_t::DecodeRaw_nm(uint8_t* data, uint32_t& len) {
         model_nm->p_len += sizeof(djinn_ewah_t);
         n_samples_obs += ewah->clean*8;
         n_samples_obs += ewah->dirty*8;
-        hist_alts[ewah->ref & 15] += 8*ewah->clean;
+        if (ewah->clean && (ewah->ref & 15) > max_symbol_obs) max_symbol_obs = ewah->ref & 15;
 
         for (int i = 0; i < ewah->dirty; ++i) {
             uint32_t r = *((const uint32_t*)&model_nm->p[model_nm->p_len]); // copy
             *((uint32_t*)&data[len]) = r;
             for (int j = 0; j < 8; ++j) {
-                ++hist_alts[r & 15];
+                if ((r & 15) > max_symbol_obs) max_symbol_obs = r & 15;
                 r >>= 4;
             }
             len += sizeof(uint32_t);
@@ -970,39 +1417,56 @@ int djn_ewah_model_container_t::DecodeRaw_nm(uint8_t* data, uint32_t& len) {
             break;
         }
 
-        if (n_samples_obs > n_samples_wah_nm) {
-            std::cerr << "[djn_ewah_model_container_t::DecodeRaw_nm] Decompression corruption: " << n_samples_obs << "/" << n_samples_wah  << std::endl;
-            exit(1);
-        }
-    }
-
-    uint32_t n_alts_obs = 0;
-    for (int i = 0; i < 256; ++i) {
-        n_alts_obs += hist_alts[i];
+        // Decompression corruption.
+        if (n_samples_obs > n_samples_wah_nm) return -2;
     }
-    assert(n_alts_obs == n_samples_wah_nm);
 
     return objects;
 }
 
-int djn_ewah_model_container_t::EncodeWah(uint32_t* wah, uint32_t len) { // input WAH-encoded data
+bool djn_ewah_model_container_t::IsDense(const uint32_t* wah, uint32_t len, uint32_t n_set) const {
+    // At least three in four words must be dirty.
+    const uint64_t n_unset = 32*(uint64_t)len - std::min<uint64_t>(n_set, 32*(uint64_t)len);
+    if (4*std::min<uint64_t>(n_set, n_unset) < 3*(uint64_t)len) return false;
+
+    // The packed bitmaps must also be smaller than the EWAH objects: a new
+    // object starts at every clean word following a dirty word or a clean
+    // word of the other kind.
+    uint32_t n_dirty = 0, n_objs = 1;
+    for (uint32_t i = 0; i < len; ++i) {
+        if (wah[i] != 0 && wah[i] != std::numeric_limits<uint32_t>::max()) ++n_dirty;
+        else if (i && wah[i] != wah[i-1]) ++n_objs;
+    }
+    if (4*n_dirty < 3*len) return false;
+    return n_objs*sizeof(djinn_ewah_t) + n_dirty*sizeof(uint32_t) > len*sizeof(uint32_t);
+}
+
+int djn_ewah_model_container_t::EncodeWahDense(uint32_t* wah, uint32_t len) {
+    if (wah == nullptr) return -1;
+    if (model_2mc.get() == nullptr) return -1;
+    if (djn_reserve(*model_2mc, model_2mc->p_len + len*sizeof(uint32_t), model_2mc->p_len) < 0) return -2;
+
+    // The archetype byte of this variant is written before calling this
+    // function.
+    memcpy(&model_2mc->p[model_2mc->p_len], wah, len*sizeof(uint32_t));
+    model_2mc->p_len += len*sizeof(uint32_t);
+    p[p_len - 1] |= DJN_ARCHETYPE_DENSE;
+
+    ++model_2mc->n_variants;
+    ++n_variants;
+    return 1;
+}
+
+int djn_ewah_model_container_t::EncodeWah(uint32_t* wah, uint32_t len, uint32_t n_set) { // input WAH-encoded data
     if (wah == nullptr) return -1;
     if (model_2mc.get() == nullptr) return -1;
+    if (IsDense(wah, len, n_set)) return EncodeWahDense(wah, len);
 
     // Resize if necessary.
-    if (model_2mc->p_len + n_samples + 65536 > model_2mc->p_cap) {
-        const uint32_t rc_size = model_2mc->p_len;
-        // std::cerr << "[djn_ewah_model_container_t::EncodeWah][RESIZE] resizing from: " << rc_size << "->" << 2*rc_size << std::endl;
-        uint8_t* prev = model_2mc->p; // old
-        model_2mc->p_cap = model_2mc->p_len + 2*n_samples + 65536;
-        model_2mc->p = new uint8_t[model_2mc->p_cap]; // double size. should rarely occur
-        memcpy(model_2mc->p, prev, rc_size);
-        if (model_2mc->p_free) delete[] prev;
-        model_2mc->p_free = true;
-    }
+    if (djn_reserve(*model_2mc, model_2mc->p_len + djn_ewah_bound(len), model_2mc->p_len) < 0) return -2;
 
-    uint32_t n_objs = 1;
-    uint32_t n_obs  = 0;
+    uint32_t n_objs  = 1;
+    uint32_t n_obs   = 0;
     
     djinn_ewah_t* ewah = (djinn_ewah_t*)&model_2mc->p[model_2mc->p_len];
     ewah->reset();
@@ -1061,15 +1525,7 @@ int djn_ewah_model_container_t::EncodeWahNm(uint32_t* wah, uint32_t len) { // in
     if (model_nm.get() == nullptr) return -1;
 
     // Resize if necessary.
-    if (model_nm->p_len + n_samples + 65536 > model_nm->p_cap) {
-        const uint32_t rc_size = model_nm->p_len;
-        uint8_t* prev = model_nm->p; // old
-        model_nm->p_cap = model_nm->p_len + 2*n_samples + 65536;
-        model_nm->p = new uint8_t[model_nm->p_cap]; // double size. should rarely occur
-        memcpy(model_nm->p, prev, rc_size);
-        if (model_nm->p_free) delete[] prev;
-        model_nm->p_free = true;
-    }
+    if (djn_reserve(*model_nm, model_nm->p_len + djn_ewah_bound(len), model_nm->p_len) < 0) return -2;
 
     // Debug
     uint32_t n_objs = 1;
@@ -1133,21 +1589,34 @@ int djn_ewah_model_container_t::DecodeNext(uint8_t* ewah_data, uint32_t& ret_ewa
     if (model_nm.get() == nullptr)  return -1;
 
     // Decode stream archetype.
-    uint8_t type = p[p_len++];
+    uint8_t type = NextArchetype();
 
     size_t ret_ewah_init = ret_ewah;
     int objs = 0;
+
+    // Genotypes are permuted with the genotype PBWT.
+    if (gt) {
+        if (type != 0 || gt_pbwt == false) return -1;
+        objs = DecodeRaw(ewah_data, ret_ewah);
+        if (objs <= 0) return -1;
+        if (UnpermuteGt(&ewah_data[ret_ewah_init], ret_ewah - ret_ewah_init) <= 0) return -1;
+
+        djn_gt_unpack(gt_buffer, pbwt_gt->n_samples, ret_buffer);
+        ret_len = n_samples;
+        return objs;
+    }
+
     switch(type) {
     case 0: objs = DecodeRaw(ewah_data, ret_ewah);    break;
     case 1: objs = DecodeRaw_nm(ewah_data, ret_ewah); break;
-    default: std::cerr << "[djn_ewah_model_container_t::DecodeNext] decoding error: " << (int)type << " (valid=[0,1])" << std::endl; return -1;
+    default: return -1; // corrupted archetype
     }
 
     if (objs <= 0) return -1;
 
     if (use_pbwt) {
         if (type == 0) {
-            if (hist_alts[1] >= 10) {
+            if (n_alt_obs >= 10) {
                  model_2mc->pbwt->ReverseUpdateEWAH(ewah_data, ret_ewah, ret_buffer); 
                 ret_len = n_samples;
             } else {
@@ -1264,12 +1733,12 @@ int djn_ewah_model_container_t::DecodeNextRaw(uint8_t* data, uint32_t& len) {
     if (model_nm.get() == nullptr) return -1;
     
     // Decode stream archetype.
-    uint8_t type = p[p_len++];
+    uint8_t type = NextArchetype();
 
     switch(type) {
-    case 0: return(DecodeRaw(data, len)); break;
+    case 0: return(gt ? DecodeRawGt(data, len) : DecodeRaw(data, len)); break;
     case 1: return(DecodeRaw_nm(data, len)); break;
-    default: std::cerr << "[djn_ewah_model_container_t::DecodeNextRaw] decoding error: " << (int)type << " (valid=[0,1])" << std::endl; return -1;
+    default: return -1; // corrupted archetype
     }
 
     // Never reached.
@@ -1284,8 +1753,26 @@ int djn_ewah_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len) {
     int64_t n_samples_obs = 0;
     int objects = 0;
 
-    // Compute als
-    memset(hist_alts, 0, 256*sizeof(uint32_t));
+    n_alt_obs = 0;
+
+    if (dense) {
+        // Raw bitmaps are returned as a single object of dirty words.
+        const uint32_t n_words = n_samples_wah >> 5; // n_samples_wah / 32
+        djinn_ewah_t* ewah = (djinn_ewah_t*)&data[len];
+        ewah->reset();
+        ewah->dirty = n_words;
+        len += sizeof(djinn_ewah_t);
+        memcpy(&data[len], &model_2mc->p[model_2mc->p_len], n_words*sizeof(uint32_t));
+        model_2mc->p_len += n_words*sizeof(uint32_t);
+
+        const uint32_t* r = (const uint32_t*)&data[len];
+        for (uint32_t i = 0; i < n_words; ++i) {
+            n_alt_obs += __builtin_popcount(r[i]);
+        }
+        max_symbol_obs = (n_alt_obs != 0);
+        len += n_words*sizeof(uint32_t);
+        return 1;
+    }
 
     while(true) {
         // Emit empty EWAH marker.
@@ -1294,7 +1781,6 @@ int djn_ewah_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len) {
         len += sizeof(djinn_ewah_t);
         
         djinn_ewah_t* e = (djinn_ewah_t*)&model_2mc->p[model_2mc->p_len]; 
-        // std::cerr << "EWAH: ref=" << e->ref << ",clean=" << e->clean << ",dirty=" << e->dirty << " offset=" << model_2mc->p_len << "/" << model_2mc->p_cap << std::endl;
         assert(e->clean + e->dirty > 0);
         ewah->ref   = e->ref;
         ewah->clean = e->clean;
@@ -1302,34 +1788,58 @@ int djn_ewah_model_container_t::DecodeRaw(uint8_t* data, uint32_t& len) {
         model_2mc->p_len += sizeof(djinn_ewah_t);
         n_samples_obs += ewah->clean*32;
         n_samples_obs += ewah->dirty*32;
-        hist_alts[ewah->ref & 1] += 32*ewah->clean;
+        n_alt_obs += (ewah->ref & 1) * 32*ewah->clean;
 
         for (int i = 0; i < ewah->dirty; ++i) {
             const uint32_t* r = (const uint32_t*)&model_2mc->p[model_2mc->p_len];
             *((uint32_t*)&data[len]) = *r;
-            hist_alts[1] += __builtin_popcount(*r);
-            hist_alts[0] += __builtin_popcount(~(*r));
+            n_alt_obs += __builtin_popcount(*r);
             len += sizeof(uint32_t);
             model_2mc->p_len += sizeof(uint32_t);
         }
         ++objects;
 
         if (n_samples_obs == n_samples_wah) {
-            // std::cerr << "obs=" << n_samples_obs << "/" << n_samples_wah << std::endl;
             break;
         }
 
-        if (n_samples_obs > n_samples_wah) {
-            std::cerr << "[djn_ewah_model_container_t::DecodeRaw] Decompression corruption: " << n_samples_obs << "/" << n_samples_wah  << std::endl;
-            exit(1);
-        }
+        // Decompression corruption.
+        if (n_samples_obs > n_samples_wah) return -2;
     }
-
-    // std::cerr << "[decoded 2nm] " << hist_alts[0] << "," <<hist_alts[1] << std::endl;
+    max_symbol_obs = (n_alt_obs != 0);
 
     return objects;
 }
 
+int djn_ewah_model_container_t::DecodeRawGt(uint8_t* data, uint32_t& len) {
+    if (data == nullptr) return -1;
+    if (gt_pbwt == false) return -2;
+
+    // The permuted genotypes are decoded into the output buffer and are
+    // overwritten once the genotype PBWT has restored the sample order.
+    const uint32_t start = len;
+    if (DecodeRaw(data, len) <= 0) return -3;
+    if (UnpermuteGt(&data[start], len - start) <= 0) return -3;
+    len = start;
+
+    // Haplotypes are returned as a single object of dirty 4-bit words.
+    const uint32_t n_words = n_samples_wah_nm >> 3; // n_samples_wah_nm / 8
+    djinn_ewah_t* ewah = (djinn_ewah_t*)&data[len];
+    ewah->reset();
+    ewah->dirty = n_words;
+    len += sizeof(djinn_ewah_t);
+
+    uint32_t* words = (uint32_t*)&data[len];
+    memset(words, 0, n_words*sizeof(uint32_t));
+    for (int i = 0; i < pbwt_gt->n_samples; ++i) {
+        const uint8_t* alleles = DJN_GT_ALLELES[gt_buffer[i]];
+        words[i / 4] |= (uint32_t)(alleles[0] | (alleles[1] << 4)) << (8*(i % 4));
+    }
+    len += n_words*sizeof(uint32_t);
+
+    return 1;
+}
+
 int djn_ewah_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
     if (variant == nullptr) {
         variant = new djinn_variant_t;
@@ -1350,13 +1860,13 @@ int djn_ewah_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
     variant->n_allele = 0;
 
     // Decode stream archetype.
-    uint8_t type = p[p_len++];
+    uint8_t type = NextArchetype();
 
     int ret = 0;
     switch(type) {
-    case 0: ret = DecodeRaw(variant->data, variant->data_len);    break;
+    case 0: ret = gt ? DecodeRawGt(variant->data, variant->data_len) : DecodeRaw(variant->data, variant->data_len); break;
     case 1: ret = DecodeRaw_nm(variant->data, variant->data_len); break;
-    default: std::cerr << "[djn_ctx_model_container_t::DecodeNextRaw] decoding error: " << (int)type << " (valid=[0,1])" << std::endl; return -1;
+    default: return -1; // corrupted archetype
     }
 
     if (ret <= 0) {
@@ -1384,14 +1894,13 @@ int djn_ewah_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
     variant->d->n_ewah  = 0;
     variant->d->n_dirty = 0;
     // Set bitmap type.
-    variant->d->dirty_type = type;
+    variant->d->dirty_type = gt ? DJN_DIRTY_NM : type; // genotypes are returned as NM
     variant->d->n_samples  = n_samples;
 
     // Construct EWAH mapping
     uint32_t local_offset = 0;
     uint32_t ret_pos = 0;
 
-    // std::cerr << "here" << std::endl;
     for (int j = 0; j < ret; ++j) {
         djinn_ewah_t* ewah = (djinn_ewah_t*)&variant->data[local_offset];
         variant->d->ewah[variant->d->n_ewah++] = (djinn_ewah_t*)&variant->data[local_offset];
@@ -1414,19 +1923,15 @@ int djn_ewah_model_container_t::DecodeNextRaw(djinn_variant_t*& variant) {
     }
     assert(ret_pos == n_samples);
 
-    // Compute number of alleles.
-    uint32_t max_allele = 0;
-    for (int i = 0; i < 256; ++i) {
-        max_allele = hist_alts[i] != 0 ? i : max_allele;
-    }
-    variant->n_allele = max_allele + 1;
+    variant->n_allele = max_symbol_obs + 1;
+    SetPhase(variant);
 
     return 1;
 }
 
 int djn_ewah_model_container_t::Serialize(uint8_t* dst) const {
     // Serialize as (int,uint32_t,uint32_t,uint8_t*,ctx1,ctx2):
-    // ploidy,n_samples,n_variants,p_len,p,model_2mc,model_nm
+    // ploidy,n_samples,n_variants,p_len,p,model_2mc,model_nm,model_phase
     uint32_t offset = 0;
     *((int*)&dst[offset]) = ploidy; // ploidy
     offset += sizeof(int);
@@ -1434,30 +1939,36 @@ int djn_ewah_model_container_t::Serialize(uint8_t* dst) const {
     offset += sizeof(uint32_t);
     *((uint32_t*)&dst[offset]) = n_variants; // number of variants
     offset += sizeof(uint32_t);
+    dst[offset] = (uint8_t)p_codec; // codec used
+    offset += sizeof(uint8_t);
     *((uint32_t*)&dst[offset]) = p_len; // data length
     offset += sizeof(uint32_t);
     memcpy(&dst[offset], p, p_len); // data
     offset += p_len;
     offset += model_2mc->Serialize(&dst[offset]);
     offset += model_nm->Serialize(&dst[offset]);
+    offset += model_phase->Serialize(&dst[offset]);
     return offset;
 }
 
 int djn_ewah_model_container_t::Serialize(std::ostream& stream) const {
     // Serialize as (int,uint32_t,uint32_t,uint8_t*,ctx1,ctx2):
-    // ploidy,n_samples,n_variants,p_len,p,model_2mc,model_nm
+    // ploidy,n_samples,n_variants,p_len,p,model_2mc,model_nm,model_phase
     stream.write((char*)&ploidy, sizeof(int));
     stream.write((char*)&n_samples, sizeof(uint32_t));
     stream.write((char*)&n_variants, sizeof(uint32_t));
+    uint8_t out_codec = (uint8_t)p_codec;
+    stream.write((char*)&out_codec, sizeof(uint8_t));
     stream.write((char*)&p_len, sizeof(uint32_t));
     stream.write((char*)p, p_len);
     model_2mc->Serialize(stream);
     model_nm->Serialize(stream);
+    model_phase->Serialize(stream);
     return stream.tellp();
 }
 
 int djn_ewah_model_container_t::GetSerializedSize() const {
-    int ret = sizeof(int) + 3*sizeof(uint32_t) + p_len + model_2mc->GetSerializedSize() + model_nm->GetSerializedSize();
+    int ret = sizeof(int) + 3*sizeof(uint32_t) + sizeof(uint8_t) + p_len + model_2mc->GetSerializedSize() + model_nm->GetSerializedSize() + model_phase->GetSerializedSize();
     return ret;
 }
 
@@ -1465,6 +1976,7 @@ int djn_ewah_model_container_t::GetCurrentSize() const {
     int ret = p_len;
     ret += model_2mc->p_len;
     ret += model_nm->p_len;
+    ret += model_phase->p_len;
     return ret;
 }
 
@@ -1478,22 +1990,26 @@ int djn_ewah_model_container_t::Deserialize(uint8_t* dst) {
     offset += sizeof(uint32_t);
     n_variants = *((uint32_t*)&dst[offset]);
     offset += sizeof(uint32_t);
+    p_codec = CompressionStrategy(dst[offset]);
+    offset += sizeof(uint8_t);
     p_len = *((uint32_t*)&dst[offset]);
     offset += sizeof(uint32_t);
 
-    // initiate a buffer if there is none or it's too small
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
-    }
+    // initiate a buffer if there is none or it's too small: data is
+    // decompressed in-place into n_variants bytes.
+    if (djn_reserve(*this, p_len > n_variants ? p_len : n_variants) < 0) return -1;
 
     memcpy(p, &dst[offset], p_len); // data
     offset += p_len;
-    offset += model_2mc->Deserialize(&dst[offset]);
-    offset += model_nm->Deserialize(&dst[offset]);
+    int ret = model_2mc->Deserialize(&dst[offset]);
+    if (ret < 0) return ret;
+    offset += ret;
+    ret = model_nm->Deserialize(&dst[offset]);
+    if (ret < 0) return ret;
+    offset += ret;
+    ret = model_phase->Deserialize(&dst[offset]);
+    if (ret < 0) return ret;
+    offset += ret;
 
     return(offset);
 }
@@ -1502,20 +2018,23 @@ int djn_ewah_model_container_t::Deserialize(std::istream& stream) {
     // #pl and #n_s read outside of this function in Deserialize() for
     // the parent.
     stream.read((char*)&n_variants, sizeof(uint32_t));
+    uint8_t in_codec = 0;
+    stream.read((char*)&in_codec, sizeof(uint8_t));
+    p_codec = CompressionStrategy(in_codec);
     stream.read((char*)&p_len, sizeof(uint32_t));
     
-    // initiate a buffer if there is none or it's too small
-    if (p_cap == 0 || p == nullptr || p_len > p_cap) {
-        // std::cerr << "[Deserialize] Limit. p_cap=" << p_cap << "," << "p is nullptr=" << (p == nullptr ? "yes" : "no") << ",p_len=" << p_len << "/" << p_cap << std::endl;
-        if (p_free) delete[] p;
-        p = new uint8_t[p_len + 65536];
-        p_cap = p_len + 65536;
-        p_free = true;
+    // initiate a buffer if there is none or it's too small: data is
+    // decompressed in-place into n_variants bytes.
+    if (djn_reserve(*this, p_len > n_variants ? p_len : n_variants) < 0) {
+        stream.setstate(std::ios::failbit);
+        return -1;
     }
 
     stream.read((char*)p, p_len);
     model_2mc->Deserialize(stream);
     model_nm->Deserialize(stream);
+    model_phase->Deserialize(stream);
+    if (stream.fail()) return -1;
     return stream.tellg();
 }
 
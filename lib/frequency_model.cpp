@@ -134,6 +134,8 @@ uint16_t FrequencyModel::DecodeSymbol(RangeCoder *rc) {
     SymFreqs* s = F;
     uint32_t freq = rc->GetFreq(total_frequency);
     uint32_t AccFreq;
+    // Corrupted input: clamp such that the search terminates within F.
+    if (freq >= total_frequency) freq = total_frequency - 1;
 
     for (AccFreq = 0; (AccFreq += s->Freq) <= freq; s++)
         _mm_prefetch((uint8_t*)s, _MM_HINT_T0);
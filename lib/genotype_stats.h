@@ -0,0 +1,246 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_GENOTYPE_STATS_H_
+#define DJINN_GENOTYPE_STATS_H_
+
+#include <cstdint>//uint
+#include <cstddef>//size_t
+#include <cstring>//memset
+
+#include "djinn.h" // djinn_variant_stats_t
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace djinn {
+
+/**
+ * Summary statistics of a genotype vector used by the encoders to select an
+ * archetype (2mc or nm) and to decide whether to update the PBWT. These
+ * replace the full 256-bin allele histogram previously computed for every
+ * variant. The counts are also stored as per-variant summaries (see
+ * djinn_variant_stats_t).
+ */
+struct djn_gt_stats_t {
+    uint32_t n_ref;      // number of haplotypes carrying the reference allele
+    uint32_t n_alt;      // number of haplotypes carrying the first alt allele
+    uint32_t n_missing;  // number of missing values
+    uint32_t n_eov;      // number of EOV symbols
+    uint32_t max_allele; // largest allele excluding missing values and EOV
+    bool has_missing;
+    bool has_eov;
+};
+
+/**
+ * Compute genotype statistics in a single pass over the data. Values are
+ * mapped into a key (x >> shift) that is compared to the key of the
+ * reference allele, the first alt allele, missing values, and EOV symbols.
+ * Optionally, bits are set in the provided bitmaps for every haplotype
+ * carrying the first alt allele or a missing value such that the caller does
+ * not need a second pass. Bitmaps of 32- or 64-bit words must be zeroed and
+ * hold at least ceil(len/(8*sizeof(word_t))) words.
+ *
+ * @param data         Input genotypes.
+ * @param len          Number of haplotypes.
+ * @param stats        Output statistics.
+ * @param bits_alt     Optional bitmap of alt alleles.
+ * @param bits_missing Optional bitmap of missing values.
+ */
+template <int shift, uint8_t key_ref, uint8_t key_alt, uint8_t key_missing, uint8_t key_eov, int allele_offset, class word_t>
+static inline void djn_gt_stats_impl(const uint8_t* data, size_t len, djn_gt_stats_t& stats, word_t* bits_alt, word_t* bits_missing) {
+    const int word_bits = 8*sizeof(word_t);
+    uint32_t n_ref = 0, n_alt = 0, n_missing = 0, n_eov = 0, max_key = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i k_ref  = _mm_set1_epi8(key_ref);
+    const __m128i k_alt  = _mm_set1_epi8(key_alt);
+    const __m128i k_miss = _mm_set1_epi8(key_missing);
+    const __m128i k_eov  = _mm_set1_epi8(key_eov);
+    const __m128i k_mask = _mm_set1_epi8(0xFF >> shift);
+    __m128i vmax  = _mm_setzero_si128();
+
+    for (/**/; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&data[i]);
+        if (shift) v = _mm_and_si128(_mm_srli_epi16(v, shift), k_mask);
+
+        const __m128i is_miss = _mm_cmpeq_epi8(v, k_miss);
+        const __m128i is_eov  = _mm_cmpeq_epi8(v, k_eov);
+        vmax  = _mm_max_epu8(vmax, _mm_andnot_si128(_mm_or_si128(is_miss, is_eov), v));
+
+        const uint32_t m_alt  = _mm_movemask_epi8(_mm_cmpeq_epi8(v, k_alt));
+        const uint32_t m_miss = _mm_movemask_epi8(is_miss);
+        n_ref     += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, k_ref)));
+        n_alt     += __builtin_popcount(m_alt);
+        n_missing += __builtin_popcount(m_miss);
+        n_eov     += __builtin_popcount(_mm_movemask_epi8(is_eov));
+        if (bits_alt) bits_alt[i / word_bits] |= (word_t)m_alt << (i % word_bits);
+        if (bits_missing) bits_missing[i / word_bits] |= (word_t)m_miss << (i % word_bits);
+    }
+
+    // Horizontal maximum.
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 8));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 4));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 2));
+    vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 1));
+    max_key = _mm_cvtsi128_si32(vmax) & 0xFF;
+#endif
+
+    for (/**/; i < len; ++i) {
+        const uint8_t v = data[i] >> shift;
+        const bool is_miss = (v == key_missing);
+        const bool is_eov  = (v == key_eov);
+        n_ref += (v == key_ref);
+        n_alt += (v == key_alt);
+        n_missing += is_miss;
+        n_eov += is_eov;
+        if (!is_miss && !is_eov && v > max_key) max_key = v;
+        if (bits_alt) bits_alt[i / word_bits] |= (word_t)(v == key_alt) << (i % word_bits);
+        if (bits_missing) bits_missing[i / word_bits] |= (word_t)is_miss << (i % word_bits);
+    }
+
+    stats.n_ref = n_ref;
+    stats.n_alt = n_alt;
+    stats.n_missing = n_missing;
+    stats.n_eov = n_eov;
+    stats.max_allele = max_key >= (uint32_t)allele_offset ? max_key - allele_offset : 0;
+    stats.has_missing = n_missing != 0;
+    stats.has_eov = n_eov != 0;
+}
+
+/**
+ * Statistics for Bcf-encoded genotypes: missing values are stored as 0, EOV
+ * as 64, and allele a as a+1 (in the upper 7 bits).
+ */
+template <class word_t = uint64_t>
+static inline void djn_gt_stats_bcf(const uint8_t* data, size_t len, djn_gt_stats_t& stats, word_t* bits_alt = nullptr, word_t* bits_missing = nullptr) {
+    djn_gt_stats_impl<1, 1, 2, 0, 64, 1, word_t>(data, len, stats, bits_alt, bits_missing);
+}
+
+/**
+ * Statistics for [0,N-1]-encoded genotypes: missing values are stored as 14
+ * and EOV as 15.
+ */
+template <class word_t = uint64_t>
+static inline void djn_gt_stats(const uint8_t* data, size_t len, djn_gt_stats_t& stats, word_t* bits_alt = nullptr, word_t* bits_missing = nullptr) {
+    djn_gt_stats_impl<0, 0, 1, 14, 15, 0, word_t>(data, len, stats, bits_alt, bits_missing);
+}
+
+/*======   Genotype PBWT (gtPBWT)   ======*/
+
+// Genotype symbols of unphased diploid samples.
+#define DJN_GT_HOM_REF 0 // 0/0
+#define DJN_GT_HET     1 // 0/1
+#define DJN_GT_HOM_ALT 2 // 1/1
+#define DJN_GT_MISSING 3 // ./.
+
+// Alleles, in [0,N-1]-encoding, of each genotype symbol.
+static const uint8_t DJN_GT_ALLELES[4][2] = {{0,0}, {0,1}, {1,1}, {DJN_ALLELE_MISSING,DJN_ALLELE_MISSING}};
+
+// Genotypes are stored as 2-bit codes in haplotype bitmaps: the code of a
+// called genotype is its pair of alleles (first allele in the lower bit) and
+// missing genotypes use the pair 1/0 that is never stored as a genotype.
+static const uint8_t DJN_GT_CODE[4] = {0, 2, 3, 1};
+static const uint8_t DJN_GT_FROM_CODE[4] = {DJN_GT_HOM_REF, DJN_GT_MISSING, DJN_GT_HET, DJN_GT_HOM_ALT};
+
+/**
+ * Collapse pairs of alleles into one genotype symbol per sample. Returns
+ * FALSE if any sample is not one of 0/0, 0/1, 1/1, or ./. such that the
+ * genotypes cannot be restored: for example 1/0, partially missing values,
+ * or other alleles. In Bcf-encodings (shift = 1) the phasing bit of the
+ * second allele must not be set.
+ *
+ * @param data Input genotypes.
+ * @param len  Number of haplotypes (two per sample).
+ * @param out  Output genotype symbols (len / 2).
+ */
+template <int shift, uint8_t key_ref, uint8_t key_alt, uint8_t key_missing>
+static inline bool djn_gt_pack_impl(const uint8_t* data, size_t len, uint8_t* out) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        if (shift && (data[i+1] & 1)) return false; // phased
+        const uint8_t a = data[i] >> shift, b = data[i+1] >> shift;
+        uint8_t gt = 0;
+        if (a == key_ref) {
+            if (b == key_ref) gt = DJN_GT_HOM_REF;
+            else if (b == key_alt) gt = DJN_GT_HET;
+            else return false;
+        } else if (a == key_alt && b == key_alt) gt = DJN_GT_HOM_ALT;
+        else if (a == key_missing && b == key_missing) gt = DJN_GT_MISSING;
+        else return false;
+        out[i >> 1] = gt;
+    }
+    return true;
+}
+
+static inline bool djn_gt_pack_bcf(const uint8_t* data, size_t len, uint8_t* out) {
+    return djn_gt_pack_impl<1, 1, 2, 0>(data, len, out);
+}
+
+static inline bool djn_gt_pack(const uint8_t* data, size_t len, uint8_t* out) {
+    return djn_gt_pack_impl<0, 0, 1, DJN_ALLELE_MISSING>(data, len, out);
+}
+
+/**
+ * Expand genotype symbols into pairs of alleles in [0,N-1]-encoding.
+ *
+ * @param gt    Input genotype symbols.
+ * @param n_gt  Number of samples.
+ * @param out   Output alleles (2 * n_gt).
+ */
+static inline void djn_gt_unpack(const uint8_t* gt, size_t n_gt, uint8_t* out) {
+    for (size_t i = 0; i < n_gt; ++i) {
+        out[2*i+0] = DJN_GT_ALLELES[gt[i] & 3][0];
+        out[2*i+1] = DJN_GT_ALLELES[gt[i] & 3][1];
+    }
+}
+
+/**
+ * Convert counts of genotype symbols into the number of alt alleles and the
+ * largest allele symbol (DJN_ALLELE_MISSING if any sample is missing).
+ *
+ * @param n_gt       Number of samples with each genotype symbol.
+ * @param n_alt      Output number of alt alleles.
+ * @param max_symbol Output largest allele symbol.
+ */
+static inline void djn_gt_counts(const uint32_t* n_gt, uint32_t& n_alt, uint8_t& max_symbol) {
+    n_alt = n_gt[DJN_GT_HET] + 2*n_gt[DJN_GT_HOM_ALT];
+    if (n_gt[DJN_GT_MISSING]) max_symbol = DJN_ALLELE_MISSING;
+    else max_symbol = (n_alt != 0);
+}
+
+/**
+ * Convert genotype statistics into the summary stored for a variant.
+ *
+ * @param stats     Genotype statistics.
+ * @param len       Number of haplotypes.
+ * @param archetype Archetype the variant was encoded with (0: 2MC, 1: NM, 2: genotypes).
+ */
+static inline djinn_variant_stats_t djn_variant_stats(const djn_gt_stats_t& stats, size_t len, uint8_t archetype) {
+    djinn_variant_stats_t ret;
+    ret.an = len - stats.n_missing - stats.n_eov;
+    ret.ac = ret.an - stats.n_ref;
+    ret.n_missing = stats.n_missing;
+    ret.max_allele = stats.max_allele > 255 ? 255 : stats.max_allele;
+    ret.archetype = archetype;
+    return ret;
+}
+
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <bitset>
 #include <cmath>//ceil
+#include <utility>//swap
 
 namespace djinn {
 
@@ -15,7 +16,9 @@ PBWT::PBWT() :
     ppa(nullptr),
     n_queue(nullptr),
     queue(nullptr),
-    prev_bitmap(nullptr)
+    prev_bitmap(nullptr),
+    div(nullptr),
+    div_tmp(nullptr)
 {
 
 }
@@ -28,7 +31,9 @@ PBWT::PBWT(int64_t n_samples, int n_symbols) :
     ppa(new uint32_t[n_samples]),
     n_queue(new uint32_t[n_symbols]),
     queue(new uint32_t*[n_symbols]),
-    prev_bitmap(nullptr)
+    prev_bitmap(nullptr),
+    div(nullptr),
+    div_tmp(nullptr)
 {
     assert(n_symbols > 1);
 
@@ -49,6 +54,8 @@ PBWT::~PBWT() {
     delete[] queue;
     delete[] n_queue;
     delete[] prev_bitmap;
+    delete[] div;
+    delete[] div_tmp;
 }
 
 void PBWT::Initiate(int64_t n_s, int n_sym) {
@@ -72,10 +79,65 @@ void PBWT::Initiate(int64_t n_s, int n_sym) {
     for (int i = 0; i < n_symbols; ++i)
         queue[i] = new uint32_t[n_samples];
 
+    if (div != nullptr) {
+        delete[] div; delete[] div_tmp;
+        div = new uint32_t[n_samples];
+        div_tmp = new uint32_t[n_samples];
+    }
+
     memset(n_queue, 0, sizeof(uint32_t)*n_symbols);
     Reset();
 }
 
+void PBWT::EnableDivergence(bool enable) {
+    if (enable == (div != nullptr)) return;
+
+    delete[] div; delete[] div_tmp;
+    div = nullptr; div_tmp = nullptr;
+    if (enable) {
+        div = new uint32_t[n_samples];
+        div_tmp = new uint32_t[n_samples];
+        // Divergence values are only meaningful from the next reset.
+        Reset();
+    }
+}
+
+template <bool indirect>
+void PBWT::UpdateDivergence(const uint8_t* y) {
+    assert(n_symbols <= 256);
+
+    // The queues are merged in symbol order: offset[c] is the next output
+    // position for symbol c.
+    uint32_t offset[256], p[256];
+    uint8_t active[256];
+    uint32_t of = 0;
+    for (int j = 0; j < n_symbols; ++j) {
+        offset[j] = of;
+        of += n_queue[j];
+        p[j] = std::numeric_limits<uint32_t>::max(); // not yet observed
+    }
+
+    // Single pass as described by Durbin (Algorithm 2): p[c] tracks the
+    // largest divergence value since the last haplotype with symbol c. Only
+    // symbols observed so far need updating as the first haplotype in a
+    // queue has no predecessor.
+    const uint32_t k = n_steps;
+    int n_active = 0;
+    for (int64_t i = 0; i < n_samples; ++i) {
+        const uint8_t c = indirect ? y[ppa[i]] : y[i];
+        for (int j = 0; j < n_active; ++j)
+            p[active[j]] = div[i] > p[active[j]] ? div[i] : p[active[j]];
+
+        if (p[c] == std::numeric_limits<uint32_t>::max()) {
+            active[n_active++] = c;
+            p[c] = k + 1;
+        }
+        div_tmp[offset[c]++] = p[c];
+        p[c] = 0;
+    }
+    std::swap(div, div_tmp);
+}
+
 void PBWT::Reset() {
     if (ppa != nullptr) {
         for (int i = 0; i < n_samples; ++i)
@@ -84,7 +146,13 @@ void PBWT::Reset() {
     if (prev != nullptr) {
         memset(prev, 0, sizeof(uint8_t)*n_samples);
     }
-    memset(n_queue, 0, sizeof(uint32_t)*n_symbols);
+    if (div != nullptr) {
+        memset(div, 0, sizeof(uint32_t)*n_samples);
+    }
+    if (n_queue != nullptr) {
+        memset(n_queue, 0, sizeof(uint32_t)*n_symbols);
+    }
+    n_steps = 0;
 }
 
 int PBWT::UpdateBcf(const uint8_t* arr, uint32_t stride) {
@@ -103,6 +171,8 @@ int PBWT::UpdateBcf(const uint8_t* arr, uint32_t stride) {
     }
     // std::cerr << std::endl << std::endl;
 
+    if (div != nullptr) UpdateDivergence<false>(prev);
+
     uint32_t of = 0;
     for (int j = 0; j < n_symbols; ++j) {
         for (uint32_t i = 0; i < n_queue[j]; ++i, ++of)
@@ -140,6 +210,8 @@ int PBWT::UpdateBcfGeneral(const uint8_t* arr, uint32_t stride) {
         prev[i] = gt;
     }
 
+    if (div != nullptr) UpdateDivergence<false>(prev);
+
     uint32_t of = 0;
     for (int j = 0; j < n_symbols; ++j) {
         for (uint32_t i = 0; i < n_queue[j]; ++i, ++of)
@@ -168,6 +240,8 @@ int PBWT::Update(const uint8_t* arr, uint32_t stride) {
         prev[i] = gt;
     }
 
+    if (div != nullptr) UpdateDivergence<false>(prev);
+
     uint32_t of = 0;
     for (int j = 0; j < n_symbols; ++j) {
         for (uint32_t i = 0; i < n_queue[j]; ++i, ++of)
@@ -179,6 +253,61 @@ int PBWT::Update(const uint8_t* arr, uint32_t stride) {
     return(1);
 }
 
+template <bool bcf>
+int PBWT::Update2mcImpl(const uint8_t* arr, uint32_t n_ref, uint32_t* bitmap) {
+    assert(n_symbols >= 2);
+    assert(n_ref <= n_samples);
+
+    // Reference alleles are written to [0, n_ref) and alt alleles to
+    // [n_ref, n_samples) of the first queue that then replaces the PPA.
+    uint32_t* out = queue[0];
+    uint32_t n_r = 0, n_a = n_ref;
+    for (int64_t i = 0; i < n_samples; ++i) {
+        const uint32_t gt = (bcf ? DJN_BCF_UNPACK_GENOTYPE(arr[ppa[i]]) : arr[ppa[i]]) != 0;
+        out[gt ? n_a : n_r] = ppa[i];
+        n_a += gt;
+        n_r += gt ^ 1;
+        prev[i] = gt;
+        bitmap[i >> 5] |= gt << (i & 31);
+    }
+    assert(n_r == n_ref);
+    assert(n_a == n_samples);
+
+    memset(n_queue, 0, sizeof(uint32_t)*n_symbols);
+    n_queue[0] = n_ref;
+    n_queue[1] = n_samples - n_ref;
+    if (div != nullptr) UpdateDivergence<false>(prev);
+
+    std::swap(ppa, queue[0]);
+    ++n_steps;
+
+    return 1;
+}
+
+int PBWT::Update2mc(const uint8_t* arr, uint32_t n_ref, uint32_t* bitmap) {
+    return Update2mcImpl<false>(arr, n_ref, bitmap);
+}
+
+int PBWT::UpdateBcf2mc(const uint8_t* arr, uint32_t n_ref, uint32_t* bitmap) {
+    return Update2mcImpl<true>(arr, n_ref, bitmap);
+}
+
+template <bool bcf>
+void PBWT::Permute2mcImpl(const uint8_t* arr, uint32_t* bitmap) const {
+    for (int64_t i = 0; i < n_samples; ++i) {
+        const uint32_t gt = (bcf ? DJN_BCF_UNPACK_GENOTYPE(arr[ppa[i]]) : arr[ppa[i]]) != 0;
+        bitmap[i >> 5] |= gt << (i & 31);
+    }
+}
+
+void PBWT::Permute2mc(const uint8_t* arr, uint32_t* bitmap) const {
+    Permute2mcImpl<false>(arr, bitmap);
+}
+
+void PBWT::PermuteBcf2mc(const uint8_t* arr, uint32_t* bitmap) const {
+    Permute2mcImpl<true>(arr, bitmap);
+}
+
 std::string PBWT::ToPrettyString() const {
     std::string ret = "n=" + std::to_string(n_samples) + " {";
     ret += std::to_string(ppa[0]);
@@ -204,6 +333,8 @@ int PBWT::ReverseUpdate(const uint8_t* arr) {
         prev[ppa[i]] = arr[i]; // Unpermute data.
     }
 
+    if (div != nullptr) UpdateDivergence<false>(arr);
+
     // Merge PPA queues.
     uint32_t of = 0;
     for (int j = 0; j < n_symbols; ++j) { // O(n)
@@ -229,7 +360,7 @@ int PBWT::ReverseUpdateEWAH(const uint8_t* arr, const uint32_t len) {
     memset(n_queue, 0, sizeof(uint32_t)*n_symbols);
 
     uint32_t local_offset = 0;
-    uint64_t n_s_obs = 0;
+    int64_t n_s_obs = 0;
     while (local_offset < len) {
         djinn_ewah_t* ewah = (djinn_ewah_t*)&arr[local_offset];
         local_offset += sizeof(djinn_ewah_t);
@@ -237,22 +368,23 @@ int PBWT::ReverseUpdateEWAH(const uint8_t* arr, const uint32_t len) {
         // std::cerr << "ewah=" << ewah->ref << "," << ewah->clean << "," << ewah->dirty << std::endl;
         
         // Clean
-        uint64_t to = n_s_obs + ewah->clean * 32 > n_samples ? n_samples : n_s_obs + ewah->clean * 32;
+        int64_t to = n_s_obs + (int64_t)ewah->clean * 32 > n_samples ? n_samples : n_s_obs + (int64_t)ewah->clean * 32;
         // std::cerr << "clean=" << n_s_obs << "->" << to << std::endl; 
-        for (int i = n_s_obs; i < to; ++i) {
+        for (int64_t i = n_s_obs; i < to; ++i) {
             queue[ewah->ref & 1][n_queue[ewah->ref & 1]++] = ppa[i];
+            prev[ppa[i]] = (ewah->ref & 1);
         }
         n_s_obs = to;
 
         // Loop over dirty bitmaps.
         // std::cerr << "dirty=" << ewah->dirty << std::endl;
-        for (int i = 0; i < ewah->dirty; ++i) {
+        for (uint32_t i = 0; i < ewah->dirty; ++i) {
             to = n_s_obs + 32 > n_samples ? n_samples - n_s_obs : 32;
             // std::cerr << "dirty steps=" << to << " -> " << n_s_obs << "-" << n_s_obs+to << "/" << n_samples << std::endl;
             assert(n_s_obs < n_samples);
             
             uint32_t dirty = *((uint32_t*)(&arr[local_offset]));
-            for (int j = 0; j < to; ++j) {
+            for (int64_t j = 0; j < to; ++j) {
                 queue[dirty & 1][n_queue[dirty & 1]++] = ppa[n_s_obs];
                 prev[ppa[n_s_obs]] = (dirty & 1); // update prev when non-zero
                 dirty >>= 1;
@@ -279,6 +411,8 @@ int PBWT::ReverseUpdateEWAH(const uint8_t* arr, const uint32_t len) {
     //     prev[ppa[i]] = arr[i]; // Unpermute data.
     // }
 
+    if (div != nullptr) UpdateDivergence<true>(prev);
+
     // Merge PPA queues.
     uint32_t of = 0;
     for (int j = 0; j < n_symbols; ++j) { // O(n)
@@ -306,7 +440,7 @@ int PBWT::ReverseUpdateEWAH(const uint8_t* arr, const uint32_t len, uint8_t* ret
     memset(n_queue, 0, sizeof(uint32_t)*n_symbols);
 
     uint32_t local_offset = 0;
-    uint64_t n_s_obs = 0;
+    int64_t n_s_obs = 0;
     while (local_offset < len) {
         djinn_ewah_t* ewah = (djinn_ewah_t*)&arr[local_offset];
         local_offset += sizeof(djinn_ewah_t);
@@ -314,9 +448,9 @@ int PBWT::ReverseUpdateEWAH(const uint8_t* arr, const uint32_t len, uint8_t* ret
         // std::cerr << "ewah=" << ewah->ref << "," << ewah->clean << "," << ewah->dirty << std::endl;
         
         // Clean words.
-        uint64_t to = n_s_obs + ewah->clean * 32 > n_samples ? n_samples : n_s_obs + ewah->clean * 32;
+        int64_t to = n_s_obs + (int64_t)ewah->clean * 32 > n_samples ? n_samples : n_s_obs + (int64_t)ewah->clean * 32;
         // std::cerr << "clean=" << n_s_obs << "->" << to << std::endl; 
-        for (int i = n_s_obs; i < to; ++i) {
+        for (int64_t i = n_s_obs; i < to; ++i) {
             queue[ewah->ref & 1][n_queue[ewah->ref & 1]++] = ppa[i];
             ret[ppa[i]] = (ewah->ref & 1); // update prev when non-zero
         }
@@ -324,14 +458,14 @@ int PBWT::ReverseUpdateEWAH(const uint8_t* arr, const uint32_t len, uint8_t* ret
 
         // Loop over dirty bitmaps.
         // std::cerr << "dirty=" << ewah->dirty << std::endl;
-        for (int i = 0; i < ewah->dirty; ++i) {
+        for (uint32_t i = 0; i < ewah->dirty; ++i) {
             to = n_s_obs + 32 > n_samples ? n_samples : n_s_obs + 32;
             // std::cerr << "dirty steps=" << n_s_obs << "->" << to << ": " << to-n_s_obs << std::endl;
             assert(n_s_obs < n_samples);
             assert(to <= n_samples);
             
             uint32_t dirty = *((uint32_t*)(&arr[local_offset])); // copy
-            for (int j = n_s_obs; j < to; ++j) {
+            for (int64_t j = n_s_obs; j < to; ++j) {
                 queue[dirty & 1][n_queue[dirty & 1]++] = ppa[j];
                 ret[ppa[j]] = (dirty & 1); // update prev when non-zero
                 dirty >>= 1;
@@ -358,6 +492,8 @@ int PBWT::ReverseUpdateEWAH(const uint8_t* arr, const uint32_t len, uint8_t* ret
     //     prev[ppa[i]] = arr[i]; // Unpermute data.
     // }
 
+    if (div != nullptr) UpdateDivergence<true>(ret);
+
     // Merge PPA queues.
     uint32_t of = 0;
     for (int j = 0; j < n_symbols; ++j) { // O(n)
@@ -387,7 +523,7 @@ int PBWT::ReverseUpdateEWAHNm(const uint8_t* arr, const uint32_t len, uint8_t* r
     // std::cerr << ToPrettyString() << std::endl;
 
     uint32_t local_offset = 0;
-    uint64_t n_s_obs = 0;
+    int64_t n_s_obs = 0;
 
     while (local_offset < len) {
         djinn_ewah_t* ewah = (djinn_ewah_t*)&arr[local_offset];
@@ -396,9 +532,9 @@ int PBWT::ReverseUpdateEWAHNm(const uint8_t* arr, const uint32_t len, uint8_t* r
         // std::cerr << "[PBWT::ReverseUpdateEWAHNm] ewah=" << ewah->ref << "," << ewah->clean << "," << ewah->dirty << std::endl;
         
         // Clean words.
-        uint64_t to = n_s_obs + ewah->clean * 8 > n_samples ? n_samples : n_s_obs + ewah->clean * 8;
+        int64_t to = n_s_obs + (int64_t)ewah->clean * 8 > n_samples ? n_samples : n_s_obs + (int64_t)ewah->clean * 8;
         // std::cerr << "[PBWT::ReverseUpdateEWAHNm] clean=" << n_s_obs << "->" << to << std::endl; 
-        for (int i = n_s_obs; i < to; ++i) {
+        for (int64_t i = n_s_obs; i < to; ++i) {
             queue[ewah->ref & 15][n_queue[ewah->ref & 15]++] = ppa[i];
             // if (ppa[i] == 0) {
                 // std::cerr << "ppa[i]=0 -> " << (int)ewah->ref << " for i=" << i << std::endl;;
@@ -409,7 +545,7 @@ int PBWT::ReverseUpdateEWAHNm(const uint8_t* arr, const uint32_t len, uint8_t* r
 
         // Loop over dirty bitmaps.
         // std::cerr << "dirty=" << ewah->dirty << std::endl;
-        for (int i = 0; i < ewah->dirty; ++i) {
+        for (uint32_t i = 0; i < ewah->dirty; ++i) {
             to = n_s_obs + 8 > n_samples ? n_samples : n_s_obs + 8;
             // std::cerr << "dirty step-" << i << "/" << ewah->dirty <<  ": " << n_s_obs << "->" << to << ": " << to-n_s_obs << std::endl;
             assert(n_s_obs < n_samples);
@@ -418,7 +554,7 @@ int PBWT::ReverseUpdateEWAHNm(const uint8_t* arr, const uint32_t len, uint8_t* r
             uint32_t dirty = *((uint32_t*)(&arr[local_offset])); // copy
             // std::cerr << "[PBWT::ReverseUpdateEWAHNm] Dirty: " << i << "/" << ewah->dirty << ": " << std::bitset<32>(dirty) << std::endl;
 
-            for (int j = n_s_obs; j < to; ++j) {
+            for (int64_t j = n_s_obs; j < to; ++j) {
                 queue[dirty & 15][n_queue[dirty & 15]++] = ppa[j];
                 // if (ppa[j] == 0) {
                 //     std::cerr << "ppa[j]=0 -> " << (int)(dirty & 15) << " for j=" << j << std::endl;;
@@ -450,6 +586,8 @@ int PBWT::ReverseUpdateEWAHNm(const uint8_t* arr, const uint32_t len, uint8_t* r
     //     prev[ppa[i]] = arr[i]; // Unpermute data.
     // }
 
+    if (div != nullptr) UpdateDivergence<true>(ret);
+
     // Merge PPA queues.
     uint32_t of = 0;
     for (int j = 0; j < n_symbols; ++j) { // O(n)
@@ -469,4 +607,231 @@ int PBWT::ReverseUpdateEWAHNm(const uint8_t* arr, const uint32_t len, uint8_t* r
     return 1;
 }
 
+/*======   PBWT haplotype matching   ======*/
+
+djinn_pbwt_matcher::djinn_pbwt_matcher() :
+    n_haplotypes(0), min_length(0), n_variants(0), with_query(false),
+    n_total(0), query_pos(0),
+    ppa(nullptr), div(nullptr), tmp_ppa(nullptr), tmp_div(nullptr), y(nullptr)
+{
+
+}
+
+djinn_pbwt_matcher::~djinn_pbwt_matcher() {
+    delete[] ppa; delete[] div;
+    delete[] tmp_ppa; delete[] tmp_div;
+    delete[] y;
+}
+
+int djinn_pbwt_matcher::Initiate(uint32_t n_haps, uint32_t min_len, bool query) {
+    if (n_haps == 0) return -1;
+
+    delete[] ppa; delete[] div;
+    delete[] tmp_ppa; delete[] tmp_div;
+    delete[] y;
+
+    n_haplotypes = n_haps;
+    min_length = min_len ? min_len : 1;
+    n_variants = 0;
+    with_query = query;
+    matches.clear();
+
+    n_total = n_haplotypes + with_query;
+    query_pos = with_query ? n_haplotypes : n_total; // past the end if there is no query
+    ppa = new uint32_t[n_total];
+    div = new uint32_t[n_total + 1];
+    tmp_ppa = new uint32_t[n_total];
+    tmp_div = new uint32_t[n_total + 1];
+    y = new uint8_t[n_total];
+
+    // All haplotypes trivially match over the empty prefix.
+    for (uint32_t i = 0; i < n_total; ++i) ppa[i] = i;
+    memset(div, 0, sizeof(uint32_t)*(n_total + 1));
+
+    return 1;
+}
+
+int djinn_pbwt_matcher::Update(const djinn_variant_t& variant, uint8_t query_allele) {
+    if (variant.unpacked != DJN_UN_IND) {
+        std::cerr << "[djinn_pbwt_matcher::Update] Variant must be unpacked into byte literals" << std::endl;
+        return -2;
+    }
+    if (variant.data_len != n_haplotypes) {
+        std::cerr << "[djinn_pbwt_matcher::Update] Variant has " << variant.data_len << " haplotypes but expected " << n_haplotypes << std::endl;
+        return -3;
+    }
+    return Update(variant.data, query_allele);
+}
+
+int djinn_pbwt_matcher::Update(const uint8_t* alleles, uint8_t query_allele) {
+    if (ppa == nullptr) return -1;
+    if (alleles == nullptr) return -2;
+
+    // Alleles in prefix order. The query haplotype is not part of the input.
+    uint32_t count[16] = {0};
+    for (uint32_t i = 0; i < query_pos; ++i) {
+        y[i] = alleles[ppa[i]] & 15;
+        ++count[y[i]];
+    }
+    if (query_pos < n_total) {
+        y[query_pos] = query_allele & 15;
+        ++count[y[query_pos]];
+        for (uint32_t i = query_pos + 1; i < n_total; ++i) {
+            y[i] = alleles[ppa[i]] & 15;
+            ++count[y[i]];
+        }
+    }
+
+    // Matches that end at this variant are reported before updating.
+    const uint32_t n_reported = with_query ? ReportQuery(y) : ReportLong(y);
+
+    // Stable sort by the current allele while tracking the divergence
+    // values: p[c] is the start of the match between the next haplotype
+    // with allele c and the previous haplotype in its queue.
+    const uint32_t k = n_variants;
+    uint32_t offset[16], p[16];
+    uint8_t symbols[16];
+    uint32_t n_symbols = 0, of = 0;
+    for (uint32_t c = 0; c < 16; ++c) {
+        if (count[c] == 0) continue;
+        offset[c] = of;
+        p[c] = k + 1;
+        symbols[n_symbols++] = c;
+        of += count[c];
+    }
+    assert(of == n_total);
+
+    uint32_t new_query_pos = query_pos;
+    for (uint32_t i = 0; i < n_total; ++i) {
+        for (uint32_t j = 0; j < n_symbols; ++j)
+            p[symbols[j]] = div[i] > p[symbols[j]] ? div[i] : p[symbols[j]];
+
+        const uint8_t c = y[i];
+        if (i == query_pos) new_query_pos = offset[c];
+        tmp_ppa[offset[c]] = ppa[i];
+        tmp_div[offset[c]++] = p[c];
+        p[c] = 0;
+    }
+
+    std::swap(ppa, tmp_ppa);
+    std::swap(div, tmp_div);
+    query_pos = new_query_pos;
+    ++n_variants;
+    div[n_total] = n_variants;
+
+    return n_reported;
+}
+
+int djinn_pbwt_matcher::Finish() {
+    if (ppa == nullptr) return 0;
+    return with_query ? ReportQuery(nullptr) : ReportLong(nullptr);
+}
+
+void djinn_pbwt_matcher::AddMatch(uint32_t h1, uint32_t h2, uint32_t start) {
+    djinn_hap_match_t m;
+    m.hap1 = h1 < h2 ? h1 : h2;
+    m.hap2 = h1 < h2 ? h2 : h1;
+    m.start = start;
+    m.end = n_variants;
+    matches.push_back(m);
+}
+
+uint32_t djinn_pbwt_matcher::ReportLong(const uint8_t* alleles) {
+    const uint32_t k = n_variants;
+    if (k < min_length) return 0;
+    const uint32_t max_start = k - min_length;
+
+    uint32_t n_reported = 0;
+    uint32_t begin = 0;
+    for (uint32_t i = 1; i <= n_total; ++i) {
+        // Haplotypes in [begin, i) all match over at least min_length variants.
+        if (i != n_total && div[i] <= max_start) continue;
+        const uint32_t end = i;
+        if (end - begin < 2) { begin = i; continue; }
+
+        if (alleles == nullptr) {
+            // End of region: every pair in the block is a match.
+            for (uint32_t a = begin; a < end; ++a) {
+                uint32_t start = 0;
+                for (uint32_t b = a + 1; b < end; ++b) {
+                    start = div[b] > start ? div[b] : start;
+                    AddMatch(ppa[a], ppa[b], start);
+                    ++n_reported;
+                }
+            }
+            begin = i;
+            continue;
+        }
+
+        // Only pairs with different alleles end at this variant. Pairs are
+        // enumerated from the haplotypes carrying a minor allele such that
+        // the work is proportional to the output.
+        uint32_t count[16] = {0};
+        for (uint32_t a = begin; a < end; ++a) ++count[alleles[a]];
+        uint8_t major = 0;
+        for (uint32_t c = 1; c < 16; ++c) major = count[c] > count[major] ? c : major;
+        if (count[major] == end - begin) { begin = i; continue; }
+
+        for (uint32_t a = begin; a < end; ++a) {
+            if (alleles[a] == major) continue;
+
+            // Forward: all haplotypes with a different allele.
+            uint32_t start = 0;
+            for (uint32_t b = a + 1; b < end; ++b) {
+                start = div[b] > start ? div[b] : start;
+                if (alleles[b] != alleles[a]) {
+                    AddMatch(ppa[a], ppa[b], start);
+                    ++n_reported;
+                }
+            }
+
+            // Backward: only haplotypes with the major allele as pairs of
+            // minor alleles are reported by the preceding haplotype.
+            start = 0;
+            for (uint32_t b = a; b > begin; --b) {
+                start = div[b] > start ? div[b] : start;
+                if (alleles[b - 1] == major) {
+                    AddMatch(ppa[a], ppa[b - 1], start);
+                    ++n_reported;
+                }
+            }
+        }
+        begin = i;
+    }
+
+    return n_reported;
+}
+
+uint32_t djinn_pbwt_matcher::ReportQuery(const uint8_t* alleles) {
+    const uint32_t k = n_variants;
+    const uint32_t i = query_pos;
+
+    // Start of the longest match with the preceding (up) and following
+    // (down) haplotype in prefix order.
+    const uint32_t d_up = i > 0 ? div[i] : k;
+    const uint32_t d_down = i + 1 < n_total ? div[i + 1] : k;
+    const uint32_t best = d_up < d_down ? d_up : d_down;
+    if (best >= k || k - best < min_length) return 0;
+
+    // The longest matches are set-maximal unless one of them continues
+    // through this variant.
+    uint32_t m = i, n = i + 1;
+    if (d_up <= d_down) {
+        while (m > 0 && div[m] <= d_up) {
+            if (alleles != nullptr && alleles[m - 1] == alleles[i]) return 0;
+            --m;
+        }
+    }
+    if (d_down <= d_up) {
+        while (n < n_total && div[n] <= d_down) {
+            if (alleles != nullptr && alleles[n] == alleles[i]) return 0;
+            ++n;
+        }
+    }
+
+    for (uint32_t j = m; j < i; ++j) AddMatch(ppa[j], ppa[i], d_up);
+    for (uint32_t j = i + 1; j < n; ++j) AddMatch(ppa[j], ppa[i], d_down);
+    return (i - m) + (n - i - 1);
+}
+
 }
\ No newline at end of file
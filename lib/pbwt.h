@@ -69,6 +69,16 @@ namespace djinn {
  * 
  * pbwt1.ppa[0-2503] now stores the permuted order for haplotype 1.
  * pbwt2.ppa[0-2503] now stores the permuted order for haplotype 2.
+ *
+ * Divergence arrays are optionally maintained by all update functions:
+ * PBWT pbwt;
+ * pbwt.Initiate(5008, 2);
+ * pbwt.EnableDivergence();
+ * pbwt.UpdateBcf(data);
+ *
+ * pbwt.div[i] now stores the first update (counted from the last Reset) from
+ * which ppa[i-1] and ppa[i] have been identical and pbwt.MatchLength(i) the
+ * length of that match.
  *--------------------------------------------------------------------------
  */
 class PBWT {
@@ -85,10 +95,33 @@ public:
 
     void Initiate(int64_t n_s, int n_sym);
     void Reset();
+
+    // Maintain divergence arrays in all subsequent updates. Divergence
+    // values are reset together with the PPA. Disabled by default as it
+    // requires 8 additional bytes per sample and a second pass over the
+    // data for every update.
+    void EnableDivergence(bool enable = true);
+    bool has_divergence() const { return div != nullptr; }
+    const uint32_t* divergence() const { return div; }
+    // Number of updates over which ppa[i-1] and ppa[i] match. The first
+    // position has no predecessor and always returns 0.
+    uint32_t MatchLength(uint32_t i) const { return n_steps - div[i]; }
     
     int Update(const uint8_t* arr, uint32_t stride = 1);
     int UpdateBcf(const uint8_t* arr, uint32_t stride = 1);
     int UpdateBcfGeneral(const uint8_t* arr, uint32_t stride = 1);
+
+    // Same as Update and UpdateBcf for biallelic data when the number of
+    // reference alleles is known in advance (see djn_gt_stats_t). Samples
+    // are written directly to their new positions rather than queued and
+    // merged, and the permuted alleles are packed into bitmap in the same
+    // pass. The bitmap must be zeroed and hold ceil(n_samples/32) words.
+    int Update2mc(const uint8_t* arr, uint32_t n_ref, uint32_t* bitmap);
+    int UpdateBcf2mc(const uint8_t* arr, uint32_t n_ref, uint32_t* bitmap);
+    // Pack biallelic data in the order of the current PPA into bitmap
+    // without updating the PBWT.
+    void Permute2mc(const uint8_t* arr, uint32_t* bitmap) const;
+    void PermuteBcf2mc(const uint8_t* arr, uint32_t* bitmap) const;
     
     // Encode WAH in 63-bits and return data.
     int UpdateBcfWah(const uint8_t* arr, uint8_t* out, uint32_t stride = 1);
@@ -110,15 +143,29 @@ public:
     // Debug function for printing out the current state of the PBWT.
     std::string ToPrettyString() const;
 
+private:
+    // Compute the divergence values for the current update. Must be called
+    // after the queues have been filled and before they are merged into ppa.
+    // The symbol at position i is y[i], or y[ppa[i]] if indirect is set.
+    template <bool indirect>
+    void UpdateDivergence(const uint8_t* y);
+
+    template <bool bcf>
+    int Update2mcImpl(const uint8_t* arr, uint32_t n_ref, uint32_t* bitmap);
+    template <bool bcf>
+    void Permute2mcImpl(const uint8_t* arr, uint32_t* bitmap) const;
+
 public:
     int        n_symbols; // universe of symbols (number of unique symbols)
     int64_t    n_samples; // number of samples (free interpretation)
-    uint64_t   n_steps; // number of updates made (debugging)
+    uint64_t   n_steps; // number of updates made since the last reset
     uint8_t*   prev; // previous output array
     uint32_t*  ppa; // current PPA
     uint32_t*  n_queue; // number of elements in each positional queue
     uint32_t** queue; // the positional queues themselves
     uint64_t*  prev_bitmap; // bitmap version
+    uint32_t*  div; // divergence array: update from which ppa[i-1] and ppa[i] match, or nullptr if disabled
+    uint32_t*  div_tmp; // output buffer for the divergence array
 };
 
 }
@@ -0,0 +1,182 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_SCRATCH_H_
+#define DJINN_SCRATCH_H_
+
+#include <cstdint>//uint
+#include <cstring>//memcpy
+#include <atomic>//std::atomic
+#include <new>//std::nothrow
+
+namespace djinn {
+
+// Smallest capacity allocated for growable buffers.
+#define DJN_SCRATCH_MIN_CAPACITY 65536
+// Largest capacity allowed for growable buffers: capacities are stored in
+// 31-bit fields.
+#define DJN_SCRATCH_MAX_CAPACITY ((1u << 31) - 1)
+
+/**
+ * Total number of bytes currently allocated by scratch buffers and model data
+ * buffers across all threads and the user-provided upper limit (0 for no
+ * limit).
+ */
+inline std::atomic<uint64_t>& djn_scratch_usage() { static std::atomic<uint64_t> usage(0); return usage; }
+inline std::atomic<uint64_t>& djn_scratch_limit() { static std::atomic<uint64_t> limit(0); return limit; }
+
+/**
+ * Returns the capacity to allocate for a buffer that must hold at least n
+ * bytes given its current capacity. Capacities grow geometrically (1.5-fold)
+ * to amortize reallocations across blocks.
+ */
+static inline uint64_t djn_grow_capacity(uint64_t cur, uint64_t n) {
+    uint64_t cap = cur + (cur >> 1);
+    if (cap < n) cap = n;
+    if (cap < DJN_SCRATCH_MIN_CAPACITY) cap = DJN_SCRATCH_MIN_CAPACITY;
+    if (cap > DJN_SCRATCH_MAX_CAPACITY) cap = DJN_SCRATCH_MAX_CAPACITY;
+    return cap;
+}
+
+/**
+ * Release the data buffer of a model object if it is owned.
+ */
+template <class T>
+static inline void djn_release(T& obj) {
+    if (obj.p != nullptr && obj.p_free) {
+        delete[] obj.p;
+        djn_scratch_usage() -= obj.p_cap;
+    }
+    obj.p = nullptr;
+    obj.p_cap = 0;
+}
+
+/**
+ * Returns the capacity to allocate for a buffer that must hold at least n
+ * bytes, given its current capacity cur, without exceeding the memory limit
+ * or 0 if the limit would be exceeded. The geometric growth is dropped in
+ * favour of the exact size before giving up.
+ */
+static inline uint64_t djn_accounted_capacity(uint64_t cur, uint64_t n) {
+    uint64_t next_cap = djn_grow_capacity(cur, n);
+    const uint64_t limit = djn_scratch_limit().load();
+    if (limit) {
+        const uint64_t others = djn_scratch_usage().load() - cur;
+        if (others + next_cap > limit) next_cap = n;
+        if (others + next_cap > limit) return 0;
+    }
+    return next_cap;
+}
+
+/**
+ * Grow the data buffer of a model object (any object with p, p_len, p_cap,
+ * and p_free members where p is a byte array) to hold at least n bytes. The
+ * first n_keep bytes are retained. Buffers are never shrunk. Owned buffers
+ * count towards the memory limit set with SetScratchMemoryLimit and must be
+ * released with djn_release.
+ *
+ * @param obj    Target object.
+ * @param n      Required capacity in bytes.
+ * @param n_keep Number of bytes to retain.
+ * @return int   Returns 1 on success, -2 if the memory limit is exceeded, or
+ *               another negative value otherwise.
+ */
+template <class T>
+static inline int djn_reserve(T& obj, uint64_t n, uint32_t n_keep = 0) {
+    if (obj.p != nullptr && obj.p_cap >= n) return 1;
+    if (n > DJN_SCRATCH_MAX_CAPACITY) return -1;
+
+    const uint64_t cur = (obj.p != nullptr && obj.p_free) ? obj.p_cap : 0;
+    const uint64_t cap = djn_accounted_capacity(cur, n);
+    if (cap == 0) return -2;
+    uint8_t* next = new (std::nothrow) uint8_t[cap];
+    if (next == nullptr) return -3;
+    if (obj.p != nullptr && n_keep) memcpy(next, obj.p, n_keep);
+    djn_release(obj);
+    obj.p = next;
+    obj.p_cap = cap;
+    obj.p_free = true;
+    djn_scratch_usage() += cap;
+    return 1;
+}
+
+/**
+ * Grow the data buffer of a model object such that n additional bytes can be
+ * appended at p_len.
+ */
+template <class T>
+static inline int djn_reserve_append(T& obj, uint32_t n) {
+    return djn_reserve(obj, (uint64_t)obj.p_len + n, obj.p_len);
+}
+
+/**
+ * Growable scratch buffer used as transient support memory when compressing
+ * and decompressing data. The content is NOT retained when growing. Every
+ * thread owns one scratch buffer (see djn_thread_scratch) that is reused by
+ * all models and blocks processed by that thread. The total memory held by
+ * scratch buffers can be capped using SetScratchMemoryLimit.
+ */
+struct djn_scratch_t {
+public:
+    djn_scratch_t() : p(nullptr), cap(0) {}
+    ~djn_scratch_t() { Release(); }
+
+    /**
+     * Ensure the buffer can hold at least n bytes.
+     *
+     * @param n    Required capacity in bytes.
+     * @return int Returns 1 on success or a negative value if the memory limit is exceeded.
+     */
+    int Reserve(uint64_t n) {
+        if (p != nullptr && cap >= n) return 1;
+        if (n > DJN_SCRATCH_MAX_CAPACITY) return -1;
+
+        const uint64_t next_cap = djn_accounted_capacity(cap, n);
+        if (next_cap == 0) return -2;
+
+        Release();
+        p = new (std::nothrow) uint8_t[next_cap];
+        if (p == nullptr) return -3;
+        cap = next_cap;
+        djn_scratch_usage() += cap;
+        return 1;
+    }
+
+    void Release() {
+        if (p == nullptr) return;
+        delete[] p;
+        djn_scratch_usage() -= cap;
+        p = nullptr;
+        cap = 0;
+    }
+
+public:
+    uint8_t* p;   // data
+    uint32_t cap; // capacity
+};
+
+/**
+ * Returns the scratch buffer owned by the calling thread.
+ */
+inline djn_scratch_t& djn_thread_scratch() {
+    static thread_local djn_scratch_t scratch;
+    return scratch;
+}
+
+}
+
+#endif
@@ -21,6 +21,13 @@
 #include <iostream>
 #include <string>
 #include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <climits>
+#include <cstring>
 
 #include <htslib/vcf.h>
 
@@ -36,22 +43,25 @@ public:
     // target file as another file-handle is accessing it.
     static std::unique_ptr<self_type> FromFile(const std::string& variants_path, uint32_t n_extra_threads = 0){
         htsFile* fp = hts_open(variants_path.c_str(), "r");
+        if (fp == nullptr) {
+            std::cerr << "Could not open " << variants_path << std::endl;
+            return nullptr;
+        }
+
+        // Additional threads are used by htslib for BGZF decompression.
         if(n_extra_threads){
             int ret = hts_set_threads(fp, n_extra_threads);
             if(ret < 0){
                 std::cerr << "Failed to open multiple handles!" << std::endl;
+                hts_close(fp);
                 return nullptr;
             }
         }
 
-        if (fp == nullptr) {
-            std::cerr << "Could not open " << variants_path << std::endl;
-            return nullptr;
-        }
-
         bcf_hdr_t* header = bcf_hdr_read(fp);
         if (header == nullptr){
             std::cerr << "Couldn't parse header for " << fp->fn << std::endl;
+            hts_close(fp);
             return nullptr;
         }
 
@@ -69,13 +79,14 @@ public:
         }
 
         bcf_unpack(this->bcf1_, unpack_level);
+        UpdateContigs();
         return true;
     }
 
     bool Next(bcf1_t* bcf_entry, const int unpack_level = BCF_UN_ALL){
         if (bcf_read(this->fp_, this->header_, bcf_entry) < 0) {
             if (bcf_entry->errcode) {
-                std::cerr << "Failed to parse VCF record: " << bcf1_->errcode << std::endl;
+                std::cerr << "Failed to parse VCF record: " << bcf_entry->errcode << std::endl;
                 return false;
             } else {
                 //std::cerr << utility::timestamp("ERROR") << "Failed to retrieve a htslib bcf1_t record!" << std::endl;
@@ -84,9 +95,18 @@ public:
         }
 
         bcf_unpack(bcf_entry, unpack_level);
+        UpdateContigs();
         return true;
     }
 
+    // Contigs that are not declared in the header of Vcf files are added to
+    // the header by htslib when first observed.
+    void UpdateContigs() {
+        const int n_contigs = this->header_->n[BCF_DT_CTG];
+        for (int i = contigs_.size(); i < n_contigs; ++i)
+            contigs_.push_back(std::string(this->header_->id[BCF_DT_CTG][i].key));
+    }
+
 private:
     // Private constructor.
     VcfReader(const std::string& variants_path,
@@ -114,13 +134,13 @@ private:
     const int n_contigs = this->header_->n[BCF_DT_CTG];
     for (int i = 0; i < n_contigs; ++i) {
         const bcf_idpair_t& idPair = this->header_->id[BCF_DT_CTG][i];
-        //this->vcf_header_.AddContigInfo(idPair);
+        contigs_.push_back(std::string(idPair.key));
     }
 
     // Populate samples info.
     n_samples_ = bcf_hdr_nsamples(this->header_);
-    //for (int i = 0; i < n_samples; i++)
-    //    this->vcf_header_.AddSample(std::string(this->header_->samples[i]));
+    for (int i = 0; i < n_samples_; i++)
+        samples_.push_back(std::string(this->header_->samples[i]));
 
    // this->vcf_header_.BuildReverseMaps();
 
@@ -147,6 +167,10 @@ public:
     // Number of samples.
     int64_t n_samples_;
 
+    // Contig and sample names.
+    std::vector<std::string> contigs_;
+    std::vector<std::string> samples_;
+
     // A pointer to the htslib file used to access the VCF data.
     htsFile * fp_;
 
@@ -157,6 +181,316 @@ public:
     bcf1_t* bcf1_;
 };
 
+/**
+ * Fast-path scanner for the GT FORMAT field of Bcf records. Instead of
+ * unpacking every FORMAT field with bcf_unpack and searching for GT by name,
+ * the scanner resolves the header ID of GT once and walks the raw
+ * per-individual bytes of a record (bcf1_t::indiv) to locate the GT block.
+ * The records therefore do not need to be unpacked (unpack level 0).
+ * 
+ * Int8-encoded genotypes are returned zero-copy as a pointer into the record.
+ * Wider encodings (int16/int32) are narrowed into an internal buffer using the
+ * same 8-bit encoding as Htslib such that the result can always be passed to
+ * djinn_model::EncodeBcf. Scan fails for records with alleles that cannot be
+ * represented in 8 bits.
+ */
+class BcfGenotypeScanner {
+public:
+    explicit BcfGenotypeScanner(const bcf_hdr_t* header) :
+        gt_id(bcf_hdr_id2int(header, BCF_DT_ID, "GT")),
+        p(nullptr), p_len(0), n(0)
+    {}
+
+    /**
+     * Locate the GT field in the given record.
+     * 
+     * @param rec  Input record (unpacking is not required).
+     * @return int Returns 1 if GT was found, 0 if not present, or a negative value on error.
+     */
+    int Scan(const bcf1_t* rec) {
+        p = nullptr; p_len = 0; n = 0;
+        if (gt_id < 0) return 0;
+
+        const uint8_t* ptr = (const uint8_t*)rec->indiv.s;
+        const uint8_t* end = ptr + rec->indiv.l;
+        for (uint32_t i = 0; i < rec->n_fmt; ++i) {
+            int32_t key = 0, n_values = 0;
+            if (ReadTypedInt(ptr, end, key) == false) return -1;
+            if (ptr >= end) return -1;
+            const int type = *ptr & 0xF;
+            n_values = *ptr++ >> 4;
+            if (n_values == 15 && ReadTypedInt(ptr, end, n_values) == false) return -1;
+
+            const int size = TypeSize(type);
+            if (size == 0 || n_values < 0) return -1;
+            const uint64_t len = (uint64_t)rec->n_sample * n_values * size;
+            if (len > (uint64_t)(end - ptr)) return -1;
+
+            if (key == gt_id) {
+                n = n_values;
+                p_len = rec->n_sample * n_values;
+                switch (type) {
+                case BCF_BT_INT8:  p = (uint8_t*)ptr; return 1;
+                case BCF_BT_INT16: return Narrow<int16_t>(ptr, INT16_MIN);
+                case BCF_BT_INT32: return Narrow<int32_t>(ptr, INT32_MIN);
+                default: return -2;
+                }
+            }
+            ptr += len;
+        }
+        return 0;
+    }
+
+private:
+    // Bcf typed integers: a type descriptor byte followed by a value.
+    static bool ReadTypedInt(const uint8_t*& ptr, const uint8_t* end, int32_t& val) {
+        if (ptr >= end) return false;
+        const int type = *ptr++ & 0xF;
+        const int size = TypeSize(type);
+        if (size == 0 || size > 4 || type == BCF_BT_FLOAT || type == BCF_BT_CHAR) return false;
+        if (end - ptr < size) return false;
+        switch (type) {
+        case BCF_BT_INT8:  { int8_t v;  memcpy(&v, ptr, 1); val = v; break; }
+        case BCF_BT_INT16: { int16_t v; memcpy(&v, ptr, 2); val = v; break; }
+        case BCF_BT_INT32: { int32_t v; memcpy(&v, ptr, 4); val = v; break; }
+        }
+        ptr += size;
+        return true;
+    }
+
+    static int TypeSize(const int type) {
+        switch (type) {
+        case BCF_BT_INT8:  return 1;
+        case BCF_BT_INT16: return 2;
+        case BCF_BT_INT32: return 4;
+        case 4:            return 8; // BCF_BT_INT64
+        case BCF_BT_FLOAT: return 4;
+        case BCF_BT_CHAR:  return 1;
+        default: return 0;
+        }
+    }
+
+    // Narrow wide genotype encodings to 8-bit values: vector end symbols map
+    // to 0x81 and missing values to 0. Values above 127 (alleles above 62)
+    // are rejected: they do not fit the 8-bit encoding and would collide
+    // with its missing (0x80) and vector end (0x81) symbols.
+    template <class T>
+    int Narrow(const uint8_t* src, const T missing) {
+        if (buf.size() < p_len) buf.resize(p_len);
+        for (uint32_t i = 0; i < p_len; ++i) {
+            T v;
+            memcpy(&v, &src[i*sizeof(T)], sizeof(T));
+            if (v == missing + 1) buf[i] = 0x81;
+            else if (v == missing) buf[i] = 0;
+            else if (v < 0 || v > 127) return -3;
+            else buf[i] = v;
+        }
+        p = buf.data();
+        return 1;
+    }
+
+public:
+    int gt_id; // header ID of the GT field
+    uint8_t* p; // GT data of the last scanned record
+    uint32_t p_len; // number of values
+    int n; // number of values per sample (base ploidy)
+
+private:
+    std::vector<uint8_t> buf; // support buffer for narrowed data
+};
+
+/**
+ * Read-ahead wrapper around VcfReader. Records are read and unpacked by a
+ * producer thread into a fixed pool of bcf1_t records that are handed to the
+ * consumer in batches through a bounded queue. Parsing therefore overlaps
+ * with encoding and, with n_extra_threads > 0, htslib decompresses BGZF
+ * blocks in additional threads.
+ *
+ * The interface mirrors VcfReader: after a successful call to Next() the
+ * current record is available in bcf1_ and remains valid until the next call
+ * to Next(). By default only the shared fields and FORMAT fields are
+ * unpacked (BCF_UN_FMT) as Djinn only consumes the GT field.
+ *
+ * The producer may extend its header while reading (for example with
+ * undeclared contigs), so the consumer is given a private copy in header_
+ * taken before the producer starts. Contigs added later are available
+ * through Contigs().
+ */
+class VcfReaderAsync {
+public:
+    typedef VcfReaderAsync self_type;
+
+public:
+    /**
+     * Open a file and start the producer thread.
+     *
+     * @param variants_path   File path or "-" for stdin.
+     * @param n_extra_threads Number of additional htslib decompression threads.
+     * @param n_batches       Number of batches in flight (queue depth).
+     * @param batch_size      Number of records per batch.
+     * @param unpack_level    Htslib unpacking level.
+     * @return                Returns a unique pointer to a reader or nullptr on failure.
+     */
+    static std::unique_ptr<self_type> FromFile(const std::string& variants_path, 
+                                               uint32_t n_extra_threads = 0,
+                                               uint32_t n_batches = 4,
+                                               uint32_t batch_size = 16,
+                                               const int unpack_level = BCF_UN_FMT)
+    {
+        std::unique_ptr<VcfReader> reader = VcfReader::FromFile(variants_path, n_extra_threads);
+        if (reader.get() == nullptr) return nullptr;
+        if (n_batches < 2) n_batches = 2;
+        if (batch_size == 0) batch_size = 1;
+
+        std::unique_ptr<self_type> ret(new self_type(std::move(reader), n_batches, batch_size, unpack_level));
+        if (ret->header_ == nullptr) return nullptr;
+        ret->producer_ = std::thread(&self_type::Produce, ret.get());
+        return ret;
+    }
+
+    ~VcfReaderAsync() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_free_.notify_all();
+        if (producer_.joinable()) producer_.join();
+
+        for (size_t i = 0; i < batches_.size(); ++i) {
+            for (size_t j = 0; j < batches_[i].records.size(); ++j)
+                bcf_destroy(batches_[i].records[j]);
+        }
+        if (header_ != nullptr) bcf_hdr_destroy(header_);
+    }
+
+    bool Next() {
+        if (cur_ != nullptr && ++cur_offset_ < cur_->n_records) {
+            bcf1_ = cur_->records[cur_offset_];
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Return the consumed batch to the producer.
+        if (cur_ != nullptr) {
+            free_.push_back(cur_);
+            cur_ = nullptr;
+            cv_free_.notify_one();
+        }
+
+        cv_full_.wait(lock, [this]{ return full_.size() || eof_; });
+        if (full_.empty()) {
+            bcf1_ = nullptr;
+            return false;
+        }
+
+        cur_ = full_.front();
+        full_.pop_front();
+        cur_offset_ = 0;
+        bcf1_ = cur_->records[0];
+        return true;
+    }
+
+    /**
+     * Returns the names of all contigs observed so far. Contigs are updated
+     * by the producer thread as records are read: every contig referenced by
+     * a record returned by Next is included.
+     */
+    std::vector<std::string> Contigs() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return contigs_;
+    }
+
+private:
+    struct batch_t {
+        std::vector<bcf1_t*> records;
+        uint32_t n_records;
+    };
+
+    VcfReaderAsync(std::unique_ptr<VcfReader> reader, uint32_t n_batches, uint32_t batch_size, int unpack_level) :
+        n_samples_(reader->n_samples_),
+        samples_(reader->samples_),
+        header_(bcf_hdr_dup(reader->header_)),
+        bcf1_(nullptr),
+        contigs_(reader->contigs_),
+        reader_(std::move(reader)),
+        unpack_level_(unpack_level),
+        batches_(n_batches),
+        cur_(nullptr),
+        cur_offset_(0),
+        eof_(false),
+        stop_(false)
+    {
+        for (uint32_t i = 0; i < n_batches; ++i) {
+            batches_[i].records.resize(batch_size);
+            for (uint32_t j = 0; j < batch_size; ++j) batches_[i].records[j] = bcf_init();
+            batches_[i].n_records = 0;
+            free_.push_back(&batches_[i]);
+        }
+    }
+
+    // Producer: fill free batches with records until the end of the file.
+    void Produce() {
+        while (true) {
+            batch_t* batch = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_free_.wait(lock, [this]{ return free_.size() || stop_; });
+                if (stop_) break;
+                batch = free_.back();
+                free_.pop_back();
+            }
+
+            batch->n_records = 0;
+            while (batch->n_records < batch->records.size() && 
+                   reader_->Next(batch->records[batch->n_records], unpack_level_))
+            {
+                ++batch->n_records;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (reader_->contigs_.size() != contigs_.size()) contigs_ = reader_->contigs_;
+            if (batch->n_records) full_.push_back(batch);
+            else free_.push_back(batch);
+            if (batch->n_records < batch->records.size()) { // end of file
+                eof_ = true;
+                cv_full_.notify_all();
+                break;
+            }
+            cv_full_.notify_one();
+        }
+    }
+
+public:
+    // Number of samples.
+    int64_t n_samples_;
+
+    // Sample names.
+    std::vector<std::string> samples_;
+
+    // Consumer copy of the htslib header. The header of the producer is
+    // never accessed from the consumer thread.
+    bcf_hdr_t * header_;
+
+    // Current record.
+    bcf1_t* bcf1_;
+
+private:
+    std::vector<std::string> contigs_; // guarded by mutex_
+    std::unique_ptr<VcfReader> reader_;
+    int unpack_level_;
+
+    std::vector<batch_t> batches_; // pool of records
+    std::vector<batch_t*> free_; // batches available to the producer
+    std::deque<batch_t*> full_; // batches available to the consumer
+    batch_t* cur_; // batch currently consumed
+    uint32_t cur_offset_; // offset of the current record in cur_
+    bool eof_, stop_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_free_, cv_full_;
+    std::thread producer_;
+};
+
 }
 
 
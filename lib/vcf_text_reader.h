@@ -0,0 +1,627 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef VCF_TEXT_READER_H_
+#define VCF_TEXT_READER_H_
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace djinn {
+
+/*======   Supportive functions   ======*/
+
+/**
+ * Returns a pointer to the n-th occurrence of the tab character in [s, end)
+ * or end if there are fewer than n tabs. Tabs are counted 16 bytes at a time
+ * using SSE2 when available.
+ */
+static inline const char* djn_skip_tabs(const char* s, const char* end, uint32_t n) {
+    if (n == 0) return s;
+#if defined(__SSE2__)
+    const __m128i tab = _mm_set1_epi8('\t');
+    while (s + 16 <= end) {
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)s), tab));
+        const uint32_t cnt = __builtin_popcount(mask);
+        if (cnt >= n) {
+            while (--n) mask &= mask - 1; // clear the lowest n-1 tabs
+            return s + __builtin_ctz(mask);
+        }
+        n -= cnt;
+        s += 16;
+    }
+#endif
+    for (/**/; s < end; ++s) {
+        if (*s == '\t' && --n == 0) return s;
+    }
+    return end;
+}
+
+/**
+ * Djinn-owned reader for Vcf and Vcf.gz files that extracts the GT field only
+ * and returns it in the Bcf encoding expected by djinn_model::EncodeBcf:
+ * allele a is stored as (a+1)<<1 with the lowest bit set for phased
+ * alleles, missing values as 0, and samples with fewer alleles than the
+ * base ploidy of the record are padded with end-of-vector symbols (0x81).
+ *
+ * Other columns are skipped without being parsed. Diploid single-digit
+ * genotypes ("0|1\t") are decoded four samples at a time using SSE2 when GT
+ * is the only FORMAT field.
+ *
+ * Input may be uncompressed, gzip-compressed, or BGZF-compressed (bgzip).
+ * BGZF blocks are independent and are inflated in parallel using n_threads
+ * threads. Compressed input requires zlib (HAVE_ZLIB).
+ */
+class VcfTextReader {
+public:
+    typedef VcfTextReader self_type;
+
+public:
+    /**
+     * Open a Vcf or Vcf.gz file and parse its header.
+     *
+     * @param variants_path File path or "-" to read from stdin.
+     * @param n_threads     Number of threads used for inflating BGZF blocks.
+     * @return              Returns a unique pointer to a reader or nullptr on failure.
+     */
+    static std::unique_ptr<self_type> FromFile(const std::string& variants_path, uint32_t n_threads = 0) {
+        FILE* fp = nullptr;
+        if (variants_path == "-") fp = stdin;
+        else fp = fopen(variants_path.c_str(), "rb");
+        if (fp == nullptr) {
+            std::cerr << "Could not open " << variants_path << std::endl;
+            return nullptr;
+        }
+
+        std::unique_ptr<self_type> reader(new self_type(fp, variants_path != "-", n_threads));
+        if (reader->DetectFormat() < 0) return nullptr;
+        if (reader->ReadHeader() < 0) return nullptr;
+        return reader;
+    }
+
+    ~VcfTextReader() {
+#if defined(HAVE_ZLIB)
+        if (mode_ == DJN_VCF_GZIP) inflateEnd(&zs_);
+#endif
+        if (own_fp_) fclose(fp_);
+    }
+
+    /**
+     * Parse the next record. On success gt_ points to gt_len_ Bcf-encoded
+     * values with a stride of ploidy_ values per sample and n_allele_ is the
+     * number of alleles (REF + ALT). Records without a GT field have
+     * gt_len_ set to 0. The site is described by rid_ (index into contigs_),
+     * pos_, and alleles_.
+     *
+     * @return Returns 1 on success, 0 at the end of the file, or a negative
+     *         value if the input could not be read or a record could not be
+     *         parsed. error_ is set in the latter case.
+     */
+    int Next() {
+        if (error_) return -1;
+
+        const char* line = nullptr;
+        const char* line_end = nullptr;
+        while (true) {
+            if (NextLine(line, line_end) == false) return error_ ? -1 : 0;
+            if (line_end != line && line[0] != '#') break;
+        }
+
+        ++n_lines_;
+        if (ParseRecord(line, line_end) < 0) {
+            std::cerr << "Failed to parse Vcf record " << n_lines_ << std::endl;
+            error_ = true;
+            return -2;
+        }
+        return 1;
+    }
+
+private:
+    enum { DJN_VCF_PLAIN = 0, DJN_VCF_GZIP = 1, DJN_VCF_BGZF = 2 };
+
+    // BGZF block descriptor.
+    struct bgzf_block_t {
+        uint32_t c_offset, c_len; // compressed payload in in_buf_
+        uint32_t u_offset, u_len; // uncompressed data in buf_
+        uint32_t crc;
+        int ret;
+    };
+
+    VcfTextReader(FILE* fp, bool own_fp, uint32_t n_threads) :
+        n_samples_(0), gt_(nullptr), gt_len_(0), ploidy_(0), n_allele_(0),
+        rid_(-1), pos_(0), n_lines_(0), error_(false),
+        fp_(fp), own_fp_(own_fp), n_threads_(n_threads), mode_(DJN_VCF_PLAIN),
+        eof_(false), pending_len_(0), buf_begin_(0), buf_end_(0), scan_(0)
+    {}
+
+    // Read raw bytes from the input including bytes consumed when detecting
+    // the file format.
+    size_t ReadRaw(uint8_t* dst, size_t n) {
+        size_t r = 0;
+        if (pending_len_) {
+            r = pending_len_ < n ? pending_len_ : n;
+            memcpy(dst, pending_, r);
+            memmove(pending_, pending_ + r, pending_len_ - r);
+            pending_len_ -= r;
+        }
+        if (r < n) r += fread(dst + r, 1, n - r, fp_);
+        return r;
+    }
+
+    int DetectFormat() {
+        pending_len_ = fread(pending_, 1, sizeof(pending_), fp_);
+        if (pending_len_ < 2 || pending_[0] != 0x1f || pending_[1] != 0x8b) {
+            mode_ = DJN_VCF_PLAIN;
+            return 1;
+        }
+
+#if defined(HAVE_ZLIB)
+        // BGZF: gzip member with the extra subfield 'BC' holding the block size.
+        if (pending_len_ >= 18 && (pending_[3] & 4) && pending_[12] == 'B' && pending_[13] == 'C') {
+            mode_ = DJN_VCF_BGZF;
+            return 1;
+        }
+
+        mode_ = DJN_VCF_GZIP;
+        memset(&zs_, 0, sizeof(z_stream));
+        if (inflateInit2(&zs_, 16 + MAX_WBITS) != Z_OK) {
+            std::cerr << "Failed to initialize zlib" << std::endl;
+            return -1;
+        }
+        return 1;
+#else
+        std::cerr << "Compressed Vcf input requires zlib (HAVE_ZLIB)" << std::endl;
+        return -1;
+#endif
+    }
+
+    // Make room for at least n more bytes at the end of buf_, discarding
+    // consumed data.
+    void ReserveBuffer(size_t n) {
+        if (buf_begin_) {
+            memmove(buf_.data(), buf_.data() + buf_begin_, buf_end_ - buf_begin_);
+            buf_end_ -= buf_begin_;
+            scan_    -= buf_begin_;
+            buf_begin_ = 0;
+        }
+        if (buf_.size() < buf_end_ + n) buf_.resize(buf_end_ + n + (buf_end_ >> 1));
+    }
+
+    // Append decompressed data to buf_. Returns the number of bytes added,
+    // 0 at the end of the file, or a negative value on error.
+    int64_t Fill() {
+        if (eof_) return 0;
+        switch (mode_) {
+        case DJN_VCF_PLAIN: {
+            ReserveBuffer(1 << 20);
+            const size_t r = ReadRaw((uint8_t*)&buf_[buf_end_], 1 << 20);
+            if (r == 0) eof_ = true;
+            buf_end_ += r;
+            return r;
+        }
+#if defined(HAVE_ZLIB)
+        case DJN_VCF_GZIP: return FillGzip();
+        case DJN_VCF_BGZF: return FillBgzf();
+#endif
+        }
+        return -1;
+    }
+
+#if defined(HAVE_ZLIB)
+    int64_t FillGzip() {
+        const size_t chunk = 1 << 20;
+        ReserveBuffer(4 * chunk);
+        zs_.next_out  = (Bytef*)&buf_[buf_end_];
+        zs_.avail_out = 4 * chunk;
+
+        while (zs_.avail_out == 4 * chunk) {
+            if (zs_.avail_in == 0) {
+                if (in_buf_.size() < chunk) in_buf_.resize(chunk);
+                const size_t r = ReadRaw(in_buf_.data(), chunk);
+                if (r == 0) { eof_ = true; break; }
+                zs_.next_in  = in_buf_.data();
+                zs_.avail_in = r;
+            }
+
+            const int ret = inflate(&zs_, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // Concatenated gzip members.
+                if (inflateReset(&zs_) != Z_OK) return -1;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                std::cerr << "Failed to inflate gzip stream: " << ret << std::endl;
+                return -1;
+            }
+        }
+
+        const size_t added = 4 * chunk - zs_.avail_out;
+        buf_end_ += added;
+        return added;
+    }
+
+    // Read a batch of BGZF blocks and inflate them in parallel.
+    int64_t FillBgzf() {
+        const uint32_t n_blocks_batch = 16 * (n_threads_ ? n_threads_ : 1);
+        blocks_.clear();
+        in_len_ = 0;
+        uint64_t u_total = 0;
+
+        while (blocks_.size() < n_blocks_batch) {
+            uint8_t hdr[18];
+            const size_t r = ReadRaw(hdr, 18);
+            if (r == 0) break;
+            if (r != 18 || hdr[0] != 0x1f || hdr[1] != 0x8b || (hdr[3] & 4) == 0 || hdr[12] != 'B' || hdr[13] != 'C') {
+                std::cerr << "Malformed BGZF block header" << std::endl;
+                return -1;
+            }
+
+            const uint32_t xlen  = hdr[10] | (hdr[11] << 8);
+            const uint32_t bsize = (hdr[16] | (hdr[17] << 8)) + 1;
+            if (xlen < 6 || bsize < 12 + xlen + 8) return -1;
+
+            // Remainder of the block: payload, CRC32, and ISIZE.
+            const uint32_t rem = bsize - 18;
+            if (in_buf_.size() < in_len_ + rem) in_buf_.resize(in_len_ + rem + 65536);
+            if (ReadRaw(&in_buf_[in_len_], rem) != rem) {
+                std::cerr << "Truncated BGZF block" << std::endl;
+                return -1;
+            }
+
+            const uint8_t* tail = &in_buf_[in_len_ + rem - 8];
+            bgzf_block_t b;
+            b.c_offset = in_len_ + (12 + xlen - 18);
+            b.c_len    = bsize - 12 - xlen - 8;
+            b.crc      = tail[0] | (tail[1] << 8) | (tail[2] << 16) | ((uint32_t)tail[3] << 24);
+            b.u_len    = tail[4] | (tail[5] << 8) | (tail[6] << 16) | ((uint32_t)tail[7] << 24);
+            b.u_offset = u_total;
+            b.ret      = 0;
+            in_len_ += rem;
+            u_total += b.u_len;
+            if (b.u_len) blocks_.push_back(b); // skip empty (EOF marker) blocks
+        }
+
+        if (blocks_.empty()) { eof_ = true; return 0; }
+
+        ReserveBuffer(u_total);
+        const uint32_t n_workers = n_threads_ > 1 ? (n_threads_ < blocks_.size() ? n_threads_ : blocks_.size()) : 1;
+        if (n_workers == 1) InflateBlocks(0, 1);
+        else {
+            std::vector<std::thread> workers;
+            for (uint32_t i = 0; i < n_workers; ++i)
+                workers.push_back(std::thread(&self_type::InflateBlocks, this, i, n_workers));
+            for (uint32_t i = 0; i < n_workers; ++i) workers[i].join();
+        }
+
+        for (size_t i = 0; i < blocks_.size(); ++i) {
+            if (blocks_[i].ret < 0) {
+                std::cerr << "Failed to inflate BGZF block: " << blocks_[i].ret << std::endl;
+                return -1;
+            }
+        }
+
+        buf_end_ += u_total;
+        return u_total;
+    }
+
+    // Inflate every stride-th block starting at offset.
+    void InflateBlocks(uint32_t offset, uint32_t stride) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(z_stream));
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+            for (size_t i = offset; i < blocks_.size(); i += stride) blocks_[i].ret = -1;
+            return;
+        }
+
+        for (size_t i = offset; i < blocks_.size(); i += stride) {
+            bgzf_block_t& b = blocks_[i];
+            Bytef* dst = (Bytef*)&buf_[buf_end_ + b.u_offset];
+            zs.next_in   = &in_buf_[b.c_offset];
+            zs.avail_in  = b.c_len;
+            zs.next_out  = dst;
+            zs.avail_out = b.u_len;
+            const int ret = inflate(&zs, Z_FINISH);
+            if (ret != Z_STREAM_END || zs.avail_out != 0) b.ret = -2;
+            else if (crc32(crc32(0L, Z_NULL, 0), dst, b.u_len) != b.crc) b.ret = -3;
+            else b.ret = 1;
+            inflateReset(&zs);
+        }
+        inflateEnd(&zs);
+    }
+#endif
+
+    // Retrieve the next line (without the trailing newline).
+    bool NextLine(const char*& line, const char*& line_end) {
+        while (true) {
+            const char* nl = nullptr;
+            if (scan_ < buf_end_) nl = (const char*)memchr(&buf_[scan_], '\n', buf_end_ - scan_);
+            if (nl != nullptr) {
+                line = &buf_[buf_begin_];
+                line_end = nl;
+                buf_begin_ = scan_ = nl - buf_.data() + 1;
+                if (line_end != line && line_end[-1] == '\r') --line_end;
+                return true;
+            }
+            scan_ = buf_end_;
+
+            const int64_t ret = Fill();
+            if (ret < 0) { error_ = true; return false; }
+            if (ret == 0) {
+                // Final line without a newline.
+                if (buf_begin_ == buf_end_) return false;
+                line = &buf_[buf_begin_];
+                line_end = &buf_[buf_end_];
+                buf_begin_ = scan_ = buf_end_;
+                return true;
+            }
+        }
+    }
+
+    int ReadHeader() {
+        const char* line = nullptr;
+        const char* line_end = nullptr;
+        while (NextLine(line, line_end)) {
+            if (line_end - line >= 13 && strncmp(line, "##contig=<ID=", 13) == 0) {
+                const char* id = line + 13;
+                const char* id_end = id;
+                while (id_end < line_end && *id_end != ',' && *id_end != '>') ++id_end;
+                ContigId(id, id_end);
+                continue;
+            }
+            if (line_end - line >= 2 && line[0] == '#' && line[1] == '#') continue;
+            if (line_end - line >= 6 && strncmp(line, "#CHROM", 6) == 0) {
+                // Sample names follow the FORMAT column (9th).
+                const char* s = djn_skip_tabs(line, line_end, 9);
+                while (s < line_end) {
+                    const char* name = s + 1;
+                    s = djn_skip_tabs(name, line_end, 1);
+                    samples_.push_back(std::string(name, s - name));
+                }
+                n_samples_ = samples_.size();
+                return 1;
+            }
+            break;
+        }
+        std::cerr << "Not a valid Vcf file: missing #CHROM header line" << std::endl;
+        return -1;
+    }
+
+    // Returns the index of a contig, adding it to contigs_ when first seen.
+    int32_t ContigId(const char* name, const char* name_end) {
+        const size_t len = name_end - name;
+        if (rid_ >= 0 && contigs_[rid_].size() == len && memcmp(contigs_[rid_].data(), name, len) == 0)
+            return rid_;
+        
+        const std::string key(name, len);
+        std::unordered_map<std::string, int32_t>::const_iterator it = contig_map_.find(key);
+        if (it != contig_map_.end()) return it->second;
+        contig_map_[key] = contigs_.size();
+        contigs_.push_back(key);
+        return contigs_.size() - 1;
+    }
+
+    // Parse the site columns, the FORMAT column, and the GT field of every
+    // sample.
+    int ParseRecord(const char* line, const char* line_end) {
+        gt_len_ = 0;
+        ploidy_ = 0;
+
+        // CHROM and POS columns.
+        const char* chrom_end = djn_skip_tabs(line, line_end, 1);
+        if (chrom_end == line_end) return -1;
+        rid_ = ContigId(line, chrom_end);
+        pos_ = strtoll(chrom_end + 1, nullptr, 10);
+
+        // Number of alleles from the ALT column (5th).
+        const char* ref = djn_skip_tabs(chrom_end + 1, line_end, 2);
+        if (ref == line_end) return -1;
+        const char* alt = djn_skip_tabs(ref + 1, line_end, 1);
+        if (alt == line_end) return -1;
+        const char* alt_end = djn_skip_tabs(alt + 1, line_end, 1);
+        if (alt_end == line_end) return -1;
+        alleles_.assign(ref + 1, alt);
+        n_allele_ = 1;
+        if (!(alt_end - alt == 2 && alt[1] == '.')) {
+            n_allele_ = 2;
+            for (const char* s = alt + 1; s < alt_end; ++s) n_allele_ += (*s == ',');
+            alleles_ += ',';
+            alleles_.append(alt + 1, alt_end);
+        }
+
+        if (n_samples_ == 0) return 1;
+
+        // FORMAT column (9th): locate GT.
+        const char* fmt = djn_skip_tabs(alt_end + 1, line_end, 3);
+        if (fmt == line_end) return -1;
+        ++fmt;
+        const char* fmt_end = djn_skip_tabs(fmt, line_end, 1);
+        int gt_field = -1, field = 0;
+        for (const char* s = fmt; s < fmt_end; ++field) {
+            const char* e = s;
+            while (e < fmt_end && *e != ':') ++e;
+            if (e - s == 2 && s[0] == 'G' && s[1] == 'T') { gt_field = field; break; }
+            s = e + 1;
+        }
+        if (gt_field < 0 || fmt_end == line_end) return 1; // no GT
+        const bool only_gt = (fmt_end - fmt == 2);
+
+        // Base ploidy from the first sample, restarting with a larger value if
+        // a later sample has more alleles.
+        const char* samples = fmt_end + 1;
+        int ploidy = CountAlleles(samples, line_end, gt_field);
+        if (ploidy <= 0) return -1;
+        while (true) {
+            const int ret = ParseSamples(samples, line_end, gt_field, only_gt, ploidy);
+            if (ret < 0) return -1;
+            if (ret == ploidy) break;
+            ploidy = ret;
+        }
+
+        gt_ = gt_buf_.data();
+        gt_len_ = n_samples_ * ploidy;
+        ploidy_ = ploidy;
+        return 1;
+    }
+
+    // Number of alleles in the GT subfield of the sample starting at s.
+    static int CountAlleles(const char* s, const char* end, int gt_field) {
+        for (int i = 0; i < gt_field; ++i) {
+            while (s < end && *s != ':' && *s != '\t') ++s;
+            if (s == end || *s == '\t') return 1; // missing subfield
+            ++s;
+        }
+        int n = 1;
+        for (/**/; s < end && *s != ':' && *s != '\t'; ++s) n += (*s == '/' || *s == '|');
+        return n;
+    }
+
+    // Returns ploidy on success, a larger ploidy if any sample does not fit,
+    // or a negative value on error.
+    int ParseSamples(const char* s, const char* end, int gt_field, bool only_gt, int ploidy) {
+        if (gt_buf_.size() < (size_t)n_samples_ * ploidy) gt_buf_.resize((size_t)n_samples_ * ploidy);
+        uint8_t* dst = gt_buf_.data();
+        int max_ploidy = ploidy;
+        int64_t i = 0;
+
+#if defined(__SSE2__)
+        if (only_gt && ploidy == 2) {
+            const __m128i lo = _mm_set1_epi16(0x00FF);
+            const __m128i c0 = _mm_set1_epi8('0');
+            const __m128i c9 = _mm_set1_epi8(9);
+            const __m128i c_tab   = _mm_set1_epi8('\t');
+            const __m128i c_phase = _mm_set1_epi8('|');
+            const __m128i c_unph  = _mm_set1_epi8('/');
+            const __m128i one_hi  = _mm_set1_epi16(0x0100);
+
+            for (/**/; i + 4 <= n_samples_ && s + 16 <= end; i += 4, s += 16) {
+                const __m128i v = _mm_loadu_si128((const __m128i*)s);
+                // Even bytes: alleles. Odd bytes: separator followed by a tab.
+                const __m128i alleles = _mm_sub_epi8(_mm_packus_epi16(_mm_and_si128(v, lo), _mm_setzero_si128()), c0);
+                const __m128i delims  = _mm_packus_epi16(_mm_srli_epi16(v, 8), _mm_setzero_si128());
+                const __m128i is_phased = _mm_cmpeq_epi8(delims, c_phase);
+                const __m128i is_sep = _mm_or_si128(is_phased, _mm_cmpeq_epi8(delims, c_unph));
+                const __m128i is_tab = _mm_cmpeq_epi8(delims, c_tab);
+                // Low bytes of each 16-bit lane must be separators, high bytes tabs.
+                const uint32_t m_delim = _mm_movemask_epi8(_mm_or_si128(_mm_and_si128(is_sep, lo), _mm_andnot_si128(lo, is_tab))) & 0xFF;
+                const uint32_t m_digit = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(alleles, c9), alleles)) & 0xFF;
+                if (m_delim != 0xFF || m_digit != 0xFF) break;
+
+                // Bcf encoding: (allele + 1) << 1 | phased (second allele only).
+                __m128i out = _mm_add_epi8(alleles, _mm_set1_epi8(1));
+                out = _mm_add_epi8(out, out);
+                out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi16(is_phased, 8), one_hi));
+                _mm_storel_epi64((__m128i*)&dst[i*2], out);
+            }
+        }
+#endif
+
+        for (/**/; i < n_samples_; ++i) {
+            if (s >= end) return -1;
+            const char* f = s;
+            // Skip to the GT subfield.
+            bool missing_field = false;
+            for (int k = 0; k < gt_field; ++k) {
+                while (f < end && *f != ':' && *f != '\t') ++f;
+                if (f == end || *f == '\t') { missing_field = true; break; }
+                ++f;
+            }
+
+            uint8_t* d = &dst[i*ploidy];
+            int n = 0;
+            if (missing_field) {
+                d[n++] = 0;
+            } else {
+                uint8_t phased = 0;
+                while (f < end && *f != ':' && *f != '\t') {
+                    uint32_t v = 0;
+                    if (*f == '.') { ++f; }
+                    else {
+                        if (*f < '0' || *f > '9') return -1;
+                        uint32_t a = 0;
+                        while (f < end && *f >= '0' && *f <= '9') a = a * 10 + (*f++ - '0');
+                        if (a > 126) return -1;
+                        v = (a + 1) << 1;
+                    }
+                    if (n < ploidy) d[n] = v | phased;
+                    ++n;
+                    if (f < end && (*f == '|' || *f == '/')) { phased = (*f == '|'); ++f; }
+                    else break;
+                }
+            }
+            if (n > max_ploidy) max_ploidy = n;
+            for (/**/; n < ploidy; ++n) d[n] = 0x81; // EOV padding
+
+            // Next sample.
+            s = djn_skip_tabs(f, end, 1) + 1;
+        }
+
+        return max_ploidy;
+    }
+
+public:
+    int64_t n_samples_; // Number of samples.
+    uint8_t* gt_;       // Bcf-encoded GT data of the current record.
+    uint32_t gt_len_;   // Number of values in gt_.
+    int ploidy_;        // Base ploidy of the current record.
+    int n_allele_;      // Number of alleles of the current record.
+    int32_t rid_;       // Contig index of the current record.
+    int64_t pos_;       // Position (1-based) of the current record.
+    std::string alleles_; // Comma-separated alleles of the current record (REF first).
+    std::vector<std::string> contigs_; // Contig names in order of appearance.
+    std::vector<std::string> samples_; // Sample names.
+    int64_t n_lines_;   // Number of records parsed.
+    bool error_;        // Set when parsing stopped because of an error.
+
+private:
+    FILE* fp_;
+    bool own_fp_;
+    uint32_t n_threads_;
+    int mode_;
+    bool eof_;
+
+    uint8_t pending_[32]; // bytes consumed when detecting the format
+    size_t pending_len_;
+
+    std::vector<char> buf_; // decompressed text
+    size_t buf_begin_, buf_end_, scan_;
+    std::vector<uint8_t> gt_buf_;
+    std::unordered_map<std::string, int32_t> contig_map_;
+
+#if defined(HAVE_ZLIB)
+    z_stream zs_;
+    std::vector<uint8_t> in_buf_; // compressed data
+    size_t in_len_;
+    std::vector<bgzf_block_t> blocks_;
+#endif
+};
+
+}
+
+#endif /* VCF_TEXT_READER_H_ */
@@ -4,10 +4,15 @@
 #include "djinn.h"
 
 #include "examples/htslib.h"
+#include "examples/import_vcf.h"
 #include "examples/iterate_vcf.h"
+#include "examples/iterate_bcf.h"
 #include "examples/iterate_raw.h"
 #include "examples/iterate.h"
 #include "examples/encode.h"
+#include "examples/merge.h"
+#include "examples/concat.h"
+#include "examples/match.h"
 
 
 #include <algorithm>//sort
@@ -19,8 +24,8 @@
 // Definition for microsecond timer.
 typedef std::chrono::high_resolution_clock::time_point clockdef;
 
-int HtslibIterateBcf(const std::string& filename) {
-    std::unique_ptr<djinn::VcfReader> reader = djinn::VcfReader::FromFile(filename);
+int HtslibIterateBcf(const std::string& filename, const uint32_t n_threads = 0) {
+    std::unique_ptr<djinn::VcfReader> reader = djinn::VcfReader::FromFile(filename, n_threads);
     if (reader.get() == nullptr) {
         std::cerr << "failed read" << std::endl;
         return -1;
@@ -34,16 +39,16 @@ int HtslibIterateBcf(const std::string& filename) {
     // While there are bcf records available.
     clockdef t1_encode = std::chrono::high_resolution_clock::now();
 
-    while (reader->Next()) {
+    djinn::BcfGenotypeScanner gt(reader->header_);
+    while (reader->Next(0)) {
         if (reader->bcf1_ == NULL)   return -1;
         if (reader->header_ == NULL) return -2;
 
         // Check for GT
-        const bcf_fmt_t* fmt = bcf_get_fmt(reader->header_, reader->bcf1_, "GT");
-        if (fmt == NULL) return 0;
+        if (gt.Scan(reader->bcf1_) <= 0) return 0;
         
-        data_in += fmt->p_len;
-        data_in_vcf += 2*fmt->p_len - 1;
+        data_in += gt.p_len;
+        data_in_vcf += 2*gt.p_len - 1;
         ++n_lines;
     }
 
@@ -55,11 +60,44 @@ int HtslibIterateBcf(const std::string& filename) {
     return n_lines;
 }
 
+int VerifyArchive(const std::string& input_file) {
+    std::istream* in_stream = nullptr;
+    if (input_file == "-") in_stream = &std::cin;
+    else {
+        in_stream = new std::ifstream(input_file, std::ios::in | std::ios::binary);
+        if (in_stream->good() == false) {
+            std::cerr << "could not open infile handle" << std::endl;
+            delete in_stream;
+            return -1;
+        }
+    }
+
+    // Checksums are verified without decoding the blocks.
+    djinn::djinn_archive_reader reader;
+    int64_t ret = reader.Open(*in_stream);
+    if (ret == 1) ret = reader.Verify();
+    else if (ret > 0) {
+        std::cerr << "Input is not framed: no checksums to verify" << std::endl;
+        ret = -1;
+    }
+    if (ret < 0 && reader.legacy == false) {
+        std::cerr << "[Verify] " << input_file << ": " << djinn::ArchiveErrorString(ret) << " after " 
+            << reader.n_blocks << " blocks" << std::endl;
+    } else if (ret >= 0) {
+        std::cerr << "[Verify] " << input_file << ": " << reader.n_blocks << " blocks and " 
+            << reader.n_variants << " variants OK" << std::endl;
+    }
+
+    if (input_file != "-") delete in_stream;
+    return ret < 0 ? ret : 0;
+}
+
 int Benchmark(std::string input_file,   // input file: "-" for stdin
               std::string output_file,  // output file: "-" for stdout
               const uint32_t type,      // 1: ctx model, 2; LZ4-EWAH, 4: ZSTD-EWAH
               const bool permute = true,// PBWT preprocessor
-              const bool reset_models = true)
+              const bool reset_models = true,
+              const uint32_t n_threads = 0)
 {
     if (output_file == "-") {
         std::cerr << "cannot benchmark when piping to stdout" << std::endl;
@@ -68,7 +106,7 @@ int Benchmark(std::string input_file,   // input file: "-" for stdin
 
     // 
     clockdef t1 = std::chrono::high_resolution_clock::now();
-    int ret = HtslibIterateBcf(input_file);
+    int ret = HtslibIterateBcf(input_file, n_threads);
     clockdef t2 = std::chrono::high_resolution_clock::now();
     auto time_span = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
     if (ret <= 0) return -1;
@@ -76,7 +114,7 @@ int Benchmark(std::string input_file,   // input file: "-" for stdin
 
     // Encode input Vcf file.
     t1 = std::chrono::high_resolution_clock::now();
-    ret = ImportHtslib(input_file, output_file, type, permute, reset_models);
+    ret = ImportHtslib(input_file, output_file, type, permute, reset_models, n_threads);
     t2 = std::chrono::high_resolution_clock::now();
     time_span = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
     if (ret <= 0) return -1;
@@ -286,15 +324,33 @@ void usage() {
     printf("   -o STRING output destination file or \"-\" for standard out\n");
     printf("   -c BOOL   compress file\n");
     printf("   -d BOOL   decompress file\n");
+    printf("   -O STRING decompressed output type: v for VCF genotypes (default) or b for BGZF-compressed BCF\n");
     printf("   -z BOOL   compress with RLE-hybrid + ZSTD-19\n");
     printf("   -l BOOL   compress with RLE-hybrid + LZ4-HC-9\n");
     printf("   -m BOOL   compress with context modelling\n");
     printf("   -p BOOL   permute data with PBWT\n");
-    printf("   -P BOOL   do NOT permute data with PBWT\n\n");
+    printf("   -P BOOL   do NOT permute data with PBWT\n");
+    printf("   -t INT    number of additional decompression threads\n");
+    printf("   -V BOOL   read Vcf/Vcf.gz input with the built-in GT parser instead of htslib\n");
+    printf("   -k BOOL   verify archive checksums without decoding\n");
+    printf("   -r STRING decompress only the variants overlapping a region (contig:start-end)\n");
+    printf("   -a FLOAT  decompress only variants with a minor allele frequency of at least FLOAT\n");
+    printf("   -n INT    decompress only variants with at most INT missing genotypes\n");
+    printf("   -M STRING merge the samples of the input archive with those of archive STRING\n");
+    printf("   -R BOOL   resume an interrupted import into the output file\n");
+    printf("   -G BOOL   permute unphased diploid sites by genotype (gtPBWT) instead of by haplotype\n");
+    printf("   -X BOOL   condition the context model on the PBWT divergence array (with -m)\n");
+    printf("   -D BOOL   code noisy biallelic sites bit by bit in the context model (with -m)\n");
+    printf("   -L INT    report haplotype matches of at least INT variants (optionally within the region -r)\n");
+    printf("   -Q STRING report set-maximal matches of the query haplotype stored in file STRING instead of all pairs (requires -L)\n\n");
     printf("Examples:\n");
     printf("  djinn -clpi file.bcf > /dev/null\n");
     printf("  djinn -czPi file.bcf > /dev/null\n");
-    printf("  djinn -cmi file.bcf > /dev/null\n\n");
+    printf("  djinn -cmi file.bcf > /dev/null\n");
+    printf("  djinn -dlOb -i file.djn -o file.bcf\n");
+    printf("  djinn -lt 4 -i batch1.djn -M batch2.djn -o merged.djn\n");
+    printf("  djinn concat -o genome.djn chr1.djn chr2.djn chr3.djn\n");
+    printf("  djinn -i file.djn -r chr20:1-5000000 -L 1000\n\n");
 }
 
 int main(int argc, char** argv) {
@@ -303,6 +359,12 @@ int main(int argc, char** argv) {
         return EXIT_SUCCESS;
     }
 
+    // Concatenation mode: "djinn concat [-o output] input1 input2 ...".
+    const bool concat = argc > 1 && std::string(argv[1]) == "concat";
+    if (concat) {
+        --argc; ++argv;
+    }
+
     int option_index = 0;
 	static struct option long_options[] = {
 		{"input",  required_argument, 0,  'i' },
@@ -315,6 +377,20 @@ int main(int argc, char** argv) {
         {"permute",  optional_argument, 0,  'p' },
         {"no-permute",  optional_argument, 0,  'P' },
         {"benchmark",  optional_argument, 0,  'b' },
+        {"output-type",  required_argument, 0,  'O' },
+        {"threads",  required_argument, 0,  't' },
+        {"native-vcf",  optional_argument, 0,  'V' },
+        {"verify",  optional_argument, 0,  'k' },
+        {"region",  required_argument, 0,  'r' },
+        {"min-maf",  required_argument, 0,  'a' },
+        {"max-missing",  required_argument, 0,  'n' },
+        {"merge",  required_argument, 0,  'M' },
+        {"resume",  optional_argument, 0,  'R' },
+        {"gt-pbwt",  optional_argument, 0,  'G' },
+        {"pbwt-context",  optional_argument, 0,  'X' },
+        {"dense",  optional_argument, 0,  'D' },
+        {"match-length",  required_argument, 0,  'L' },
+        {"query",  required_argument, 0,  'Q' },
 		{0,0,0,0}
 	};
 
@@ -326,9 +402,23 @@ int main(int argc, char** argv) {
     bool decompress = false;
     bool permute = true;
     bool benchmark = false;
+    char output_type = 'v';
+    int n_threads = 0;
+    bool native_vcf = false;
+    bool verify = false;
+    std::string region;
+    djinn::djinn_stats_filter_t filter;
+    bool use_filter = false;
+    std::string merge;
+    bool resume = false;
+    bool gt_pbwt = false;
+    bool pbwt_ctx = false;
+    bool dense = false;
+    int match_length = 0;
+    std::string query;
 
     int c;
-    while ((c = getopt_long(argc, argv, "i:o:zlcdmpPb?", long_options, &option_index)) != -1){
+    while ((c = getopt_long(argc, argv, "i:o:O:t:r:a:n:M:L:Q:zlcdmpPbVkRGXD?", long_options, &option_index)) != -1){
 		switch (c){
 		case 0:
 			std::cerr << "Case 0: " << option_index << '\t' << long_options[option_index].name << std::endl;
@@ -339,8 +429,58 @@ int main(int argc, char** argv) {
         case 'o':
 			output = std::string(optarg);
 			break;
+        case 'O':
+            output_type = optarg[0];
+            if (output_type != 'v' && output_type != 'b') {
+                std::cerr << "Unknown output type: " << optarg << " (valid=[v,b])" << std::endl;
+                return 1;
+            }
+            break;
 		
+        case 't':
+            n_threads = atoi(optarg);
+            if (n_threads < 0) {
+                std::cerr << "Number of threads must be non-negative: " << optarg << std::endl;
+                return 1;
+            }
+            break;
+
+        case 'a':
+            filter.min_maf = atof(optarg);
+            if (filter.min_maf < 0 || filter.min_maf > 0.5) {
+                std::cerr << "Minor allele frequency must be in [0, 0.5]: " << optarg << std::endl;
+                return 1;
+            }
+            use_filter = true;
+            break;
+
+        case 'n':
+            if (atoi(optarg) < 0) {
+                std::cerr << "Number of missing genotypes must be non-negative: " << optarg << std::endl;
+                return 1;
+            }
+            filter.max_missing = atoi(optarg);
+            use_filter = true;
+            break;
+
+        case 'L':
+            match_length = atoi(optarg);
+            if (match_length <= 0) {
+                std::cerr << "Match length must be positive: " << optarg << std::endl;
+                return 1;
+            }
+            break;
+
+        case 'r': region = std::string(optarg); break;
+        case 'Q': query = std::string(optarg); break;
+        case 'M': merge = std::string(optarg); break;
         case 'b': benchmark = true; break;
+        case 'V': native_vcf = true; break;
+        case 'k': verify = true; break;
+        case 'R': resume = true; break;
+        case 'G': gt_pbwt = true; break;
+        case 'X': pbwt_ctx = true; break;
+        case 'D': dense = true; break;
         case 'z': zstd = true;  lz4 = false; context = false; break;
         case 'l': zstd = false; lz4 = true;  context = false; break;
         case 'm': zstd = false; lz4 = false; context = true;  break;
@@ -355,6 +495,13 @@ int main(int argc, char** argv) {
 		}
 	}
 
+    if (concat) {
+        std::vector<std::string> inputs;
+        if (input.size()) inputs.push_back(input);
+        for (int i = optind; i < argc; ++i) inputs.push_back(argv[i]);
+        return ConcatArchives(inputs, output) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
 	if(input.length() == 0){
 		std::cerr << "No input value specified..." << std::endl;
 		return 1;
@@ -365,16 +512,39 @@ int main(int argc, char** argv) {
 
 
     bool reset = true;
+    if (verify) {
+        return VerifyArchive(input) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (query.size() && match_length == 0) {
+        std::cerr << "Query matching requires a minimum match length (-L)" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (match_length) {
+        return MatchHaplotypes(input, region, match_length, query) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (merge.size()) {
+        return MergeArchives(input, merge, output, type, permute, n_threads) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     if (benchmark) {
-        return Benchmark(input, output, type, permute, reset);
+        return Benchmark(input, output, type, permute, reset, n_threads);
     }
 
     if (compress) {
-        return ImportHtslib(input, output, type, permute, reset);
+        if (resume && output == "-") {
+            std::cerr << "Resuming requires an output file" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (native_vcf) return ImportVcf(input, output, type, permute, reset, n_threads, resume, gt_pbwt, pbwt_ctx, dense);
+        return ImportHtslib(input, output, type, permute, reset, n_threads, resume, gt_pbwt, pbwt_ctx, dense);
     }
 
     if (decompress) {
-        return IterateVcf(input, type);
+        if (region.size()) return QueryVcf(input, region);
+        if (output_type == 'b') return IterateBcf(input, output, type);
+        return IterateVcf(input, type, use_filter ? &filter : nullptr);
     }
 
     return EXIT_FAILURE;
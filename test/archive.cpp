@@ -0,0 +1,102 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include <sstream>
+
+#include "test_util.h"
+#include "checksum.h"
+
+using namespace djinn;
+
+// Open the archive and verify all frames.
+static int64_t VerifyArchive(const std::string& data) {
+    std::istringstream stream(data);
+    djinn_archive_reader reader;
+    const int ret = reader.Open(stream);
+    if (ret < 0) return ret;
+    return reader.Verify();
+}
+
+static void TestChecksum() {
+    // Check value of the CRC-32C (Castagnoli) parameters.
+    const uint8_t check[] = "123456789";
+    DJN_TEST_CHECK(djn_crc32c(0, check, 9) == 0xE3069283);
+    DJN_TEST_CHECK(djn_crc32c(0, check, 0) == 0);
+
+    // Incremental updates equal a single pass over all lengths and alignments.
+    std::mt19937 gen(1);
+    std::vector<uint8_t> data(1024);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = gen();
+    for (uint32_t len = 0; len < 64; ++len) {
+        for (uint32_t off = 0; off < 9; ++off) {
+            const uint32_t crc = djn_crc32c(0, &data[off], len);
+            DJN_TEST_CHECK(djn_crc32c(djn_crc32c(0, &data[off], len / 3), &data[off + len / 3], len - len / 3) == crc);
+        }
+    }
+    DJN_TEST_CHECK(djn_crc32c(djn_crc32c(0, &data[0], 517), &data[517], 507) == djn_crc32c(0, data.data(), 1024));
+}
+
+static void TestArchive(djinn_model& model, bool permute, uint32_t seed) {
+    std::mt19937 gen(seed);
+    djn_test_archive_t archive;
+    djn_test_make_archive(gen, 97, 5, 40, 2, archive);
+
+    std::stringstream stream;
+    DJN_TEST_CHECK(djn_test_write_archive(stream, model, archive, permute) > 0);
+    const std::string data = stream.str();
+
+    // Round trip and verification.
+    std::istringstream in(data);
+    DJN_TEST_CHECK(djn_test_check_archive(in, archive) == (int64_t)archive.genotypes.size());
+    DJN_TEST_CHECK(VerifyArchive(data) == 5);
+
+    // Every changed byte is detected by a checksum, except for changes to
+    // the magic number which make the stream unrecognizable.
+    for (size_t i = 0; i < data.size(); i += (i < 256 ? 1 : 17)) {
+        std::string corrupt = data;
+        corrupt[i] ^= 1 << (i % 8);
+        const int64_t ret = VerifyArchive(corrupt);
+        DJN_TEST_CHECK(ret == (i < 8 ? DJN_ARCHIVE_ERR_INVALID : DJN_ARCHIVE_ERR_CORRUPT));
+
+        std::istringstream corrupt_in(corrupt);
+        DJN_TEST_CHECK(djn_test_check_archive(corrupt_in, archive) < 0);
+    }
+
+    // Truncated archives are reported as such.
+    for (size_t len = 0; len < data.size(); len += (len < 256 ? 1 : 5)) {
+        const int64_t ret = VerifyArchive(data.substr(0, len));
+        DJN_TEST_CHECK(ret == (len < 8 ? DJN_ARCHIVE_ERR_INVALID : DJN_ARCHIVE_ERR_IO));
+    }
+    DJN_TEST_CHECK(VerifyArchive(data.substr(0, data.size() - 1)) == DJN_ARCHIVE_ERR_IO);
+}
+
+int main(int argc, char** argv) {
+    TestChecksum();
+
+    for (int permute = 0; permute < 2; ++permute) {
+        djinn_ctx_model ctx;
+        TestArchive(ctx, permute, 1 + permute);
+        djinn_ewah_model ewah(CompressionStrategy::ZSTD, 1);
+        TestArchive(ewah, permute, 3 + permute);
+    }
+
+    for (int code = DJN_ARCHIVE_ERR_NO_INDEX; code <= 0; ++code)
+        DJN_TEST_CHECK(ArchiveErrorString(code) != nullptr);
+    DJN_TEST_CHECK(strcmp(ArchiveErrorString(DJN_ARCHIVE_ERR_IO), ArchiveErrorString(DJN_ARCHIVE_ERR_CORRUPT)) != 0);
+
+    return djn_test_finish("archive");
+}
@@ -0,0 +1,123 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include <sstream>
+
+#include "test_util.h"
+
+using namespace djinn;
+
+// Write blocks [from, to) of a generated archive.
+static std::string WriteBlocks(djinn_model& model, const djn_test_archive_t& archive, uint32_t from, uint32_t to, bool permute) {
+    std::stringstream stream;
+    djinn_archive_writer writer;
+    DJN_TEST_CHECK(writer.Open(stream, model, archive.n_samples) > 0);
+    DJN_TEST_CHECK(writer.WriteNames(DJN_FRAME_SAMPLES, archive.samples) > 0);
+    DJN_TEST_CHECK(writer.WriteNames(DJN_FRAME_CONTIGS, archive.contigs) > 0);
+    for (uint32_t b = from; b < to; ++b) {
+        DJN_TEST_CHECK(djn_test_write_block(writer, model, archive, b, permute) > 0);
+    }
+    DJN_TEST_CHECK(writer.Close() > 0);
+    return stream.str();
+}
+
+// Concatenate archives with AppendArchive.
+static int Concat(const std::vector<std::string>& parts, std::string& out) {
+    std::stringstream stream;
+    djinn_archive_writer writer;
+    int ret = 0;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        std::istringstream in(parts[i]);
+        djinn_archive_reader reader;
+        if ((ret = reader.Open(in)) < 0) return ret;
+        if (i == 0 && (ret = writer.Open(stream, reader.header)) < 0) return ret;
+        if ((ret = writer.AppendArchive(reader)) < 0) return ret;
+    }
+    if ((ret = writer.Close()) < 0) return ret;
+    out = stream.str();
+    return 1;
+}
+
+static void TestConcat(djinn_model& model, bool permute, uint32_t seed) {
+    std::mt19937 gen(seed);
+    djn_test_archive_t archive;
+    djn_test_make_archive(gen, 61, 6, 35, 2, archive);
+
+    // The second part lists its contigs in reverse order such that its site
+    // tables are rewritten when appended.
+    djn_test_archive_t reversed = archive;
+    reversed.contigs.assign(archive.contigs.rbegin(), archive.contigs.rend());
+    for (uint32_t i = 0; i < reversed.sites.size(); ++i) reversed.sites.contig[i] = archive.contigs.size() - 1 - archive.sites.contig[i];
+
+    std::vector<std::string> parts;
+    parts.push_back(WriteBlocks(model, archive, 0, 2, permute));
+    parts.push_back(WriteBlocks(model, reversed, 2, 5, permute));
+    parts.push_back(WriteBlocks(model, archive, 5, 6, permute));
+
+    // Concatenation reads back as the archive written in one go.
+    std::string out;
+    DJN_TEST_CHECK(Concat(parts, out) > 0);
+    std::istringstream in(out);
+    DJN_TEST_CHECK(djn_test_check_archive(in, archive) == (int64_t)archive.genotypes.size());
+
+    // The index is rebuilt.
+    std::istringstream in_index(out);
+    djinn_archive_reader reader;
+    DJN_TEST_CHECK(reader.Open(in_index) > 0);
+    DJN_TEST_CHECK(reader.LoadIndex() > 0);
+    std::unique_ptr<djinn_model> decoder(reader.CreateModel());
+    for (uint32_t c = 0; c < archive.contigs.size(); ++c) {
+        uint32_t n_expected = 0, n_found = 0;
+        for (uint32_t i = 0; i < archive.sites.size(); ++i) n_expected += archive.sites.contig[i] == (int32_t)c;
+        DJN_TEST_CHECK(reader.Query(c, 1, std::numeric_limits<int64_t>::max()) > 0);
+        djinn_variant_t* variant = nullptr;
+        while (reader.NextQuery(*decoder, variant) > 0) {
+            DJN_TEST_CHECK(djn_test_equal(*variant, archive.genotypes[reader.sites.ordinal[reader.query_site]]));
+            ++n_found;
+        }
+        delete variant;
+        DJN_TEST_CHECK(n_found == n_expected);
+    }
+
+    // Archives with other samples cannot be appended.
+    djn_test_archive_t renamed = archive;
+    renamed.samples[3] = "other";
+    std::vector<std::string> bad_parts(1, parts[0]);
+    bad_parts.push_back(WriteBlocks(model, renamed, 2, 3, permute));
+    DJN_TEST_CHECK(Concat(bad_parts, out) == DJN_ARCHIVE_ERR_UNSUPPORTED);
+
+    djn_test_archive_t fewer;
+    djn_test_make_archive(gen, 60, 1, 35, 2, fewer);
+    bad_parts[1] = WriteBlocks(model, fewer, 0, 1, permute);
+    DJN_TEST_CHECK(Concat(bad_parts, out) == DJN_ARCHIVE_ERR_UNSUPPORTED);
+
+    // Corrupted blocks are not copied.
+    bad_parts[1] = parts[1];
+    bad_parts[1][bad_parts[1].size() / 2] ^= 0x10;
+    DJN_TEST_CHECK(Concat(bad_parts, out) == DJN_ARCHIVE_ERR_CORRUPT);
+}
+
+int main(int argc, char** argv) {
+    for (int permute = 0; permute < 2; ++permute) {
+        djinn_ctx_model ctx;
+        TestConcat(ctx, permute, 1 + permute);
+        djinn_ewah_model ewah(CompressionStrategy::ZSTD, 1);
+        TestConcat(ewah, permute, 3 + permute);
+    }
+
+    return djn_test_finish("concat");
+}
@@ -0,0 +1,181 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include <algorithm>
+#include <sstream>
+
+#include "test_util.h"
+
+using namespace djinn;
+
+typedef std::vector<std::vector<uint8_t>> haplotype_matrix; // alleles per variant
+
+static bool MatchLess(const djinn_hap_match_t& a, const djinn_hap_match_t& b) {
+    if (a.hap1 != b.hap1) return a.hap1 < b.hap1;
+    if (a.hap2 != b.hap2) return a.hap2 < b.hap2;
+    if (a.start != b.start) return a.start < b.start;
+    return a.end < b.end;
+}
+
+static bool MatchEqual(const std::vector<djinn_hap_match_t>& a, const std::vector<djinn_hap_match_t>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (MatchLess(a[i], b[i]) || MatchLess(b[i], a[i])) return false;
+    }
+    return true;
+}
+
+// Maximal runs [start, end) of at least min_length variants over which the
+// sequences x and y agree.
+static void AddRuns(const std::vector<uint8_t>& x, const std::vector<uint8_t>& y, uint32_t min_length, uint32_t hap1, uint32_t hap2, std::vector<djinn_hap_match_t>& out) {
+    uint32_t start = 0;
+    for (uint32_t v = 0; v <= x.size(); ++v) {
+        if (v < x.size() && x[v] == y[v]) continue;
+        if (v - start >= min_length) out.push_back(djinn_hap_match_t{hap1, hap2, start, v});
+        start = v + 1;
+    }
+}
+
+// All pairs of haplotypes with a maximal match of at least min_length variants.
+static std::vector<djinn_hap_match_t> BruteForceLong(const haplotype_matrix& sites, uint32_t min_length) {
+    const uint32_t n_haplotypes = sites[0].size();
+    std::vector<std::vector<uint8_t>> haps(n_haplotypes, std::vector<uint8_t>(sites.size()));
+    for (uint32_t v = 0; v < sites.size(); ++v) {
+        for (uint32_t h = 0; h < n_haplotypes; ++h) haps[h][v] = sites[v][h];
+    }
+
+    std::vector<djinn_hap_match_t> out;
+    for (uint32_t i = 0; i < n_haplotypes; ++i) {
+        for (uint32_t j = i + 1; j < n_haplotypes; ++j) AddRuns(haps[i], haps[j], min_length, i, j, out);
+    }
+    std::sort(out.begin(), out.end(), MatchLess);
+    return out;
+}
+
+// Set-maximal matches of the query of at least min_length variants: maximal
+// matches that no other haplotype extends by a variant on either side.
+static std::vector<djinn_hap_match_t> BruteForceQuery(const haplotype_matrix& sites, const std::vector<uint8_t>& query, uint32_t min_length) {
+    const uint32_t n_haplotypes = sites[0].size();
+    const uint32_t n_variants = sites.size();
+
+    // agree[h][v]: length of the agreement of haplotype h with the query
+    // ending at variant v (exclusive).
+    std::vector<std::vector<uint32_t>> agree(n_haplotypes, std::vector<uint32_t>(n_variants + 1, 0));
+    std::vector<std::vector<uint8_t>> haps(n_haplotypes, std::vector<uint8_t>(n_variants));
+    for (uint32_t h = 0; h < n_haplotypes; ++h) {
+        for (uint32_t v = 0; v < n_variants; ++v) {
+            haps[h][v] = sites[v][h];
+            agree[h][v + 1] = sites[v][h] == query[v] ? agree[h][v] + 1 : 0;
+        }
+    }
+
+    std::vector<djinn_hap_match_t> runs, out;
+    for (uint32_t h = 0; h < n_haplotypes; ++h) AddRuns(haps[h], query, min_length, h, n_haplotypes, runs);
+    for (size_t i = 0; i < runs.size(); ++i) {
+        const uint32_t s = runs[i].start, e = runs[i].end;
+        bool maximal = true;
+        for (uint32_t k = 0; k < n_haplotypes && maximal; ++k) {
+            if (s > 0 && agree[k][e] >= e - s + 1) maximal = false;
+            if (e < n_variants && agree[k][e + 1] >= e + 1 - s) maximal = false;
+        }
+        if (maximal) out.push_back(runs[i]);
+    }
+    std::sort(out.begin(), out.end(), MatchLess);
+    return out;
+}
+
+static std::vector<djinn_hap_match_t> Sorted(std::vector<djinn_hap_match_t> matches) {
+    std::sort(matches.begin(), matches.end(), MatchLess);
+    return matches;
+}
+
+static void TestMatch(uint32_t seed) {
+    std::mt19937 gen(seed);
+    const uint32_t n_samples = 40, n_haplotypes = 2*n_samples, n_variants = 250;
+
+    // Panel of haplotypes including missing and end-of-vector symbols, and
+    // a query copied from panel haplotypes with switches and mutations.
+    std::vector<std::vector<uint8_t>> bcf;
+    std::vector<uint8_t> n_alleles;
+    haplotype_matrix sites;
+    std::vector<uint8_t> query(n_variants);
+    uint32_t source = gen() % n_haplotypes;
+    for (uint32_t v = 0; v < n_variants; ++v) {
+        uint8_t n_allele = 0;
+        bcf.push_back(djn_test_site(gen, n_samples, gen() % DJN_TEST_KINDS, DJN_TEST_PHASED, n_allele));
+        n_alleles.push_back(n_allele);
+        std::vector<uint8_t> alleles(n_haplotypes);
+        for (uint32_t h = 0; h < n_haplotypes; ++h) alleles[h] = DJN_BCF_UNPACK_GENOTYPE_GENERAL(bcf.back()[h]);
+        sites.push_back(alleles);
+
+        if (gen() % 20 == 0) source = gen() % n_haplotypes;
+        query[v] = gen() % 40 == 0 ? (alleles[source] ^ 1) : alleles[source];
+    }
+
+    const uint32_t lengths[3] = { 1, 7, 30 };
+    for (int l = 0; l < 3; ++l) {
+        // All long matches, from allele vectors.
+        djinn_pbwt_matcher matcher;
+        DJN_TEST_CHECK(matcher.Initiate(n_haplotypes, lengths[l]) > 0);
+        for (uint32_t v = 0; v < n_variants; ++v) DJN_TEST_CHECK(matcher.Update(sites[v].data()) >= 0);
+        DJN_TEST_CHECK(matcher.Finish() >= 0);
+        const std::vector<djinn_hap_match_t> expected = BruteForceLong(sites, lengths[l]);
+        DJN_TEST_CHECK(expected.size() > 0);
+        DJN_TEST_CHECK(MatchEqual(Sorted(matcher.matches), expected));
+        for (size_t i = 0; i < matcher.matches.size(); ++i)
+            DJN_TEST_CHECK(matcher.matches[i].hap1 < matcher.matches[i].hap2);
+
+        // Set-maximal matches of the query.
+        DJN_TEST_CHECK(matcher.Initiate(n_haplotypes, lengths[l], true) > 0);
+        for (uint32_t v = 0; v < n_variants; ++v) DJN_TEST_CHECK(matcher.Update(sites[v].data(), query[v]) >= 0);
+        DJN_TEST_CHECK(matcher.Finish() >= 0);
+        const std::vector<djinn_hap_match_t> expected_query = BruteForceQuery(sites, query, lengths[l]);
+        DJN_TEST_CHECK(expected_query.size() > 0);
+        DJN_TEST_CHECK(MatchEqual(Sorted(matcher.matches), expected_query));
+    }
+
+    // Decoded variants give the same matches as their alleles.
+    djinn_ctx_model encoder, decoder;
+    encoder.StartEncoding(true, true);
+    for (uint32_t v = 0; v < n_variants; ++v)
+        DJN_TEST_CHECK(encoder.EncodeBcf(bcf[v].data(), bcf[v].size(), 2, n_alleles[v]) > 0);
+    DJN_TEST_CHECK(encoder.FinishEncoding() > 0);
+    std::stringstream stream;
+    DJN_TEST_CHECK(encoder.Serialize(stream) > 0);
+    DJN_TEST_CHECK(decoder.Deserialize(stream) > 0);
+    DJN_TEST_CHECK(decoder.StartDecoding() >= 0);
+
+    djinn_pbwt_matcher matcher;
+    DJN_TEST_CHECK(matcher.Initiate(n_haplotypes, 7, true) > 0);
+    djinn_variant_t* variant = nullptr;
+    for (uint32_t v = 0; v < n_variants; ++v) {
+        if (decoder.DecodeNext(variant) <= 0) {
+            DJN_TEST_CHECK(false);
+            break;
+        }
+        DJN_TEST_CHECK(matcher.Update(*variant, query[v]) >= 0);
+    }
+    delete variant;
+    DJN_TEST_CHECK(matcher.Finish() >= 0);
+    DJN_TEST_CHECK(MatchEqual(Sorted(matcher.matches), BruteForceQuery(sites, query, 7)));
+}
+
+int main(int argc, char** argv) {
+    for (uint32_t seed = 1; seed <= 5; ++seed) TestMatch(seed);
+
+    return djn_test_finish("match");
+}
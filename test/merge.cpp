@@ -0,0 +1,121 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include <sstream>
+
+#include "test_util.h"
+
+using namespace djinn;
+
+static djinn_model* CreateModel(int type) {
+    if (type == 0) return new djinn_ctx_model();
+    return new djinn_ewah_model(CompressionStrategy::ZSTD, 1);
+}
+
+// Encode a block of Bcf-encoded sites with haplotypes [from, to) of every
+// site, and deserialize it into a new model of the same type.
+static djinn_model* EncodeBlock(int type, bool permute, const std::vector<std::vector<uint8_t>>& sites, const std::vector<uint8_t>& n_alleles, uint32_t from, uint32_t to) {
+    std::unique_ptr<djinn_model> encoder(CreateModel(type));
+    encoder->StartEncoding(permute, true);
+    for (size_t v = 0; v < sites.size(); ++v) {
+        std::vector<uint8_t> part(sites[v].begin() + from, sites[v].begin() + to);
+        DJN_TEST_CHECK(encoder->EncodeBcf(part.data(), part.size(), 2, n_alleles[v]) > 0);
+    }
+    DJN_TEST_CHECK(encoder->FinishEncoding() > 0);
+
+    std::stringstream stream;
+    DJN_TEST_CHECK(encoder->Serialize(stream) > 0);
+    djinn_model* decoder = CreateModel(type);
+    DJN_TEST_CHECK(decoder->Deserialize(stream) > 0);
+    return decoder;
+}
+
+// Merging blocks of disjoint samples decodes to the same variants as
+// encoding all samples at once.
+static void TestMerge(int type1, int type2, int type_out, bool permute, uint32_t seed) {
+    std::mt19937 gen(seed);
+    const uint32_t n_samples1 = 73, n_samples2 = 131;
+    std::vector<std::vector<uint8_t>> sites;
+    std::vector<uint8_t> n_alleles;
+    for (int v = 0; v < 120; ++v) {
+        uint8_t n_allele = 0;
+        sites.push_back(djn_test_site(gen, n_samples1 + n_samples2, v % DJN_TEST_KINDS, (v / DJN_TEST_KINDS) % DJN_TEST_PHASINGS, n_allele));
+        n_alleles.push_back(n_allele);
+    }
+    // Samples of the second batch differ in phasing from the first batch.
+    for (size_t v = 0; v < sites.size(); v += 4) {
+        for (uint32_t i = 2*n_samples1 + 1; i < sites[v].size(); i += 2) {
+            if (sites[v][i] != 0x81) sites[v][i] ^= 1;
+        }
+    }
+
+    std::unique_ptr<djinn_model> block1(EncodeBlock(type1, permute, sites, n_alleles, 0, 2*n_samples1));
+    std::unique_ptr<djinn_model> block2(EncodeBlock(type2, !permute, sites, n_alleles, 2*n_samples1, 2*(n_samples1 + n_samples2)));
+
+    std::unique_ptr<djinn_model> merged(CreateModel(type_out));
+    merged->StartEncoding(permute, true);
+    DJN_TEST_CHECK(merged->Merge(*block1, *block2) == (int)sites.size());
+    DJN_TEST_CHECK(merged->FinishEncoding() > 0);
+
+    std::stringstream stream;
+    DJN_TEST_CHECK(merged->Serialize(stream) > 0);
+    std::unique_ptr<djinn_model> decoder(CreateModel(type_out));
+    DJN_TEST_CHECK(decoder->Deserialize(stream) > 0);
+    DJN_TEST_CHECK(decoder->n_variants == sites.size());
+    DJN_TEST_CHECK(decoder->StartDecoding() >= 0);
+
+    djinn_variant_t* variant = nullptr;
+    for (size_t v = 0; v < sites.size(); ++v) {
+        if (decoder->DecodeNext(variant) <= 0) {
+            DJN_TEST_CHECK(false);
+            break;
+        }
+        DJN_TEST_CHECK(djn_test_equal(*variant, sites[v]));
+    }
+    delete variant;
+}
+
+// Blocks with different numbers of variants cannot be merged.
+static void TestMergeMismatch() {
+    std::mt19937 gen(7);
+    std::vector<std::vector<uint8_t>> sites;
+    std::vector<uint8_t> n_alleles;
+    for (int v = 0; v < 10; ++v) {
+        uint8_t n_allele = 0;
+        sites.push_back(djn_test_site(gen, 10, DJN_TEST_BIALLELIC, DJN_TEST_PHASED, n_allele));
+        n_alleles.push_back(n_allele);
+    }
+    std::unique_ptr<djinn_model> block1(EncodeBlock(0, true, sites, n_alleles, 0, 20));
+    sites.pop_back();
+    std::unique_ptr<djinn_model> block2(EncodeBlock(0, true, sites, n_alleles, 0, 20));
+
+    djinn_ctx_model merged;
+    merged.StartEncoding(true, true);
+    DJN_TEST_CHECK(merged.Merge(*block1, *block2) < 0);
+}
+
+int main(int argc, char** argv) {
+    uint32_t seed = 1;
+    for (int permute = 0; permute < 2; ++permute) {
+        for (int types = 0; types < 8; ++types) {
+            TestMerge((types >> 0) & 1, (types >> 1) & 1, (types >> 2) & 1, permute, seed++);
+        }
+    }
+    TestMergeMismatch();
+
+    return djn_test_finish("merge");
+}
@@ -0,0 +1,124 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include <sstream>
+
+#include "test_util.h"
+
+using namespace djinn;
+
+// Ordinals of the sites overlapping [start, end] by a linear scan.
+static std::vector<uint64_t> ScanSites(const djinn_site_table& sites, int32_t contig, int64_t start, int64_t end) {
+    std::vector<uint64_t> out;
+    for (uint32_t i = 0; i < sites.size(); ++i) {
+        const char* comma = (const char*)memchr(sites.alleles(i), ',', sites.alleles_len(i));
+        const int64_t len_ref = comma ? comma - sites.alleles(i) : sites.alleles_len(i);
+        if (sites.contig[i] == contig && sites.pos[i] <= end && sites.pos[i] + len_ref - 1 >= start)
+            out.push_back(sites.ordinal[i]);
+    }
+    return out;
+}
+
+// Ordinals of the sites returned by NextQuery. Decoded variants are
+// compared with the generated genotypes.
+static std::vector<uint64_t> QuerySites(djinn_archive_reader& reader, djinn_model& model, const djn_test_archive_t& archive) {
+    std::vector<uint64_t> out;
+    djinn_variant_t* variant = nullptr;
+    int ret = 0;
+    while ((ret = reader.NextQuery(model, variant)) > 0) {
+        const uint64_t ordinal = reader.sites.ordinal[reader.query_site];
+        DJN_TEST_CHECK(ordinal < archive.genotypes.size() && djn_test_equal(*variant, archive.genotypes[ordinal]));
+        out.push_back(ordinal);
+    }
+    DJN_TEST_CHECK(ret == 0);
+    delete variant;
+    return out;
+}
+
+static void TestQuery(djinn_model& encoder, bool permute, uint32_t seed) {
+    std::mt19937 gen(seed);
+    djn_test_archive_t archive;
+    djn_test_make_archive(gen, 53, 7, 45, 2, archive);
+
+    std::stringstream stream;
+    DJN_TEST_CHECK(djn_test_write_archive(stream, encoder, archive, permute) > 0);
+
+    djinn_archive_reader reader;
+    DJN_TEST_CHECK(reader.Open(stream) > 0);
+    DJN_TEST_CHECK(reader.LoadIndex() > 0);
+    DJN_TEST_CHECK(reader.contigs == archive.contigs);
+    std::unique_ptr<djinn_model> model(reader.CreateModel());
+
+    const int64_t max_pos = archive.sites.pos[archive.sites.size() - 1] + 10;
+    for (int q = 0; q < 300; ++q) {
+        const int32_t contig = gen() % archive.contigs.size();
+        int64_t start = gen() % max_pos, end = start + gen() % (q % 3 == 0 ? 5 : 100);
+        if (q == 0) { start = 1; end = max_pos; } // whole contig
+        if (q == 1) { start = 10; end = 9; } // empty interval
+
+        const std::vector<uint64_t> expected = ScanSites(archive.sites, contig, start, end);
+        DJN_TEST_CHECK(reader.Query(contig, start, end) >= 0);
+        DJN_TEST_CHECK(QuerySites(reader, *model, archive) == expected);
+
+        // Queries by name select the same variants.
+        if (q % 10 == 0) {
+            DJN_TEST_CHECK(reader.Query(archive.contigs[contig], start, end) >= 0);
+            DJN_TEST_CHECK(QuerySites(reader, *model, archive) == expected);
+        }
+    }
+
+    // Unknown contigs select nothing.
+    DJN_TEST_CHECK(reader.Query("chrUn", 1, max_pos) == 0);
+    DJN_TEST_CHECK(QuerySites(reader, *model, archive).empty());
+    DJN_TEST_CHECK(reader.Query((int32_t)archive.contigs.size(), 1, max_pos) == 0);
+    DJN_TEST_CHECK(QuerySites(reader, *model, archive).empty());
+}
+
+// Archives written without site tables have no index.
+static void TestNoIndex() {
+    std::mt19937 gen(11);
+    djinn_ctx_model encoder;
+    std::stringstream stream;
+    djinn_archive_writer writer;
+    DJN_TEST_CHECK(writer.Open(stream, encoder, 20) > 0);
+    encoder.StartEncoding(true, true);
+    for (int v = 0; v < 10; ++v) {
+        uint8_t n_allele = 0;
+        std::vector<uint8_t> site = djn_test_site(gen, 20, DJN_TEST_BIALLELIC, DJN_TEST_PHASED, n_allele);
+        DJN_TEST_CHECK(encoder.EncodeBcf(site.data(), site.size(), 2, n_allele) > 0);
+    }
+    DJN_TEST_CHECK(encoder.FinishEncoding() > 0);
+    DJN_TEST_CHECK(writer.WriteBlock(encoder) > 0);
+    DJN_TEST_CHECK(writer.Close() > 0);
+
+    djinn_archive_reader reader;
+    DJN_TEST_CHECK(reader.Open(stream) > 0);
+    DJN_TEST_CHECK(reader.LoadIndex() == DJN_ARCHIVE_ERR_NO_INDEX);
+    DJN_TEST_CHECK(reader.Query(0, 1, 100) == DJN_ARCHIVE_ERR_NO_INDEX);
+}
+
+int main(int argc, char** argv) {
+    for (int permute = 0; permute < 2; ++permute) {
+        djinn_ctx_model ctx;
+        TestQuery(ctx, permute, 1 + permute);
+        djinn_ewah_model ewah(CompressionStrategy::ZSTD, 1);
+        TestQuery(ewah, permute, 3 + permute);
+    }
+    TestNoIndex();
+
+    return djn_test_finish("query");
+}
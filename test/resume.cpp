@@ -0,0 +1,118 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include <sstream>
+
+#include "test_util.h"
+
+using namespace djinn;
+
+// Recover a damaged archive, discard everything following the last complete
+// block, and write the remaining blocks as an interrupted import would.
+static void TestResume(djinn_model& model, const djn_test_archive_t& archive, const std::string& damaged, bool permute) {
+    djinn_archive_writer writer;
+    std::istringstream in(damaged);
+    const int64_t offset = writer.Recover(in);
+    DJN_TEST_CHECK(offset >= DJN_ARCHIVE_HEADER_SIZE && offset <= (int64_t)damaged.size());
+    if (offset < DJN_ARCHIVE_HEADER_SIZE) return;
+
+    // Recovered blocks are complete and the resumed import continues with
+    // the site following the last written site.
+    DJN_TEST_CHECK(writer.n_variants == writer.n_blocks * archive.n_sites);
+    DJN_TEST_CHECK(writer.last_ordinal == (int64_t)writer.n_variants - 1);
+
+    std::stringstream out(damaged.substr(0, offset));
+    out.seekp(0, std::ios::end);
+    DJN_TEST_CHECK(writer.Resume(out) > 0);
+    if (writer.n_blocks == 0) {
+        DJN_TEST_CHECK(writer.WriteNames(DJN_FRAME_SAMPLES, archive.samples) > 0);
+        DJN_TEST_CHECK(writer.WriteNames(DJN_FRAME_CONTIGS, archive.contigs) > 0);
+    }
+    const uint32_t n_blocks = archive.genotypes.size() / archive.n_sites;
+    for (uint32_t b = writer.n_blocks; b < n_blocks; ++b) {
+        DJN_TEST_CHECK(djn_test_write_block(writer, model, archive, b, permute) > 0);
+    }
+    DJN_TEST_CHECK(writer.Close() > 0);
+
+    std::istringstream resumed(out.str());
+    DJN_TEST_CHECK(djn_test_check_archive(resumed, archive) == (int64_t)archive.genotypes.size());
+}
+
+static void TestRecover(djinn_model& model, bool permute, uint32_t seed) {
+    std::mt19937 gen(seed);
+    djn_test_archive_t archive;
+    djn_test_make_archive(gen, 47, 4, 30, 2, archive);
+
+    std::stringstream stream;
+    DJN_TEST_CHECK(djn_test_write_archive(stream, model, archive, permute) > 0);
+    const std::string data = stream.str();
+
+    // Truncated at offsets following the header, including finished
+    // archives whose index and trailer are discarded.
+    for (size_t len = DJN_ARCHIVE_HEADER_SIZE; len <= data.size(); len += 1 + len % 61) {
+        TestResume(model, archive, data.substr(0, len), permute);
+    }
+    TestResume(model, archive, data, permute);
+
+    // A corrupted frame ends the recovered archive.
+    for (size_t i = DJN_ARCHIVE_HEADER_SIZE; i < data.size(); i += data.size() / 7) {
+        std::string corrupt = data;
+        corrupt[i] ^= 0x40;
+        TestResume(model, archive, corrupt, permute);
+    }
+
+    // Incomplete headers cannot be recovered.
+    djinn_archive_writer writer;
+    std::istringstream in(data.substr(0, DJN_ARCHIVE_HEADER_SIZE - 1));
+    DJN_TEST_CHECK(writer.Recover(in) == DJN_ARCHIVE_ERR_IO);
+}
+
+// Blocks that depend on preceding blocks cannot be resumed.
+static void TestRecoverDependent() {
+    std::mt19937 gen(9);
+    djinn_ctx_model model;
+    std::stringstream stream;
+    djinn_archive_writer writer;
+    model.StartEncoding(true, false);
+    DJN_TEST_CHECK(writer.Open(stream, model, 20) > 0);
+    for (int b = 0; b < 2; ++b) {
+        if (b) model.StartEncoding(true, false);
+        for (int v = 0; v < 10; ++v) {
+            uint8_t n_allele = 0;
+            std::vector<uint8_t> site = djn_test_site(gen, 20, DJN_TEST_BIALLELIC, DJN_TEST_PHASED, n_allele);
+            DJN_TEST_CHECK(model.EncodeBcf(site.data(), site.size(), 2, n_allele) > 0);
+        }
+        DJN_TEST_CHECK(model.FinishEncoding() > 0);
+        DJN_TEST_CHECK(writer.WriteBlock(model) > 0);
+    }
+    DJN_TEST_CHECK(writer.Close() > 0);
+
+    djinn_archive_writer resumed;
+    DJN_TEST_CHECK(resumed.Recover(stream) == DJN_ARCHIVE_ERR_UNSUPPORTED);
+}
+
+int main(int argc, char** argv) {
+    for (int permute = 0; permute < 2; ++permute) {
+        djinn_ctx_model ctx;
+        TestRecover(ctx, permute, 1 + permute);
+        djinn_ewah_model ewah(CompressionStrategy::ZSTD, 1);
+        TestRecover(ewah, permute, 3 + permute);
+    }
+    TestRecoverDependent();
+
+    return djn_test_finish("resume");
+}
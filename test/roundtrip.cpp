@@ -0,0 +1,98 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#include <sstream>
+
+#include "test_util.h"
+
+using namespace djinn;
+
+// Encode sites of every kind and phasing, serialize and deserialize the
+// block, and compare the decoded variants with the input. Bcf input is
+// checked for alleles and phasing, and [0,N-1]-encoded input for alleles.
+static void TestRoundTrip(djinn_model& encoder, djinn_model& decoder, bool permute, bool bcf, uint32_t seed) {
+    std::mt19937 gen(seed);
+    const uint32_t n_samples = 311;
+    std::vector<std::vector<uint8_t>> sites;
+
+    encoder.StartEncoding(permute, true);
+    for (int v = 0; v < 150; ++v) {
+        uint8_t n_allele = 0;
+        std::vector<uint8_t> site = djn_test_site(gen, n_samples, v % DJN_TEST_KINDS, (v / DJN_TEST_KINDS) % DJN_TEST_PHASINGS, n_allele);
+        if (bcf) {
+            DJN_TEST_CHECK(encoder.EncodeBcf(site.data(), site.size(), 2, n_allele) > 0);
+        } else {
+            std::vector<uint8_t> alleles(site.size());
+            for (size_t i = 0; i < site.size(); ++i) alleles[i] = DJN_BCF_UNPACK_GENOTYPE_GENERAL(site[i]);
+            DJN_TEST_CHECK(encoder.Encode(alleles.data(), alleles.size(), 2, n_allele) > 0);
+        }
+        sites.push_back(site);
+    }
+    DJN_TEST_CHECK(encoder.FinishEncoding() > 0);
+
+    std::stringstream stream;
+    DJN_TEST_CHECK(encoder.Serialize(stream) > 0);
+    DJN_TEST_CHECK(decoder.Deserialize(stream) > 0);
+    DJN_TEST_CHECK(decoder.n_variants == sites.size());
+    DJN_TEST_CHECK(decoder.StartDecoding() >= 0);
+
+    djinn_variant_t* variant = nullptr;
+    for (size_t v = 0; v < sites.size(); ++v) {
+        if (decoder.DecodeNext(variant) <= 0) {
+            DJN_TEST_CHECK(false);
+            break;
+        }
+        if (bcf) {
+            DJN_TEST_CHECK(djn_test_equal(*variant, sites[v]));
+        } else {
+            bool equal = (variant->data_len == sites[v].size());
+            for (size_t i = 0; equal && i < sites[v].size(); ++i)
+                equal = (variant->data[i] == DJN_BCF_UNPACK_GENOTYPE_GENERAL(sites[v][i]));
+            DJN_TEST_CHECK(equal);
+        }
+    }
+    delete variant;
+}
+
+int main(int argc, char** argv) {
+    uint32_t seed = 1;
+    for (int permute = 0; permute < 2; ++permute) {
+        for (int bcf = 0; bcf < 2; ++bcf) {
+            // Context model with every combination of options.
+            for (int opt = 0; opt < 8; ++opt) {
+                djinn_ctx_model encoder, decoder;
+                encoder.pbwt_ctx = (opt >> 0) & 1;
+                encoder.dense    = (opt >> 1) & 1;
+                encoder.gt_pbwt  = (opt >> 2) & 1;
+                TestRoundTrip(encoder, decoder, permute, bcf, seed++);
+            }
+
+            // EWAH model with every codec.
+            const CompressionStrategy codecs[4] = { CompressionStrategy::ZSTD, CompressionStrategy::LZ4,
+                                                    CompressionStrategy::NONE, CompressionStrategy::AUTO };
+            for (int c = 0; c < 4; ++c) {
+                for (int gt_pbwt = 0; gt_pbwt < 2; ++gt_pbwt) {
+                    djinn_ewah_model encoder(codecs[c], 1), decoder;
+                    encoder.gt_pbwt = gt_pbwt;
+                    TestRoundTrip(encoder, decoder, permute, bcf, seed++);
+                }
+            }
+        }
+    }
+
+    return djn_test_finish("roundtrip");
+}
@@ -0,0 +1,240 @@
+/*
+* Copyright (c) 2019 Marcus D. R. Klarqvist
+* Author(s): Marcus D. R. Klarqvist
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*   http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*/
+#ifndef DJINN_TEST_UTIL_H_
+#define DJINN_TEST_UTIL_H_
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <djinn.h>
+
+// Test programs count failed checks and exit with a non-zero status if any
+// check failed (automake TESTS convention).
+static int djn_test_failures = 0;
+
+#define DJN_TEST_CHECK(cond) do { \
+    if (!(cond)) { \
+        ++djn_test_failures; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+static inline int djn_test_finish(const char* name) {
+    fprintf(stderr, "%s: %d failures\n", name, djn_test_failures);
+    return djn_test_failures == 0 ? 0 : 1;
+}
+
+// Kinds of generated diploid sites.
+enum {
+    DJN_TEST_BIALLELIC = 0, // alleles 0 and 1
+    DJN_TEST_MISSING   = 1, // some missing alleles
+    DJN_TEST_MULTI     = 2, // up to 12 alleles (multi-digit in Vcf)
+    DJN_TEST_EOV       = 3, // some haploid samples padded with end-of-vector
+    DJN_TEST_COMMON    = 4, // biallelic with an allele frequency of about 0.5
+    DJN_TEST_KINDS     = 5
+};
+
+// Phasing of the generated sites.
+enum {
+    DJN_TEST_UNPHASED = 0,
+    DJN_TEST_PHASED   = 1,
+    DJN_TEST_MIXED    = 2,
+    DJN_TEST_PHASINGS = 3
+};
+
+/**
+ * Generate a Bcf-encoded diploid site for n_samples samples: allele a is
+ * stored as (a+1)<<1 with the lowest bit set for phased alleles, missing
+ * values as 0, and end-of-vector symbols as 0x81. Haplotypes are copied
+ * from a small number of founders with some noise such that PBWT-permuted
+ * encodings are exercised.
+ *
+ * @param gen       Random number generator.
+ * @param n_samples Number of samples.
+ * @param kind      One of DJN_TEST_BIALLELIC to DJN_TEST_COMMON.
+ * @param phasing   One of DJN_TEST_UNPHASED to DJN_TEST_MIXED.
+ * @param n_allele  Set to the number of alleles (REF + ALT).
+ * @return          Returns the Bcf-encoded genotypes.
+ */
+static inline std::vector<uint8_t> djn_test_site(std::mt19937& gen, uint32_t n_samples, int kind, int phasing, uint8_t& n_allele) {
+    const uint32_t n_haplotypes = 2*n_samples;
+    const uint32_t freq = kind == DJN_TEST_COMMON ? 2 : 2 + gen() % 20;
+    uint8_t founders[8];
+    for (int i = 0; i < 8; ++i) founders[i] = (gen() % freq) == 0;
+
+    std::vector<uint8_t> data(n_haplotypes);
+    uint8_t max_allele = 1;
+    for (uint32_t i = 0; i < n_haplotypes; ++i) {
+        int allele = founders[(i / 2) % 8 ^ (i & 1)];
+        if (gen() % 50 == 0) allele ^= 1;
+        if (kind == DJN_TEST_MULTI && gen() % 30 == 0) allele = 2 + gen() % 10;
+        if (kind == DJN_TEST_MISSING && gen() % 40 == 0) allele = -1;
+        max_allele = allele > max_allele ? allele : max_allele;
+
+        uint8_t phased = 0;
+        if (i & 1) phased = phasing == DJN_TEST_PHASED ? 1 : phasing == DJN_TEST_MIXED ? (gen() & 1) : 0;
+        data[i] = allele < 0 ? phased : (((allele + 1) << 1) | phased);
+    }
+    if (kind == DJN_TEST_EOV) {
+        for (uint32_t i = 1; i < n_haplotypes; i += 2) {
+            if (gen() % 25 == 0) data[i] = 0x81;
+        }
+    }
+
+    n_allele = max_allele + 1;
+    return data;
+}
+
+/**
+ * Returns TRUE if a variant decoded with DecodeNext matches the Bcf-encoded
+ * input: alleles, missing and end-of-vector symbols, and the phasing of
+ * every haplotype following the first of its sample.
+ */
+static inline bool djn_test_equal(const djinn::djinn_variant_t& variant, const std::vector<uint8_t>& bcf) {
+    using namespace djinn;
+    if (variant.data_len != bcf.size()) return false;
+    uint32_t n_sep = 0, n_phased = 0;
+    for (uint32_t i = 0; i < bcf.size(); ++i) {
+        if (variant.data[i] != DJN_BCF_UNPACK_GENOTYPE_GENERAL(bcf[i])) return false;
+        if ((i & 1) == 0 || bcf[i] == 0x81) continue;
+        ++n_sep;
+        n_phased += bcf[i] & 1;
+    }
+
+    const int phased = n_sep == 0 ? DJN_PHASE_UNKNOWN : n_phased == n_sep ? DJN_PHASE_ALL : n_phased == 0 ? DJN_PHASE_NONE : DJN_PHASE_MIXED;
+    if (variant.phased != phased) return false;
+    if (phased == DJN_PHASE_MIXED) {
+        for (uint32_t i = 1; i < bcf.size(); i += 2) {
+            if (bcf[i] == 0x81) continue;
+            if (((variant.phase[i >> 3] >> (i & 7)) & 1) != (bcf[i] & 1)) return false;
+        }
+    }
+    return true;
+}
+
+// Genotypes and site metadata of a generated archive. Sites are sorted by
+// contig and position, and reference alleles span one to three bases.
+struct djn_test_archive_t {
+    uint32_t n_samples, n_sites; // number of samples, and sites per block
+    std::vector<std::vector<uint8_t>> genotypes; // Bcf-encoded genotypes per site
+    std::vector<uint8_t> n_alleles; // number of alleles per site
+    djinn::djinn_site_table sites; // all sites, with ordinals 0 to N-1
+    std::vector<std::string> samples, contigs;
+};
+
+static inline void djn_test_make_archive(std::mt19937& gen, uint32_t n_samples, uint32_t n_blocks, uint32_t n_sites, uint32_t n_contigs, djn_test_archive_t& archive) {
+    static const char* alleles[3] = { "A,T", "AC,A", "ACG,A,C" };
+    archive.n_samples = n_samples;
+    archive.n_sites = n_sites;
+    for (uint32_t i = 0; i < n_samples; ++i) archive.samples.push_back("sample" + std::to_string(i));
+    for (uint32_t i = 0; i < n_contigs; ++i) archive.contigs.push_back("chr" + std::to_string(i + 1));
+
+    const uint32_t n_total = n_blocks * n_sites;
+    int64_t pos = 0;
+    int32_t contig = 0;
+    for (uint32_t v = 0; v < n_total; ++v) {
+        const int32_t c = (uint64_t)v * n_contigs / n_total;
+        if (c != contig) { contig = c; pos = 0; }
+        pos += 1 + gen() % 8; // positions may repeat within overlapping alleles
+
+        uint8_t n_allele = 0;
+        archive.genotypes.push_back(djn_test_site(gen, n_samples, v % DJN_TEST_KINDS, (v / DJN_TEST_KINDS) % DJN_TEST_PHASINGS, n_allele));
+        archive.n_alleles.push_back(n_allele);
+        const char* a = alleles[gen() % 3];
+        archive.sites.Add(contig, pos, a, strlen(a), v);
+    }
+}
+
+/**
+ * Encode block b of a generated archive and write it with its site table.
+ *
+ * @return int Returns the return value of WriteBlock or a negative value on error.
+ */
+static inline int djn_test_write_block(djinn::djinn_archive_writer& writer, djinn::djinn_model& model, const djn_test_archive_t& archive, uint32_t b, bool permute) {
+    djinn::djinn_site_table sites;
+    model.StartEncoding(permute, true);
+    for (uint32_t v = b * archive.n_sites; v < (b + 1) * archive.n_sites && v < archive.genotypes.size(); ++v) {
+        std::vector<uint8_t> site = archive.genotypes[v];
+        if (model.EncodeBcf(site.data(), site.size(), 2, archive.n_alleles[v]) <= 0) return -1;
+        sites.Add(archive.sites.contig[v], archive.sites.pos[v], archive.sites.alleles(v), archive.sites.alleles_len(v), archive.sites.ordinal[v]);
+    }
+    if (model.FinishEncoding() < 0) return -1;
+    return writer.WriteBlock(model, sites);
+}
+
+/**
+ * Write a generated archive: header, sample and contig names, all blocks,
+ * and the trailer.
+ *
+ * @return int Returns 1 on success or a negative value on error.
+ */
+static inline int djn_test_write_archive(std::ostream& stream, djinn::djinn_model& model, const djn_test_archive_t& archive, bool permute) {
+    djinn::djinn_archive_writer writer;
+    if (writer.Open(stream, model, archive.n_samples) < 0) return -1;
+    if (writer.WriteNames(DJN_FRAME_SAMPLES, archive.samples) < 0) return -1;
+    if (writer.WriteNames(DJN_FRAME_CONTIGS, archive.contigs) < 0) return -1;
+    const uint32_t n_blocks = (archive.genotypes.size() + archive.n_sites - 1) / archive.n_sites;
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        if (djn_test_write_block(writer, model, archive, b, permute) < 0) return -1;
+    }
+    return writer.Close();
+}
+
+/**
+ * Decode all blocks of an archive and compare the variants and their sites
+ * with the generated archive, starting at variant first.
+ *
+ * @return int64_t Returns the number of matching variants, -1 on mismatches,
+ *                 or the error code of the reader.
+ */
+static inline int64_t djn_test_check_archive(std::istream& stream, const djn_test_archive_t& archive, uint32_t first = 0) {
+    djinn::djinn_archive_reader reader;
+    int ret = reader.Open(stream);
+    if (ret < 0) return ret;
+    if (reader.header.n_samples != archive.n_samples) return -1;
+
+    std::unique_ptr<djinn::djinn_model> model(reader.CreateModel());
+    djinn::djinn_variant_t* variant = nullptr;
+    uint64_t v = first;
+    bool equal = true;
+    while (equal && (ret = reader.NextBlock(*model)) > 0) {
+        if (reader.samples != archive.samples || reader.contigs != archive.contigs) equal = false;
+        if (reader.has_sites == false || reader.sites.size() != model->n_variants) equal = false;
+        if (model->StartDecoding() < 0) equal = false;
+        for (uint32_t i = 0; equal && i < model->n_variants; ++i, ++v) {
+            if (v >= archive.genotypes.size() || model->DecodeNext(variant) <= 0) { equal = false; break; }
+            equal = djn_test_equal(*variant, archive.genotypes[v])
+                 && reader.sites.contig[i]  == archive.sites.contig[v]
+                 && reader.sites.pos[i]     == archive.sites.pos[v]
+                 && reader.sites.ordinal[i] == archive.sites.ordinal[v]
+                 && std::string(reader.sites.alleles(i), reader.sites.alleles_len(i)) == std::string(archive.sites.alleles(v), archive.sites.alleles_len(v));
+        }
+    }
+    delete variant;
+    if (ret < 0) return ret;
+    if (equal == false || reader.finished == false) return -1;
+    return v - first;
+}
+
+#endif